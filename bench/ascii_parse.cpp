@@ -0,0 +1,203 @@
+/*
+
+Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
+
+    This file is part of stl_cmd.
+
+    stl_cmd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// ASCII STL parsing throughput. Generates an ASCII STL in memory with
+// write_facet and times parsing it back with the fgets/sscanf reader
+// stl_cmd used to have, with stl_ascii_reader_t and with
+// parse_ascii_stl_parallel. Every reader has to produce the same facets.
+//
+// usage: bench_ascii_parse [<facets> [<repeats>]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../src/stl_util.h"
+
+// read_facet's ASCII path before the block buffered reader replaced it.
+static int read_facet_sscanf(FILE *f, facet_t *facet) {
+    memset(facet, 0x00, sizeof(facet_t));
+    long offset = ftell(f);
+    if (offset < 0) {
+        return 0;
+    }
+    char buffer[4096];
+    if (!fgets(buffer, 4095, f)) {
+        return 0;
+    }
+    if (strncmp(buffer, "endsolid", 8) == 0) {
+        fseek(f, offset, SEEK_SET);
+        return 0;
+    }
+    if (sscanf(buffer, " facet normal %f %f %f", &(facet->normal.x), &(facet->normal.y), &(facet->normal.z)) != 3) {
+        return 0;
+    }
+    if (!fgets(buffer, 4095, f)) {
+        return 0;
+    }
+    char arg1[256], arg2[256];
+    if (sscanf(buffer, " %s %s", arg1, arg2) != 2 || strcmp(arg1, "outer") != 0 || strcmp(arg2, "loop") != 0) {
+        return 0;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!fgets(buffer, 4095, f)) {
+            return 0;
+        }
+        if (sscanf(buffer, " vertex %f %f %f", &(facet->vertices[i].x), &(facet->vertices[i].y), &(facet->vertices[i].z)) != 3) {
+            return 0;
+        }
+    }
+    if (!fgets(buffer, 4095, f)) {
+        return 0;
+    }
+    if (sscanf(buffer, " %s", arg1) != 1 || strcmp(arg1, "endloop") != 0) {
+        return 0;
+    }
+    if (!fgets(buffer, 4095, f)) {
+        return 0;
+    }
+    if (sscanf(buffer, " %s", arg1) != 1 || strcmp(arg1, "endfacet") != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+static void parse_sscanf(const std::vector<char> &text, std::vector<unsigned char> &records) {
+    FILE *f = fmemopen((void*)text.data(), text.size(), "r");
+    char line[4096];
+    facet_t facet;
+    if (fgets(line, sizeof(line), f)) {
+        while (read_facet_sscanf(f, &facet)) {
+            size_t offset = records.size();
+            records.resize(offset + STL_RECORD_SIZE);
+            encode_facet(&facet, &records[offset]);
+        }
+    }
+    fclose(f);
+}
+
+static void parse_reader(const std::vector<char> &text, std::vector<unsigned char> &records) {
+    FILE *f = fmemopen((void*)text.data(), text.size(), "r");
+    stl_ascii_reader_t reader;
+    char name[STL_HEADER_SIZE];
+    facet_t facet;
+    if (stl_ascii_reader_open(&reader, f)) {
+        if (stl_ascii_read_header(&reader, name, sizeof(name))) {
+            while (stl_ascii_read_facet(&reader, &facet)) {
+                size_t offset = records.size();
+                records.resize(offset + STL_RECORD_SIZE);
+                encode_facet(&facet, &records[offset]);
+            }
+        }
+        stl_ascii_reader_close(&reader);
+    }
+    fclose(f);
+}
+
+static void parse_parallel(const std::vector<char> &text, std::vector<unsigned char> &records) {
+    char name[STL_HEADER_SIZE];
+    uint32_t facet_count;
+    parse_ascii_stl_parallel(text.data(), text.size(), std::thread::hardware_concurrency(),
+                             name, sizeof(name), records, &facet_count);
+}
+
+typedef void (*parser_t)(const std::vector<char>&, std::vector<unsigned char>&);
+
+// Best of repeats runs, in seconds.
+static double time_parser(parser_t parser, const std::vector<char> &text, int repeats, std::vector<unsigned char> &records) {
+    double best = 0;
+    for (int r = 0; r < repeats; r++) {
+        records.clear();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        parser(text, records);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (r == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    size_t num_facets = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int repeats = argc > 2 ? atoi(argv[2]) : 3;
+    if (num_facets == 0 || repeats < 1) {
+        fprintf(stderr, "usage: bench_ascii_parse [<facets> [<repeats>]]\n");
+        return 2;
+    }
+
+    std::vector<facet_t> facets(num_facets);
+    srand(1);
+    for (size_t i = 0; i < num_facets; i++) {
+        memset(&facets[i], 0x00, sizeof(facet_t));
+        float *v = &facets[i].vertices[0].x;
+        for (int j = 0; j < 3; j++) {
+            v[j*4] = 200.0f*rand()/RAND_MAX - 100;
+            v[j*4+1] = 200.0f*rand()/RAND_MAX - 100;
+            v[j*4+2] = 200.0f*rand()/RAND_MAX - 100;
+        }
+        vec u, v2, normal;
+        vec_sub(&facets[i].vertices[1], &facets[i].vertices[0], &u);
+        vec_sub(&facets[i].vertices[2], &facets[i].vertices[0], &v2);
+        vec_cross(&u, &v2, &normal);
+        vec_normalize(&normal, &facets[i].normal);
+    }
+
+    char *data = NULL;
+    size_t length = 0;
+    FILE *stream = open_memstream(&data, &length);
+    write_header(stream, "bench", num_facets, 1);
+    for (size_t i = 0; i < num_facets; i++) {
+        write_facet(stream, &facets[i], 1);
+    }
+    write_final(stream, "bench", num_facets, 1);
+    fclose(stream);
+    std::vector<char> text(data, data + length);
+    free(data);
+
+    printf("%zu facets, %.1f MB of ASCII STL, %u threads, best of %d\n",
+           num_facets, text.size()/1e6, std::thread::hardware_concurrency(), repeats);
+
+    const char *names[] = { "fgets/sscanf", "stl_ascii_reader_t", "parse_ascii_stl_parallel" };
+    parser_t parsers[] = { parse_sscanf, parse_reader, parse_parallel };
+    std::vector<unsigned char> expected;
+    double baseline = 0;
+    int ok = 1;
+    for (size_t p = 0; p < sizeof(parsers)/sizeof(parsers[0]); p++) {
+        std::vector<unsigned char> records;
+        double seconds = time_parser(parsers[p], text, repeats, records);
+        if (p == 0) {
+            expected.swap(records);
+            baseline = seconds;
+        } else if (records != expected) {
+            fprintf(stderr, "%s parsed different facets\n", names[p]);
+            ok = 0;
+        }
+        printf("%-26s %8.3fs %9.1f MB/s %6.1fx\n", names[p], seconds, text.size()/seconds/1e6, baseline/seconds);
+    }
+    if (expected.size() != num_facets*STL_RECORD_SIZE) {
+        fprintf(stderr, "fgets/sscanf parsed %zu of %zu facets\n", expected.size()/STL_RECORD_SIZE, num_facets);
+        ok = 0;
+    }
+    return ok ? 0 : 1;
+}
@@ -29,41 +29,9 @@
 #include <float.h> //FLT_EPSILON, DBL_EPSILON
 #include "stl_util.h"
 #include "csgjs/math/HashKeys.h"
-#include <unordered_map>
 
 using csgjs::Vector3;
 
-struct VertexKey {
-  float x;
-  float y;
-  float z;
-  VertexKey() : x(0), y(0), z(0) {}
-  VertexKey(float xx, float yy, float zz, bool exact = false) {
-    if(exact) {
-      x = xx;
-      y = yy;
-      z = zz;
-    } else {
-      x = (float)(int)(std::round((double)xx/EPSILON));
-      y = (float)(int)(std::round((double)yy/EPSILON));
-      z = (float)(int)(std::round((double)zz/EPSILON));
-    }
-  }
-
-  bool operator==(const VertexKey& k) const {
-    return x == k.x && y == k.y && z == k.z;
-  }
-};
-
-namespace std {
-  template <>
-  struct hash<VertexKey> {
-    std::size_t operator()(const VertexKey& k) const {
-      return ((std::hash<float>()(k.x) ^ (std::hash<float>()(k.y) << 1)) >> 1) ^ (hash<float>()(k.z) << 1);
-    }
-  };
-}
-
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
 #define loopj(start_l,end_l) for ( int j=start_l;j<end_l;++j )
@@ -1016,75 +984,37 @@ namespace Simplify
               fprintf(stderr, "Can't read file: %s\n", filename);
               exit(2);
           }
-          fseek(f, 80, SEEK_SET);
-          uint32_t num_tris;
-          uint16_t abc = 0; // attribute byte count
-          size_t readBytes = fread(&num_tris, 4, 1, f);
-          vec tmp_vec;
-          vec normal;
-          vec point1;
-          vec point2;
-          vec point3;
-
-          std::unordered_map<VertexKey, int> vertexMap;
+          stl_view_t view;
+          if(!stl_view_open(&view, f)) {
+              fprintf(stderr, "%s is not a binary stl file.\n", filename);
+              exit(2);
+          }
+          indexed_mesh_t mesh;
+          if(!indexed_mesh_from_view(&mesh, &view, 0, std::thread::hardware_concurrency())) {
+              fprintf(stderr, "%s has too many triangles.\n", filename);
+              exit(2);
+          }
 
-          Vector3 vector3;
           Vertex v;
           Triangle tri;
 
-          int i0;
-          int i1;
-          int i2;
-          for(int i = 0; i < num_tris; i++) {
-              readBytes = fread(&normal, 1, 12,f);
-              readBytes = fread(&point1, 1, 12,f);
-              readBytes = fread(&point2, 1, 12,f);
-              readBytes = fread(&point3, 1, 12,f);
-              readBytes = fread(&abc, 1, 2,f);
-
-              VertexKey k(point1.x, point1.y, point1.z, true);
-              if(vertexMap.count(k) > 0) {
-                i0 = vertexMap[k];
-              } else {
-                v.p.x = point1.x;
-                v.p.y = point1.y;
-                v.p.z = point1.z;
-                i0 = vertices.size();
-                vertexMap[k] = i0;
-                vertices.push_back(v);
-              }
-
-              k = VertexKey(point2.x, point2.y, point2.z, true);
-              if(vertexMap.count(k) > 0) {
-                i1 = vertexMap[k];
-              } else {
-                v.p.x = point2.x;
-                v.p.y = point2.y;
-                v.p.z = point2.z;
-                i1 = vertices.size();
-                vertexMap[k] = i1;
-                vertices.push_back(v);
-              }
-
-              k = VertexKey(point3.x, point3.y, point3.z, true);
-              if(vertexMap.count(k) > 0) {
-                i2 = vertexMap[k];
-              } else {
-                v.p.x = point3.x;
-                v.p.y = point3.y;
-                v.p.z = point3.z;
-                i2 = vertices.size();
-                vertexMap[k] = i2;
-                vertices.push_back(v);
-              }
-
-              tri.v[0] = i0;
-              tri.v[1] = i1;
-              tri.v[2] = i2;
+          vertices.reserve(indexed_mesh_vertex_count(&mesh));
+          for(size_t i = 0; i < indexed_mesh_vertex_count(&mesh); i++) {
+              v.p.x = mesh.x[i];
+              v.p.y = mesh.y[i];
+              v.p.z = mesh.z[i];
+              vertices.push_back(v);
+          }
 
+          triangles.reserve(indexed_mesh_triangle_count(&mesh));
+          for(size_t i = 0; i < mesh.indices.size(); i += 3) {
+              tri.v[0] = mesh.indices[i];
+              tri.v[1] = mesh.indices[i+1];
+              tri.v[2] = mesh.indices[i+2];
               triangles.push_back(tri);
           }
 
+          stl_view_close(&view);
           fclose(f);
         }
 
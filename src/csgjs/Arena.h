@@ -0,0 +1,132 @@
+#ifndef __CSGJS_ARENA__
+#define __CSGJS_ARENA__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+namespace csgjs {
+
+  typedef uint32_t ArenaIndex;
+  const ArenaIndex NO_INDEX = 0xffffffff;
+
+  // Monotonic pool of T addressed by index. Objects are constructed in place in fixed size blocks, so an object
+  // never moves once created and references to it stay valid while more objects are added. Nothing is freed
+  // individually; everything goes when the arena does. Memory is released a block at a time, and for a trivially
+  // destructible T that is all clearing does. Any other T has its destructor run for every object, which is
+  // linear in the arena's size.
+  //
+  // add() may be called from several threads at once. Reading an object another thread is still adding isn't
+  // safe, but everything added before a fork or join is.
+  template<typename T, int BLOCK_BITS = 12>
+  class Arena {
+    private:
+      static const ArenaIndex BLOCK_SIZE = 1 << BLOCK_BITS;
+      static const ArenaIndex BLOCK_MASK = BLOCK_SIZE-1;
+      static const ArenaIndex MAX_BLOCKS = 1 << (28-BLOCK_BITS);
+
+      std::atomic<T*> *blocks;
+      std::atomic<ArenaIndex> count;
+
+      Arena(const Arena&);
+      Arena& operator=(const Arena&);
+
+      T* block(ArenaIndex b) {
+        if(b >= MAX_BLOCKS) {
+          throw std::bad_alloc();
+        }
+        T *block = blocks[b].load(std::memory_order_acquire);
+        if(block == NULL) {
+          T *newBlock = static_cast<T*>(::operator new(sizeof(T)*BLOCK_SIZE));
+          if(blocks[b].compare_exchange_strong(block, newBlock, std::memory_order_acq_rel)) {
+            block = newBlock;
+          } else {
+            ::operator delete(newBlock);
+          }
+        }
+        return block;
+      }
+
+    public:
+      Arena() : count(0) {
+        // zeroed pages are only touched as blocks get used
+        blocks = static_cast<std::atomic<T*>*>(calloc(MAX_BLOCKS, sizeof(std::atomic<T*>)));
+        if(blocks == NULL) {
+          throw std::bad_alloc();
+        }
+      }
+
+      ~Arena() {
+        clear();
+        free(blocks);
+      }
+
+      template<typename... Args>
+      ArenaIndex add(Args&&... args) {
+        ArenaIndex i = count.fetch_add(1, std::memory_order_relaxed);
+        new (block(i >> BLOCK_BITS)+(i & BLOCK_MASK)) T(std::forward<Args>(args)...);
+        return i;
+      }
+
+      // Adds copies of the n objects at values next to each other in one block, so all of them can be reached
+      // through a pointer to the first. A run that doesn't fit in the rest of the current block starts the next
+      // one and leaves the slots it skipped unconstructed, so arenas holding runs can't be walked with forEach.
+      ArenaIndex addRun(const T *values, ArenaIndex n) {
+        static_assert(std::is_trivially_destructible<T>::value, "runs leave unconstructed slots behind");
+        if(n > BLOCK_SIZE) {
+          throw std::bad_alloc();
+        }
+        ArenaIndex i = count.load(std::memory_order_relaxed);
+        ArenaIndex first;
+        do {
+          first = (i & BLOCK_MASK)+n > BLOCK_SIZE ? (i | BLOCK_MASK)+1 : i;
+        } while(!count.compare_exchange_weak(i, first+n, std::memory_order_relaxed));
+        T *b = block(first >> BLOCK_BITS)+(first & BLOCK_MASK);
+        for(ArenaIndex k = 0; k < n; k++) {
+          new (b+k) T(values[k]);
+        }
+        return first;
+      }
+
+      T& operator[](ArenaIndex i) {
+        return blocks[i >> BLOCK_BITS].load(std::memory_order_relaxed)[i & BLOCK_MASK];
+      }
+
+      const T& operator[](ArenaIndex i) const {
+        return blocks[i >> BLOCK_BITS].load(std::memory_order_relaxed)[i & BLOCK_MASK];
+      }
+
+      ArenaIndex size() const {
+        return count.load(std::memory_order_relaxed);
+      }
+
+      // calls fn on every object in creation order, a block at a time
+      template<typename F>
+      void forEach(F fn) {
+        ArenaIndex n = size();
+        for(ArenaIndex b = 0; b*BLOCK_SIZE < n; b++) {
+          T *block = blocks[b].load(std::memory_order_relaxed);
+          ArenaIndex end = n-b*BLOCK_SIZE < BLOCK_SIZE ? n-b*BLOCK_SIZE : BLOCK_SIZE;
+          for(ArenaIndex i = 0; i < end; i++) {
+            fn(block[i]);
+          }
+        }
+      }
+
+      void clear() {
+        if(!std::is_trivially_destructible<T>::value) {
+          forEach([](T &t) { t.~T(); });
+        }
+        for(ArenaIndex b = 0; b < MAX_BLOCKS && blocks[b].load(std::memory_order_relaxed) != NULL; b++) {
+          ::operator delete(blocks[b].load(std::memory_order_relaxed));
+          blocks[b].store(NULL, std::memory_order_relaxed);
+        }
+        count = 0;
+      }
+  };
+}
+
+#endif
@@ -12,13 +12,13 @@ namespace csgjs {
     return _polygons;
   }
 
-  CSG CSG::csgUnion(const CSG &csg) const {
+  CSG CSG::csgUnion(const CSG &csg, TaskScheduler *scheduler, const SplitOptions &options, TreeStats *stats) const {
     if(!mayOverlap(csg)) {
       return unionForNonIntersecting(csg);
     }
 
-    Tree A(_polygons);
-    Tree B(csg._polygons);
+    Tree A(_polygons, scheduler, options);
+    Tree B(csg._polygons, scheduler, options);
 
     A.clipTo(B);
     B.clipTo(A);
@@ -26,6 +26,11 @@ namespace csgjs {
     B.clipTo(A);
     B.invert();
 
+    if(stats != NULL) {
+      *stats += A.stats();
+      *stats += B.stats();
+    }
+
     std::vector<Polygon> aPolys(A.toPolygons());
     std::vector<Polygon> bPolys(B.toPolygons());
 
@@ -34,13 +39,13 @@ namespace csgjs {
     return CSG(std::move(aPolys));
   }
 
-  CSG CSG::csgIntersect(const CSG &csg) const {
+  CSG CSG::csgIntersect(const CSG &csg, TaskScheduler *scheduler, const SplitOptions &options, TreeStats *stats) const {
     if(!mayOverlap(csg)) {
       return CSG();
     }
 
-    Tree A(_polygons);
-    Tree B(csg._polygons);
+    Tree A(_polygons, scheduler, options);
+    Tree B(csg._polygons, scheduler, options);
 
     A.invert();
     B.clipTo(A);
@@ -50,18 +55,23 @@ namespace csgjs {
     A.addPolygons(B.toPolygons());
     A.invert();
 
+    if(stats != NULL) {
+      *stats += A.stats();
+      *stats += B.stats();
+    }
+
     std::vector<Polygon> aPolys(A.toPolygons());
 
     return CSG(std::move(aPolys));
   }
 
-  CSG CSG::csgSubtract(const CSG &csg) const {
+  CSG CSG::csgSubtract(const CSG &csg, TaskScheduler *scheduler, const SplitOptions &options, TreeStats *stats) const {
     if(!mayOverlap(csg)) {
       return *this;
     }
 
-    Tree A(_polygons);
-    Tree B(csg._polygons);
+    Tree A(_polygons, scheduler, options);
+    Tree B(csg._polygons, scheduler, options);
 
     A.invert();
     A.clipTo(B);
@@ -69,6 +79,11 @@ namespace csgjs {
     A.addPolygons(B.toPolygons());
     A.invert();
 
+    if(stats != NULL) {
+      *stats += A.stats();
+      *stats += B.stats();
+    }
+
     std::vector<Polygon> aPolys(A.toPolygons());
 
     return CSG(std::move(aPolys));
@@ -139,9 +154,9 @@ namespace csgjs {
   void CSG::findUnmatchedEdges(std::unordered_map<EdgeKey, PolygonEdgeData> &unmatchedEdges) {
     std::vector<Polygon>::iterator polyItr = _polygons.begin();
     while(polyItr != _polygons.end()) {
-      std::vector<Vertex>::iterator vertexItr = polyItr->vertices.begin();
+      VertexList::iterator vertexItr = polyItr->vertices.begin();
       while(vertexItr != polyItr->vertices.end()) {
-        std::vector<Vertex>::iterator nextVertexItr = vertexItr+1;
+        VertexList::iterator nextVertexItr = vertexItr+1;
         if(nextVertexItr == polyItr->vertices.end()) {
           nextVertexItr = polyItr->vertices.begin();
         }
@@ -166,7 +181,7 @@ namespace csgjs {
 
     std::vector<Polygon>::iterator polyItr = _polygons.begin();
     while(polyItr != _polygons.end()) {
-      std::vector<Vertex>::iterator vertexItr = polyItr->vertices.begin();
+      VertexList::iterator vertexItr = polyItr->vertices.begin();
       while(vertexItr != polyItr->vertices.end()) {
         Vector3 v = vertexItr->pos;
         VertexKey k(v);
@@ -344,8 +359,8 @@ namespace csgjs {
 
         //std::cout << polygon->vertices << std::endl;
 
-        std::vector<Vertex>::iterator vertexItr = polygon->vertices.begin();
-        std::vector<Vertex> newVertices;
+        VertexList::iterator vertexItr = polygon->vertices.begin();
+        VertexList newVertices;
         while(vertexItr != polygon->vertices.end()) {
           newVertices.push_back(*vertexItr);
           while(insertItr != verticesToInsert[polygon].end() && vertexItr->pos == insertItr->second) {
@@ -370,8 +385,8 @@ namespace csgjs {
 
         //std::cout << "rev inserting " << verticesToInsert[polygon].size() << " extra vertices" << std::endl;
         std::vector<std::pair<Vector3,Vector3> >::reverse_iterator insertItr = verticesToInsert[polygon].rbegin();
-        std::vector<Vertex>::iterator vertexItr = polygon->vertices.begin();
-        std::vector<Vertex> newVertices;
+        VertexList::iterator vertexItr = polygon->vertices.begin();
+        VertexList newVertices;
         while(vertexItr != polygon->vertices.end()) {
           newVertices.push_back(*vertexItr);
           while(insertItr != verticesToInsert[polygon].rend() && vertexItr->pos == insertItr->second) {
@@ -6,6 +6,7 @@
 #include <vector>
 #include <utility>
 #include "csgjs/math/HashKeys.h"
+#include "csgjs/Trees.h"
 #include <unordered_map>
 
 namespace csgjs {
@@ -28,9 +29,9 @@ class CSG {
     CSG(std::vector<Polygon> &&p);
 
     std::vector<Polygon> toPolygons() const;
-    CSG csgUnion(const CSG &csg) const;
-    CSG csgIntersect(const CSG &csg) const;
-    CSG csgSubtract(const CSG &csg) const;
+    CSG csgUnion(const CSG &csg, TaskScheduler *scheduler=NULL, const SplitOptions &options=SplitOptions(), TreeStats *stats=NULL) const;
+    CSG csgIntersect(const CSG &csg, TaskScheduler *scheduler=NULL, const SplitOptions &options=SplitOptions(), TreeStats *stats=NULL) const;
+    CSG csgSubtract(const CSG &csg, TaskScheduler *scheduler=NULL, const SplitOptions &options=SplitOptions(), TreeStats *stats=NULL) const;
     bool mayOverlap(const CSG &csg) const;
     std::pair<Vector3, Vector3> getBounds() const;
 
@@ -0,0 +1,172 @@
+#ifndef __CSGJS_SMALL_VECTOR__
+#define __CSGJS_SMALL_VECTOR__
+
+#include <stdint.h>
+#include <string.h>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace csgjs {
+
+  // Vector that keeps up to N elements inline and only allocates once it grows past them. Elements are moved
+  // around with memcpy, so T has to be trivially copyable. Iterators are plain pointers and, like std::vector's,
+  // are invalidated by anything that grows the vector.
+  template<typename T, uint32_t N>
+  class SmallVector {
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector elements must be trivially copyable");
+
+    public:
+      typedef T value_type;
+      typedef T* iterator;
+      typedef const T* const_iterator;
+      typedef std::reverse_iterator<iterator> reverse_iterator;
+      typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    private:
+      T *_data;
+      uint32_t _size;
+      uint32_t _capacity;
+      typename std::aligned_storage<sizeof(T)*N, alignof(T)>::type _inline;
+
+      T* inlineData() {
+        return reinterpret_cast<T*>(&_inline);
+      }
+
+      bool isInline() const {
+        return _data == reinterpret_cast<const T*>(&_inline);
+      }
+
+      void release() {
+        if(!isInline()) {
+          ::operator delete(_data);
+        }
+      }
+
+      // takes s's elements, stealing its buffer if it has one
+      void take(SmallVector &s) {
+        if(s.isInline()) {
+          _data = inlineData();
+          _capacity = N;
+          memcpy(_data, s._data, sizeof(T)*s._size);
+        } else {
+          _data = s._data;
+          _capacity = s._capacity;
+          s._data = s.inlineData();
+          s._capacity = N;
+        }
+        _size = s._size;
+        s._size = 0;
+      }
+
+    public:
+      SmallVector() : _data(inlineData()), _size(0), _capacity(N) {}
+
+      SmallVector(const SmallVector &s) : _data(inlineData()), _size(0), _capacity(N) {
+        reserve(s._size);
+        memcpy(_data, s._data, sizeof(T)*s._size);
+        _size = s._size;
+      }
+
+      SmallVector(SmallVector &&s) {
+        take(s);
+      }
+
+      ~SmallVector() {
+        release();
+      }
+
+      SmallVector& operator=(const SmallVector &s) {
+        if(this != &s) {
+          _size = 0;
+          reserve(s._size);
+          memcpy(_data, s._data, sizeof(T)*s._size);
+          _size = s._size;
+        }
+        return *this;
+      }
+
+      SmallVector& operator=(SmallVector &&s) {
+        if(this != &s) {
+          release();
+          take(s);
+        }
+        return *this;
+      }
+
+      void reserve(uint32_t n) {
+        if(n > _capacity) {
+          uint32_t capacity = _capacity*2 > n ? _capacity*2 : n;
+          T *data = static_cast<T*>(::operator new(sizeof(T)*capacity));
+          memcpy(data, _data, sizeof(T)*_size);
+          release();
+          _data = data;
+          _capacity = capacity;
+        }
+      }
+
+      void push_back(const T &t) {
+        if(_size == _capacity) {
+          // t may live in this vector
+          T copy(t);
+          reserve(_size+1);
+          _data[_size++] = copy;
+        } else {
+          _data[_size++] = t;
+        }
+      }
+
+      void pop_back() {
+        _size--;
+      }
+
+      void resize(uint32_t n) {
+        reserve(n);
+        for(uint32_t i = _size; i < n; i++) {
+          new (_data+i) T();
+        }
+        _size = n;
+      }
+
+      void clear() {
+        _size = 0;
+      }
+
+      iterator erase(iterator pos) {
+        memmove(pos, pos+1, sizeof(T)*(end()-pos-1));
+        _size--;
+        return pos;
+      }
+
+      iterator erase(iterator first, iterator last) {
+        memmove(first, last, sizeof(T)*(end()-last));
+        _size -= last-first;
+        return first;
+      }
+
+      uint32_t size() const { return _size; }
+      uint32_t capacity() const { return _capacity; }
+      bool empty() const { return _size == 0; }
+
+      T& operator[](uint32_t i) { return _data[i]; }
+      const T& operator[](uint32_t i) const { return _data[i]; }
+      T& front() { return _data[0]; }
+      const T& front() const { return _data[0]; }
+      T& back() { return _data[_size-1]; }
+      const T& back() const { return _data[_size-1]; }
+      T* data() { return _data; }
+      const T* data() const { return _data; }
+
+      iterator begin() { return _data; }
+      iterator end() { return _data+_size; }
+      const_iterator begin() const { return _data; }
+      const_iterator end() const { return _data+_size; }
+      reverse_iterator rbegin() { return reverse_iterator(end()); }
+      reverse_iterator rend() { return reverse_iterator(begin()); }
+      const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+      const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+  };
+}
+
+#endif
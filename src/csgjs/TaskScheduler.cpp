@@ -0,0 +1,123 @@
+#include "csgjs/TaskScheduler.h"
+
+namespace csgjs {
+  static thread_local const TaskScheduler *currentScheduler = NULL;
+  static thread_local int currentWorker = 0;
+
+  TaskScheduler::TaskScheduler(int numThreads) : pending(0), stopping(false) {
+    if(numThreads < 1) {
+      numThreads = 1;
+    }
+
+    for(int i = 0; i < numThreads; i++) {
+      workers.push_back(new Worker());
+    }
+
+    for(int i = 1; i < numThreads; i++) {
+      threads.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+    }
+  }
+
+  TaskScheduler::~TaskScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    sleepCond.notify_all();
+
+    std::vector<std::thread>::iterator itr = threads.begin();
+    while(itr != threads.end()) {
+      itr->join();
+      ++itr;
+    }
+
+    std::vector<Worker*>::iterator wItr = workers.begin();
+    while(wItr != workers.end()) {
+      delete *wItr;
+      ++wItr;
+    }
+  }
+
+  int TaskScheduler::numThreads() const {
+    return workers.size();
+  }
+
+  int TaskScheduler::workerIndex() const {
+    return currentScheduler == this ? currentWorker : 0;
+  }
+
+  void TaskScheduler::push(int w, Task *task) {
+    {
+      std::lock_guard<std::mutex> lock(workers[w]->mutex);
+      workers[w]->tasks.push_back(task);
+    }
+
+    // taking the sleep lock orders this with a worker that checked pending and is about to wait
+    pending++;
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    sleepCond.notify_one();
+  }
+
+  bool TaskScheduler::popIfNewest(int w, Task *task) {
+    std::lock_guard<std::mutex> lock(workers[w]->mutex);
+
+    std::deque<Task*> &tasks = workers[w]->tasks;
+    if(!tasks.empty() && tasks.back() == task) {
+      tasks.pop_back();
+      pending--;
+      return true;
+    }
+    return false;
+  }
+
+  // newest task from our own deque, otherwise the oldest from someone else's
+  TaskScheduler::Task* TaskScheduler::take(int w) {
+    int n = workers.size();
+
+    for(int i = 0; i < n; i++) {
+      int victim = (w+i) % n;
+      std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+
+      std::deque<Task*> &tasks = workers[victim]->tasks;
+      if(!tasks.empty()) {
+        Task *task;
+        if(i == 0) {
+          task = tasks.back();
+          tasks.pop_back();
+        } else {
+          task = tasks.front();
+          tasks.pop_front();
+        }
+        pending--;
+        return task;
+      }
+    }
+    return NULL;
+  }
+
+  void TaskScheduler::run(Task *task) {
+    task->fn();
+    task->done.store(true, std::memory_order_release);
+  }
+
+  void TaskScheduler::workerLoop(int w) {
+    currentScheduler = this;
+    currentWorker = w;
+
+    while(true) {
+      Task *task = take(w);
+      if(task != NULL) {
+        run(task);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      sleepCond.wait(lock, [this]() { return stopping || pending > 0; });
+      if(stopping) {
+        return;
+      }
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef __CSGJS_TASK_SCHEDULER__
+#define __CSGJS_TASK_SCHEDULER__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace csgjs {
+
+  // Work stealing fork/join pool for the recursive tree algorithms. Each worker keeps a deque of forked tasks,
+  // runs its own newest first and steals the oldest from others when it runs dry. A thread waiting on a join
+  // runs other tasks meanwhile, so nested forks never block a worker. The thread that created the scheduler
+  // is worker 0; it should be the only outside thread calling forkJoin.
+  class TaskScheduler {
+    private:
+      struct Task {
+        std::function<void()> fn;
+        std::atomic<bool> done;
+
+        Task(const std::function<void()> &f) : fn(f), done(false) {}
+      };
+
+      struct Worker {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+      };
+
+      std::vector<Worker*> workers;
+      std::vector<std::thread> threads;
+
+      std::atomic<int> pending;
+      std::atomic<bool> stopping;
+      std::mutex sleepMutex;
+      std::condition_variable sleepCond;
+
+      TaskScheduler(const TaskScheduler&);
+      TaskScheduler& operator=(const TaskScheduler&);
+
+      int workerIndex() const;
+      void push(int w, Task *task);
+      bool popIfNewest(int w, Task *task);
+      Task* take(int w);
+      void run(Task *task);
+      void workerLoop(int w);
+
+    public:
+      explicit TaskScheduler(int numThreads);
+      ~TaskScheduler();
+
+      int numThreads() const;
+
+      // Runs a and b, b possibly on another thread, and returns once both have finished
+      template<typename A, typename B>
+      void forkJoin(A a, B b) {
+        if(threads.empty()) {
+          a();
+          b();
+          return;
+        }
+
+        int w = workerIndex();
+        Task task(b);
+        push(w, &task);
+
+        a();
+
+        if(popIfNewest(w, &task)) {
+          task.fn();
+          return;
+        }
+
+        // b was stolen, help out until it's done
+        while(!task.done.load(std::memory_order_acquire)) {
+          Task *other = take(w);
+          if(other != NULL) {
+            run(other);
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      }
+  };
+}
+
+#endif
@@ -1,313 +1,558 @@
 #include "csgjs/Trees.h"
-#include <list>
+#include "csgjs/math/HashKeys.h"
+#include <algorithm>
+#include <unordered_map>
 
 namespace csgjs {
-  Node::Node() : parent(NULL), front(NULL), back(NULL)  {
-  }
-
-  Node::Node(Node *p) : parent(p), front(NULL), back(NULL) {
+  // most polygons split in one batch, and fewest in one task
+  const size_t TASK_CUTOFF = 2048;
+
+  // most polygons a node looks at to score candidate planes with COST_PLANE
+  const size_t PLANE_SAMPLE = 64;
+
+  // A BSP node and where its polygons are in the current level's list
+  struct LevelNode {
+    ArenaIndex node;
+    size_t begin;
+    size_t end;
+    size_t firstBatch;
+
+    LevelNode(ArenaIndex n, size_t b, size_t e) : node(n), begin(b), end(e), firstBatch(0) {}
+  };
+
+  // Cuts every node's polygons into batches of at most TASK_CUTOFF, so even a single huge node splits in parallel
+  static void makeBatches(std::vector<LevelNode> &level, std::vector<PolygonBatch> &batches) {
+    batches.clear();
+
+    std::vector<LevelNode>::iterator itr = level.begin();
+    while(itr != level.end()) {
+      itr->firstBatch = batches.size();
+      size_t begin = itr->begin;
+      do {
+        size_t end = std::min(begin+TASK_CUTOFF, itr->end);
+        batches.push_back(PolygonBatch(itr->node, begin, end));
+        begin = end;
+      } while(begin < itr->end);
+      ++itr;
+    }
   }
 
-  void Node::invert() {
-    plane = plane.flipped();
-
-    if(front != NULL) {
-      front->invert();
+  // Appends the polygons in the given list of each of the node's batches to out, in order
+  static size_t gatherBatches(std::vector<PolygonBatch> &batches, size_t first, size_t last,
+                              std::vector<ArenaIndex> PolygonBatch::*list, std::vector<ArenaIndex> &out) {
+    size_t begin = out.size();
+    for(size_t b = first; b < last; b++) {
+      std::vector<ArenaIndex> &polygons = batches[b].*list;
+      out.insert(out.end(), polygons.begin(), polygons.end());
     }
+    return out.size()-begin;
+  }
 
-    if(back != NULL) {
-      back->invert();
+  // Drops each vertex within EPS of the last one kept, going around from the last vertex, compacting in place
+  static void removeCloseVertices(VertexList &vertices) {
+    Vector3 prevPos = vertices.back().pos;
+    VertexList::iterator out = vertices.begin();
+
+    VertexList::iterator itr = vertices.begin();
+    while(itr != vertices.end()) {
+      if(!(itr->pos.distanceTo(prevPos) < EPS)) {
+        prevPos = itr->pos;
+        *out = *itr;
+        ++out;
+      }
+      ++itr;
     }
 
-    Node *n = front;
-    front = back;
-    back = n;
+    vertices.erase(out, vertices.end());
   }
 
-  void Node::addPolygonTreeNodes(const std::vector<PolygonTreeNode*> &polyTreeNodes) {
-    std::vector<PolygonTreeNode*> frontNodes;
-    std::vector<PolygonTreeNode*> backNodes;
+  SplitOptions::SplitOptions() : planeSelection(RANDOM_PLANE), candidates(8), splitCost(4) {}
 
-    if(polyTreeNodes.size() > 0) {
-      int pick = fastRandom(polyTreeNodes.size());
-  //    int pick = 0;
+  TreeStats::TreeStats() : depth(0), nodes(0), buildSplits(0), clipSplits(0) {}
 
-      plane = polyTreeNodes[pick]->getPolygon().plane;
-    }
+  TreeStats& TreeStats::operator+=(const TreeStats &s) {
+    depth = std::max(depth, s.depth);
+    nodes += s.nodes;
+    buildSplits += s.buildSplits;
+    clipSplits += s.clipSplits;
+    return *this;
+  }
 
-    std::vector<PolygonTreeNode*>::const_iterator itr = polyTreeNodes.begin();
-    while(itr != polyTreeNodes.end()) {
-      (*itr)->splitByPlane(plane, polygonTreeNodes, backNodes, frontNodes, backNodes);
-      ++itr;
-    }
+  PolygonBatch::PolygonBatch(ArenaIndex n, size_t b, size_t e) : node(n), begin(b), end(e) {}
 
-    // CSG.js did this iteratively rather than recursively. Probably safer to do iteratively, but starting with a recursive
-    // solution for ease of implementation. If it leads to stack overflows, will refactor. May see a performance improvement
-    // when implemented iteratively, so it might be worth trying.
-    if(frontNodes.size() > 0) {
-      front = new Node(this);
-      front->addPolygonTreeNodes(frontNodes);
-    }
+  Node::Node() : parent(NO_INDEX), front(NO_INDEX), back(NO_INDEX), firstPolygon(NO_INDEX), lastPolygon(NO_INDEX) {
+  }
 
-    if(backNodes.size() > 0) {
-      back = new Node(this);
-      back->addPolygonTreeNodes(backNodes);
-    }
+  Node::Node(ArenaIndex p) : parent(p), front(NO_INDEX), back(NO_INDEX), firstPolygon(NO_INDEX), lastPolygon(NO_INDEX) {
   }
 
   bool Node::isRootNode() const {
-    return parent == NULL;
+    return parent == NO_INDEX;
   }
 
-  void Node::clipTo(Tree &tree, bool alsoRemoveCoplanarFront) {
-    if(polygonTreeNodes.size() > 0) {
-      tree.rootnode.clipPolygons(polygonTreeNodes, alsoRemoveCoplanarFront);
-    }
-    if(front != NULL) {
-      front->clipTo(tree, alsoRemoveCoplanarFront);
-    }
-    if(back != NULL) {
-      back->clipTo(tree, alsoRemoveCoplanarFront);
-    }
+  PolygonTreeNode::PolygonTreeNode() : sphereRadius(0), firstVertex(NO_INDEX), vertexCount(0), parent(NO_INDEX), firstChild(NO_INDEX),
+                                       lastChild(NO_INDEX), nextSibling(NO_INDEX), nextCoplanar(NO_INDEX), valid(false), removed(false) {}
+  PolygonTreeNode::PolygonTreeNode(ArenaIndex p, const Plane &pl, ArenaIndex first, ArenaIndex count, const std::pair<Vector3, csgjs_real> &sphere) :
+                                   plane(pl), sphereCenter(sphere.first), sphereRadius(sphere.second), firstVertex(first), vertexCount(count),
+                                   parent(p), firstChild(NO_INDEX), lastChild(NO_INDEX), nextSibling(NO_INDEX), nextCoplanar(NO_INDEX),
+                                   valid(true), removed(false) {}
+
+  bool PolygonTreeNode::isRootNode() const {
+    return parent == NO_INDEX;
   }
 
-  // Returns true if any triangles exist on the front side of the triangle
-  //
-  // breadth first search for provided plane, then check if any front nodes exist
-  bool Node::hasFrontNodes(const Plane &p) const {
-    std::list<const Node*> queue;
+  bool PolygonTreeNode::isRemoved() const {
+    return removed;
+  }
 
-    queue.push_back(this);
+  Tree::Tree(const std::vector<Polygon> &polygons, TaskScheduler *s, const SplitOptions &o) : scheduler(s), options(o), depth(0),
+                                                                                             buildSplits(0), splits(0) {
+    nodes.add();
+    polygonTree.add();
+    addPolygons(polygons);
+  }
 
-    while(!queue.empty()) {
-      const Node* curNode = queue.front();
-      queue.pop_front();
+  void Tree::addPolygons(const std::vector<Polygon> &polygons) {
+    std::vector<Polygon>::const_iterator itr = polygons.begin();
 
-      if(curNode->plane.isEqualWithinTolerance(p)) {
-        if(curNode->front != NULL) {
-          return true;
-        }
-      } else {
-        if(curNode->front != NULL) {
-          queue.push_back(curNode->front);
-        }
-        if(curNode->back != NULL) {
-          queue.push_back(curNode->back);
-        }
+    std::vector<ArenaIndex> polyTreeNodes;
+    polyTreeNodes.reserve(polygons.size());
+
+    while(itr != polygons.end()) {
+      polyTreeNodes.push_back(addChild(0, itr->vertices.data(), itr->vertices.size(), itr->plane));
+      ++itr;
+    }
+
+    addPolygonTreeNodes(0, polyTreeNodes, random.split());
+  }
+
+  // Calls fn on each of a level's consecutive polygon ranges (nodes or batches), forking halves with about the same
+  // number of polygons while there are enough of them
+  template<typename T, typename F>
+  void Tree::forEachRange(T *ranges, size_t count, const F &fn) {
+    size_t polygons = ranges[count-1].end-ranges[0].begin;
+
+    if(scheduler == NULL || count == 1 || polygons < 2*TASK_CUTOFF) {
+      for(size_t r = 0; r < count; r++) {
+        fn(ranges[r]);
       }
+      return;
     }
-    return false;
+
+    size_t middle = ranges[0].begin+polygons/2;
+    size_t half = 1;
+    while(half < count-1 && ranges[half].end <= middle) {
+      half++;
+    }
+
+    scheduler->forkJoin([&]() {
+      forEachRange(ranges, half, fn);
+    }, [&]() {
+      forEachRange(ranges+half, count-half, fn);
+    });
   }
 
-  void Node::clipPolygons(std::vector<PolygonTreeNode*> &polyTreeNodes, bool alsoRemoveCoplanarFront) {
-    std::vector<PolygonTreeNode*> frontNodes;
-    std::vector<PolygonTreeNode*> backNodes;
+  Plane Tree::pickPlane(const ArenaIndex *polyTreeNodes, size_t count, FastRandom &random) const {
+    if(options.planeSelection == RANDOM_PLANE || count == 1) {
+      return polygonTree[polyTreeNodes[random(count)]].plane;
+    }
 
-    std::vector<PolygonTreeNode*>::iterator itr = polyTreeNodes.begin();
+    std::vector<const PolygonTreeNode*> sample;
+    sample.reserve(std::min(count, PLANE_SAMPLE));
+    if(count <= PLANE_SAMPLE) {
+      for(size_t i = 0; i < count; i++) {
+        sample.push_back(&polygonTree[polyTreeNodes[i]]);
+      }
+    } else {
+      for(size_t i = 0; i < PLANE_SAMPLE; i++) {
+        sample.push_back(&polygonTree[polyTreeNodes[random(count)]]);
+      }
+    }
 
-    while(itr != polyTreeNodes.end()) {
-      PolygonTreeNode *node = (*itr);
-      if(!node->isRemoved()) {
-        node->splitByPlane(plane, alsoRemoveCoplanarFront ? backNodes : frontNodes, backNodes, frontNodes, backNodes);
+    // group the sample by plane, in order of first appearance so ties break the same way every run
+    std::unordered_map<PlaneKey, size_t> groupOf;
+    std::vector<std::pair<size_t, const Plane*> > groups;
+    std::vector<const PolygonTreeNode*>::const_iterator itr = sample.begin();
+    while(itr != sample.end()) {
+      std::pair<std::unordered_map<PlaneKey, size_t>::iterator, bool> inserted = groupOf.insert(std::make_pair(PlaneKey((*itr)->plane), groups.size()));
+      if(inserted.second) {
+        groups.push_back(std::make_pair(0, &(*itr)->plane));
       }
+      groups[inserted.first->second].first++;
       ++itr;
     }
 
-    if(front != NULL && frontNodes.size() > 0) {
-      front->clipPolygons(frontNodes);
-    }
+    std::stable_sort(groups.begin(), groups.end(), [](const std::pair<size_t, const Plane*> &a, const std::pair<size_t, const Plane*> &b) {
+      return a.first > b.first;
+    });
+
+    size_t numCandidates = std::min(groups.size(), (size_t)std::max(options.candidates, 1));
+    const Plane *best = groups[0].second;
+    csgjs_real bestCost = 0;
+
+    for(size_t c = 0; c < numCandidates; c++) {
+      const Plane &plane = *groups[c].second;
+      int front = 0;
+      int back = 0;
+      int spanning = 0;
+      int coplanar = 0;
+
+      itr = sample.begin();
+      while(itr != sample.end()) {
+        csgjs_real minT = 0;
+        csgjs_real maxT = 0;
+        const Vertex *v = &vertices[(*itr)->firstVertex];
+        for(ArenaIndex i = 0; i < (*itr)->vertexCount; i++) {
+          csgjs_real t = plane.normal.dot(v[i].pos)-plane.w;
+          minT = std::min(minT, t);
+          maxT = std::max(maxT, t);
+        }
 
-    if(back != NULL && backNodes.size() > 0) {
-      back->clipPolygons(backNodes);
-    } else {
-      std::vector<PolygonTreeNode*>::iterator backItr = backNodes.begin();
+        if(maxT > EPS && minT < NEG_EPS) {
+          spanning++;
+        } else if(maxT > EPS) {
+          front++;
+        } else if(minT < NEG_EPS) {
+          back++;
+        } else {
+          coplanar++;
+        }
+        ++itr;
+      }
 
-      while(backItr != backNodes.end()) {
-        (*backItr)->remove();
-        ++backItr;
+      csgjs_real cost = options.splitCost*spanning+(front > back ? front-back : back-front)-coplanar;
+      if(c == 0 || cost < bestCost) {
+        best = &plane;
+        bestCost = cost;
       }
     }
-  }
 
-  Tree::Tree(const std::vector<Polygon> &polygons) {
-    addPolygons(polygons);
+    return *best;
   }
 
-  bool Tree::hasPolygonsInFront(const Plane &p) const {
-    return rootnode.hasFrontNodes(p);
-  }
+  ArenaIndex Tree::addChild(ArenaIndex parent, const Vertex *v, ArenaIndex count, const Plane &plane) {
+    ArenaIndex child = polygonTree.add(parent, plane, vertices.addRun(v, count), count, Polygon::boundingSphere(v, count));
 
-  void Tree::addPolygons(const std::vector<Polygon> &polygons) {
-    std::vector<Polygon>::const_iterator itr = polygons.begin();
+    PolygonTreeNode &p = polygonTree[parent];
+    if(p.lastChild == NO_INDEX) {
+      p.firstChild = child;
+    } else {
+      polygonTree[p.lastChild].nextSibling = child;
+    }
+    p.lastChild = child;
 
-    std::vector<PolygonTreeNode*> polyTreeNodes;
-    polyTreeNodes.reserve(polygons.size());
+    return child;
+  }
 
-    while(itr != polygons.end()) {
-      polyTreeNodes.push_back(polygonTree.addChild(*itr));
-      ++itr;
+  void Tree::addCoplanar(ArenaIndex node, ArenaIndex polygon) {
+    Node &n = nodes[node];
+    if(n.lastPolygon == NO_INDEX) {
+      n.firstPolygon = polygon;
+    } else {
+      polygonTree[n.lastPolygon].nextCoplanar = polygon;
     }
-
-    rootnode.addPolygonTreeNodes(polyTreeNodes);
+    n.lastPolygon = polygon;
   }
 
   void Tree::invert() {
-    polygonTree.invert();
-    rootnode.invert();
+    // the same as Polygon::flip, on each valid polygon's run of vertices
+    polygonTree.forEach([this](PolygonTreeNode &p) {
+      if(p.valid.load(std::memory_order_relaxed)) {
+        Vertex *v = &vertices[p.firstVertex];
+        std::reverse(v, v+p.vertexCount);
+        for(ArenaIndex i = 0; i < p.vertexCount; i++) {
+          v[i] = v[i].flipped();
+        }
+        p.plane = p.plane.flipped();
+      }
+    });
+    nodes.forEach([](Node &n) {
+      n.plane = n.plane.flipped();
+      std::swap(n.front, n.back);
+    });
   }
 
-  void Tree::clipTo(Tree &tree, bool alsoRemoveCoplanarFront) {
-    rootnode.clipTo(tree, alsoRemoveCoplanarFront);
-  }
+  void Tree::addPolygonTreeNodes(ArenaIndex node, const std::vector<ArenaIndex> &polyTreeNodes, FastRandom random) {
+    std::vector<ArenaIndex> polygons(polyTreeNodes);
+    std::vector<ArenaIndex> nextPolygons;
+    std::vector<LevelNode> level(1, LevelNode(node, 0, polygons.size()));
+    std::vector<LevelNode> nextLevel;
+    std::vector<FastRandom> randoms(1, random);
+    std::vector<FastRandom> nextRandoms;
+    std::vector<PolygonBatch> batches;
+
+    size_t splitsBefore = splits.load();
+    int levels = 0;
+
+    while(!level.empty()) {
+      levels++;
+      forEachRange(level.data(), level.size(), [&](LevelNode &l) {
+        if(l.end > l.begin) {
+          nodes[l.node].plane = pickPlane(&polygons[l.begin], l.end-l.begin, randoms[&l-level.data()]);
+        }
+      });
 
-  std::vector<Polygon> Tree::toPolygons() {
-    std::vector<Polygon> polygons;
+      makeBatches(level, batches);
+      forEachRange(batches.data(), batches.size(), [&](PolygonBatch &batch) {
+        const Plane plane = nodes[batch.node].plane;
+        for(size_t p = batch.begin; p < batch.end; p++) {
+          splitByPlane(polygons[p], plane, batch.coplanar, batch.back, batch.front, batch.back);
+        }
+      });
+
+      // children are added a level at a time, so each level of the BSP tree ends up together in the arena
+      nextPolygons.clear();
+      nextLevel.clear();
+      nextRandoms.clear();
+      for(size_t i = 0; i < level.size(); i++) {
+        ArenaIndex n = level[i].node;
+        size_t firstBatch = level[i].firstBatch;
+        size_t lastBatch = i+1 < level.size() ? level[i+1].firstBatch : batches.size();
+
+        for(size_t b = firstBatch; b < lastBatch; b++) {
+          std::vector<ArenaIndex>::const_iterator itr = batches[b].coplanar.begin();
+          while(itr != batches[b].coplanar.end()) {
+            addCoplanar(n, *itr);
+            ++itr;
+          }
+        }
 
-    polygonTree.getPolygons(polygons);
+        FastRandom frontRandom = randoms[i].split();
+        FastRandom backRandom = randoms[i].split();
 
-    return polygons;
-  }
+        size_t begin = nextPolygons.size();
+        if(gatherBatches(batches, firstBatch, lastBatch, &PolygonBatch::front, nextPolygons) > 0) {
+          ArenaIndex front = nodes.add(n);
+          nodes[n].front = front;
+          nextLevel.push_back(LevelNode(front, begin, nextPolygons.size()));
+          nextRandoms.push_back(frontRandom);
+        }
 
-  PolygonTreeNode::PolygonTreeNode() : parent(NULL), removed(false), valid(false) {}
-  PolygonTreeNode::PolygonTreeNode(PolygonTreeNode *p, const Polygon &poly) : parent(p), polygon(poly), removed(false), valid(true) {}
-  PolygonTreeNode::~PolygonTreeNode() {
-    std::vector<PolygonTreeNode*>::iterator itr = children.begin();
+        begin = nextPolygons.size();
+        if(gatherBatches(batches, firstBatch, lastBatch, &PolygonBatch::back, nextPolygons) > 0) {
+          ArenaIndex back = nodes.add(n);
+          nodes[n].back = back;
+          nextLevel.push_back(LevelNode(back, begin, nextPolygons.size()));
+          nextRandoms.push_back(backRandom);
+        }
+      }
 
-    while(itr != children.end()) {
-      delete *itr;
-      ++itr;
+      polygons.swap(nextPolygons);
+      level.swap(nextLevel);
+      randoms.swap(nextRandoms);
     }
+
+    depth = std::max(depth, levels);
+    buildSplits += splits.load()-splitsBefore;
   }
 
-  void PolygonTreeNode::invalidate() {
-    valid = false;
+  // Each polygon is clipped on its own, so the polygons of every node go down tree's BSP in one batched pass
+  void Tree::clipTo(Tree &tree, bool alsoRemoveCoplanarFront) {
+    std::vector<ArenaIndex> queue(1, 0);
+    std::vector<ArenaIndex> polyTreeNodes;
 
-    if(parent != NULL) {
-      parent->invalidate();
-    }
-  }
+    for(size_t i = 0; i < queue.size(); i++) {
+      const Node &node = nodes[queue[i]];
 
-  void PolygonTreeNode::remove() {
-#ifdef CSGJS_DEBUG
-    if(isRootNode()) {
-      throw std::runtime_error("trying to delete root node");
+      for(ArenaIndex p = node.firstPolygon; p != NO_INDEX; p = polygonTree[p].nextCoplanar) {
+        polyTreeNodes.push_back(p);
+      }
+      if(node.front != NO_INDEX) {
+        queue.push_back(node.front);
+      }
+      if(node.back != NO_INDEX) {
+        queue.push_back(node.back);
+      }
     }
-    if(children.size() > 0) {
-      throw std::runtime_error("trying to delete node with children");
+
+    if(polyTreeNodes.size() > 0) {
+      tree.clipPolygons(*this, polyTreeNodes, alsoRemoveCoplanarFront);
     }
-#endif
+  }
 
-    invalidate();
+  // Returns true if any triangles exist on the front side of the triangle
+  //
+  // breadth first search for provided plane, then check if any front nodes exist
+  bool Tree::hasPolygonsInFront(const Plane &p) const {
+    std::vector<ArenaIndex> queue(1, 0);
 
-    // Can't delete this without removing pointers in BSP Node objects as well, if we remove from parent's children vector, we'll be creating a memory leak
-    // Maybe use some kind of smart pointer so we can remove them here
-    //parent->children.erase(std::remove(parent->children.begin(), parent->children.end(), this), parent->children.end());
-    //delete this;
+    for(size_t i = 0; i < queue.size(); i++) {
+      const Node &curNode = nodes[queue[i]];
 
+      if(curNode.plane.isEqualWithinTolerance(p)) {
+        if(curNode.front != NO_INDEX) {
+          return true;
+        }
+      } else {
+        if(curNode.front != NO_INDEX) {
+          queue.push_back(curNode.front);
+        }
+        if(curNode.back != NO_INDEX) {
+          queue.push_back(curNode.back);
+        }
+      }
+    }
+    return false;
   }
 
-  PolygonTreeNode* PolygonTreeNode::addChild(const Polygon &polygon) {
-    PolygonTreeNode *child = new PolygonTreeNode(this, polygon);
+  // Splits polyTree's polygons by the planes of this tree, level by level from the root
+  void Tree::clipPolygons(Tree &polyTree, const std::vector<ArenaIndex> &polyTreeNodes, bool alsoRemoveCoplanarFront) {
+    std::vector<ArenaIndex> polygons(polyTreeNodes);
+    std::vector<ArenaIndex> nextPolygons;
+    std::vector<LevelNode> level(1, LevelNode(0, 0, polygons.size()));
+    std::vector<LevelNode> nextLevel;
+    std::vector<PolygonBatch> batches;
+
+    // only polygons coplanar with the root's plane can be removed as coplanar fronts
+    bool removeCoplanarFront = alsoRemoveCoplanarFront;
+
+    while(!level.empty()) {
+      makeBatches(level, batches);
+      forEachRange(batches.data(), batches.size(), [&](PolygonBatch &batch) {
+        const Node &n = nodes[batch.node];
+        for(size_t p = batch.begin; p < batch.end; p++) {
+          if(!polyTree.polygonTree[polygons[p]].isRemoved()) {
+            polyTree.splitByPlane(polygons[p], n.plane, removeCoplanarFront ? batch.back : batch.front, batch.back, batch.front, batch.back);
+          }
+        }
+
+        if(n.back == NO_INDEX) {
+          std::vector<ArenaIndex>::const_iterator itr = batch.back.begin();
+          while(itr != batch.back.end()) {
+            polyTree.remove(*itr);
+            ++itr;
+          }
+        }
+      });
+
+      nextPolygons.clear();
+      nextLevel.clear();
+      for(size_t i = 0; i < level.size(); i++) {
+        const Node &n = nodes[level[i].node];
+        size_t firstBatch = level[i].firstBatch;
+        size_t lastBatch = i+1 < level.size() ? level[i+1].firstBatch : batches.size();
+
+        size_t begin = nextPolygons.size();
+        if(n.front != NO_INDEX && gatherBatches(batches, firstBatch, lastBatch, &PolygonBatch::front, nextPolygons) > 0) {
+          nextLevel.push_back(LevelNode(n.front, begin, nextPolygons.size()));
+        }
 
-    children.push_back(child);
+        begin = nextPolygons.size();
+        if(n.back != NO_INDEX && gatherBatches(batches, firstBatch, lastBatch, &PolygonBatch::back, nextPolygons) > 0) {
+          nextLevel.push_back(LevelNode(n.back, begin, nextPolygons.size()));
+        }
+      }
 
-    return child;
+      polygons.swap(nextPolygons);
+      level.swap(nextLevel);
+      removeCoplanarFront = false;
+    }
   }
 
-  bool PolygonTreeNode::isRootNode() const {
-    return parent == NULL;
+  std::vector<Polygon> Tree::toPolygons() {
+    std::vector<Polygon> polygons;
+
+    getPolygons(0, polygons);
+
+    return polygons;
   }
 
-  bool PolygonTreeNode::isRemoved() const {
-    return removed;
+  void Tree::invalidate(ArenaIndex polygon) {
+    // a node is only ever invalidated along with all of its ancestors, so we can stop at the first invalid one
+    while(polygon != NO_INDEX && polygonTree[polygon].valid.load(std::memory_order_relaxed)) {
+      polygonTree[polygon].valid.store(false, std::memory_order_relaxed);
+      polygon = polygonTree[polygon].parent;
+    }
   }
 
-  Polygon& PolygonTreeNode::getPolygon() {
-    return polygon;
+  void Tree::remove(ArenaIndex polygon) {
+#ifdef CSGJS_DEBUG
+    if(polygonTree[polygon].isRootNode()) {
+      throw std::runtime_error("trying to delete root node");
+    }
+    if(polygonTree[polygon].firstChild != NO_INDEX) {
+      throw std::runtime_error("trying to delete node with children");
+    }
+#endif
+
+    // The node stays in the arena, invalidating it is enough to drop it from toPolygons
+    invalidate(polygon);
   }
 
-  // Like addPolygonTreeNodes, this was implemented iteratively in CSG.js, but we're doing it recursively here.
-  // Might be worth revisiting.
-  void PolygonTreeNode::splitByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                                         std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                                         std::vector<PolygonTreeNode*> &frontNodes,
-                                                         std::vector<PolygonTreeNode*> &backNodes) {
+  // Splits the leaves under polygon in order. The walk follows the parent and sibling links rather than recursing,
+  // and never descends into the pieces of a leaf it has just split.
+  void Tree::splitByPlane(ArenaIndex polygon, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                  std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                  std::vector<ArenaIndex> &frontNodes,
+                                                                  std::vector<ArenaIndex> &backNodes) {
+    ArenaIndex current = polygon;
 
-    if(children.size() > 0) {
-      std::vector<PolygonTreeNode*>::iterator itr = children.begin();
+    while(true) {
+      const PolygonTreeNode &node = polygonTree[current];
 
-      while(itr != children.end()) {
-        (*itr)->splitByPlane(plane, coplanarFrontNodes, coplanarBackNodes, frontNodes, backNodes);
-        ++itr;
+      if(node.firstChild != NO_INDEX) {
+        current = node.firstChild;
+        continue;
       }
-    } else {
-      if(valid) {
-        splitLeafByPlane(plane, coplanarFrontNodes, coplanarBackNodes, frontNodes, backNodes);
+
+      if(node.valid) {
+        splitLeafByPlane(current, plane, coplanarFrontNodes, coplanarBackNodes, frontNodes, backNodes);
+      }
+
+      while(current != polygon && polygonTree[current].nextSibling == NO_INDEX) {
+        current = polygonTree[current].parent;
       }
+      if(current == polygon) {
+        return;
+      }
+      current = polygonTree[current].nextSibling;
     }
   }
 
-  void PolygonTreeNode::splitLeafByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                                             std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                                             std::vector<PolygonTreeNode*> &frontNodes,
-                                                             std::vector<PolygonTreeNode*> &backNodes) {
+  void Tree::splitLeafByPlane(ArenaIndex polygon, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                      std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                      std::vector<ArenaIndex> &frontNodes,
+                                                                      std::vector<ArenaIndex> &backNodes) {
 #ifdef CSGJS_DEBUG
-    if(children.size() > 0) {
+    if(polygonTree[polygon].firstChild != NO_INDEX) {
       throw std::runtime_error("trying to split non-leaf node");
     }
 #endif
 
-    std::pair<Vector3, csgjs_real> bound = polygon.boundingSphere();
-    csgjs_real sphereRadius = bound.second;
-    Vector3 sphereCenter = bound.first;
+    csgjs_real sphereRadius = polygonTree[polygon].sphereRadius;
+    Vector3 sphereCenter = polygonTree[polygon].sphereCenter;
 
     Vector3 planeNormal = plane.normal;
     csgjs_real d = planeNormal.dot(sphereCenter) - plane.w;
     if(d > sphereRadius) {
-      frontNodes.push_back(this);
+      frontNodes.push_back(polygon);
     } else if(d < -sphereRadius) {
-      backNodes.push_back(this);
+      backNodes.push_back(polygon);
     } else {
-      splitPolygonByPlane(plane, coplanarFrontNodes, coplanarBackNodes, frontNodes, backNodes);
+      splitPolygonByPlane(polygon, plane, coplanarFrontNodes, coplanarBackNodes, frontNodes, backNodes);
     }
   }
 
-  void PolygonTreeNode::invertRecurse() {
-    if(valid) {
-      polygon = polygon.flipped();
-    }
-    std::vector<PolygonTreeNode*>::iterator itr = children.begin();
-    while(itr != children.end()) {
-      (*itr)->invertRecurse();
-      ++itr;
-    }
-  }
+  void Tree::splitPolygonByPlane(ArenaIndex index, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                       std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                       std::vector<ArenaIndex> &frontNodes,
+                                                                       std::vector<ArenaIndex> &backNodes) {
+    // arena slots never move, so these stay valid while the pieces are added below
+    const PolygonTreeNode &polygon = polygonTree[index];
+    const Vertex *polygonVertices = &vertices[polygon.firstVertex];
+    int numVertices = polygon.vertexCount;
 
-  void PolygonTreeNode::invert() {
-#ifdef CSGJS_DEBUG
-    if(!isRootNode()) {
-      throw std::runtime_error("can only call invert on root node");
-    }
-#endif
-    invertRecurse();
-  }
-
-  void PolygonTreeNode::splitPolygonByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                                                std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                                                std::vector<PolygonTreeNode*> &frontNodes,
-                                                                std::vector<PolygonTreeNode*> &backNodes) {
     if(plane == polygon.plane) {
       // if the polygon's plane is exactly the same as the cutting plane it as a coplanar front
-      coplanarFrontNodes.push_back(this);
+      coplanarFrontNodes.push_back(index);
     } else {
-      std::vector<bool> vertexIsBack;
-      vertexIsBack.reserve(polygon.vertices.size());
+      SmallVector<bool, 8> vertexIsBack;
+      vertexIsBack.reserve(numVertices);
 
-      std::vector<Vertex>::iterator itr = polygon.vertices.begin();
       bool hasFront = false;
       bool hasBack = false;
-      while(itr != polygon.vertices.end()) {
-        csgjs_real t = plane.normal.dot(itr->pos)-plane.w;
+      for(int i = 0; i < numVertices; i++) {
+        csgjs_real t = plane.normal.dot(polygonVertices[i].pos)-plane.w;
         bool isBack = t < 0;
         vertexIsBack.push_back(isBack);
         if(t > EPS) {
@@ -316,36 +561,34 @@ namespace csgjs {
         if(t < NEG_EPS) {
           hasBack = true;
         }
-        ++itr;
       }
 
       if(!hasFront && !hasBack) {
         if(plane.normal.dot(polygon.plane.normal) >= 0) {
           // if the polygon's plane is in the same direction as the cutting plane
           // and all of our vertices were within tolerance of being on the plane
-          coplanarFrontNodes.push_back(this);
+          coplanarFrontNodes.push_back(index);
         } else {
           // if the polygon's plane is in the opposite direction as the cutting plane
           // and all of our vertices were within tolerance of being on the plane
-          coplanarBackNodes.push_back(this);
+          coplanarBackNodes.push_back(index);
         }
       } else if(!hasBack) {
         // if the polygon only has vertices in front of the cutting plane
-        frontNodes.push_back(this);
+        frontNodes.push_back(index);
       } else if(!hasFront) {
         // if the polygon only has vertices behind the cutting plane
-        backNodes.push_back(this);
+        backNodes.push_back(index);
       } else {
         // the polygon crosses the cutting plane and needs to be divided into a front and back polygon
 
-        std::vector<Vertex> frontVertices;
-        std::vector<Vertex> backVertices;
+        VertexList frontVertices;
+        VertexList backVertices;
 
-        int numVertices = polygon.vertices.size();
         for(int i = 0; i < numVertices; i++) {
           int nextI = i == (numVertices-1) ? 0 : i+1;
-          Vertex vertex = polygon.vertices[i];
-          Vertex nextVertex = polygon.vertices[nextI];
+          const Vertex &vertex = polygonVertices[i];
+          const Vertex &nextVertex = polygonVertices[nextI];
           bool isBack = vertexIsBack[i];
           bool nextIsBack = vertexIsBack[nextI];
           if(isBack == nextIsBack) {
@@ -357,9 +600,7 @@ namespace csgjs {
             }
           } else {
             // line segment intersects plane
-            Vector3 pos = vertex.pos;
-            Vector3 nextPos = nextVertex.pos;
-            Vertex intersectionV(plane.splitLineBetweenPoints(pos, nextPos));
+            Vertex intersectionV(plane.splitLineBetweenPoints(vertex.pos, nextVertex.pos));
             if(isBack) {
               backVertices.push_back(vertex);
               backVertices.push_back(intersectionV);
@@ -373,98 +614,100 @@ namespace csgjs {
         }
 
         if(backVertices.size() >= 3) {
-          int numBackVertices = backVertices.size();
-          Vertex prevVertex = backVertices[numBackVertices-1];
-          std::vector<Vertex>::iterator backVertsItr = backVertices.begin();
-          while(backVertsItr != backVertices.end()) {
-            Vertex v = *backVertsItr;
-            if(v.pos.distanceTo(prevVertex.pos) < EPS) {
-              backVertsItr = backVertices.erase(backVertsItr);
-            } else {
-              prevVertex = v;
-              ++backVertsItr;
-            }
-          }
+          removeCloseVertices(backVertices);
         }
-
         if(frontVertices.size() >= 3) {
-          int numFrontVertices = frontVertices.size();
-          Vertex prevVertex = frontVertices[numFrontVertices-1];
-          std::vector<Vertex>::iterator frontVertsItr = frontVertices.begin();
-          while(frontVertsItr != frontVertices.end()) {
-            Vertex v = *frontVertsItr;
-            if(v.pos.distanceTo(prevVertex.pos) < EPS) {
-              frontVertsItr = frontVertices.erase(frontVertsItr);
-            } else {
-              prevVertex = v;
-              ++frontVertsItr;
-            }
-          }
+          removeCloseVertices(frontVertices);
         }
 
+        splits.fetch_add(1, std::memory_order_relaxed);
+
         if(frontVertices.size() >= 3) {
-          PolygonTreeNode *node = addChild(Polygon(std::move(frontVertices), polygon.plane));
+          ArenaIndex node = addChild(index, frontVertices.data(), frontVertices.size(), polygon.plane);
           frontNodes.push_back(node);
         }
         if(backVertices.size() >= 3) {
-          PolygonTreeNode *node = addChild(Polygon(std::move(backVertices), polygon.plane));
+          ArenaIndex node = addChild(index, backVertices.data(), backVertices.size(), polygon.plane);
           backNodes.push_back(node);
         }
       }
     }
   }
 
-  void PolygonTreeNode::getPolygons(std::vector<Polygon> &polygons) const {
-    if(valid) {
-      polygons.push_back(polygon);
-    } else {
-      std::vector<PolygonTreeNode*>::const_iterator itr = children.begin();
-      while(itr != children.end()) {
-        (*itr)->getPolygons(polygons);
-        ++itr;
+  // Collects the topmost valid polygons under polygon, walking the links like splitByPlane
+  void Tree::getPolygons(ArenaIndex polygon, std::vector<Polygon> &polygons) const {
+    ArenaIndex current = polygon;
+
+    while(true) {
+      const PolygonTreeNode &node = polygonTree[current];
+
+      if(node.valid) {
+        polygons.push_back(toPolygon(current));
+      } else if(node.firstChild != NO_INDEX) {
+        current = node.firstChild;
+        continue;
+      }
+
+      while(current != polygon && polygonTree[current].nextSibling == NO_INDEX) {
+        current = polygonTree[current].parent;
+      }
+      if(current == polygon) {
+        return;
       }
+      current = polygonTree[current].nextSibling;
     }
   }
 
-  int PolygonTreeNode::countNodes() const {
-    int count = 1;
-
-    std::vector<PolygonTreeNode*>::const_iterator itr = children.begin();
-    while(itr != children.end()) {
-      count += (*itr)->countNodes();
-      ++itr;
+  Polygon Tree::toPolygon(ArenaIndex polygon) const {
+    const PolygonTreeNode &node = polygonTree[polygon];
+    VertexList v;
+    if(node.firstVertex != NO_INDEX) {
+      const Vertex *run = &vertices[node.firstVertex];
+      v.reserve(node.vertexCount);
+      for(ArenaIndex i = 0; i < node.vertexCount; i++) {
+        v.push_back(run[i]);
+      }
     }
-    return count;
+    return Polygon(std::move(v), node.plane);
+  }
+
+  int Tree::countNodes() const {
+    return polygonTree.size();
+  }
+
+  TreeStats Tree::stats() const {
+    TreeStats s;
+    s.depth = depth;
+    s.nodes = nodes.size();
+    s.buildSplits = buildSplits;
+    s.clipSplits = splits.load()-buildSplits;
+    return s;
   }
 
   std::ostream& operator<<(std::ostream& os, const Tree &tree) {
-//    os << tree.rootnode << std::endl;
-    os << tree.polygonTree.countNodes() << std::endl;
+//    os << indentChildNodes(os, tree, 0, 0) << std::endl;
+    os << tree.countNodes() << std::endl;
     return os;
   }
 
-  std::ostream& indentChildNodes(std::ostream& os, const PolygonTreeNode *node, int level) {
+  std::ostream& indentChildNodes(std::ostream& os, const Tree &tree, ArenaIndex polygon, int level) {
+    const PolygonTreeNode &node = tree.polygonTree[polygon];
+
     for(int i = 0; i < level; i++) {
       os << "  ";
     }
-    os << node->polygon;
+    os << tree.toPolygon(polygon);
 
-    if(node->children.size() > 0) {
+    if(node.firstChild != NO_INDEX) {
       os << "Children: ";
       os << std::endl;
-      std::vector<PolygonTreeNode*>::const_iterator itr = node->children.begin();
 
-      while(itr != node->children.end()) {
-        indentChildNodes(os, *itr, level+1);
-        ++itr;
+      for(ArenaIndex child = node.firstChild; child != NO_INDEX; child = tree.polygonTree[child].nextSibling) {
+        indentChildNodes(os, tree, child, level+1);
       }
     } else {
       os << std::endl;
     }
     return os;
   }
-
-  std::ostream& operator<<(std::ostream& os, const PolygonTreeNode &node) {
-    return indentChildNodes(os, &node, 0);
-  }
 }
@@ -3,87 +3,157 @@
 
 #include "csgjs/util.h"
 #include <vector>
+#include <type_traits>
+#include "csgjs/Arena.h"
+#include "csgjs/TaskScheduler.h"
 #include "csgjs/math/Plane.h"
 #include "csgjs/math/Polygon3.h"
 
 namespace csgjs {
 
-  class PolygonTreeNode {
-    private:
-      PolygonTreeNode *parent;
-      std::vector<PolygonTreeNode*> children;
-      Polygon polygon;
-      bool valid;
-      bool removed;
+  // Node of the polygon tree. When a polygon is split, the pieces become its children. Links are indices into
+  // the owning Tree's polygon arena, and the polygon's vertices are a run in its vertex arena, so a node owns no
+  // memory of its own.
+  struct PolygonTreeNode {
+    Plane plane;
+    Vector3 sphereCenter; // bounding sphere, what splitting by a plane checks first
+    csgjs_real sphereRadius;
+    ArenaIndex firstVertex;
+    ArenaIndex vertexCount;
+    ArenaIndex parent;
+    ArenaIndex firstChild;
+    ArenaIndex lastChild;
+    ArenaIndex nextSibling;
+    ArenaIndex nextCoplanar; // next polygon in the coplanar list of the BSP node holding this one
+    std::atomic<bool> valid; // cleared up the parent chain, possibly from several threads at once
+    bool removed;
+
+    PolygonTreeNode();
+    PolygonTreeNode(ArenaIndex parent, const Plane &plane, ArenaIndex firstVertex, ArenaIndex vertexCount,
+                    const std::pair<Vector3, csgjs_real> &sphere);
+
+    bool isRootNode() const;
+    bool isRemoved() const;
+  };
 
-      void splitLeafByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                         std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                         std::vector<PolygonTreeNode*> &frontNodes,
-                                         std::vector<PolygonTreeNode*> &backNodes);
+  // Node of the BSP tree. Links are indices into the owning Tree's node arena, and the polygons lying in this
+  // node's plane are a list threaded through PolygonTreeNode::nextCoplanar.
+  struct Node {
+    Plane plane;
+    ArenaIndex parent;
+    ArenaIndex front;
+    ArenaIndex back;
+    ArenaIndex firstPolygon;
+    ArenaIndex lastPolygon;
 
-      void splitPolygonByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                                   std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                                   std::vector<PolygonTreeNode*> &frontNodes,
-                                                   std::vector<PolygonTreeNode*> &backNodes);
+    Node();
+    Node(ArenaIndex parent);
 
-      void invertRecurse();
+    bool isRootNode() const;
+  };
 
-    public:
-      PolygonTreeNode();
-      PolygonTreeNode(const Polygon &polygon);
-      PolygonTreeNode(PolygonTreeNode *parent, const Polygon &polygon);
-      ~PolygonTreeNode();
+  // Keeps freeing the arenas a block at a time, without walking their nodes
+  static_assert(std::is_trivially_destructible<Node>::value, "BSP nodes must be trivially destructible");
+  static_assert(std::is_trivially_destructible<PolygonTreeNode>::value, "polygon tree nodes must be trivially destructible");
+  static_assert(std::is_trivially_destructible<Vertex>::value, "vertices must be trivially destructible");
+
+  // How each BSP node picks its splitting plane while a Tree is built.
+  //
+  // RANDOM_PLANE takes the plane of a random polygon. COST_PLANE groups a sample of the node's polygons by plane,
+  // takes the candidates most polygons share and keeps the one with the lowest cost over the sample:
+  // splitCost for each polygon it would split, plus the difference between the polygons in front and behind,
+  // less the polygons lying in it, which are settled at this node.
+  enum PlaneSelection {
+    RANDOM_PLANE,
+    COST_PLANE
+  };
 
-      PolygonTreeNode* addChild(const Polygon &polygon);
+  struct SplitOptions {
+    PlaneSelection planeSelection;
+    int candidates;
+    csgjs_real splitCost;
 
-      void getPolygons(std::vector<Polygon> &polygons) const;
-      void invalidate();
-      void remove();
-      void invert();
-      bool isRootNode() const;
-      bool isRemoved() const;
-      int countNodes() const;
-      Polygon& getPolygon();
-      void splitByPlane(const Plane &plane, std::vector<PolygonTreeNode*> &coplanarFrontNodes,
-                                            std::vector<PolygonTreeNode*> &coplanarBackNodes,
-                                            std::vector<PolygonTreeNode*> &frontNodes,
-                                            std::vector<PolygonTreeNode*> &backNodes);
-
-      friend std::ostream& indentChildNodes(std::ostream& os, const PolygonTreeNode *node, int level);
-      friend std::ostream& operator<<(std::ostream& os, const PolygonTreeNode &polygonTreeNode);
+    SplitOptions();
   };
 
+  // Shape of a built tree, and how many polygons were split building it and clipping it to other trees
+  struct TreeStats {
+    int depth;
+    size_t nodes;
+    size_t buildSplits;
+    size_t clipSplits;
 
-  class Tree;
+    TreeStats();
 
-  class Node {
-    private:
-      Plane plane;
-      Node* front;
-      Node* back;
-      Node* parent;
-      std::vector<PolygonTreeNode*> polygonTreeNodes;
+    // combines the stats of two trees, keeping the deeper depth
+    TreeStats& operator+=(const TreeStats &s);
+  };
 
-    public:
-      Node();
-      Node(Node* p);
+  // A run of polygons headed for one BSP node, and the lists splitting them by that node's plane sorted them into
+  struct PolygonBatch {
+    ArenaIndex node;
+    size_t begin;
+    size_t end;
+    std::vector<ArenaIndex> coplanar;
+    std::vector<ArenaIndex> front;
+    std::vector<ArenaIndex> back;
 
-      bool hasFrontNodes(const Plane &p) const;
-      bool isRootNode() const;
-      void invert();
-      void clipTo(Tree &tree, bool alsoRemoveCoplanarFront=false);
-      void clipPolygons(std::vector<PolygonTreeNode*> &polyTreeNodes, bool alsoRemoveCoplanarFront=false);
-      void addPolygonTreeNodes(const std::vector<PolygonTreeNode*> &polyTreeNodes);
+    PolygonBatch(ArenaIndex node, size_t begin, size_t end);
   };
 
-  // Root node of the CSG tree and PolygonTree
+  // Root node of the CSG tree and PolygonTree. Owns their arenas and the vertex arena; the root of each tree is
+  // at index 0.
+  //
+  // Building and clipping walk the BSP tree breadth first with explicit work lists, a level of nodes at a time, so
+  // deep trees don't use up the stack. Each level's polygons are split in batches, in parallel given a scheduler.
+  // Each node draws its splitting plane from its own random stream, split off its parent's, so the tree comes out
+  // the same for any number of threads.
   class Tree {
     private:
-      Node rootnode;
-      PolygonTreeNode polygonTree;
+      Arena<Node> nodes;
+      Arena<PolygonTreeNode> polygonTree;
+      Arena<Vertex> vertices;
+      TaskScheduler *scheduler;
+      SplitOptions options;
+      FastRandom random;
+
+      int depth;
+      size_t buildSplits;
+      std::atomic<size_t> splits;
+
+      template<typename T, typename F>
+      void forEachRange(T *ranges, size_t count, const F &fn);
+
+      Plane pickPlane(const ArenaIndex *polyTreeNodes, size_t count, FastRandom &random) const;
+
+      ArenaIndex addChild(ArenaIndex parent, const Vertex *v, ArenaIndex count, const Plane &plane);
+      Polygon toPolygon(ArenaIndex polygon) const;
+      void addCoplanar(ArenaIndex node, ArenaIndex polygon);
+      void invalidate(ArenaIndex polygon);
+      void remove(ArenaIndex polygon);
+
+      void splitByPlane(ArenaIndex polygon, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                std::vector<ArenaIndex> &frontNodes,
+                                                                std::vector<ArenaIndex> &backNodes);
+
+      void splitLeafByPlane(ArenaIndex polygon, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                    std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                    std::vector<ArenaIndex> &frontNodes,
+                                                                    std::vector<ArenaIndex> &backNodes);
+
+      void splitPolygonByPlane(ArenaIndex polygon, const Plane &plane, std::vector<ArenaIndex> &coplanarFrontNodes,
+                                                                       std::vector<ArenaIndex> &coplanarBackNodes,
+                                                                       std::vector<ArenaIndex> &frontNodes,
+                                                                       std::vector<ArenaIndex> &backNodes);
+
+      void getPolygons(ArenaIndex polygon, std::vector<Polygon> &polygons) const;
+
+      void addPolygonTreeNodes(ArenaIndex node, const std::vector<ArenaIndex> &polyTreeNodes, FastRandom random);
+      void clipPolygons(Tree &polyTree, const std::vector<ArenaIndex> &polyTreeNodes, bool alsoRemoveCoplanarFront=false);
 
     public:
-      Tree(const std::vector<Polygon> &polygons);
+      Tree(const std::vector<Polygon> &polygons, TaskScheduler *scheduler=NULL, const SplitOptions &options=SplitOptions());
 
       void addPolygons(const std::vector<Polygon> &polygons);
 
@@ -91,9 +161,11 @@ namespace csgjs {
       void clipTo(Tree &tree, bool alsoRemoveCoplanarFront=false);
       void invert();
       std::vector<Polygon> toPolygons();
+      int countNodes() const;
+      TreeStats stats() const;
 
+      friend std::ostream& indentChildNodes(std::ostream& os, const Tree &tree, ArenaIndex node, int level);
       friend std::ostream& operator<<(std::ostream& os, const Tree &tree);
-      friend class Node;
   };
 }
 
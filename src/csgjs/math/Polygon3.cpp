@@ -3,7 +3,7 @@
 #include <stdexcept>
 
 namespace csgjs {
-  Polygon::Polygon(const std::vector<Vertex> &v, const Plane &p) : _boundingSphereCacheValid(false), _boundingBoxCacheValid(false), vertices(v), plane(p) {
+  Polygon::Polygon(const VertexList &v, const Plane &p) : vertices(v), plane(p), _boundingSphereRadius(-1) {
 #ifdef CSGJS_DEBUG
     if(!checkIfConvex()) {
       std::cout << "not convex " << *this << std::endl;
@@ -12,7 +12,7 @@ namespace csgjs {
 #endif
   }
 
-  Polygon::Polygon(std::vector<Vertex> &&v, const Plane &p) : _boundingSphereCacheValid(false), _boundingBoxCacheValid(false), vertices(v), plane(p) {
+  Polygon::Polygon(VertexList &&v, const Plane &p) : vertices(std::move(v)), plane(p), _boundingSphereRadius(-1) {
 #ifdef CSGJS_DEBUG
     if(!checkIfConvex()) {
       std::cout << "not convex " << *this << std::endl;
@@ -21,7 +21,7 @@ namespace csgjs {
 #endif
   }
 
-  Polygon::Polygon(const std::vector<Vertex> &v) : vertices(v), _boundingSphereCacheValid(false), _boundingBoxCacheValid(false) {
+  Polygon::Polygon(const VertexList &v) : vertices(v), _boundingSphereRadius(-1) {
     plane = Plane::fromVector3s(vertices[0].pos, vertices[1].pos, vertices[2].pos);
 #ifdef CSGJS_DEBUG
     if(!checkIfConvex()) {
@@ -31,19 +31,35 @@ namespace csgjs {
 #endif
   }
 
-  Polygon::Polygon() : _boundingSphereCacheValid(false), _boundingBoxCacheValid(false) {}
+  Polygon::Polygon(VertexList &&v) : vertices(std::move(v)), _boundingSphereRadius(-1) {
+    plane = Plane::fromVector3s(vertices[0].pos, vertices[1].pos, vertices[2].pos);
+#ifdef CSGJS_DEBUG
+    if(!checkIfConvex()) {
+      std::cout << "not convex " << *this << std::endl;
+//      throw std::runtime_error("Not convex!");
+    }
+#endif
+  }
+
+  Polygon::Polygon() : _boundingSphereRadius(-1) {}
 
   Polygon Polygon::flipped() const {
-    std::vector<Vertex> newVertices;
-    Plane newPlane = plane.flipped();
+    Polygon p(*this);
+    p.flip();
+    return p;
+  }
+
+  // Flipping keeps the same points, so the bounding sphere stays valid
+  void Polygon::flip() {
+    std::reverse(vertices.begin(), vertices.end());
 
-    std::vector<Vertex>::const_reverse_iterator itr = vertices.rbegin();
-    while(itr != vertices.rend()) {
-      newVertices.push_back(itr->flipped());
+    VertexList::iterator itr = vertices.begin();
+    while(itr != vertices.end()) {
+      *itr = itr->flipped();
       ++itr;
     }
 
-    return Polygon(std::move(newVertices), newPlane);
+    plane = plane.flipped();
   }
 
   bool Polygon::checkIfDegenerateTriangle() const {
@@ -100,8 +116,8 @@ namespace csgjs {
   }
 
   Polygon Polygon::transform(const Matrix4x4 &m) const {
-    std::vector<Vertex> verts(vertices);
-    std::vector<Vertex>::iterator itr = verts.begin();
+    VertexList verts(vertices);
+    VertexList::iterator itr = verts.begin();
     while(itr != verts.end()) {
       *itr = itr->transform(m);
       ++itr;
@@ -120,45 +136,42 @@ namespace csgjs {
     return crossdotnormal >= 0;
   }
 
-  // seems like this caching scheme could be an unnecessary optimization, but
-  // this is how it was done in CSG.js, maybe try calculating the bounding box and sphere
-  // in the constructor to avoid any branching (it probably makes sense in JavaScript,
-  // but I question the benefit in C++). It would come down to how often polygons are
-  // constructed without ever needing a bounding box or sphere, which I'm not sure about.
+  // Only the bounding sphere is cached, it's what splitting by a plane checks first. The box is a few min/max
+  // over vertices that are already in the polygon.
   std::pair<Vector3, Vector3> Polygon::boundingBox() const {
-    if(!_boundingBoxCacheValid) {
-      std::vector<Vertex>::const_iterator itr = vertices.begin();
+    return boundingBox(vertices.data(), vertices.size());
+  }
 
-      if(itr != vertices.end()) {
-        _boundingBoxCache.first = itr->pos;
-        _boundingBoxCache.second = itr->pos;
+  std::pair<Vector3, csgjs_real> Polygon::boundingSphere() const {
+    if(_boundingSphereRadius < 0) {
+      std::pair<Vector3, csgjs_real> sphere = boundingSphere(vertices.data(), vertices.size());
+      _boundingSphereCenter = sphere.first;
+      _boundingSphereRadius = sphere.second;
+    }
 
-        while(itr != vertices.end()) {
-          _boundingBoxCache.first = _boundingBoxCache.first.min(itr->pos);
-          _boundingBoxCache.second = _boundingBoxCache.second.max(itr->pos);
-          ++itr;
-        }
-        _boundingBoxCacheValid = true;
+    return std::make_pair(_boundingSphereCenter, _boundingSphereRadius);
+  }
 
-      } else {
-        _boundingBoxCache.first = Vector3(0,0,0);
-        _boundingBoxCache.second = Vector3(0,0,0);
-        _boundingBoxCacheValid = true;
+  std::pair<Vector3, Vector3> Polygon::boundingBox(const Vertex *vertices, size_t n) {
+    std::pair<Vector3, Vector3> box(Vector3(0,0,0), Vector3(0,0,0));
+
+    if(n > 0) {
+      box.first = vertices[0].pos;
+      box.second = vertices[0].pos;
+
+      for(size_t i = 0; i < n; i++) {
+        box.first = box.first.min(vertices[i].pos);
+        box.second = box.second.max(vertices[i].pos);
       }
     }
 
-    return _boundingBoxCache;
+    return box;
   }
 
-  std::pair<Vector3, csgjs_real> Polygon::boundingSphere() const {
-    if(!_boundingSphereCacheValid) {
-      std::pair<Vector3, Vector3> box = boundingBox();
-      _boundingSphereCache.first = .5*(box.first+box.second);
-      _boundingSphereCache.second = (box.second-_boundingSphereCache.first).length();
-      _boundingSphereCacheValid = true;
-    }
-
-    return _boundingSphereCache;
+  std::pair<Vector3, csgjs_real> Polygon::boundingSphere(const Vertex *vertices, size_t n) {
+    std::pair<Vector3, Vector3> box = boundingBox(vertices, n);
+    Vector3 center = .5*(box.first+box.second);
+    return std::make_pair(center, (box.second-center).length());
   }
 
   PolygonEdgeData::PolygonEdgeData() : polygon(NULL) {
@@ -170,7 +183,7 @@ namespace csgjs {
   std::ostream& operator<<(std::ostream& os, const Polygon &poly) {
     os << "Polygon - vertices: { ";
 
-    std::vector<Vertex>::const_iterator itr = poly.vertices.begin();
+    VertexList::const_iterator itr = poly.vertices.begin();
     while(itr != poly.vertices.end()) {
       os << *itr;
       ++itr;
@@ -194,8 +207,8 @@ namespace csgjs {
     return os;
   }
 
-  std::ostream& operator<<(std::ostream& os, const std::vector<Vertex> &vertices) {
-    std::vector<Vertex>::const_iterator itr = vertices.begin();
+  std::ostream& operator<<(std::ostream& os, const VertexList &vertices) {
+    VertexList::const_iterator itr = vertices.begin();
     while(itr != vertices.end()) {
       os << itr->pos << " ";
       ++itr;
@@ -4,19 +4,24 @@
 #include "csgjs/math/Vector3.h"
 #include "csgjs/math/Vertex3.h"
 #include "csgjs/math/Plane.h"
+#include "csgjs/SmallVector.h"
 #include <vector>
 #include <utility>
 
 namespace csgjs {
 
+// Triangles and the quads splitting them leaves behind fit without allocating
+typedef SmallVector<Vertex, 4> VertexList;
+
 class Polygon {
   public:
-    std::vector<Vertex> vertices;
+    VertexList vertices;
     Plane plane;
 
-    Polygon(std::vector<Vertex> &&v, const Plane &p);
-    Polygon(const std::vector<Vertex> &v, const Plane &p);
-    Polygon(const std::vector<Vertex> &v);
+    Polygon(VertexList &&v, const Plane &p);
+    Polygon(const VertexList &v, const Plane &p);
+    Polygon(VertexList &&v);
+    Polygon(const VertexList &v);
     Polygon();
 
     bool checkIfDegenerateTriangle() const; // checks if polygon has 3 vertices and if they're a degenerate triangle
@@ -24,17 +29,20 @@ class Polygon {
     std::pair<Vector3, csgjs_real> boundingSphere() const;
     std::pair<Vector3, Vector3> boundingBox() const;
 
+    // the same bounds for n vertices held outside a polygon
+    static std::pair<Vector3, csgjs_real> boundingSphere(const Vertex *vertices, size_t n);
+    static std::pair<Vector3, Vector3> boundingBox(const Vertex *vertices, size_t n);
+
     Polygon flipped() const;
+    void flip();
     Polygon transform(const Matrix4x4 &m) const;
 
     static bool isConvexPoint(const Vector3 &prevpoint, const Vector3 &point, const Vector3 &nextpoint, const Vector3 normal);
 
   private:
-    mutable bool _boundingSphereCacheValid;
-    mutable std::pair<Vector3, csgjs_real> _boundingSphereCache;
-
-    mutable bool _boundingBoxCacheValid;
-    mutable std::pair<Vector3, Vector3> _boundingBoxCache;
+    // negative radius until the sphere is first asked for
+    mutable Vector3 _boundingSphereCenter;
+    mutable csgjs_real _boundingSphereRadius;
 };
 
 struct PolygonEdgeData {
@@ -52,7 +60,7 @@ std::ostream& operator<<(std::ostream& os, const Polygon &poly);
 std::ostream& operator<<(std::ostream& os, const std::pair<Vector3, Vector3> &bounds);
 std::ostream& operator<<(std::ostream& os, const std::pair<Vector3, csgjs_real> &bounds);
 
-std::ostream& operator<<(std::ostream& os, const std::vector<Vertex> &vertices);
+std::ostream& operator<<(std::ostream& os, const VertexList &vertices);
 
 }
 
@@ -5,15 +5,11 @@
 #include "stl_util.h"
 #include <vector>
 #include <stdio.h>
-#include <unordered_map>
-#include "csgjs/math/HashKeys.h"
 
 namespace csgjs {
 
   std::vector<Polygon> ReadSTLFile(const char* filename) {
     std::vector<Polygon> polys;
-    std::vector<Vertex> verts;
-    verts.reserve(3);
 
     FILE *f;
 
@@ -23,52 +19,43 @@ namespace csgjs {
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
-
-    uint32_t num_tris;
-    size_t readBytes = fread(&num_tris, 4, 1, f);
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", filename);
+        exit(2);
+    }
 
-    vec p1;
-    vec p2;
-    vec p3;
+    facet_t facet;
 
-    for(int i = 0; i < num_tris; i++) {
-        fseek(f, 12, SEEK_CUR); // normal
+    polys.reserve(view.facet_count);
+    for(uint32_t i = 0; i < view.facet_count; i++) {
+        stl_view_facet(&view, i, &facet);
 
-        readBytes = fread(&p1, 1, 12,f);
-        readBytes = fread(&p2, 1, 12,f);
-        readBytes = fread(&p3, 1, 12,f);
-        fseek(f, 2, SEEK_CUR);
+        vec &p1 = facet.vertices[0];
+        vec &p2 = facet.vertices[1];
+        vec &p3 = facet.vertices[2];
 
-        verts.clear();
+        VertexList verts;
         verts.push_back(Vertex(Vector3(p1.x, p1.y, p1.z)));
         verts.push_back(Vertex(Vector3(p2.x, p2.y, p2.z)));
         verts.push_back(Vertex(Vector3(p3.x, p3.y, p3.z)));
 
-        Polygon p(verts);
+        Polygon p(std::move(verts));
 
         if(p.checkIfDegenerateTriangle()) {
 //          std::cout << "found degenerate triangle, ignoring" << std::endl;
         } else {
-          polys.push_back(Polygon(verts));
+          polys.push_back(std::move(p));
         }
     }
 
+    stl_view_close(&view);
     fclose(f);
 
     return std::move(polys);
   }
 
   void WriteSTLFile(const char* filename, const std::vector<Polygon> polygons) {
-    FILE *outf = fopen(filename, "wb");
-    if(!outf) {
-      fprintf(stderr, "Can't write to file: %s\n", filename);
-    }
-
-    char header[81] = {0};
-    snprintf(header, 81, "Created with stl_cmd");
-    fwrite(header, 80, 1, outf);
-
     uint32_t num_tris = 0;
     std::vector<Polygon>::const_iterator itr = polygons.begin();
     while(itr != polygons.end()) {
@@ -76,71 +63,65 @@ namespace csgjs {
       ++itr;
     }
 
-    std::unordered_map<VertexKey, Vector3> vertexLookup;
+    // weld vertices that the operations left a rounding error apart
+    std::vector<csgjs_real> corners;
+    corners.reserve((size_t)num_tris*9);
+    itr = polygons.begin();
+    while(itr != polygons.end()) {
+      const Vector3 &vertex0 = itr->vertices[0].pos;
+      int numVertices = itr->vertices.size();
+      for(int i = 2; i < numVertices; i++) {
+        const Vector3 &vertex1 = itr->vertices[i-1].pos;
+        const Vector3 &vertex2 = itr->vertices[i].pos;
+        csgjs_real triangle[9] = { vertex0.x, vertex0.y, vertex0.z,
+                                   vertex1.x, vertex1.y, vertex1.z,
+                                   vertex2.x, vertex2.y, vertex2.z };
+        corners.insert(corners.end(), triangle, triangle+9);
+      }
+      ++itr;
+    }
+
+    // the same test VertexKey makes: within EPS of a vertex whose position rounds to the same 10*EPS cell
+    indexed_mesh_t mesh;
+    if(!indexed_mesh_build_within(&mesh, corners.data(), num_tris, 10*EPS, EPS, std::thread::hardware_concurrency())) {
+      fprintf(stderr, "Too many triangles to write to %s\n", filename);
+      exit(2);
+    }
+
+    FILE *outf = fopen(filename, "wb");
+    if(!outf) {
+      fprintf(stderr, "Can't write to file: %s\n", filename);
+      exit(2);
+    }
 
+    char header[81] = {0};
+    snprintf(header, 81, "Created with stl_cmd");
+    fwrite(header, 80, 1, outf);
     fwrite(&num_tris, 4, 1, outf);
 
     uint16_t abc = 0;
+    size_t corner = 0;
 
     itr = polygons.begin();
     while(itr != polygons.end()) {
       vec normal;
-      vec p0;
-      vec p1;
-
-      Vector3 vertex0 = itr->vertices[0].pos;
-      Vector3 vertex1 = itr->vertices[1].pos;
-
-      VertexKey key0(vertex0);
-      VertexKey key1(vertex1);
-
-      if(vertexLookup.count(key0) > 0) {
-        vertex0 = vertexLookup[key0];
-      } else {
-        vertexLookup[key0] = vertex0;
-      }
-      if(vertexLookup.count(key1) > 0) {
-        vertex1 = vertexLookup[key1];
-      } else {
-        vertexLookup[key1] = vertex1;
-      }
-
       normal.x = (float)itr->plane.normal.x;
       normal.y = (float)itr->plane.normal.y;
       normal.z = (float)itr->plane.normal.z;
 
-      p0.x = (float)vertex0.x;
-      p0.y = (float)vertex0.y;
-      p0.z = (float)vertex0.z;
-
-      p1.x = (float)vertex1.x;
-      p1.y = (float)vertex1.y;
-      p1.z = (float)vertex1.z;
-
       int numVertices = itr->vertices.size();
       for(int i = 2; i < numVertices; i++) {
         fwrite(&normal, 1, 12, outf);
 
-        vec p2;
-
-        Vector3 vertex2 = itr->vertices[i].pos;
-        VertexKey key2(vertex2);
-        if(vertexLookup.count(key2) > 0) {
-          vertex2 = vertexLookup[key2];
-        } else {
-          vertexLookup[key2] = vertex2;
+        for(int j = 0; j < 3; j++) {
+          uint32_t index = mesh.indices[corner++];
+          vec p;
+          p.x = mesh.x[index];
+          p.y = mesh.y[index];
+          p.z = mesh.z[index];
+          fwrite(&p, 1, 12, outf);
         }
-
-        p2.x = (float)vertex2.x;
-        p2.y = (float)vertex2.y;
-        p2.z = (float)vertex2.z;
-
-        fwrite(&p0, 1, 12, outf);
-        fwrite(&p1, 1, 12, outf);
-        fwrite(&p2, 1, 12, outf);
         fwrite(&abc, 1, 2,outf);
-
-        p1 = p2;
       }
 
       ++itr;
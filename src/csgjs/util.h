@@ -3,6 +3,7 @@
 
 #include "math/Polygon3.h"
 #include <vector>
+#include <stdint.h>
 #include <stdio.h>
 
 namespace csgjs {
@@ -12,6 +13,50 @@ namespace csgjs {
 
   unsigned long xorshf96(void);
   int fastRandom(int max);
+
+  // xorshf96 with the state held by the caller rather than in globals, so independent tasks can each draw from
+  // their own stream and get the same numbers whichever thread runs them
+  class FastRandom {
+    private:
+      uint64_t x, y, z;
+
+      static uint64_t mix(uint64_t v) {
+        // splitmix64 finalizer, so split streams don't just continue this one
+        v = (v ^ (v >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        v = (v ^ (v >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return v ^ (v >> 31);
+      }
+
+    public:
+      FastRandom() : x(123456789), y(362436069), z(521288629) {}
+
+      uint64_t next() {
+        uint64_t t;
+        x ^= x << 16;
+        x ^= x >> 5;
+        x ^= x << 1;
+
+        t = x;
+        x = y;
+        y = z;
+        z = t ^ x ^ y;
+
+        return z;
+      }
+
+      int operator()(int max) {
+        return next() % max;
+      }
+
+      // a new generator seeded from this one
+      FastRandom split() {
+        FastRandom r;
+        r.x = mix(next());
+        r.y = mix(next());
+        r.z = mix(next()) | 1;
+        return r;
+      }
+  };
 }
 
 #endif
@@ -42,9 +42,10 @@ int main(int argc, char** argv) {
 
     char *file = argv[1];
 
-    if(!is_valid_binary_stl(file)) {
-        fprintf(stderr, "%s is not a binary stl file.\n", file);
-        exit(2);
+    stl_meta_t meta;
+    if(stl_meta_enabled() && stl_meta_query(file, &meta)) {
+        printf("%f\n", meta.area);
+        return 0;
     }
 
     FILE *f;
@@ -55,38 +56,15 @@ int main(int argc, char** argv) {
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
-
-    uint32_t num_tris;
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    float area = 0;
-
-    for(int i = 0; i < num_tris; i++) {
-        fseek(f, 12, SEEK_CUR); // normal
-
-        vec pt1, pt2, pt3;
-
-        readBytes = fread(&pt1, 1, 12,f);
-        readBytes = fread(&pt2, 1, 12,f);
-        readBytes = fread(&pt3, 1, 12,f);
-
-        vec a,b;
-
-        vec_sub(&pt2, &pt1, &a);
-        vec_sub(&pt3, &pt1, &b);
-
-        vec cross;
-
-        vec_cross(&a, &b, &cross);
-
-        float triArea = vec_magnitude(&cross)*.5;
-
-        area += triArea;
-
-        fseek(f, 2, SEEK_CUR);
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
     }
 
+    double area = stl_view_area(&view);
+
+    stl_view_close(&view);
     fclose(f);
 
     printf("%f\n", area);
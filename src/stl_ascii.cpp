@@ -31,9 +31,13 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 
 void print_usage() {
     fprintf(stderr, "stl_ascii converts a binary STL file to ASCII.\n\n");
-    fprintf(stderr, "usage: stl_ascii [<input file> [<output file>] ]\n");
+    fprintf(stderr, "usage: stl_ascii [ -p <precision> ] [ -z <compression> ] [<input file> [<output file>] ]\n");
     fprintf(stderr, "    Outputs an ASCII stl file given a binary STL file. ");
     fprintf(stderr, "    If no input file is provided, data is read from stdin. If no output file is provided, data is sent to stdout. \n");
+    fprintf(stderr, "    Coordinates are written with the fewest digits that read back as the exact same values.\n");
+    fprintf(stderr, "     -p <precision> - write coordinates with a fixed number of digits (0 to %d) after the decimal point instead.\n", STL_MAX_PRECISION);
+    fprintf(stderr, "     -z <compression> - compress the output with gzip, zstd or none. Defaults to gzip for output files ending in .gz, zstd for .zst and none otherwise.\n");
+    fprintf(stderr, "    gzip and zstd compressed input is detected and decompressed automatically.\n");
 }
 
 int main(int argc, char** argv) {
@@ -41,63 +45,140 @@ int main(int argc, char** argv) {
         print_usage();
         exit(2);
     }
+    int c;
+    int errflg = 0;
+    int precision = -1;
+    int compression = -1;
+
+    while((c = getopt(argc, argv, "p:z:")) != -1) {
+        switch(c) {
+            case 'p': {
+                char *end;
+                precision = (int)strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || precision < 0 || precision > STL_MAX_PRECISION) {
+                    fprintf(stderr, "Invalid precision: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            }
+            case 'z':
+                compression = stl_compression_from_string(optarg);
+                if (compression < 0) {
+                    fprintf(stderr, "Invalid compression: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case '?':
+                fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+                errflg++;
+                break;
+        }
+    }
+
+    if (errflg) {
+        print_usage();
+        exit(2);
+    }
+
     FILE *in_file = stdin;
     const char* in_file_name = "stdin";
     FILE *out_file = stdout;
     const char* out_file_name = "stdout";
-    if (argc >= 2) {
-        in_file_name = argv[1];
+    if (optind < argc) {
+        in_file_name = argv[optind];
         in_file = fopen(in_file_name, "rb");
         if (!in_file) {
             fprintf(stderr, "Can't read from file: %s\n", in_file_name);
         }
     }
-    if (argc >= 3) {
-        out_file_name = argv[2];
+    if (optind + 1 < argc) {
+        out_file_name = argv[optind + 1];
         out_file = fopen(out_file_name, "w");
         if (!out_file) {
             fprintf(stderr, "Can't write to file: %s\n", out_file_name);
             fclose(in_file);
         }
     }
+    if (compression < 0) {
+        compression = out_file == stdout ? STL_COMPRESSION_NONE : stl_compression_from_name(out_file_name);
+    }
+    stl_compressor_t compressor;
+    FILE *out_stream = stl_compressor_open(&compressor, out_file, compression);
+    if (!out_stream) {
+        fprintf(stderr, "This build can't write %s compressed output.\n", stl_compression_name(compression));
+        exit(2);
+    }
     char name[BUFFER_SIZE];
     memset(name, 0x00, BUFFER_SIZE);
     facet_t facet;
     uint32_t facet_count = 0;
 
-    if (is_valid_ascii_stl(in_file)) {
-        read_header(in_file, name, BUFFER_SIZE, NULL, 1);
-        write_header(out_file, name, facet_count, 1);
-        while (read_facet(in_file, &facet, 1)) {
-            write_facet(out_file, &facet, 1);
+    stl_ascii_reader_t reader;
+    stl_ascii_writer_t writer;
+    if (!stl_ascii_writer_open(&writer, out_stream, precision)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    int failed = 0;
+    in_file = stl_decompress_input(in_file, 1);
+    unsigned char header[STL_HEADER_SIZE];
+    size_t header_length;
+    int format = sniff_stl_format(in_file, header, &header_length);
+    if (format == STL_FORMAT_ASCII && stl_ascii_reader_open(&reader, in_file)) {
+        stl_ascii_reader_prefill(&reader, header, header_length);
+        int is_valid = stl_ascii_read_header(&reader, name, BUFFER_SIZE);
+        stl_ascii_write_header(&writer, name);
+        while (is_valid && stl_ascii_read_facet(&reader, &facet)) {
+            stl_ascii_write_facet(&writer, &facet);
             facet_count++;
         }
-        read_final(in_file, 1);
-        write_final(out_file, name, facet_count, 1);
-    } else if (is_valid_binary_stl(in_file)) {
-        read_header(in_file, name, BUFFER_SIZE, &facet_count, 0);
-        write_header(out_file, name, facet_count, 1);
-        for (int i = 0; i < facet_count; i++) {
-            read_facet(in_file, &facet, 0);
-            write_facet(out_file, &facet, 1);
+        is_valid = is_valid && stl_ascii_read_final(&reader);
+        stl_ascii_reader_close(&reader);
+        stl_ascii_write_final(&writer, name);
+        if (!is_valid) {
+            fprintf(stderr, "Invalid STL file: %s (error at facet %u)\n", in_file_name, facet_count);
+            failed++;
         }
-        read_final(in_file, 0);
-        write_final(out_file, name, facet_count, 1);
-    } else {
-        fprintf(stderr, "Invalid STL file: %s\n", in_file_name);
-        if (in_file != stdin) {
-            fclose(in_file);
+    } else if (format == STL_FORMAT_BINARY) {
+        decode_header(header, name, BUFFER_SIZE, &facet_count);
+        stl_ascii_write_header(&writer, name);
+        // give each formatting thread a full batch per round
+        int threads = std::thread::hardware_concurrency();
+        size_t batch_size = STL_BATCH_SIZE*(threads > 1 ? threads : 1);
+        std::vector<facet_t> facets(batch_size);
+        uint32_t remaining = facet_count;
+        while (remaining > 0) {
+            size_t batch = remaining < batch_size ? remaining : batch_size;
+            batch = read_facets(in_file, &facets[0], batch);
+            if (batch == 0) {
+                break;
+            }
+            stl_ascii_write_facets(&writer, &facets[0], batch, threads);
+            remaining -= batch;
         }
-        if (out_file != stdout) {
-            fclose(out_file);
+        stl_ascii_write_final(&writer, name);
+        // only streams of unknown length can end early or run on
+        if (remaining > 0 || getc(in_file) != EOF) {
+            fprintf(stderr, "Invalid STL file: %s (error at facet %u)\n", in_file_name, facet_count - remaining);
+            failed++;
         }
-        exit(2);
+    } else {
+        fprintf(stderr, "Invalid STL file: %s\n", in_file_name);
+        failed++;
+    }
+    int written = stl_ascii_writer_close(&writer);
+    if (!stl_compressor_close(&compressor) || !written) {
+        fprintf(stderr, "Error writing to %s\n", out_file_name);
+        failed++;
     }
-    if (in_file != stdin) {
-        fclose(in_file);
+    if (!stl_input_close(in_file)) {
+        failed++;
     }
     if (out_file != stdout) {
         fclose(out_file);
     }
+    if (failed) {
+        exit(2);
+    }
     return 0;
 }
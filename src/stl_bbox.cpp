@@ -35,6 +35,11 @@ void print_usage() {
     fprintf(stderr, "    If '-' is given as a file name, stdin is read.\n");
 }
 
+void print_bounds(const char *file_name, bounds_t *b) {
+    printf("File: %s Extents: (%f, %f, %f) - (%f, %f, %f)\n", file_name, b->min.x, b->min.y, b->min.z, b->max.x, b->max.y, b->max.z);
+    printf("File: %s Dimensions: (%f, %f, %f)\n", file_name, b->max.x-b->min.x, b->max.y-b->min.y, b->max.z-b->min.z);
+}
+
 int main(int argc, char** argv) {
     if (argc == 1 || (argc >= 2 && strcmp(argv[1], "--help") == 0)) {
         print_usage();
@@ -44,24 +49,34 @@ int main(int argc, char** argv) {
     int failed = 0;
     for (int arg = 1; arg < argc; arg++) {
         char *file_name = argv[arg];
+        stl_meta_t meta;
+        if (strcmp(file_name, "-") != 0 && stl_meta_enabled() && stl_meta_query(file_name, &meta)) {
+            print_bounds(file_name, &meta.bounds);
+            continue;
+        }
         FILE* f = (strcmp(file_name, "-") == 0) ? stdin : fopen(file_name, "rb");
+        f = stl_decompress_input(f, 1);
         if (!f) {
             fprintf(stderr, "Can't read file: %s\n", file_name);
             failed++;
         } else {
-            int is_ascii = is_valid_ascii_stl(f);
-            if (!is_ascii && !is_valid_binary_stl(f)) {
+            unsigned char header[STL_HEADER_SIZE];
+            size_t header_length;
+            int format = sniff_stl_format(f, header, &header_length);
+            bounds_t b;
+            uint32_t facets_read;
+            if (format == STL_FORMAT_INVALID) {
                 fprintf(stderr, "%s is not an STL file.\n", file_name);
                 failed++;
+            } else if (!get_bounds(f, header, header_length, &b, format == STL_FORMAT_ASCII, &facets_read)) {
+                fprintf(stderr, "%s is not an STL file (error at facet %u).\n", file_name, facets_read);
+                failed++;
             } else {
-                bounds_t b;
-                get_bounds(f, &b, is_ascii);
-                printf("File: %s Extents: (%f, %f, %f) - (%f, %f, %f)\n", file_name, b.min.x, b.min.y, b.min.z, b.max.x, b.max.y, b.max.z);
-                printf("File: %s Dimensions: (%f, %f, %f)\n", file_name, b.max.x-b.min.x, b.max.y-b.min.y, b.max.z-b.min.z);
+                print_bounds(file_name, &b);
             }
         }
-        if (f && f != stdin) {
-            fclose(f);
+        if (!stl_input_close(f)) {
+            failed++;
         }
     }
     if (failed) {
@@ -28,10 +28,16 @@ Copyright 2018 Allwine Designs, LLC (stl_cmd@allwinedesigns.com)
 
 #define BUFFER_SIZE 4096
 
+// Values that %f rounds to zero, so negative ones don't print as -0.000000.
+float printable(float v) {
+    return fabs(v) < 0.0000005f ? 0 : v;
+}
+
 void print_usage() {
     fprintf(stderr, "stl_bcylinder prints bounding cylinder information about an STL file.\n\n");
-    fprintf(stderr, "usage: stl_bcylinder <input file>\n");
-    fprintf(stderr, "    Prints bounding cylinder information for the given binary STL file.\n");
+    fprintf(stderr, "usage: stl_bcylinder [ -a <axis> ] <input file>\n");
+    fprintf(stderr, "    Prints the smallest bounding cylinder along an axis for the given binary STL file.\n"
+                    "     -a <axis> - x, y or z, the axis of the cylinder (defaults to y).\n");
 }
 
 int main(int argc, char** argv) {
@@ -41,98 +47,63 @@ int main(int argc, char** argv) {
             exit(2);
         }
     }
-
-    char *file = argv[1];
-
-    if(!is_valid_binary_stl(file)) {
-        fprintf(stderr, "%s is not a binary stl file.\n", file);
-        exit(2);
+    int c;
+    int errflg = 0;
+    int axis = STL_AXIS_Y;
+
+    while((c = getopt(argc, argv, "a:")) != -1) {
+        switch(c) {
+            case 'a':
+                axis = stl_axis_from_string(optarg);
+                if(axis < 0) {
+                    fprintf(stderr, "Unknown axis: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case '?':
+                fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+                errflg++;
+                break;
+        }
     }
 
-    FILE *f;
-
-    f = fopen(file, "rb");
-    if(!f) {
-        fprintf(stderr, "Can't read file: %s\n", file);
+    if(errflg || optind != argc-1) {
+        print_usage();
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
-
-    uint32_t num_tris;
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    vec point;
-    point.w = 1;
-
-    vec min;
-    vec max;
-
-    for(int i = 0; i < num_tris; i++) {
-        fseek(f, 12, SEEK_CUR); // normal
-
-        for(int j = 0; j < 3; j++) {
-            readBytes = fread(&point, 1, 12,f);
-            if(i == 0 && j == 0) {
-                min.x = point.x;
-                min.y = point.y;
-                min.z = point.z;
-                max.x = point.x;
-                max.y = point.y;
-                max.z = point.z;
-            } else {
-                if(min.x > point.x) min.x = point.x;
-                if(min.y > point.y) min.y = point.y;
-                if(min.z > point.z) min.z = point.z;
-                if(max.x < point.x) max.x = point.x;
-                if(max.y < point.y) max.y = point.y;
-                if(max.z < point.z) max.z = point.z;
-            }
-        }
-        fseek(f, 2, SEEK_CUR);
-    }
-
-    vec center;
-    vec pointOnCylinder;
+    char *file = argv[optind];
 
-    center.x = .5*(max.x+min.x);
-    center.y = .5*(max.y+min.y);
-    center.z = .5*(max.z+min.z);
+    stl_meta_t meta;
+    bcylinder_t cylinder;
 
-    float maxR = 0;
+    if(axis == STL_AXIS_Y && stl_meta_enabled() && stl_meta_query(file, &meta)) {
+        cylinder = meta.bcylinder;
+    } else {
+        FILE *f;
 
-    fseek(f, 84, SEEK_SET);
-
-    for(int i = 0; i < num_tris; i++) {
-        fseek(f, 12, SEEK_CUR); // normal
-
-        for(int j = 0; j < 3; j++) {
-            readBytes = fread(&point, 1, 12,f);
-
-            vec R;
+        f = fopen(file, "rb");
+        if(!f) {
+            fprintf(stderr, "Can't read file: %s\n", file);
+            exit(2);
+        }
 
-            R.x = point.x-center.x;
-            R.y = 0;
-            R.z = point.z-center.z;
+        stl_view_t view;
+        if(!stl_view_open(&view, f)) {
+            fprintf(stderr, "%s is not a binary stl file.\n", file);
+            exit(2);
+        }
 
-            float rMag = vec_magnitude(&R);
+        stl_view_bcylinder(&view, axis, &cylinder);
 
-            if(rMag > maxR) {
-              maxR = rMag;
-              pointOnCylinder.x = point.x;
-              pointOnCylinder.y = point.y;
-              pointOnCylinder.z = point.z;
-            }
-        }
-        fseek(f, 2, SEEK_CUR);
+        stl_view_close(&view);
+        fclose(f);
     }
 
-    fclose(f);
-
-    printf("Center: (%f, %f, %f)\n", center.x, center.y, center.z);
-    printf("Point On Cylinder: (%f, %f, %f)\n", pointOnCylinder.x, pointOnCylinder.y, pointOnCylinder.z);
-    printf("R: %f\n", maxR);
-    printf("H: %f\n", max.y-min.y);
+    printf("Center: (%f, %f, %f)\n", printable(cylinder.center.x), printable(cylinder.center.y), printable(cylinder.center.z));
+    printf("Point On Cylinder: (%f, %f, %f)\n", printable(cylinder.point.x), printable(cylinder.point.y), printable(cylinder.point.z));
+    printf("R: %f\n", cylinder.radius);
+    printf("H: %f\n", cylinder.height);
 
     return 0;
 }
@@ -31,9 +31,11 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 
 void print_usage() {
     fprintf(stderr, "stl_binary converts an ASCII STL file to binary.\n\n");
-    fprintf(stderr, "usage: stl_binary [<input file> [<output file>] ]\n");
+    fprintf(stderr, "usage: stl_binary [ -z <compression> ] [<input file> [<output file>] ]\n");
     fprintf(stderr, "    Outputs a binary stl file given an ascii STL file. ");
     fprintf(stderr, "    If no input file is provided, data is read from stdin. If no output file is provided, data is sent to stdout. \n");
+    fprintf(stderr, "     -z <compression> - compress the output with gzip, zstd or none. Defaults to gzip for output files ending in .gz, zstd for .zst and none otherwise.\n");
+    fprintf(stderr, "    gzip and zstd compressed input is detected and decompressed automatically.\n");
 }
 
 int main(int argc, char** argv) {
@@ -41,63 +43,148 @@ int main(int argc, char** argv) {
         print_usage();
         exit(2);
     }
+    int c;
+    int errflg = 0;
+    int compression = -1;
+
+    while((c = getopt(argc, argv, "z:")) != -1) {
+        switch(c) {
+            case 'z':
+                compression = stl_compression_from_string(optarg);
+                if (compression < 0) {
+                    fprintf(stderr, "Invalid compression: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case '?':
+                fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+                errflg++;
+                break;
+        }
+    }
+
+    if (errflg) {
+        print_usage();
+        exit(2);
+    }
+
     FILE *in_file = stdin;
     const char* in_file_name = "stdin";
     FILE *out_file = stdout;
     const char* out_file_name = "stdout";
-    if (argc >= 2) {
-        in_file_name = argv[1];
+    if (optind < argc) {
+        in_file_name = argv[optind];
         in_file = fopen(in_file_name, "rb");
         if (!in_file) {
             fprintf(stderr, "Can't read from file: %s\n", in_file_name);
         }
     }
-    if (argc >= 3) {
-        out_file_name = argv[2];
+    if (optind + 1 < argc) {
+        out_file_name = argv[optind + 1];
         out_file = fopen(out_file_name, "wb");
         if (!out_file) {
             fprintf(stderr, "Can't write to file: %s\n", out_file_name);
             fclose(in_file);
         }
     }
+    if (compression < 0) {
+        compression = out_file == stdout ? STL_COMPRESSION_NONE : stl_compression_from_name(out_file_name);
+    }
+    stl_compressor_t compressor;
+    FILE *out_stream = stl_compressor_open(&compressor, out_file, compression);
+    if (!out_stream) {
+        fprintf(stderr, "This build can't write %s compressed output.\n", stl_compression_name(compression));
+        exit(2);
+    }
     char name[BUFFER_SIZE];
     memset(name, 0x00, BUFFER_SIZE);
-    facet_t facet;
+    facet_t facets[STL_BATCH_SIZE];
     uint32_t facet_count = 0;
 
-    if (is_valid_ascii_stl(in_file)) {
-        read_header(in_file, name, BUFFER_SIZE, NULL, 1);
-        write_header(out_file, name, facet_count, 0);
-        while (read_facet(in_file, &facet, 1)) {
-            write_facet(out_file, &facet, 0);
-            facet_count++;
+    in_file = stl_decompress_input(in_file, 1);
+    unsigned char header[STL_HEADER_SIZE];
+    size_t header_length;
+    int format = sniff_stl_format(in_file, header, &header_length);
+    size_t in_length;
+    unsigned char *in_data = format == STL_FORMAT_ASCII ? map_stl_file(in_file, &in_length) : NULL;
+    std::vector<unsigned char> records;
+    int parsed = 0;
+    int failed = 0;
+    if (in_data) {
+        int threads = std::thread::hardware_concurrency();
+        parsed = parse_ascii_stl_parallel((const char*)in_data, in_length, threads, name, BUFFER_SIZE, records, &facet_count);
+        munmap(in_data, in_length);
+    }
+
+    stl_ascii_reader_t reader;
+    if (parsed) {
+        write_header(out_stream, name, facet_count, 0);
+        if (facet_count) {
+            fwrite(&records[0], STL_RECORD_SIZE, facet_count, out_stream);
         }
-        read_final(in_file, 1);
-        write_final(out_file, name, facet_count, 0);
-    } else if (is_valid_binary_stl(in_file)) {
-        read_header(in_file, name, BUFFER_SIZE, &facet_count, 0);
-        write_header(out_file, name, facet_count, 0);
-        for (int i = 0; i < facet_count; i++) {
-            read_facet(in_file, &facet, 0);
-            write_facet(out_file, &facet, 0);
+    } else if (format == STL_FORMAT_ASCII && stl_ascii_reader_open(&reader, in_file)) {
+        // the count is only known at the end, spool if out_file is a pipe
+        stl_spool_t spool;
+        FILE *spool_file = stl_spool_open(&spool, out_stream);
+        stl_ascii_reader_prefill(&reader, header, header_length);
+        int is_valid = stl_ascii_read_header(&reader, name, BUFFER_SIZE);
+        write_header(spool_file, name, facet_count, 0);
+        size_t batch = 0;
+        while (is_valid && stl_ascii_read_facet(&reader, &facets[batch])) {
+            batch++;
+            if (batch == STL_BATCH_SIZE) {
+                write_facets(spool_file, facets, batch);
+                facet_count += batch;
+                batch = 0;
+            }
         }
-        read_final(in_file, 0);
-        write_final(out_file, name, facet_count, 0);
-    } else {
-        fprintf(stderr, "Invalid STL file: %s\n", in_file_name);
-        if (in_file != stdin) {
-            fclose(in_file);
+        write_facets(spool_file, facets, batch);
+        facet_count += batch;
+        is_valid = is_valid && stl_ascii_read_final(&reader);
+        stl_ascii_reader_close(&reader);
+        if (!stl_spool_close(&spool, facet_count)) {
+            fprintf(stderr, "Error writing to %s\n", out_file_name);
+            failed++;
         }
-        if (out_file != stdout) {
-            fclose(out_file);
+        if (!is_valid) {
+            fprintf(stderr, "Invalid STL file: %s (error at facet %u)\n", in_file_name, facet_count);
+            failed++;
         }
-        exit(2);
+    } else if (format == STL_FORMAT_BINARY) {
+        decode_header(header, name, BUFFER_SIZE, &facet_count);
+        write_header(out_stream, name, facet_count, 0);
+        uint32_t remaining = facet_count;
+        while (remaining > 0) {
+            size_t batch = remaining < STL_BATCH_SIZE ? remaining : STL_BATCH_SIZE;
+            batch = read_facets(in_file, facets, batch);
+            if (batch == 0) {
+                break;
+            }
+            write_facets(out_stream, facets, batch);
+            remaining -= batch;
+        }
+        write_final(out_stream, name, facet_count, 0);
+        // only streams of unknown length can end early or run on
+        if (remaining > 0 || getc(in_file) != EOF) {
+            fprintf(stderr, "Invalid STL file: %s (error at facet %u)\n", in_file_name, facet_count - remaining);
+            failed++;
+        }
+    } else {
+        fprintf(stderr, "Invalid STL file: %s\n", in_file_name);
+        failed++;
     }
-    if (in_file != stdin) {
-        fclose(in_file);
+    if (!stl_compressor_close(&compressor)) {
+        fprintf(stderr, "Error writing to %s\n", out_file_name);
+        failed++;
+    }
+    if (!stl_input_close(in_file)) {
+        failed++;
     }
     if (out_file != stdout) {
         fclose(out_file);
     }
+    if (failed) {
+        exit(2);
+    }
     return 0;
 }
@@ -23,17 +23,26 @@ Copyright 2017 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <thread>
+#include <chrono>
 
 #include "csgjs/CSG.h"
 #include "csgjs/util.h"
 
 void print_usage() {
     fprintf(stderr, "stl_boolean performs CSG operations on two STL files.\n\n");
-    fprintf(stderr, "usage: stl_boolean -a <stl file A> -b <stl file B> [ -i ] [ -u ] [ -d ] <output file>\n");
+    fprintf(stderr, "usage: stl_boolean -a <stl file A> -b <stl file B> [ -i ] [ -u ] [ -d ] [ -j <threads> ] [ -p <random|cost> ] [ -k <candidates> ] [ -v ] <output file>\n");
     fprintf(stderr, "    Performs a mesh CSG boolean operation on STL files A and B using BSP trees.\n"
                     "     -i - performs the intersection of A and B\n"
                     "     -u - performs the union of A and B (default)\n"
-                    "     -d - performs 'A minus B', produces the volume present in A but not present in B\n");
+                    "     -d - performs 'A minus B', produces the volume present in A but not present in B\n"
+                    "     -j <threads> - number of threads to build and clip the trees with, defaults to the number of cores.\n"
+                    "                    The result is the same for any number of threads.\n"
+                    "     -p <random|cost> - how BSP nodes pick their splitting plane. random takes the plane of a random polygon\n"
+                    "                        (default). cost scores the planes shared by the most polygons by how many polygons\n"
+                    "                        they split and how evenly they divide the rest, and takes the best.\n"
+                    "     -k <candidates> - number of candidate planes scored per node with -p cost (default 8)\n"
+                    "     -v - prints the depth of the trees, how many polygons were split and the time taken to stderr\n");
 }
 
 int main(int argc, char **argv)
@@ -54,9 +63,13 @@ int main(int argc, char **argv)
     int intersection = 0;
     int difference = 0;
 
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    csgjs::SplitOptions options;
+    int verbose = 0;
+
     int c;
 
-    while((c = getopt(argc, argv, "a:b:iud")) != -1) {
+    while((c = getopt(argc, argv, "a:b:iudj:p:k:v")) != -1) {
         switch(c) {
             case 'a':
                 a_set = 1;
@@ -90,6 +103,33 @@ int main(int argc, char **argv)
                     unionAB = 0;
                 }
                 break;
+            case 'j':
+                threads = atoi(optarg);
+                if(threads < 1) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case 'p':
+                if(strcmp(optarg, "random") == 0) {
+                    options.planeSelection = csgjs::RANDOM_PLANE;
+                } else if(strcmp(optarg, "cost") == 0) {
+                    options.planeSelection = csgjs::COST_PLANE;
+                } else {
+                    fprintf(stderr, "Invalid plane selection: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case 'k':
+                options.candidates = atoi(optarg);
+                if(options.candidates < 1) {
+                    fprintf(stderr, "Invalid number of candidate planes: %s\n", optarg);
+                    errflg++;
+                }
+                break;
+            case 'v':
+                verbose = 1;
+                break;
             case '?':
                 fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
                 errflg++;
@@ -111,22 +151,32 @@ int main(int argc, char **argv)
     csgjs::CSG A(csgjs::ReadSTLFile(a_file));
     csgjs::CSG B(csgjs::ReadSTLFile(b_file));
 
+    csgjs::TaskScheduler scheduler(threads);
+
+    csgjs::TreeStats stats;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    csgjs::CSG csg;
     if(unionAB) {
-      csgjs::CSG csg = A.csgUnion(B);
-      csg.canonicalize();
-      csg.makeManifold();
-      csgjs::WriteSTLFile(out_filename, csg.toPolygons());
+      csg = A.csgUnion(B, &scheduler, options, &stats);
     }
     if(intersection) {
-      csgjs::CSG csg = A.csgIntersect(B);
-      csg.canonicalize();
-      csg.makeManifold();
-      csgjs::WriteSTLFile(out_filename, csg.toPolygons());
+      csg = A.csgIntersect(B, &scheduler, options, &stats);
     }
     if(difference) {
-      csgjs::CSG csg = A.csgSubtract(B);
-      csg.canonicalize();
-      csg.makeManifold();
-      csgjs::WriteSTLFile(out_filename, csg.toPolygons());
+      csg = A.csgSubtract(B, &scheduler, options, &stats);
     }
+
+    if(verbose) {
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+      fprintf(stderr, "tree depth: %d\n", stats.depth);
+      fprintf(stderr, "tree nodes: %zu\n", stats.nodes);
+      fprintf(stderr, "polygons split building trees: %zu\n", stats.buildSplits);
+      fprintf(stderr, "polygons split clipping trees: %zu\n", stats.clipSplits);
+      fprintf(stderr, "time: %.3f s\n", seconds);
+    }
+
+    csg.canonicalize();
+    csg.makeManifold();
+    csgjs::WriteSTLFile(out_filename, csg.toPolygons());
 }
@@ -25,7 +25,7 @@ Copyright 2017 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <libgen.h>
 #include <cmath>
 #include "stl_util.h"
-#include <unordered_map>
+#include <algorithm>
 #include <iostream>
 
 #define BUFFER_SIZE 4096
@@ -38,61 +38,6 @@ void print_usage() {
     fprintf(stderr, "    -i - ignore degenerate triangles (those with area very near or exactly 0).");
 }
 
-struct VertexKey {
-  float x;
-  float y;
-  float z;
-  VertexKey() : x(0), y(0), z(0) {}
-  VertexKey(float xx, float yy, float zz, bool exact = false) {
-    if(exact) {
-      x = xx;
-      y = yy;
-      z = zz;
-    } else {
-      x = (float)(int)(std::round((double)xx/EPSILON));
-      y = (float)(int)(std::round((double)yy/EPSILON));
-      z = (float)(int)(std::round((double)zz/EPSILON));
-    }
-  }
-
-  bool operator==(const VertexKey& k) const {
-    return x == k.x && y == k.y && z == k.z;
-  }
-};
-
-namespace std {
-  template <>
-  struct hash<VertexKey> {
-    std::size_t operator()(const VertexKey& k) const {
-      return ((std::hash<float>()(k.x) ^ (std::hash<float>()(k.y) << 1)) >> 1) ^ (hash<float>()(k.z) << 1);
-    }
-  };
-}
-
-struct EdgeKey {
-  VertexKey v1;
-  VertexKey v2;
-
-  EdgeKey(const VertexKey &a, const VertexKey &b) {
-    v1 = a;
-    v2 = b;
-  }
-
-  bool operator==(const EdgeKey &k) const {
-    return (v1 == k.v1 && v2 == k.v2);
-  }
-};
-
-namespace std {
-  template<>
-  struct hash<EdgeKey> {
-    std::size_t operator()(const EdgeKey& k) const {
-      return ((std::hash<VertexKey>()(k.v1) ^ (std::hash<VertexKey>()(k.v2) << 1)) >> 1);
-    }
-  };
-}
-
-
 int main(int argc, char** argv) {
     if(argc >= 2) {
         if(strcmp(argv[1], "--help") == 0) {
@@ -139,26 +84,24 @@ int main(int argc, char** argv) {
         f = stdin;
     }
 
-    fseek(f, 80, SEEK_SET);
-    uint32_t num_tris;
-    uint16_t abc = 0; // attribute byte count
-
-    size_t readBytes = fread(&num_tris, 4, 1, f);
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "invalid binary stl file\n");
+        exit(2);
+    }
+    uint32_t num_tris = view.facet_count;
 
-    std::unordered_map<EdgeKey, int> edgeCounts;
+    std::vector<float> corners;
+    corners.reserve((size_t)num_tris*9);
 
     int ignoredFaces = 0;
-    for(int i = 0; i < num_tris; i++) {
-      vec normal;
-      vec p0;
-      vec p1;
-      vec p2;
-
-      readBytes = fread(&normal, 1, 12,f);
-      readBytes = fread(&p0, 1, 12,f);
-      readBytes = fread(&p1, 1, 12,f);
-      readBytes = fread(&p2, 1, 12,f);
-      readBytes = fread(&abc, 1, 2,f);
+    facet_t facet;
+    for(uint32_t i = 0; i < num_tris; i++) {
+      stl_view_facet(&view, i, &facet);
+
+      vec p0 = facet.vertices[0];
+      vec p1 = facet.vertices[1];
+      vec p2 = facet.vertices[2];
 
       if(ignoreDegenerateFaces) {
         vec vec1;
@@ -182,48 +125,46 @@ int main(int argc, char** argv) {
         }
       }
 
-      VertexKey v0(p0.x, p0.y, p0.z, exactKeys);
-      VertexKey v1(p1.x, p1.y, p1.z, exactKeys);
-      VertexKey v2(p2.x, p2.y, p2.z, exactKeys);
-
-      EdgeKey e0(v0,v1);
-      EdgeKey e1(v1,v2);
-      EdgeKey e2(v2,v0);
+      float triangle[9] = { p0.x, p0.y, p0.z, p1.x, p1.y, p1.z, p2.x, p2.y, p2.z };
+      corners.insert(corners.end(), triangle, triangle+9);
+    }
 
-      if(edgeCounts.count(e0)) {
-        edgeCounts[e0] = edgeCounts[e0] + 1;
-      } else {
-        edgeCounts[e0] = 1;
-      }
+    stl_view_close(&view);
 
-      if(edgeCounts.count(e1)) {
-        edgeCounts[e1] = edgeCounts[e1] + 1;
-      } else {
-        edgeCounts[e1] = 1;
-      }
-
-      if(edgeCounts.count(e2)) {
-        edgeCounts[e2] = edgeCounts[e2] + 1;
-      } else {
-        edgeCounts[e2] = 1;
+    indexed_mesh_t mesh;
+    if(!indexed_mesh_build(&mesh, corners.data(), corners.size()/9, exactKeys ? 0 : EPSILON, std::thread::hardware_concurrency())) {
+      fprintf(stderr, "Too many triangles\n");
+      exit(2);
+    }
+    std::vector<float>().swap(corners);
+
+    // Every directed edge is stored under its undirected key with +1 or -1
+    // for its direction. After sorting, the border edges between two
+    // vertices are the difference of the counts in each direction.
+    std::vector<std::pair<uint64_t, int>> edges;
+    edges.reserve(mesh.indices.size());
+    for(size_t i = 0; i < mesh.indices.size(); i += 3) {
+      for(int j = 0; j < 3; j++) {
+        uint32_t a = mesh.indices[i+j];
+        uint32_t b = mesh.indices[i+(j+1)%3];
+        if(a != b) {
+          edges.push_back(std::make_pair(mesh_edge_key(a, b), a < b ? 1 : -1));
+        }
       }
     }
-
-    std::unordered_map<EdgeKey, int>::iterator itr = edgeCounts.begin();
+    std::sort(edges.begin(), edges.end());
 
     uint32_t borderEdges = 0;
-    while(itr != edgeCounts.end()) {
-      VertexKey v1 = itr->first.v1;
-      VertexKey v2 = itr->first.v2;
-      EdgeKey reverseKey(v2, v1);
-      if(!edgeCounts.count(reverseKey) || itr->second > edgeCounts[reverseKey]) {
-        if(edgeCounts.count(reverseKey)) {
-          borderEdges += itr->second-edgeCounts[reverseKey];
-        } else {
-          borderEdges += itr->second;
-        }
+    size_t i = 0;
+    while(i < edges.size()) {
+      int64_t net = 0;
+      size_t j = i;
+      while(j < edges.size() && edges[j].first == edges[i].first) {
+        net += edges[j].second;
+        j++;
       }
-      ++itr;
+      borderEdges += net < 0 ? -net : net;
+      i = j;
     }
 
     std::cout << borderEdges << std::endl;
@@ -25,8 +25,7 @@ Copyright 2017 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <libgen.h>
 #include <cmath>
 #include "stl_util.h"
-#include <unordered_set>
-#include <unordered_map>
+#include <algorithm>
 #include <vector>
 #include <iostream>
 
@@ -40,78 +39,6 @@ void print_usage() {
 }
 
 #define EPS .000001
-struct VertexKey {
-  int x;
-  int y;
-  int z;
-  VertexKey() : x(0), y(0), z(0) {}
-  VertexKey(float xx, float yy, float zz) {
-    x = (int)(std::round((double)xx/EPS));
-    y = (int)(std::round((double)yy/EPS));
-    z = (int)(std::round((double)zz/EPS));
-  }
-
-  bool operator==(const VertexKey& k) const {
-    return x == k.x && y == k.y && z == k.z;
-  }
-};
-
-namespace std {
-  template <>
-  struct hash<VertexKey> {
-    std::size_t operator()(const VertexKey& k) const {
-      return ((std::hash<int>()(k.x) ^ (std::hash<int>()(k.y) << 1)) >> 1) ^ (hash<int>()(k.z) << 1);
-    }
-  };
-}
-
-struct EdgeKey {
-  VertexKey v1;
-  VertexKey v2;
-
-  EdgeKey(const VertexKey &a, const VertexKey &b) {
-    if(a.x < b.x) {
-      v1 = a;
-      v2 = b;
-    } else if(a.x > b.x) {
-      v2 = a;
-      v1 = b;
-    } else {
-      if(a.y < b.y) {
-        v1 = a;
-        v2 = b;
-      } else if(a.y > b.y) {
-        v2 = a;
-        v1 = b;
-      } else {
-        if(a.z < b.z) {
-          v1 = a;
-          v2 = b;
-        } else if(a.z > b.z) {
-          v2 = a;
-          v1 = b;
-        } else {
-          v1 = a;
-          v2 = b;
-        }
-      }
-    }
-  }
-
-  bool operator==(const EdgeKey &k) const {
-    return (v1 == k.v1 && v2 == k.v2);
-  }
-};
-
-namespace std {
-  template<>
-  struct hash<EdgeKey> {
-    std::size_t operator()(const EdgeKey& k) const {
-      return ((std::hash<VertexKey>()(k.v1) ^ (std::hash<VertexKey>()(k.v2) << 1)) >> 1);
-    }
-  };
-}
-
 
 int main(int argc, char** argv) {
     if(argc >= 2) {
@@ -156,81 +83,37 @@ int main(int argc, char** argv) {
         f = stdin;
     }
 
-    fseek(f, 80, SEEK_SET);
-    uint32_t num_tris;
-    uint16_t abc = 0; // attribute byte count
-
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    std::unordered_map<VertexKey,std::vector<vec>> verts2normals;
-    std::unordered_map<VertexKey,std::vector<vec>> verts2edges;
-    std::unordered_set<EdgeKey> edgesSeen;
-
-    for(int i = 0; i < num_tris; i++) {
-      vec normal;
-      vec p0;
-      vec p1;
-      vec p2;
-
-      readBytes = fread(&normal, 1, 12,f);
-      readBytes = fread(&p0, 1, 12,f);
-      readBytes = fread(&p1, 1, 12,f);
-      readBytes = fread(&p2, 1, 12,f);
-      readBytes = fread(&abc, 1, 2,f);
-
-      VertexKey v0(p0.x, p0.y, p0.z);
-      VertexKey v1(p1.x, p1.y, p1.z);
-      VertexKey v2(p2.x, p2.y, p2.z);
-
-      verts2normals[v0].push_back(normal);
-      verts2normals[v1].push_back(normal);
-      verts2normals[v2].push_back(normal);
-
-      vec e;
-
-      e.x = p1.x-p0.x;
-      e.y = p1.y-p0.y;
-      e.z = p1.z-p0.z;
-
-      verts2edges[v0].push_back(e);
-
-      e.x = p2.x-p0.x;
-      e.y = p2.y-p0.y;
-      e.z = p2.z-p0.z;
-
-      verts2edges[v0].push_back(e);
-
-      e.x = p0.x-p1.x;
-      e.y = p0.y-p1.y;
-      e.z = p0.z-p1.z;
-
-      verts2edges[v1].push_back(e);
-
-      e.x = p2.x-p1.x;
-      e.y = p2.y-p1.y;
-      e.z = p2.z-p1.z;
-
-      verts2edges[v1].push_back(e);
-
-      e.x = p0.x-p2.x;
-      e.y = p0.y-p2.y;
-      e.z = p0.z-p2.z;
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "invalid binary stl file\n");
+        exit(2);
+    }
+    uint32_t num_tris = view.facet_count;
 
-      verts2edges[v2].push_back(e);
+    std::vector<vec> normals(num_tris);
+    for(uint32_t i = 0; i < num_tris; i++) {
+      memcpy(&normals[i], stl_view_record(&view, i), 12);
+    }
 
-      e.x = p1.x-p2.x;
-      e.y = p1.y-p2.y;
-      e.z = p1.z-p2.z;
+    indexed_mesh_t mesh;
+    if(!indexed_mesh_from_view(&mesh, &view, EPS, std::thread::hardware_concurrency())) {
+      fprintf(stderr, "Too many triangles\n");
+      exit(2);
+    }
 
-      verts2edges[v2].push_back(e);
+    stl_view_close(&view);
 
-      edgesSeen.insert(EdgeKey(v0, v1));
-      edgesSeen.insert(EdgeKey(v1, v2));
-      edgesSeen.insert(EdgeKey(v2, v0));
+    std::vector<uint64_t> edges;
+    edges.reserve(mesh.indices.size());
+    for(size_t i = 0; i < mesh.indices.size(); i += 3) {
+      edges.push_back(mesh_edge_key(mesh.indices[i], mesh.indices[i+1]));
+      edges.push_back(mesh_edge_key(mesh.indices[i+1], mesh.indices[i+2]));
+      edges.push_back(mesh_edge_key(mesh.indices[i+2], mesh.indices[i]));
     }
+    std::sort(edges.begin(), edges.end());
 
-    int V = verts2normals.size();
-    int E = edgesSeen.size();
+    int V = indexed_mesh_vertex_count(&mesh);
+    int E = std::unique(edges.begin(), edges.end()) - edges.begin();
     int F = num_tris;
 
     int euler_characteristic = V - E + F;
@@ -247,25 +130,47 @@ int main(int argc, char** argv) {
         std::cout << "Euler characteristic of 2... possibly convex" << std::endl;
       }
 
-      std::unordered_map<VertexKey, std::vector<vec>>::iterator itr = verts2edges.begin();
-      while(itr != verts2edges.end()) {
-        std::vector<vec>::iterator nItr = verts2normals[itr->first].begin();
-        while(nItr != verts2normals[itr->first].end()) {
-          std::vector<vec>::iterator vItr = itr->second.begin();
-          while(vItr != itr->second.end()) {
-            if(vec_dot(&(*vItr), &(*nItr)) > EPSILON) {
+      // corners[first[v]] .. corners[first[v+1]-1] are the corners that
+      // share vertex v
+      std::vector<uint32_t> first(V+1, 0);
+      for(size_t i = 0; i < mesh.indices.size(); i++) {
+        first[mesh.indices[i]+1]++;
+      }
+      for(int v = 0; v < V; v++) {
+        first[v+1] += first[v];
+      }
+      std::vector<uint32_t> corners(mesh.indices.size());
+      std::vector<uint32_t> next(first.begin(), first.end()-1);
+      for(size_t i = 0; i < mesh.indices.size(); i++) {
+        corners[next[mesh.indices[i]]++] = i;
+      }
+
+      for(int v = 0; v < V; v++) {
+        std::vector<vec> edgeVecs;
+        for(uint32_t k = first[v]; k < first[v+1]; k++) {
+          uint32_t t = corners[k]/3;
+          uint32_t j = corners[k]%3;
+          for(uint32_t o = 1; o < 3; o++) {
+            uint32_t w = mesh.indices[t*3+(j+o)%3];
+            vec e;
+            e.x = mesh.x[w]-mesh.x[v];
+            e.y = mesh.y[w]-mesh.y[v];
+            e.z = mesh.z[w]-mesh.z[v];
+            edgeVecs.push_back(e);
+          }
+        }
+        for(uint32_t k = first[v]; k < first[v+1]; k++) {
+          vec *n = &normals[corners[k]/3];
+          for(size_t e = 0; e < edgeVecs.size(); e++) {
+            if(vec_dot(&edgeVecs[e], n) > EPSILON) {
               if(verbose) {
                 std::cout << "found vertex with non convex edge" << std::endl;
               }
               std::cout << "not convex" << std:: endl;
               exit(0);
             }
-            ++vItr;
           }
-          ++nItr;
         }
-        ++itr;
-
       }
 
       std::cout << "convex" << std:: endl;
@@ -25,88 +25,134 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <libgen.h>
 #include "stl_util.h"
 
-#define BUFFER_SIZE 4096
-
 void print_usage() {
     fprintf(stderr, "stl_count prints the number of triangles in an STL file.\n\n");
     fprintf(stderr, "usage: stl_count [ <input file> ]\n");
-    fprintf(stderr, "    Prints the number of triangles in the provided binary STL file. If no input file is specified, data is read from stdin.\n");
+    fprintf(stderr, "    Prints the number of triangles in the provided binary or ASCII STL file. If no input file is specified, data is read from stdin.\n");
 }
 
-int main(int argc, char** argv) {
-    if(argc >= 2) {
-        if(strcmp(argv[1], "--help") == 0) {
-            print_usage();
-            exit(2);
+// Reads fd to the end without looking at the data, returns how many bytes
+// there were. Pipes are spliced to /dev/null so nothing is copied to user
+// space.
+uint64_t drain(int fd) {
+    uint64_t total = 0;
+#ifdef __linux__
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        ssize_t n;
+        while ((n = splice(fd, NULL, null_fd, NULL, 1 << 30, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) {
+                total += n;
+            }
+        }
+        close(null_fd);
+        if (n == 0) {
+            return total;
         }
     }
-    if(argc == 2) {
-        FILE *f;
-        char* filename = argv[1];
+#endif
+    std::vector<char> buffer(STL_COPY_BUFFER_SIZE);
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            total += n;
+        }
+    }
+    return total;
+}
 
-        if(!is_valid_binary_stl(filename)) {
-            fprintf(stderr, "stl_count only accepts binary stl files.\n");
-            exit(2);
+// Counts the facets of an unbuffered STL stream, reading it to the end.
+// Binary data has to be exactly as long as its facet count says, which
+// takes precedence over a header starting with "solid ". Otherwise the data
+// is parsed as ASCII. Returns 0 if it's neither.
+int count_stream(FILE *f, uint64_t *count) {
+    unsigned char header[STL_HEADER_SIZE];
+    size_t n = fread(header, 1, STL_HEADER_SIZE, f);
+    uint64_t total = n;
+    uint64_t ascii_count = 0;
+    int is_ascii = 0;
+    if (n >= 6 && memcmp(header, "solid ", 6) == 0) {
+        stl_ascii_reader_t reader;
+        if (!stl_ascii_reader_open(&reader, f)) {
+            return 0;
         }
-        f = fopen(filename, "r+b");
-        if(!f) {
-            fprintf(stderr, "Can't read file: %s\n", filename);
-            exit(2);
+        stl_ascii_reader_prefill(&reader, header, n);
+        char name[STL_HEADER_SIZE];
+        facet_t facet;
+        if (stl_ascii_read_header(&reader, name, sizeof(name))) {
+            while (stl_ascii_read_facet(&reader, &facet)) {
+                ascii_count++;
+            }
+            is_ascii = stl_ascii_read_final(&reader);
         }
-        fseek(f, 80, SEEK_SET);
-
-        uint32_t num_tris;
+        total = reader.bytes_read;
+        stl_ascii_reader_close(&reader);
+    }
+    total += drain(fileno(f));
+
+    uint32_t num_tris = 0;
+    if (n == STL_HEADER_SIZE) {
+        memcpy(&num_tris, header + 80, 4);
+        if (total == STL_HEADER_SIZE+STL_RECORD_SIZE*(uint64_t)num_tris) {
+            *count = num_tris;
+            return 1;
+        }
+    }
+    *count = ascii_count;
+    return is_ascii;
+}
 
-        if(fread(&num_tris, 1, 4, f) < 4) {
-            fprintf(stderr, "invalid binary stl file\n");
+int main(int argc, char** argv) {
+    if(argc >= 2) {
+        if(strcmp(argv[1], "--help") == 0) {
+            print_usage();
             exit(2);
         }
-
-        fclose(f);
-        printf("%d\n", num_tris);
-    } else if(argc > 2) {
+    }
+    if(argc > 2) {
         print_usage();
         exit(2);
-    } else {
-        off_t bights_read = 0;
-        while(bights_read < 80 && getc(stdin) != EOF) {
-            bights_read++;
-        }
-        if(bights_read < 80) {
-            fprintf(stderr, "invalid binary stl file\n");
-            exit(2);
-        }
-        // got through header
-
-        bights_read = 0;
-        uint8_t buff[4];
-
-        int c;
-        // now read num_tris
-        while(bights_read < 4 && (c = getc(stdin)) != EOF) {
-            buff[bights_read] = c;
-            bights_read++;
-        }
+    }
 
-        if(bights_read < 4) {
-            fprintf(stderr, "invalid binary stl file\n");
+    const char *filename = argc == 2 ? argv[1] : "stdin";
+    uint64_t count;
+    FILE *f = stdin;
+    if(argc == 2) {
+        // a binary file's count comes straight from its header
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0) {
+            fprintf(stderr, "Can't read file: %s\n", filename);
             exit(2);
         }
-
-        uint32_t num_tris = *((uint32_t*)buff);
-
-        // read the rest of the file
-        while(bights_read < num_tris*16 && getc(stdin) != EOF) {
-            bights_read++;
+        uint32_t num_tris;
+        int is_binary = read_binary_stl_count(fd, &num_tris);
+        close(fd);
+        if(is_binary) {
+            printf("%u\n", num_tris);
+            return 0;
         }
-
-        if(bights_read < num_tris*16) {
-            fprintf(stderr, "invalid binary stl file\n");
+        f = fopen(filename, "rb");
+        if(!f) {
+            fprintf(stderr, "Can't read file: %s\n", filename);
             exit(2);
         }
+    }
 
-        printf("%d\n", num_tris);
+    // unbuffered, so the data can be drained from the file descriptor
+    // without stdio holding on to part of it
+    setvbuf(f, NULL, _IONBF, 0);
+    FILE *in = stl_decompress_input(f, 0);
+    if(in && in != f) {
+        setvbuf(in, NULL, _IONBF, 0);
+    }
+    if(!in || !count_stream(in, &count)) {
+        fprintf(stderr, "%s is not an STL file.\n", filename);
+        exit(2);
+    }
+    if(!stl_input_close(in)) {
+        exit(2);
     }
+    printf("%llu\n", (unsigned long long)count);
 
     return 0;
 }
@@ -30,8 +30,9 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 
 void print_usage() {
     fprintf(stderr, "stl_empty outputs an empty STL file.\n\n");
-    fprintf(stderr, "usage: stl_empty <output file>\n");
+    fprintf(stderr, "usage: stl_empty [ <output file> ]\n");
     fprintf(stderr, "    Outputs a properly formatted, but empty stl file (just an 80 byte header and a 0 indicating no triangles). ");
+    fprintf(stderr, "If no output file is provided, data is sent to stdout.\n");
 }
 
 int main(int argc, char** argv) {
@@ -41,18 +42,20 @@ int main(int argc, char** argv) {
             exit(2);
         }
     }
-    if(argc != 2) {
+    if(argc > 2) {
         print_usage();
         exit(2);
     }
 
-    char *file = argv[1];
-    FILE *outf;
+    FILE *outf = stdout;
 
-    outf = fopen(file, "wb");
-    if(!outf) {
-        fprintf(stderr, "Can't write to file: %s\n", file);
-        exit(2);
+    if(argc == 2) {
+        char *file = argv[1];
+        outf = fopen(file, "wb");
+        if(!outf) {
+            fprintf(stderr, "Can't write to file: %s\n", file);
+            exit(2);
+        }
     }
 
     char header[81] = {0};
@@ -64,7 +67,9 @@ int main(int argc, char** argv) {
 
     fwrite(&num_tris, 4, 1, outf);
 
-    fclose(outf);
+    if(outf != stdout) {
+        fclose(outf);
+    }
 
     return 0;
 }
@@ -0,0 +1,132 @@
+/*
+
+Copyright 2018 Allwine Designs, LLC (stl_cmd@allwinedesigns.com)
+
+    This file is part of stl_cmd.
+
+    stl_cmd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <string.h>
+#include <math.h>
+#include "stl_util.h"
+
+void print_usage() {
+    fprintf(stderr, "stl_measure prints the mass properties of an STL file as JSON.\n\n");
+    fprintf(stderr, "usage: stl_measure [ <input file> ]\n");
+    fprintf(stderr, "    Prints the facet count, bounding box, surface area, signed volume, centroid,\n");
+    fprintf(stderr, "    inertia tensor about the centroid (unit density) and bounding cylinder of a\n");
+    fprintf(stderr, "    binary STL file, all from one pass over the file. If no input file is given\n");
+    fprintf(stderr, "    or it is -, stdin is read.\n");
+}
+
+// JSON has no nan or infinity.
+void print_double(double v) {
+    if (isfinite(v)) {
+        printf("%.17g", v);
+    } else {
+        printf("null");
+    }
+}
+
+void print_float(float v) {
+    if (isfinite(v)) {
+        char text[STL_FLOAT_CHARS];
+        int n = format_float_shortest(v, text);
+        printf("%.*s", n, text);
+    } else {
+        printf("null");
+    }
+}
+
+void print_vec(const vec *v) {
+    printf("[");
+    print_float(v->x);
+    printf(", ");
+    print_float(v->y);
+    printf(", ");
+    print_float(v->z);
+    printf("]");
+}
+
+void print_doubles(const double *v) {
+    printf("[");
+    print_double(v[0]);
+    printf(", ");
+    print_double(v[1]);
+    printf(", ");
+    print_double(v[2]);
+    printf("]");
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--help") == 0)) {
+        print_usage();
+        exit(2);
+    }
+
+    const char *file = argc == 2 ? argv[1] : "-";
+    FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't read file: %s\n", file);
+        exit(2);
+    }
+
+    stl_view_t view;
+    if (!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
+    }
+
+    stl_measure_t measure;
+    stl_view_measure(&view, &measure);
+
+    stl_view_close(&view);
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    bounds_t *b = &measure.bounds;
+    vec size;
+    vec_sub(&b->max, &b->min, &size);
+
+    printf("{\n");
+    printf("  \"facets\": %u,\n", measure.facet_count);
+    printf("  \"bounds\": {\n");
+    printf("    \"min\": "); print_vec(&b->min); printf(",\n");
+    printf("    \"max\": "); print_vec(&b->max); printf(",\n");
+    printf("    \"size\": "); print_vec(&size); printf("\n");
+    printf("  },\n");
+    printf("  \"area\": "); print_double(measure.area); printf(",\n");
+    printf("  \"volume\": "); print_double(measure.volume); printf(",\n");
+    printf("  \"centroid\": "); print_doubles(measure.centroid); printf(",\n");
+    printf("  \"inertia\": [\n");
+    for (int i = 0; i < 3; i++) {
+        printf("    "); print_doubles(measure.inertia[i]); printf(i < 2 ? ",\n" : "\n");
+    }
+    printf("  ],\n");
+    printf("  \"bcylinder\": {\n");
+    printf("    \"center\": "); print_vec(&measure.bcylinder.center); printf(",\n");
+    printf("    \"point\": "); print_vec(&measure.bcylinder.point); printf(",\n");
+    printf("    \"radius\": "); print_float(measure.bcylinder.radius); printf(",\n");
+    printf("    \"height\": "); print_float(measure.bcylinder.height); printf("\n");
+    printf("  }\n");
+    printf("}\n");
+
+    return 0;
+}
@@ -25,15 +25,221 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <string.h>
 #include "stl_util.h"
 
-#define BUFFER_SIZE 4096
-
-// TODO Add options for layouting out merged files in a row or grid
-// rather than just merging.
+// Facets translated by each thread before they're written in order.
+#define LAYOUT_CHUNK_SIZE 16384
 
 void print_usage() {
     fprintf(stderr, "stl_merge concatenates multiple STL files.\n\n");
-    fprintf(stderr, "usage: stl_merge [ -o <out file> ] [ <in file1> ... ]\n");
+    fprintf(stderr, "usage: stl_merge [ -o <out file> ] [ -l [ -w <width> ] [ -g <gap> ] ] [ <in file1> ... ]\n");
     fprintf(stderr, "    Merges binary stl files into a single file. If no out file is provided, data is output to stdout.\n");
+    fprintf(stderr, "    An in file of - reads from stdin, as does giving no in files at all.\n");
+    fprintf(stderr, "     -l - lays the files out side by side on the xy plane instead of overlapping them,\n"
+                    "          each resting on z = 0, packed into rows by their bounding boxes.\n");
+    fprintf(stderr, "     -w <width> - width of the plate in x to pack into, by default about as\n"
+                    "                  wide as the packed files are deep.\n");
+    fprintf(stderr, "     -g <gap> - space between files, 1 by default.\n");
+}
+
+typedef struct {
+    double x;
+    double y;
+    double width;
+} skyline_segment_t;
+
+// Lowest y a rectangle of width can rest at with its left side at segment
+// i of the skyline, or INFINITY if it runs past the plate.
+double skyline_fit(const std::vector<skyline_segment_t> &skyline, size_t i, double width, double plate_width) {
+    double x = skyline[i].x;
+    if(x > 0 && x + width > plate_width) {
+        return INFINITY;
+    }
+    double y = 0;
+    for(size_t j = i; j < skyline.size() && skyline[j].x < x + width; j++) {
+        y = std::max(y, skyline[j].y);
+    }
+    return y;
+}
+
+// Raises the skyline under a width x height rectangle placed at x, y.
+void skyline_place(std::vector<skyline_segment_t> &skyline, double x, double y, double width, double height) {
+    std::vector<skyline_segment_t> next;
+    skyline_segment_t top = { x, y + height, width };
+    int placed = 0;
+    for(size_t i = 0; i < skyline.size(); i++) {
+        skyline_segment_t s = skyline[i];
+        double end = s.x + s.width;
+        if(end <= x || s.x >= x + width) {
+            if(!placed && s.x >= x + width) {
+                next.push_back(top);
+                placed = 1;
+            }
+            next.push_back(s);
+            continue;
+        }
+        if(s.x < x) {
+            skyline_segment_t left = { s.x, s.y, x - s.x };
+            next.push_back(left);
+        }
+        if(!placed) {
+            next.push_back(top);
+            placed = 1;
+        }
+        if(end > x + width) {
+            skyline_segment_t right = { x + width, s.y, end - x - width };
+            next.push_back(right);
+        }
+    }
+    if(!placed) {
+        next.push_back(top);
+    }
+    // neighbours at the same height become one segment
+    skyline.clear();
+    for(size_t i = 0; i < next.size(); i++) {
+        if(!skyline.empty() && skyline.back().y == next[i].y) {
+            skyline.back().width = next[i].x + next[i].width - skyline.back().x;
+        } else {
+            skyline.push_back(next[i]);
+        }
+    }
+}
+
+// Packs the xy footprints of bounds into a plate plate_width wide (about
+// square for 0) with gap between them, tallest first, each at the lowest
+// and then leftmost spot of the skyline. Fills in the translation moving
+// each to its spot with its lowest point on z = 0.
+void layout_parts(const std::vector<bounds_t> &bounds, double gap, double plate_width, std::vector<vec> &translations) {
+    size_t n = bounds.size();
+    std::vector<size_t> order(n);
+    double area = 0;
+    double widest = 0;
+    for(size_t i = 0; i < n; i++) {
+        order[i] = i;
+        double width = bounds[i].max.x - bounds[i].min.x + gap;
+        double depth = bounds[i].max.y - bounds[i].min.y + gap;
+        area += width*depth;
+        widest = std::max(widest, width);
+    }
+    if(plate_width <= 0) {
+        plate_width = sqrt(area);
+    }
+    plate_width = std::max(plate_width + gap, widest);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return bounds[a].max.y - bounds[a].min.y > bounds[b].max.y - bounds[b].min.y;
+    });
+
+    std::vector<skyline_segment_t> skyline;
+    skyline_segment_t floor = { 0, 0, plate_width };
+    skyline.push_back(floor);
+    translations.resize(n);
+    for(size_t k = 0; k < n; k++) {
+        const bounds_t *b = &bounds[order[k]];
+        double width = b->max.x - b->min.x + gap;
+        double depth = b->max.y - b->min.y + gap;
+        size_t best = 0;
+        double best_y = INFINITY;
+        for(size_t i = 0; i < skyline.size(); i++) {
+            double y = skyline_fit(skyline, i, width, plate_width);
+            if(y < best_y) {
+                best = i;
+                best_y = y;
+            }
+        }
+        double x = skyline[best].x;
+        skyline_place(skyline, x, best_y, width, depth);
+
+        vec *t = &translations[order[k]];
+        memset(t, 0x00, sizeof(vec));
+        t->x = x - b->min.x;
+        t->y = best_y - b->min.y;
+        t->z = -b->min.z;
+    }
+}
+
+// Writes the records of view moved by t, translating chunks on all threads
+// and writing them in order.
+int write_translated(const stl_view_t *view, const vec *t, FILE *outf, int threads) {
+    size_t round = (size_t)threads*LAYOUT_CHUNK_SIZE;
+    std::vector<unsigned char> records(std::min(round, (size_t)view->facet_count)*STL_RECORD_SIZE);
+    for(size_t first = 0; first < view->facet_count; first += round) {
+        size_t n = std::min(round, view->facet_count - first);
+        stl_translate_records_parallel(stl_view_record(view, first), records.data(), n, t, threads);
+        if(fwrite(records.data(), STL_RECORD_SIZE, n, outf) != n) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copies the records of files after the header already written to outf.
+// They go straight from file to file in the kernel. A regular output file
+// gets every input copied to its precomputed offset in parallel, anything
+// else is appended to in order.
+// Files with an open view (stdin and compressed files) are written from it,
+// the rest are copied by the kernel.
+void copy_records(char **files, int num_files, const std::vector<uint32_t> &counts, const std::vector<stl_view_t> &views, FILE *outf) {
+    int out_fd = fileno(outf);
+    struct stat st;
+    int positional = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+    off_t base = positional ? lseek(out_fd, 0, SEEK_CUR) : -1;
+    if(base < 0) {
+        positional = 0;
+    }
+    std::vector<off_t> offsets(num_files);
+    off_t offset = base;
+    for(int i = 0; i < num_files; i++) {
+        offsets[i] = offset;
+        offset += STL_RECORD_SIZE*(off_t)counts[i];
+    }
+
+    std::atomic<int> next(0);
+    std::atomic<int> failed(-1);
+    auto copy_files = [&]() {
+        int i;
+        while((i = next++) < num_files && failed < 0) {
+            size_t length = STL_RECORD_SIZE*(size_t)counts[i];
+            int ok;
+            if(views[i].data) {
+                const unsigned char *records = views[i].data + STL_HEADER_SIZE;
+                ok = positional ? stl_pwrite_all(out_fd, records, length, offsets[i]) : stl_write_all(out_fd, records, length);
+            } else {
+                int fd = open(files[i], O_RDONLY);
+                uint32_t count;
+                ok = fd >= 0 && read_binary_stl_count(fd, &count) && count == counts[i] &&
+                     (positional ? stl_copy_range(fd, STL_HEADER_SIZE, out_fd, offsets[i], length) :
+                                   stl_copy_stream(fd, STL_HEADER_SIZE, out_fd, length));
+                if(fd >= 0) {
+                    close(fd);
+                }
+            }
+            if(!ok) {
+                int none = -1;
+                failed.compare_exchange_strong(none, i);
+            }
+        }
+    };
+
+    int threads = positional ? std::min((int)std::thread::hardware_concurrency(), num_files) : 1;
+    if(threads > 1) {
+        std::vector<std::thread> workers;
+        for(int t = 0; t < threads; t++) {
+            workers.push_back(std::thread(copy_files));
+        }
+        for(size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+    } else {
+        copy_files();
+    }
+    if(positional) {
+        lseek(out_fd, offset, SEEK_SET);
+    }
+
+    if(failed >= 0) {
+        char name[100];
+        snprintf(name, sizeof(name), "%s", files[(int)failed]);
+        fprintf(stderr, "Error copying %s to the output.\n", name);
+        exit(2);
+    }
 }
 
 int main(int argc, char** argv) {
@@ -47,13 +253,25 @@ int main(int argc, char** argv) {
     int errflg = 0;
     char *out_file;
     int outflag = 0;
+    int layout = 0;
+    double plate_width = 0;
+    double gap = 1;
 
-    while((c = getopt(argc, argv, "o:")) != -1) {
+    while((c = getopt(argc, argv, "o:lw:g:")) != -1) {
         switch(c) {
             case 'o':
                 outflag = 1;
                 out_file = optarg;
                 break;
+            case 'l':
+                layout = 1;
+                break;
+            case 'w':
+                plate_width = atof(optarg);
+                break;
+            case 'g':
+                gap = atof(optarg);
+                break;
             case '?':
                 fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
                 errflg++;
@@ -66,35 +284,92 @@ int main(int argc, char** argv) {
         exit(2);
     }
 
+    // stdin can only be read once, so it's held in memory between
+    // counting the triangles and copying them
+    char stdin_name[] = "-";
+    char *stdin_files[] = { stdin_name };
+    char **files = argv + optind;
+    int num_files = argc - optind;
+    if(num_files == 0) {
+        files = stdin_files;
+        num_files = 1;
+    }
+    stl_view_t stdin_view;
+    int read_stdin = 0;
+
     uint32_t num_tris = 0;
+    std::vector<uint32_t> counts(num_files);
 
-    for(int i = optind; i < argc; i++) {
-        char* file = argv[i];
+    // laying out needs the bounds, so every file is mapped up front.
+    // Otherwise only stdin and compressed files get a view.
+    std::vector<stl_view_t> views(num_files);
+    std::vector<bounds_t> bounds(layout ? num_files : 0);
+
+    for(int i = 0; i < num_files; i++) {
+        char* file = files[i];
 
         char name[100];
         snprintf(name, sizeof(name), "%s", file);
 
-        if(!is_valid_binary_stl(file)) {
-
-            fprintf(stderr, "%s is not a binary stl file.\n", name);
-            exit(2);
+        if(strcmp(file, "-") == 0) {
+            if(read_stdin) {
+                fprintf(stderr, "stdin can only be merged once.\n");
+                exit(2);
+            }
+            if(!stl_view_open(&stdin_view, stdin)) {
+                fprintf(stderr, "stdin is not a binary stl file.\n");
+                exit(2);
+            }
+            read_stdin = 1;
+            counts[i] = stdin_view.facet_count;
+            num_tris += counts[i];
+            views[i] = stdin_view;
+            if(layout) {
+                stl_view_bounds(&views[i], &bounds[i]);
+            }
+            continue;
         }
 
-        FILE *f;
-        f = fopen(file, "rb");
-        if(!f) {
-            fprintf(stderr, "Can't read file: %s\n", name);
-            exit(2);
+        if(layout) {
+            FILE *f = fopen(file, "rb");
+            if(!f || !stl_view_open(&views[i], f)) {
+                fprintf(stderr, "%s is not a binary stl file.\n", name);
+                exit(2);
+            }
+            fclose(f);
+            stl_meta_t meta;
+            if(stl_meta_enabled() && stl_meta_load(file, &meta)) {
+                bounds[i] = meta.bounds;
+            } else {
+                stl_view_bounds(&views[i], &bounds[i]);
+            }
+            counts[i] = views[i].facet_count;
+            num_tris += counts[i];
+            continue;
         }
-        fseek(f, 80, SEEK_SET);
 
-        uint32_t nt;
-        size_t readBytes = fread(&nt, 4, 1, f);
+        int fd = open(file, O_RDONLY);
+        if(fd < 0 || !read_binary_stl_count(fd, &counts[i])) {
+            // compressed, or not an stl file at all
+            FILE *f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+            if(!f || !stl_view_open(&views[i], f)) {
+                fprintf(stderr, "%s is not a binary stl file.\n", name);
+                exit(2);
+            }
+            fclose(f);
+            counts[i] = views[i].facet_count;
+            num_tris += counts[i];
+            continue;
+        }
+        close(fd);
 
-        num_tris += nt;
-        fclose(f);
+        num_tris += counts[i];
     }
 
+    std::vector<vec> translations;
+    if(layout) {
+        layout_parts(bounds, gap, plate_width, translations);
+    }
 
     FILE *outf;
 
@@ -113,34 +388,40 @@ int main(int argc, char** argv) {
     }
 
     char header[81] = {0}; // include an extra char for terminating \0 of snprintf
-    char base1[50];
-    char base2[50];
     snprintf(header, 81, "Merged using stl_merge.");
 
     fwrite(header, 80, 1, outf);
     fwrite(&num_tris, 4, 1, outf);
+    if(fflush(outf) != 0) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(2);
+    }
 
-    char buffer[BUFFER_SIZE];
-
-    for(int i = optind; i < argc; i++) {
-        char* file = argv[i];
-
-        char name[100];
-        snprintf(name, sizeof(name), "%s", file);
-
-        FILE *f;
-        f = fopen(file, "rb");
-        if(!f) {
-            fprintf(stderr, "Can't read file: %s\n", name);
-            exit(2);
+    if(layout) {
+        int threads = std::max(1u, std::thread::hardware_concurrency());
+        for(int i = 0; i < num_files; i++) {
+            if(!write_translated(&views[i], &translations[i], outf, threads)) {
+                fprintf(stderr, "Error writing output.\n");
+                exit(2);
+            }
         }
-        fseek(f, 84, SEEK_SET);
+    } else {
+        copy_records(files, num_files, counts, views, outf);
+    }
 
-        int r;
-        while((r = fread(buffer, 1, BUFFER_SIZE, f))) {
-            fwrite(buffer, 1, r, outf);
+    // stdin's view is closed below
+    for(int i = 0; i < num_files; i++) {
+        if(views[i].data && strcmp(files[i], "-") != 0) {
+            stl_view_close(&views[i]);
         }
-        fclose(f);
+    }
+
+    if(read_stdin) {
+        stl_view_close(&stdin_view);
+    }
+    if(outflag && fclose(outf) != 0) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(2);
     }
 
     return 0;
@@ -34,7 +34,8 @@ void print_usage() {
                     "     -c - if present will ignore the present normal values and calculate them based on the vertex ordering.\n"
                     "     -r - if present will reverse the winding order of the vertices.\n"
                     "     -w - if present will correct the winding order of the vertices based on the direction of the stored normal.\n"
-                    "     -v - be verboze when printing out differing normals\n");
+                    "     -v - be verboze when printing out differing normals\n"
+                    "    An in file of - reads from stdin.\n");
 }
 
 int main(int argc, char** argv) {
@@ -97,17 +98,29 @@ int main(int argc, char** argv) {
         char name[100];
         snprintf(name, sizeof(name), "%s", in_file);
 
-        if(!is_valid_binary_stl(in_file)) {
+        if(strcmp(in_file, "-") == 0) {
+            // the facet count is passed through, so stdin can be streamed
+            inf = stdin;
+        } else {
+            inf = fopen(in_file, "rb");
+            if(!inf) {
+                fprintf(stderr, "Can't read file: %s\n", name);
+                exit(2);
+            }
+        }
+
+        // compressed input is streamed too, plain files have to match the
+        // size in their header
+        FILE *decompressed = stl_decompress_input(inf, 1);
+        if(decompressed == inf && inf != stdin && !is_valid_binary_stl(inf)) {
             fprintf(stderr, "%s is not a binary stl file.\n", name);
             exit(2);
         }
-
-        inf = fopen(in_file, "rb");
+        inf = decompressed;
         if(!inf) {
             fprintf(stderr, "Can't read file: %s\n", name);
             exit(2);
         }
-        fseek(inf, 80, SEEK_SET); // skip header
 
         if(optind+1 < argc) {
             out_file = argv[optind+1];
@@ -126,27 +139,19 @@ int main(int argc, char** argv) {
         exit(2);
     }
 
-    fseek(inf, 0, SEEK_SET);
-
     char header[80] = {0};
-    size_t readBytes = fread(header, 1, 80, inf);
-
-    uint16_t zero = 0;
-    uint16_t abc;
     uint32_t num_tris;
-    readBytes = fread(&num_tris, 4, 1, inf);
+    if(fread(header, 1, 80, inf) != 80 || fread(&num_tris, 4, 1, inf) != 1) {
+        fprintf(stderr, "%s is not a binary stl file.\n", in_file);
+        exit(2);
+    }
 
     if(needs_out) {
         fwrite(header, 1, 80, outf);
         fwrite(&num_tris, 1, 4, outf);
     }
 
-    vec p1,p2,p3;
-    vec n,cn;
-    p1.w = 1;
-    p2.w = 1;
-    p3.w = 1;
-    n.w = 0;
+    vec cn;
     cn.w = 0;
 
     vec d1,d2;
@@ -158,68 +163,75 @@ int main(int argc, char** argv) {
     if(verbose) {
         fprintf(stderr, "reading %d triangles and normals\n", num_tris);
     }
-    for(int i = 0; i < num_tris; i++) {
-        readBytes = fread(&n, 1, 12, inf);
-        readBytes = fread(&p1, 1, 12, inf);
-        readBytes = fread(&p2, 1, 12, inf);
-        readBytes = fread(&p3, 1, 12, inf);
-        readBytes = fread(&abc, 1, 2, inf);
-
-        vec_sub(&p2, &p1, &d1);
-        vec_sub(&p3, &p1, &d2);
-        vec_cross(&d1, &d2, &cn);
-        if(cn.x != 0 ||
-            cn.y != 0 ||
-             cn.z != 0) {
-            vec_normalize(&cn, &cn);
+
+    facet_t facets[STL_BATCH_SIZE];
+
+    uint32_t i = 0;
+    while(i < num_tris) {
+        size_t batch = num_tris-i < STL_BATCH_SIZE ? num_tris-i : STL_BATCH_SIZE;
+        batch = read_facets(inf, facets, batch);
+        if(batch == 0) {
+            break;
         }
-        if(vec_dot(&cn, &n) < 0) {
-            match = 0;
-            if(verbose) {
-                fprintf(stderr, "calculated normal %d different than input normal\n", i);
-                fprintf(stderr, "calculated: %f, %f, %f\n", cn.x, cn.y, cn.z);
-                fprintf(stderr, "input: %f, %f, %f\n", n.x, n.y, n.z);
+
+        for(size_t k = 0; k < batch; k++, i++) {
+            facet_t *facet = &facets[k];
+            vec &n = facet->normal;
+            vec p1 = facet->vertices[0];
+            vec p2 = facet->vertices[1];
+            vec p3 = facet->vertices[2];
+
+            vec_sub(&p2, &p1, &d1);
+            vec_sub(&p3, &p1, &d2);
+            vec_cross(&d1, &d2, &cn);
+            if(cn.x != 0 ||
+                cn.y != 0 ||
+                 cn.z != 0) {
+                vec_normalize(&cn, &cn);
+            }
+            if(vec_dot(&cn, &n) < 0) {
+                match = 0;
+                if(verbose) {
+                    fprintf(stderr, "calculated normal %d different than input normal\n", i);
+                    fprintf(stderr, "calculated: %f, %f, %f\n", cn.x, cn.y, cn.z);
+                    fprintf(stderr, "input: %f, %f, %f\n", n.x, n.y, n.z);
+                }
             }
-        }
 
-        const float dot = vec_dot(&cn, &n);
+            const float dot = vec_dot(&cn, &n);
+
+            if(needs_out) {
+                if(calc) {
+                    if(reverse ||
+                       (calc_winding && dot <= 0)) {
+                        cn.x *= -1;
+                        cn.y *= -1;
+                        cn.z *= -1;
+                    }
+                    n = cn;
+                }
 
-        if(needs_out) {
-            if(calc) {
                 if(reverse ||
                    (calc_winding && dot <= 0)) {
-                    cn.x *= -1;
-                    cn.y *= -1;
-                    cn.z *= -1;
+                    facet->vertices[0] = p3;
+                    facet->vertices[2] = p1;
                 }
-                fwrite(&cn, 1, 12, outf);
-            } else {
-                fwrite(&n, 1, 12, outf);
             }
+        }
 
-            if(reverse) {
-                fwrite(&p3, 1, 12, outf);
-                fwrite(&p2, 1, 12, outf);
-                fwrite(&p1, 1, 12, outf);
-            } else if(calc_winding) {
-              if(dot > 0) {
-                fwrite(&p1, 1, 12, outf);
-                fwrite(&p2, 1, 12, outf);
-                fwrite(&p3, 1, 12, outf);
-              } else {
-                fwrite(&p3, 1, 12, outf);
-                fwrite(&p2, 1, 12, outf);
-                fwrite(&p1, 1, 12, outf);
-              }
-            } else {
-                fwrite(&p1, 1, 12, outf);
-                fwrite(&p2, 1, 12, outf);
-                fwrite(&p3, 1, 12, outf);
-            }
-            fwrite(&abc, 1, 2, outf);
+        if(needs_out) {
+            write_facets(outf, facets, batch);
         }
     }
 
+    if(i < num_tris) {
+        fprintf(stderr, "%s ended after %u of %u triangles.\n", in_file, i, num_tris);
+        exit(2);
+    }
+    if(!stl_input_close(inf)) {
+        exit(2);
+    }
+
     if(!needs_out) {
         if(match) {
             fprintf(stderr, "Normals match calculated normals.\n");
@@ -0,0 +1,528 @@
+/*
+
+Copyright 2018 Allwine Designs, LLC (stl_cmd@allwinedesigns.com)
+
+    This file is part of stl_cmd.
+
+    stl_cmd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <string.h>
+#include <math.h>
+#include "stl_util.h"
+
+// Larger hulls are built from an even subset of the candidate points.
+#define OBB_HULL_POINTS 65536
+// Orientations are compared on at most this many hull vertices.
+#define OBB_EVALUATION_POINTS 16384
+// Hull faces with about the same normal are grouped, the largest groups
+// are tried as box faces.
+#define OBB_FACE_CANDIDATES 1024
+#define OBB_NORMAL_QUANTIZATION 4096
+
+void print_usage() {
+    fprintf(stderr, "stl_obb prints a tight oriented bounding box of an STL file.\n\n");
+    fprintf(stderr, "usage: stl_obb [ -t ] [ <input file> ]\n");
+    fprintf(stderr, "    Finds a small box around the convex hull of a binary STL file by trying\n"
+                    "    box orientations with a face flush against the largest hull faces and the\n"
+                    "    principal axes, rotating each about its normal for the smallest area. Prints\n"
+                    "    its center, axes (longest first), dimensions and volume, and the\n"
+                    "    stl_transform arguments that move the box to the origin, aligned with x, y\n"
+                    "    and z.\n"
+                    "     -t - only print the stl_transform arguments, e.g.\n"
+                    "          stl_transform $(stl_obb -t part.stl) part.stl aligned.stl\n"
+                    "    If no input file is provided, data is read from stdin.\n");
+}
+
+typedef struct {
+    double axis[3][3];
+    double min[3];
+    double max[3];
+    double volume;
+} obb_t;
+
+inline double dot3(const double *a, const double *b) {
+    return a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+}
+
+inline void cross3(const double *a, const double *b, double *out) {
+    out[0] = a[1]*b[2]-a[2]*b[1];
+    out[1] = a[2]*b[0]-a[0]*b[2];
+    out[2] = a[0]*b[1]-a[1]*b[0];
+}
+
+inline int normalize3(double *a) {
+    double length = sqrt(dot3(a, a));
+    if (length == 0) {
+        return 0;
+    }
+    a[0] /= length; a[1] /= length; a[2] /= length;
+    return 1;
+}
+
+// Two unit vectors completing n to an orthonormal basis.
+void plane_basis(const double *n, double *u, double *v) {
+    double other[3] = { 0, 0, 0 };
+    other[fabs(n[0]) < .6 ? 0 : (fabs(n[1]) < .6 ? 1 : 2)] = 1;
+    cross3(n, other, u);
+    normalize3(u);
+    cross3(n, u, v);
+}
+
+// Convex hull of 2D points (x y pairs), counterclockwise without
+// collinear points.
+void hull_2d(std::vector<double> &points, std::vector<double> &hull) {
+    size_t n = points.size()/2;
+    std::vector<std::pair<double, double> > p(n);
+    for (size_t i = 0; i < n; i++) {
+        p[i] = std::make_pair(points[2*i], points[2*i+1]);
+    }
+    std::sort(p.begin(), p.end());
+    p.erase(std::unique(p.begin(), p.end()), p.end());
+    n = p.size();
+    hull.clear();
+    if (n < 3) {
+        for (size_t i = 0; i < n; i++) {
+            hull.push_back(p[i].first);
+            hull.push_back(p[i].second);
+        }
+        return;
+    }
+    std::vector<std::pair<double, double> > h(2*n);
+    size_t k = 0;
+    #define TURN(o, a, b) ((a.first-o.first)*(b.second-o.second) - (a.second-o.second)*(b.first-o.first))
+    for (size_t i = 0; i < n; i++) {
+        while (k >= 2 && TURN(h[k-2], h[k-1], p[i]) <= 0) k--;
+        h[k++] = p[i];
+    }
+    for (size_t i = n-1, t = k+1; i > 0; i--) {
+        while (k >= t && TURN(h[k-2], h[k-1], p[i-1]) <= 0) k--;
+        h[k++] = p[i-1];
+    }
+    #undef TURN
+    for (size_t i = 0; i + 1 < k; i++) {
+        hull.push_back(h[i].first);
+        hull.push_back(h[i].second);
+    }
+}
+
+// Smallest area rectangle around a convex polygon by rotating calipers.
+// Returns the area and the direction of one of its sides.
+double min_area_rectangle(const std::vector<double> &hull, double *direction) {
+    size_t m = hull.size()/2;
+    direction[0] = 1;
+    direction[1] = 0;
+    if (m < 2) {
+        return 0;
+    }
+    if (m == 2) {
+        direction[0] = hull[2]-hull[0];
+        direction[1] = hull[3]-hull[1];
+        double length = sqrt(direction[0]*direction[0]+direction[1]*direction[1]);
+        direction[0] /= length;
+        direction[1] /= length;
+        return 0;
+    }
+    #define P(i) (&hull[2*((i)%m)])
+    #define DOT(d, p) ((d)[0]*(p)[0]+(d)[1]*(p)[1])
+    double best = INFINITY;
+    size_t right = 0, top = 0, left = 0;
+    for (size_t i = 0; i < m; i++) {
+        const double *a = P(i), *b = P(i+1);
+        double e[2] = { b[0]-a[0], b[1]-a[1] };
+        double length = sqrt(e[0]*e[0]+e[1]*e[1]);
+        e[0] /= length;
+        e[1] /= length;
+        double n[2] = { -e[1], e[0] };
+        if (i == 0) {
+            right = 0;
+        }
+        for (size_t s = 0; s < m && DOT(e, P(right+1)) >= DOT(e, P(right)); s++) right++;
+        if (i == 0) {
+            top = right;
+        }
+        for (size_t s = 0; s < m && DOT(n, P(top+1)) >= DOT(n, P(top)); s++) top++;
+        if (i == 0) {
+            left = top;
+        }
+        for (size_t s = 0; s < m && DOT(e, P(left+1)) <= DOT(e, P(left)); s++) left++;
+        double width = DOT(e, P(right)) - DOT(e, P(left));
+        double height = DOT(n, P(top)) - DOT(n, a);
+        if (width*height < best) {
+            best = width*height;
+            direction[0] = e[0];
+            direction[1] = e[1];
+        }
+    }
+    #undef P
+    #undef DOT
+    return best;
+}
+
+// Box with one axis along normal and the others rotated about it for the
+// smallest cross section, measured over points.
+void box_about_normal(const double *normal, const std::vector<double> &points, obb_t *box) {
+    double n[3] = { normal[0], normal[1], normal[2] };
+    normalize3(n);
+    double u[3], v[3];
+    plane_basis(n, u, v);
+
+    size_t count = points.size()/3;
+    std::vector<double> projected(2*count);
+    double lo = INFINITY, hi = -INFINITY;
+    for (size_t i = 0; i < count; i++) {
+        const double *p = &points[3*i];
+        projected[2*i] = dot3(u, p);
+        projected[2*i+1] = dot3(v, p);
+        double d = dot3(n, p);
+        lo = std::min(lo, d);
+        hi = std::max(hi, d);
+    }
+    std::vector<double> hull;
+    hull_2d(projected, hull);
+    double direction[2];
+    double area = min_area_rectangle(hull, direction);
+
+    for (int k = 0; k < 3; k++) {
+        box->axis[0][k] = n[k];
+        box->axis[1][k] = direction[0]*u[k] + direction[1]*v[k];
+    }
+    cross3(box->axis[0], box->axis[1], box->axis[2]);
+    box->volume = area*(hi-lo);
+}
+
+// Extents of points along the box's axes.
+void box_extents(const std::vector<double> &points, obb_t *box) {
+    for (int a = 0; a < 3; a++) {
+        box->min[a] = INFINITY;
+        box->max[a] = -INFINITY;
+    }
+    for (size_t i = 0; i < points.size(); i += 3) {
+        for (int a = 0; a < 3; a++) {
+            double d = dot3(box->axis[a], &points[i]);
+            box->min[a] = std::min(box->min[a], d);
+            box->max[a] = std::max(box->max[a], d);
+        }
+    }
+    box->volume = (box->max[0]-box->min[0])*(box->max[1]-box->min[1])*(box->max[2]-box->min[2]);
+}
+
+// Eigenvectors of a symmetric 3x3 matrix by Jacobi rotations, as rows of
+// vectors.
+void symmetric_eigenvectors(double a[3][3], double vectors[3][3]) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            vectors[i][j] = i == j;
+        }
+    }
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = fabs(a[0][1]) + fabs(a[0][2]) + fabs(a[1][2]);
+        if (off == 0) {
+            break;
+        }
+        for (int p = 0; p < 2; p++) {
+            for (int q = p+1; q < 3; q++) {
+                if (a[p][q] == 0) {
+                    continue;
+                }
+                double theta = .5*atan2(2*a[p][q], a[q][q]-a[p][p]);
+                double c = cos(theta), s = sin(theta);
+                for (int k = 0; k < 3; k++) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c*akp - s*akq;
+                    a[k][q] = s*akp + c*akq;
+                }
+                for (int k = 0; k < 3; k++) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c*apk - s*aqk;
+                    a[q][k] = s*apk + c*aqk;
+                }
+                for (int k = 0; k < 3; k++) {
+                    double vp = vectors[p][k], vq = vectors[q][k];
+                    vectors[p][k] = c*vp - s*vq;
+                    vectors[q][k] = s*vp + c*vq;
+                }
+            }
+        }
+    }
+}
+
+// Normals to try as box faces: the largest groups of hull faces with about
+// the same normal, the principal axes of the points and x, y and z.
+void candidate_normals(const convex_hull_t *hull, const std::vector<double> &points, std::vector<double> &normals) {
+    typedef struct {
+        int64_t key[3];
+        double area;
+        double normal[3];
+    } group_t;
+    std::vector<group_t> groups;
+    for (size_t f = 0; f < hull->faces.size(); f += 3) {
+        const double *a = &hull->points[3*hull->faces[f]];
+        const double *b = &hull->points[3*hull->faces[f+1]];
+        const double *c = &hull->points[3*hull->faces[f+2]];
+        double u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+        double v[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+        group_t group;
+        cross3(u, v, group.normal);
+        group.area = .5*sqrt(dot3(group.normal, group.normal));
+        if (!normalize3(group.normal)) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            group.key[k] = llround(group.normal[k]*OBB_NORMAL_QUANTIZATION);
+        }
+        groups.push_back(group);
+    }
+    std::sort(groups.begin(), groups.end(), [](const group_t &a, const group_t &b) {
+        if (a.key[0] != b.key[0]) return a.key[0] < b.key[0];
+        if (a.key[1] != b.key[1]) return a.key[1] < b.key[1];
+        if (a.key[2] != b.key[2]) return a.key[2] < b.key[2];
+        return a.area > b.area;
+    });
+    // the largest face of a group stands for it
+    size_t merged = 0;
+    for (size_t i = 0; i < groups.size(); i++) {
+        if (merged > 0 && memcmp(groups[merged-1].key, groups[i].key, sizeof(groups[i].key)) == 0) {
+            groups[merged-1].area += groups[i].area;
+        } else {
+            groups[merged++] = groups[i];
+        }
+    }
+    groups.resize(merged);
+    std::stable_sort(groups.begin(), groups.end(), [](const group_t &a, const group_t &b) {
+        return a.area > b.area;
+    });
+    normals.clear();
+    for (size_t i = 0; i < groups.size() && i < OBB_FACE_CANDIDATES; i++) {
+        normals.insert(normals.end(), groups[i].normal, groups[i].normal + 3);
+    }
+
+    double mean[3] = { 0, 0, 0 };
+    size_t count = points.size()/3;
+    for (size_t i = 0; i < points.size(); i++) {
+        mean[i%3] += points[i]/count;
+    }
+    double covariance[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+    for (size_t i = 0; i < points.size(); i += 3) {
+        double d[3] = { points[i]-mean[0], points[i+1]-mean[1], points[i+2]-mean[2] };
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                covariance[j][k] += d[j]*d[k];
+            }
+        }
+    }
+    double principal[3][3];
+    symmetric_eigenvectors(covariance, principal);
+    for (int k = 0; k < 3; k++) {
+        normals.insert(normals.end(), principal[k], principal[k] + 3);
+        double axis[3] = { 0, 0, 0 };
+        axis[k] = 1;
+        normals.insert(normals.end(), axis, axis + 3);
+    }
+}
+
+// Every count/limit-th point, or all of them if there are few enough.
+void even_subset(const std::vector<double> &points, size_t limit, std::vector<double> &subset) {
+    size_t count = points.size()/3;
+    if (count <= limit) {
+        subset = points;
+        return;
+    }
+    subset.clear();
+    for (size_t i = 0; i < limit; i++) {
+        size_t j = i*count/limit;
+        subset.insert(subset.end(), &points[3*j], &points[3*j] + 3);
+    }
+}
+
+void find_obb(const stl_view_t *view, obb_t *box) {
+    int threads = std::thread::hardware_concurrency();
+
+    std::vector<double> candidates;
+    stl_view_hull_candidates(view, &candidates, threads);
+
+    std::vector<double> subset;
+    even_subset(candidates, OBB_HULL_POINTS, subset);
+    convex_hull_t hull;
+    std::vector<double> evaluation;
+    if (convex_hull_build(&hull, subset.data(), subset.size()/3)) {
+        even_subset(hull.points, OBB_EVALUATION_POINTS, evaluation);
+    } else {
+        // flat, every orientation is tried on the points themselves
+        even_subset(candidates, OBB_EVALUATION_POINTS, evaluation);
+    }
+
+    std::vector<double> normals;
+    candidate_normals(&hull, evaluation, normals);
+    size_t tries = normals.size()/3;
+    std::vector<obb_t> boxes(tries);
+    parallel_slices(tries, threads, 16, [&](size_t begin, size_t end, int /*thread*/) {
+        for (size_t i = begin; i < end; i++) {
+            box_about_normal(&normals[3*i], evaluation, &boxes[i]);
+        }
+    });
+    size_t best = 0;
+    for (size_t i = 1; i < tries; i++) {
+        if (boxes[i].volume < boxes[best].volume) {
+            best = i;
+        }
+    }
+    *box = boxes[best];
+
+    // the hull vertices are among the candidates, so measuring them covers
+    // every vertex
+    box_extents(candidates, box);
+
+    // longest axis first, each pointing mostly positive, right handed
+    int order[3] = { 0, 1, 2 };
+    std::sort(order, order + 3, [box](int a, int b) {
+        return box->max[a]-box->min[a] > box->max[b]-box->min[b];
+    });
+    obb_t sorted = *box;
+    for (int a = 0; a < 3; a++) {
+        int from = order[a];
+        double *axis = sorted.axis[a];
+        memcpy(axis, box->axis[from], sizeof(sorted.axis[a]));
+        sorted.min[a] = box->min[from];
+        sorted.max[a] = box->max[from];
+        int largest = 0;
+        for (int k = 1; k < 3; k++) {
+            if (fabs(axis[k]) > fabs(axis[largest])) {
+                largest = k;
+            }
+        }
+        if (a < 2 && axis[largest] < 0) {
+            for (int k = 0; k < 3; k++) {
+                axis[k] = -axis[k];
+            }
+            double lo = sorted.min[a];
+            sorted.min[a] = -sorted.max[a];
+            sorted.max[a] = -lo;
+        }
+    }
+    double third[3];
+    cross3(sorted.axis[0], sorted.axis[1], third);
+    if (dot3(third, sorted.axis[2]) < 0) {
+        for (int k = 0; k < 3; k++) {
+            sorted.axis[2][k] = -sorted.axis[2][k];
+        }
+        double lo = sorted.min[2];
+        sorted.min[2] = -sorted.max[2];
+        sorted.max[2] = -lo;
+    }
+    *box = sorted;
+}
+
+int main(int argc, char** argv) {
+    if(argc >= 2) {
+        if(strcmp(argv[1], "--help") == 0) {
+            print_usage();
+            exit(2);
+        }
+    }
+    int c;
+    int errflg = 0;
+    int transform_only = 0;
+
+    while((c = getopt(argc, argv, "t")) != -1) {
+        switch(c) {
+            case 't':
+                transform_only = 1;
+                break;
+            case '?':
+                fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+                errflg++;
+                break;
+        }
+    }
+
+    if(errflg || argc - optind > 1) {
+        print_usage();
+        exit(2);
+    }
+
+    const char *file = optind < argc ? argv[optind] : "-";
+    FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if(!f) {
+        fprintf(stderr, "Can't read file: %s\n", file);
+        exit(2);
+    }
+
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
+    }
+    if(view.facet_count == 0) {
+        fprintf(stderr, "%s has no facets.\n", file);
+        exit(2);
+    }
+
+    obb_t box;
+    find_obb(&view, &box);
+
+    stl_view_close(&view);
+    if(f != stdin) {
+        fclose(f);
+    }
+
+    double center[3] = { 0, 0, 0 };
+    double size[3];
+    for(int a = 0; a < 3; a++) {
+        double mid = .5*(box.min[a]+box.max[a]);
+        for(int k = 0; k < 3; k++) {
+            center[k] += mid*box.axis[a][k];
+        }
+        size[a] = box.max[a]-box.min[a];
+    }
+
+    // stl_transform applies its arguments in order to row vectors, so
+    // -rz c -ry b -rx a rotates by Rx(a)Ry(b)Rz(c), whose rows are the axes
+    double (*R)[3] = box.axis;
+    double rx, ry, rz;
+    ry = asin(std::max(-1.0, std::min(1.0, R[0][2])));
+    if(fabs(R[0][2]) < 1 - 1e-12) {
+        rx = atan2(-R[1][2], R[2][2]);
+        rz = atan2(-R[0][1], R[0][0]);
+    } else {
+        rx = atan2(R[2][1], R[1][1]);
+        rz = 0;
+    }
+    rx *= 180/M_PI;
+    ry *= 180/M_PI;
+    rz *= 180/M_PI;
+
+    char transform[512];
+    snprintf(transform, sizeof(transform), "-tx %.9g -ty %.9g -tz %.9g -rz %.9g -ry %.9g -rx %.9g",
+             -center[0] + 0.0, -center[1] + 0.0, -center[2] + 0.0, rz + 0.0, ry + 0.0, rx + 0.0);
+
+    if(transform_only) {
+        printf("%s\n", transform);
+        return 0;
+    }
+
+    printf("Center: (%f, %f, %f)\n", center[0] + 0.0, center[1] + 0.0, center[2] + 0.0);
+    for(int a = 0; a < 3; a++) {
+        printf("Axis %d: (%f, %f, %f)\n", a+1, R[a][0] + 0.0, R[a][1] + 0.0, R[a][2] + 0.0);
+    }
+    printf("Dimensions: (%f, %f, %f)\n", size[0], size[1], size[2]);
+    printf("Volume: %f\n", size[0]*size[1]*size[2]);
+    printf("Transform: %s\n", transform);
+
+    return 0;
+}
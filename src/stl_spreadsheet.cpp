@@ -24,13 +24,109 @@ Copyright 2017 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <libgen.h>
 #include <string.h>
 #include <math.h>
+#include <string>
 #include "stl_util.h"
-#include <iostream>
+
+// Facets formatted by each thread before the rows are written in order.
+#define SPREADSHEET_CHUNK_SIZE 16384
+// Upper bound on the text of one row.
+#define SPREADSHEET_ROW_CHARS (12*(STL_FLOAT_CHARS + 1))
+#define SPREADSHEET_COLUMNS 12
+
+const char *column_names[SPREADSHEET_COLUMNS] = {
+    "normal.x", "normal.y", "normal.z",
+    "point1.x", "point1.y", "point1.z",
+    "point2.x", "point2.y", "point2.z",
+    "point3.x", "point3.y", "point3.z"
+};
 
 void print_usage() {
     fprintf(stderr, "stl_spreadsheet outputs an STL file in a tab delimited text format.\n\n");
-    fprintf(stderr, "usage: stl_spreadsheet <input file>\n");
+    fprintf(stderr, "usage: stl_spreadsheet [ -c ] [ -o <directory> ] <input file>\n");
     fprintf(stderr, "    Prints vertex and normal information for every triangle in STL file in a tab delimited format that can be opened as a spreadsheet.\n");
+    fprintf(stderr, "     -c - comma separated instead of tab delimited.\n");
+    fprintf(stderr, "     -o <directory> - instead of text, write each column as raw little endian\n"
+                    "                      float32 values to <directory>/<column>.f32, e.g.\n"
+                    "                      normal.x.f32 or point3.z.f32, ready to be memory mapped.\n");
+}
+
+// Formats the rows of facets [begin, end) into out, returns the length.
+size_t format_rows(const stl_view_t *view, size_t begin, size_t end, char separator, char *out) {
+    char *p = out;
+    for (size_t i = begin; i < end; i++) {
+        float values[SPREADSHEET_COLUMNS];
+        memcpy(values, stl_view_record(view, i), sizeof(values));
+        for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+            p += format_float_general(values[c], p);
+            *p++ = c + 1 < SPREADSHEET_COLUMNS ? separator : '\n';
+        }
+    }
+    return p - out;
+}
+
+int write_text(const stl_view_t *view, char separator, int threads) {
+    for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+        fputs(column_names[c], stdout);
+        fputc(c + 1 < SPREADSHEET_COLUMNS ? separator : '\n', stdout);
+    }
+
+    std::vector<std::vector<char> > texts(threads, std::vector<char>(SPREADSHEET_CHUNK_SIZE*SPREADSHEET_ROW_CHARS));
+    std::vector<size_t> lengths(threads);
+    size_t round = (size_t)threads*SPREADSHEET_CHUNK_SIZE;
+    for (size_t first = 0; first < view->facet_count; first += round) {
+        size_t n = std::min(round, view->facet_count - first);
+        std::fill(lengths.begin(), lengths.end(), 0);
+        parallel_slices(n, threads, SPREADSHEET_CHUNK_SIZE/4, [&](size_t begin, size_t end, int t) {
+            lengths[t] = format_rows(view, first + begin, first + end, separator, texts[t].data());
+        });
+        for (int t = 0; t < threads; t++) {
+            if (fwrite(texts[t].data(), 1, lengths[t], stdout) != lengths[t]) {
+                return 0;
+            }
+        }
+    }
+    return fflush(stdout) == 0;
+}
+
+int write_columns(const stl_view_t *view, const char *directory, int threads) {
+    FILE *columns[SPREADSHEET_COLUMNS];
+    for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+        std::string path = std::string(directory) + "/" + column_names[c] + ".f32";
+        columns[c] = fopen(path.c_str(), "wb");
+        if (!columns[c]) {
+            fprintf(stderr, "Can't write file: %s\n", path.c_str());
+            exit(2);
+        }
+    }
+
+    // STL data is little endian like the hosts we build for, so the floats
+    // are copied as they are
+    size_t round = (size_t)threads*SPREADSHEET_CHUNK_SIZE;
+    std::vector<float> values(SPREADSHEET_COLUMNS*round);
+    int ok = 1;
+    for (size_t first = 0; first < view->facet_count && ok; first += round) {
+        size_t n = std::min(round, view->facet_count - first);
+        parallel_slices(n, threads, SPREADSHEET_CHUNK_SIZE/4, [&](size_t begin, size_t end, int /*thread*/) {
+            for (size_t i = begin; i < end; i++) {
+                float record[SPREADSHEET_COLUMNS];
+                memcpy(record, stl_view_record(view, first + i), sizeof(record));
+                for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+                    values[c*round + i] = record[c];
+                }
+            }
+        });
+        for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+            if (fwrite(&values[c*round], sizeof(float), n, columns[c]) != n) {
+                ok = 0;
+            }
+        }
+    }
+    for (int c = 0; c < SPREADSHEET_COLUMNS; c++) {
+        if (fclose(columns[c]) != 0) {
+            ok = 0;
+        }
+    }
+    return ok;
 }
 
 int main(int argc, char** argv) {
@@ -40,18 +136,33 @@ int main(int argc, char** argv) {
             exit(2);
         }
     }
-    if(argc != 2) {
-        print_usage();
-        exit(2);
+    int c;
+    int errflg = 0;
+    char separator = '\t';
+    char *directory = NULL;
+
+    while((c = getopt(argc, argv, "co:")) != -1) {
+        switch(c) {
+            case 'c':
+                separator = ',';
+                break;
+            case 'o':
+                directory = optarg;
+                break;
+            case '?':
+                fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+                errflg++;
+                break;
+        }
     }
 
-    char *file = argv[1];
-
-    if(!is_valid_binary_stl(file)) {
-        fprintf(stderr, "%s is not a binary stl file.\n", file);
+    if(errflg || argc - optind != 1) {
+        print_usage();
         exit(2);
     }
 
+    char *file = argv[optind];
+
     FILE *f;
 
     f = fopen(file, "rb");
@@ -60,30 +171,31 @@ int main(int argc, char** argv) {
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
-
-    uint32_t num_tris;
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    vec normal;
-    vec point;
-
-    std::cout << "normal.x\tnormal.y\tnormal.z\tpoint1.x\tpoint1.y\tpoint1.z\tpoint2.x\tpoint2.y\tpoint2.z\tpoint3.x\tpoint3.y\tpoint3.z" << std::endl;
-
-    for(int i = 0; i < num_tris; i++) {
-      readBytes = fread(&normal, 1, 12,f);
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
+    }
 
-      std::cout << normal.x << "\t" << normal.y << "\t" << normal.z;
+    int threads = std::thread::hardware_concurrency();
+    if(threads < 1) {
+        threads = 1;
+    }
 
-      for(int j = 0; j < 3; j++) {
-        readBytes = fread(&point, 1, 12,f);
-        std::cout << "\t" << point.x << "\t" << point.y << "\t" << point.z;
-      }
-      std::cout << std::endl;
-      fseek(f, 2, SEEK_CUR);
+    int ok;
+    if(directory) {
+        ok = write_columns(&view, directory, threads);
+    } else {
+        ok = write_text(&view, separator, threads);
     }
 
+    stl_view_close(&view);
     fclose(f);
 
+    if(!ok) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(2);
+    }
+
     return 0;
 }
@@ -26,16 +26,10 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include <math.h>
 #include "stl_util.h"
 
-// TODO make output file optional, if not specified output
-// to stdout. Requires calculating how many tris are necessary
-// before outputting any. Currently, we write all our tris, then
-// fseek back to byte 80 to set the number of tris in the file. That
-// won't work with stdout.
-
 void print_usage() {
     fprintf(stderr, "stl_threads outputs an STL file with male or female threads per the ISO metric screw thread standard.\n\n");
     fprintf(stderr, "usage: stl_threads [ -f ] [ -D <diameter> ] [ -P <pitch> ] [ -a <angle> ]\n"
-                    "                   [ -h <height> ] [ -s <segments> ] <output file>\n");
+                    "                   [ -h <height> ] [ -s <segments> ] [ <output file> ]\n");
     fprintf(stderr, "    Outputs an stl file with male or female screw threads per the ISO metric \n"
                     "    screw thread standard (http://en.wikipedia.org/wiki/ISO_metric_screw_thread).\n"
                     "\n"
@@ -54,7 +48,9 @@ void print_usage() {
                     "                    of segments to approximate a circle. Defaults to 72 (every\n"
                     "                    5 degrees).\n"
                     "    -o <outer female diameter> - When generating female threads, this is the\n"
-                    "                                 outer diameter. Must be greater than <diameter>.\n");
+                    "                                 outer diameter. Must be greater than <diameter>.\n"
+                    "\n"
+                    "    If no output file is provided, data is sent to stdout.\n");
 }
 
 void print_normal(vec *p1, vec *p2, vec *p3, int rev) {
@@ -386,21 +382,27 @@ int main(int argc, char** argv) {
         outerDiameter = D+1;
     }
 
-    if(errflg || optind >= argc) {
+    if(errflg || optind < argc-1) {
         print_usage();
         exit(2);
     }
 
-    char *file = argv[optind];
-
-    FILE *outf;
+    FILE *file_outf = stdout;
 
-    outf = fopen(file, "wb");
-    if(!outf) {
-        fprintf(stderr, "Can't write to file: %s\n", file);
-        exit(2);
+    if(optind == argc-1) {
+        char *file = argv[optind];
+        file_outf = fopen(file, "wb");
+        if(!file_outf) {
+            fprintf(stderr, "Can't write to file: %s\n", file);
+            exit(2);
+        }
     }
 
+    // The number of tris depends on how the threads get sliced, so it's
+    // only known once they've all been written. stdout gets them spooled.
+    stl_spool_t spool;
+    FILE *outf = stl_spool_open(&spool, file_outf);
+
     char header[81] = {0};
     // TODO add some settings summary to header string
     snprintf(header, 81, "Created with stl_threads.");
@@ -1032,10 +1034,14 @@ int main(int argc, char** argv) {
         }
     }
 
-    fseek(outf, 80, SEEK_SET);
-    fwrite(&num_tris, 4, 1, outf);
+    if(!stl_spool_close(&spool, num_tris)) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(2);
+    }
 
-    fclose(outf);
+    if(file_outf != stdout) {
+        fclose(file_outf);
+    }
 
     return 0;
 }
@@ -27,17 +27,12 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include "stl_util.h"
 
 #define BUFFER_SIZE 4096
-
-// TODO make input and output file optional, if not specified read from
-// stdin and write to stdout. Add to other stl_cmds as well. This will
-// allow for piping between stl_cmds which could elimate some temporary files:
-// stl_cube -w 1 | stl_transform -tx 10 > cube.stl
-// stl_cube -w 2 | stl_transform -tx 20 > cube2.stl
-// stl_merge *.stl |  transform -s 10 > all_cubes_scaled.stl
+// Facets transformed by each thread before they're written in order.
+#define TRANSFORM_CHUNK_SIZE 16384
 
 void print_usage() {
     fprintf(stderr, "stl_transform performs any number of transformations to an STL file.\n\n");
-    fprintf(stderr, "usage: stl_transform [[ <transformation> ] ...] <input file> <output file>\n");
+    fprintf(stderr, "usage: stl_transform [[ <transformation> ] ...] [ -i ] [ <input file> [ <output file> ] ]\n");
     fprintf(stderr, "    Performs any number of the following transformations in\n");
     fprintf(stderr, "    the order they are listed on the command line:\n");
     fprintf(stderr, "        -rx <angle> - rotates <angle> degrees about the x-axis\n");
@@ -50,6 +45,26 @@ void print_usage() {
     fprintf(stderr, "        -tx <x> - translates <x> units in x\n");
     fprintf(stderr, "        -ty <y> - translates <y> units in y\n");
     fprintf(stderr, "        -tz <z> - translates <z> units in z\n");
+    fprintf(stderr, "    If no input file is provided, data is read from stdin. If no output file is provided, data is sent to stdout.\n");
+    fprintf(stderr, "    With -i the input file is transformed in place instead, keeping its header.\n");
+}
+
+// Transforms the records of a binary STL file where they are, through a
+// shared mapping.
+void transform_in_place(const char *file, const stl_transform_t *transform, int threads) {
+    size_t length;
+    uint32_t num_tris;
+    unsigned char *data = stl_map_in_place(file, &length, &num_tris);
+    if(!data) {
+        fprintf(stderr, "%s is not a binary stl file that can be written.\n", file);
+        exit(2);
+    }
+    unsigned char *records = data + STL_HEADER_SIZE;
+    stl_transform_records_parallel(transform, records, records, num_tris, threads);
+    if(munmap(data, length) != 0) {
+        fprintf(stderr, "Error writing file: %s\n", file);
+        exit(2);
+    }
 }
 
 int main(int argc, char** argv) {
@@ -61,6 +76,7 @@ int main(int argc, char** argv) {
     }
     int errflg = 0;
     int did_scale = 0;
+    int in_place = 0;
 
     mat tmp;
     mat tmp2;
@@ -77,7 +93,10 @@ int main(int argc, char** argv) {
     for(index = 1; index < argc; index++) {
         if(strcmp("-rx", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_rx_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -88,7 +107,10 @@ int main(int argc, char** argv) {
            mat_mult(&tmp, &tmp2, &inv_combined);
         } else if(strcmp("-ry", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_ry_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -99,7 +121,10 @@ int main(int argc, char** argv) {
            mat_mult(&tmp, &tmp2, &inv_combined);
         } else if(strcmp("-rz", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_rz_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -110,7 +135,10 @@ int main(int argc, char** argv) {
            mat_mult(&tmp, &tmp2, &inv_combined);
         } else if(strcmp("-s", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            did_scale = 1;
            arg = atof(argv[index]);
            if(arg == 0) {
@@ -126,7 +154,10 @@ int main(int argc, char** argv) {
            }
         } else if(strcmp("-sx", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            did_scale = 1;
            arg = atof(argv[index]);
            if(arg == 0) {
@@ -142,7 +173,10 @@ int main(int argc, char** argv) {
            }
         } else if(strcmp("-sy", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            did_scale = 1;
            arg = atof(argv[index]);
            if(arg == 0) {
@@ -158,7 +192,10 @@ int main(int argc, char** argv) {
            }
         } else if(strcmp("-sz", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            did_scale = 1;
            arg = atof(argv[index]);
            if(arg == 0) {
@@ -174,7 +211,10 @@ int main(int argc, char** argv) {
            }
         } else if(strcmp("-tx", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_tx_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -185,7 +225,10 @@ int main(int argc, char** argv) {
            mat_mult(&tmp, &tmp2, &inv_combined);
         } else if(strcmp("-ty", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_ty_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -196,7 +239,10 @@ int main(int argc, char** argv) {
            mat_mult(&tmp, &tmp2, &inv_combined);
         } else if(strcmp("-tz", argv[index]) == 0) {
            index++;
-           if(index >= argc) break;
+           if(index >= argc) {
+               errflg++;
+               break;
+           }
            arg = atof(argv[index]);
            init_tz_mat(&tmp, arg);
            mat_copy(&combined, &tmp2);
@@ -205,84 +251,138 @@ int main(int argc, char** argv) {
            init_inv_tz_mat(&tmp, arg);
            mat_copy(&inv_combined, &tmp2);
            mat_mult(&tmp, &tmp2, &inv_combined);
+        } else if(strcmp("-i", argv[index]) == 0) {
+           in_place = 1;
         } else {
             break;
         }
     }
 
-    if(errflg || index+1 >= argc) {
+    if(errflg || (in_place && argc - index != 1)) {
         print_usage();
         exit(2);
     }
 
-    char *file = argv[index];
-    char *outfile = argv[index+1];
-
-    if(!is_valid_binary_stl(file)) {
-        fprintf(stderr, "%s is not a binary stl file.\n", file);
-        exit(2);
-    }
+    const char *file = index < argc ? argv[index] : "stdin";
+    const char *outfile = index+1 < argc ? argv[index+1] : "stdout";
 
     mat_transpose(&inv_combined, &inv_transpose);
 
-    FILE *f;
-    FILE *outf;
+    stl_transform_t transform;
+    stl_transform_init(&transform, &combined, &inv_transpose, did_scale);
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if(in_place) {
+        transform_in_place(file, &transform, threads);
+        return 0;
+    }
+
+    FILE *f = stdin;
+    FILE *outf = stdout;
 
-    f = fopen(file, "rb");
+    if(index < argc) {
+        f = fopen(file, "rb");
+    }
+    // compressed input comes back as a pipe and is streamed
+    f = stl_decompress_input(f, 1);
     if(!f) {
         fprintf(stderr, "Can't read file: %s\n", file);
         exit(2);
     }
 
-    outf = fopen(outfile, "wb");
-    if(!outf) {
-        fprintf(stderr, "Can't write to file: %s\n", outfile);
+    // files have to match the size in their header, pipes are checked
+    // for running short as they're read
+    stl_view_t view;
+    int mapped = is_seekable(f);
+    if(mapped && (!is_valid_binary_stl(f) || !stl_view_open_uncompressed(&view, f))) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
+    if(index+1 < argc) {
+        outf = fopen(outfile, "wb");
+        if(!outf) {
+            fprintf(stderr, "Can't write to file: %s\n", outfile);
+            exit(2);
+        }
+    }
 
     uint32_t num_tris;
 
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    char header[81] = {0}; // include an extra char for terminating \0 of snprintf
-    snprintf(header, 81, "Transformed copy of %s", basename(file));
-
-    fwrite(header, 80, 1, outf);
-    fwrite(&num_tris, 4, 1, outf);
-
-    uint16_t abc = 0; // attribute byte count
+    if(mapped) {
+        num_tris = view.facet_count;
+    } else if(!read_header(f, NULL, 0, &num_tris, 0)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
+    }
 
-    vec tmp_vec;
-    vec normal;
-    vec point;
+    // the facet count is passed through, so the header can be written
+    // before any facets and nothing needs to seek
+    unsigned char header[STL_HEADER_SIZE];
+    char name[81] = {0}; // include an extra char for terminating \0 of snprintf
+    char base[BUFFER_SIZE];
+    snprintf(base, sizeof(base), "%s", file);
+    snprintf(name, 81, "Transformed copy of %s", basename(base));
+    memcpy(header, name, 80);
+    memcpy(header + 80, &num_tris, 4);
+
+    // a mapped input going to a named file is transformed straight from
+    // one mapping into the other
+    size_t length = STL_HEADER_SIZE+STL_RECORD_SIZE*(size_t)num_tris;
+    unsigned char *out_data = mapped && outf != stdout ? stl_map_output(outf, length) : NULL;
+    if(out_data) {
+        memcpy(out_data, header, STL_HEADER_SIZE);
+        stl_transform_records_parallel(&transform, view.data + STL_HEADER_SIZE, out_data + STL_HEADER_SIZE, num_tris, threads);
+        if(munmap(out_data, length) != 0) {
+            fprintf(stderr, "Error writing file: %s\n", outfile);
+            exit(2);
+        }
+        stl_view_close(&view);
+        fclose(f);
+        fclose(outf);
+        return 0;
+    }
 
-    normal.w = 0;
-    point.w = 1;
+    fwrite(header, STL_HEADER_SIZE, 1, outf);
 
-    for(int i = 0; i < num_tris; i++) {
-        readBytes = fread(&normal, 1, 12,f);
+    size_t round = (size_t)threads*TRANSFORM_CHUNK_SIZE;
+    std::vector<unsigned char> in_records(mapped ? 0 : round*STL_RECORD_SIZE);
+    std::vector<unsigned char> out_records(std::min(round, (size_t)num_tris)*STL_RECORD_SIZE);
 
-        vec_mat_mult(&normal, &inv_transpose, &tmp_vec);
-        if(did_scale) {
-            vec_normalize(&tmp_vec, &normal);
-            fwrite(&normal, 1, 12, outf);
+    uint32_t remaining = num_tris;
+    while(remaining > 0) {
+        size_t batch = std::min((size_t)remaining, round);
+        const unsigned char *records;
+        if(mapped) {
+            records = view.data + STL_HEADER_SIZE + STL_RECORD_SIZE*(size_t)(num_tris - remaining);
         } else {
-            fwrite(&tmp_vec, 1, 12, outf);
+            batch = fread(in_records.data(), STL_RECORD_SIZE, batch, f);
+            records = in_records.data();
         }
-
-        for(int j = 0; j < 3; j++) {
-            readBytes = fread(&point, 1, 12,f);
-            vec_mat_mult(&point, &combined, &tmp_vec);
-            fwrite(&tmp_vec, 1, 12, outf);
+        if(batch == 0) {
+            break;
         }
-        readBytes = fread(&abc, 1, 2,f);
-        fwrite(&abc, 1, 2,outf);
+
+        stl_transform_records_parallel(&transform, records, out_records.data(), batch, threads);
+
+        fwrite(out_records.data(), STL_RECORD_SIZE, batch, outf);
+        remaining -= batch;
     }
 
-    fclose(f);
-    fclose(outf);
+    if(remaining > 0) {
+        fprintf(stderr, "%s ended after %u of %u facets.\n", file, num_tris - remaining, num_tris);
+        exit(2);
+    }
+
+    if(mapped) {
+        stl_view_close(&view);
+    }
+    if(!stl_input_close(f)) {
+        exit(2);
+    }
+    if(outf != stdout) {
+        fclose(outf);
+    }
 
     return 0;
 }
@@ -23,10 +23,31 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #define ___STL_UTIL_H___
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <math.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef STL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef STL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifndef M_PI
 #define M_PI 3.141592653589793
@@ -68,8 +89,484 @@ typedef struct {
 typedef struct {
     vec normal;
     vec vertices[3];
+    uint16_t abc; // attribute byte count
 } facet_t;
 
+#define STL_HEADER_SIZE 84
+#define STL_RECORD_SIZE 50
+
+// number of facets moved per fread/fwrite by read_facets and write_facets
+#define STL_BATCH_SIZE 4096
+
+inline void decode_facet(const unsigned char *record, facet_t *facet) {
+    memcpy(&(facet->normal), record, 12);
+    facet->normal.w = 1.0;
+    for (int i = 0; i < 3; i++) {
+        memcpy(&(facet->vertices[i]), record + 12 + 12*i, 12);
+        facet->vertices[i].w = 1.0;
+    }
+    memcpy(&(facet->abc), record + 48, 2);
+}
+
+inline void encode_facet(const facet_t *facet, unsigned char *record) {
+    memcpy(record, &(facet->normal), 12);
+    for (int i = 0; i < 3; i++) {
+        memcpy(record + 12 + 12*i, &(facet->vertices[i]), 12);
+    }
+    memcpy(record + 48, &(facet->abc), 2);
+}
+
+// Longest string format_stl_float produces, "%.9f" of -FLT_MAX.
+#define STL_FLOAT_CHARS 64
+
+// Upper bound on the text of one facet written by format_ascii_facet.
+#define STL_ASCII_FACET_CHARS (128 + 12*(STL_FLOAT_CHARS + 1))
+
+// Largest precision accepted in fixed precision mode. Up to here a float times
+// 10^precision is exact in a double, so rounding matches printf.
+#define STL_MAX_PRECISION 9
+
+// Fixed point approximations of 5^-q and 5^i used by float_to_decimal, see
+// Ulf Adams, "Ryu: Fast Float-to-String Conversion", PLDI 2018.
+#define STL_POW5_INV_BITCOUNT 59
+#define STL_POW5_BITCOUNT 61
+
+typedef struct {
+    uint64_t inv_split[31];
+    uint64_t split[47];
+} stl_pow5_table_t;
+
+// ceil(log2(5^e)) for e > 0, 1 for e == 0.
+inline int32_t stl_pow5_bits(int32_t e) {
+    return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// 2^(bits(i)-1+STL_POW5_INV_BITCOUNT) / 5^i + 1 and 5^i scaled to STL_POW5_BITCOUNT bits, as in Ryu.
+// Precomputed so no 128-bit arithmetic is needed.
+inline const stl_pow5_table_t* stl_pow5_table() {
+    static const stl_pow5_table_t table = {
+      {
+        UINT64_C(576460752303423489), UINT64_C(461168601842738791), UINT64_C(368934881474191033),
+        UINT64_C(295147905179352826), UINT64_C(472236648286964522), UINT64_C(377789318629571618),
+        UINT64_C(302231454903657294), UINT64_C(483570327845851670), UINT64_C(386856262276681336),
+        UINT64_C(309485009821345069), UINT64_C(495176015714152110), UINT64_C(396140812571321688),
+        UINT64_C(316912650057057351), UINT64_C(507060240091291761), UINT64_C(405648192073033409),
+        UINT64_C(324518553658426727), UINT64_C(519229685853482763), UINT64_C(415383748682786211),
+        UINT64_C(332306998946228969), UINT64_C(531691198313966350), UINT64_C(425352958651173080),
+        UINT64_C(340282366920938464), UINT64_C(544451787073501542), UINT64_C(435561429658801234),
+        UINT64_C(348449143727040987), UINT64_C(557518629963265579), UINT64_C(446014903970612463),
+        UINT64_C(356811923176489971), UINT64_C(570899077082383953), UINT64_C(456719261665907162),
+        UINT64_C(365375409332725730),
+      },
+      {
+        UINT64_C(1152921504606846976), UINT64_C(1441151880758558720), UINT64_C(1801439850948198400),
+        UINT64_C(2251799813685248000), UINT64_C(1407374883553280000), UINT64_C(1759218604441600000),
+        UINT64_C(2199023255552000000), UINT64_C(1374389534720000000), UINT64_C(1717986918400000000),
+        UINT64_C(2147483648000000000), UINT64_C(1342177280000000000), UINT64_C(1677721600000000000),
+        UINT64_C(2097152000000000000), UINT64_C(1310720000000000000), UINT64_C(1638400000000000000),
+        UINT64_C(2048000000000000000), UINT64_C(1280000000000000000), UINT64_C(1600000000000000000),
+        UINT64_C(2000000000000000000), UINT64_C(1250000000000000000), UINT64_C(1562500000000000000),
+        UINT64_C(1953125000000000000), UINT64_C(1220703125000000000), UINT64_C(1525878906250000000),
+        UINT64_C(1907348632812500000), UINT64_C(1192092895507812500), UINT64_C(1490116119384765625),
+        UINT64_C(1862645149230957031), UINT64_C(1164153218269348144), UINT64_C(1455191522836685180),
+        UINT64_C(1818989403545856475), UINT64_C(2273736754432320594), UINT64_C(1421085471520200371),
+        UINT64_C(1776356839400250464), UINT64_C(2220446049250313080), UINT64_C(1387778780781445675),
+        UINT64_C(1734723475976807094), UINT64_C(2168404344971008868), UINT64_C(1355252715606880542),
+        UINT64_C(1694065894508600678), UINT64_C(2117582368135750847), UINT64_C(1323488980084844279),
+        UINT64_C(1654361225106055349), UINT64_C(2067951531382569187), UINT64_C(1292469707114105741),
+        UINT64_C(1615587133892632177), UINT64_C(2019483917365790221),
+      }
+    };
+    return &table;
+}
+
+inline uint32_t stl_mul_shift(uint32_t m, uint64_t factor, int32_t shift) {
+    uint64_t bits0 = (uint64_t)m * (uint32_t)factor;
+    uint64_t bits1 = (uint64_t)m * (uint32_t)(factor >> 32);
+    return (uint32_t)(((bits0 >> 32) + bits1) >> (shift - 32));
+}
+
+inline int stl_multiple_of_pow5(uint32_t value, uint32_t p) {
+    uint32_t count = 0;
+    while (value % 5 == 0 && value != 0) {
+        value /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+// Finds the shortest digits * 10^exponent that rounds back to the positive,
+// finite float with the given IEEE fields, picking the closest one on ties.
+inline void float_to_decimal(uint32_t ieee_mantissa, uint32_t ieee_exponent, uint32_t *digits, int32_t *exponent) {
+    const stl_pow5_table_t *table = stl_pow5_table();
+    int32_t e2;
+    uint32_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - 127 - 23 - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t)ieee_exponent - 127 - 23 - 2;
+        m2 = (1u << 23) | ieee_mantissa;
+    }
+    int accept_bounds = (m2 & 1) == 0;
+
+    // the float and the halfway points to its neighbours, scaled by 4
+    uint32_t mv = 4*m2;
+    uint32_t mp = 4*m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint32_t mm = 4*m2 - 1 - mm_shift;
+
+    uint32_t vr, vp, vm;
+    int32_t e10;
+    int vm_trailing_zeros = 0;
+    int vr_trailing_zeros = 0;
+    uint32_t last_removed_digit = 0;
+    if (e2 >= 0) {
+        int32_t q = (int32_t)(((uint32_t)e2 * 78913) >> 18);
+        e10 = q;
+        int32_t k = STL_POW5_INV_BITCOUNT + stl_pow5_bits(q) - 1;
+        int32_t i = -e2 + q + k;
+        vr = stl_mul_shift(mv, table->inv_split[q], i);
+        vp = stl_mul_shift(mp, table->inv_split[q], i);
+        vm = stl_mul_shift(mm, table->inv_split[q], i);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            int32_t l = STL_POW5_INV_BITCOUNT + stl_pow5_bits(q - 1) - 1;
+            last_removed_digit = stl_mul_shift(mv, table->inv_split[q - 1], -e2 + q - 1 + l) % 10;
+        }
+        if (q <= 9) {
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = stl_multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = stl_multiple_of_pow5(mm, q);
+            } else {
+                vp -= stl_multiple_of_pow5(mp, q);
+            }
+        }
+    } else {
+        int32_t q = (int32_t)(((uint32_t)-e2 * 732923) >> 20);
+        e10 = q + e2;
+        int32_t i = -e2 - q;
+        int32_t k = stl_pow5_bits(i) - STL_POW5_BITCOUNT;
+        int32_t j = q - k;
+        vr = stl_mul_shift(mv, table->split[i], j);
+        vp = stl_mul_shift(mp, table->split[i], j);
+        vm = stl_mul_shift(mm, table->split[i], j);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            j = q - 1 - (stl_pow5_bits(i + 1) - STL_POW5_BITCOUNT);
+            last_removed_digit = stl_mul_shift(mv, table->split[i + 1], j) % 10;
+        }
+        if (q <= 1) {
+            vr_trailing_zeros = 1;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 31) {
+            vr_trailing_zeros = (mv & ((1u << (q - 1)) - 1)) == 0;
+        }
+    }
+
+    int32_t removed = 0;
+    uint32_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last_removed_digit == 5 && vr % 2 == 0) {
+            // exactly halfway, round to even
+            last_removed_digit = 4;
+        }
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed_digit >= 5);
+    } else {
+        while (vp / 10 > vm / 10) {
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || last_removed_digit >= 5);
+    }
+    *digits = output;
+    *exponent = e10 + removed;
+}
+
+inline const char* stl_digit_pairs() {
+    return "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+           "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+           "8081828384858687888990919293949596979899";
+}
+
+// Writes the shortest string strtof reads back as exactly v. Magnitudes
+// outside [1e-4, 1e9) use exponent notation. out needs STL_FLOAT_CHARS bytes.
+// Returns the length, the output isn't NUL terminated.
+inline int format_float_shortest(float v, char *out) {
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    uint32_t ieee_mantissa = bits & ((1u << 23) - 1);
+    uint32_t ieee_exponent = (bits >> 23) & 0xff;
+    char *p = out;
+    if (ieee_exponent == 0xff) {
+        if (ieee_mantissa) {
+            memcpy(p, "nan", 3);
+            return 3;
+        }
+        if (bits >> 31) {
+            *p++ = '-';
+        }
+        memcpy(p, "inf", 3);
+        return p - out + 3;
+    }
+    if (bits >> 31) {
+        *p++ = '-';
+    }
+    if (ieee_exponent == 0 && ieee_mantissa == 0) {
+        *p++ = '0';
+        return p - out;
+    }
+
+    uint32_t digits;
+    int32_t exponent;
+    float_to_decimal(ieee_mantissa, ieee_exponent, &digits, &exponent);
+    // digits end at buffer + 16, the fixed size copies below may move some
+    // padding past the end of the number which later writes overwrite
+    char buffer[32];
+    char *d = buffer + 16;
+    while (digits >= 100) {
+        d -= 2;
+        memcpy(d, stl_digit_pairs() + 2*(digits % 100), 2);
+        digits /= 100;
+    }
+    if (digits >= 10) {
+        d -= 2;
+        memcpy(d, stl_digit_pairs() + 2*digits, 2);
+    } else {
+        *--d = '0' + digits;
+    }
+    int length = buffer + 16 - d;
+    int point = length + exponent; // digits before the decimal point
+    if (point > -4 && point <= 9) {
+        if (point <= 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = 0; i < -point; i++) {
+                *p++ = '0';
+            }
+            memcpy(p, d, 16);
+            p += length;
+        } else if (point < length) {
+            memcpy(p, d, 16);
+            memcpy(p + point + 1, d + point, 16);
+            p[point] = '.';
+            p += length + 1;
+        } else {
+            memcpy(p, d, 16);
+            p += length;
+            for (int i = length; i < point; i++) {
+                *p++ = '0';
+            }
+        }
+    } else {
+        p[0] = d[0];
+        if (length > 1) {
+            p[1] = '.';
+            memcpy(p + 2, d + 1, 16);
+            p += length + 1;
+        } else {
+            p++;
+        }
+        int e = point - 1;
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        if (e < 0) {
+            e = -e;
+        }
+        memcpy(p, stl_digit_pairs() + 2*e, 2);
+        p += 2;
+    }
+    return p - out;
+}
+
+// Writes v the way "%.*f" does with 0 <= precision <= STL_MAX_PRECISION.
+inline int format_float_fixed(float v, int precision, char *out) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+    };
+    double scaled = fabs((double)v) * powers_of_ten[precision];
+    if (!(scaled < 1e18)) {
+        return snprintf(out, STL_FLOAT_CHARS, "%.*f", precision, v);
+    }
+    // scaled is exact, so rounding it half to even matches printf
+    uint64_t n = (uint64_t)nearbyint(scaled);
+    char buffer[24];
+    int length = 0;
+    do {
+        buffer[length++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (length <= precision) {
+        buffer[length++] = '0';
+    }
+    char *p = out;
+    if (signbit(v)) {
+        *p++ = '-';
+    }
+    for (int i = length - 1; i >= precision; i--) {
+        *p++ = buffer[i];
+    }
+    if (precision > 0) {
+        *p++ = '.';
+        for (int i = precision - 1; i >= 0; i--) {
+            *p++ = buffer[i];
+        }
+    }
+    return p - out;
+}
+
+// Writes v the way "%g" does, six significant digits with trailing zeros
+// removed. This is also how iostreams print a float by default.
+inline int format_float_general(float v, char *out) {
+    static const double powers_of_ten[] = {
+        1e-33, 1e-32, 1e-31, 1e-30, 1e-29, 1e-28, 1e-27, 1e-26, 1e-25, 1e-24,
+        1e-23, 1e-22, 1e-21, 1e-20, 1e-19, 1e-18, 1e-17, 1e-16, 1e-15, 1e-14,
+        1e-13, 1e-12, 1e-11, 1e-10, 1e-9, 1e-8, 1e-7, 1e-6, 1e-5, 1e-4,
+        1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+        1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16,
+        1e17, 1e18, 1e19, 1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26,
+        1e27, 1e28, 1e29, 1e30, 1e31, 1e32, 1e33, 1e34, 1e35, 1e36,
+        1e37, 1e38, 1e39, 1e40, 1e41, 1e42, 1e43, 1e44, 1e45, 1e46,
+        1e47, 1e48, 1e49, 1e50
+    };
+    double a = fabs((double)v);
+    if (!(a < INFINITY)) {
+        return snprintf(out, STL_FLOAT_CHARS, "%g", v);
+    }
+    char *p = out;
+    if (signbit(v)) {
+        *p++ = '-';
+    }
+    if (a == 0) {
+        *p++ = '0';
+        return p - out;
+    }
+
+    // the six digits are a scaled to [1e5, 1e6), the product is within a
+    // few ulps so rounding is only in doubt right next to a half
+    int e = (int)floor(log10(a));
+    double scaled = a * powers_of_ten[33 + 5 - e];
+    if (scaled < 1e5) {
+        e--;
+        scaled = a * powers_of_ten[33 + 5 - e];
+    } else if (scaled >= 1e6) {
+        e++;
+        scaled = a * powers_of_ten[33 + 5 - e];
+    }
+    double rounded = nearbyint(scaled);
+    if (fabs(fabs(scaled - rounded) - .5) < 1e-6) {
+        return snprintf(out, STL_FLOAT_CHARS, "%g", v);
+    }
+    uint32_t n = (uint32_t)rounded;
+    if (n == 1000000) {
+        n = 100000;
+        e++;
+    }
+    char digits[6];
+    for (int i = 5; i >= 0; i--) {
+        digits[i] = '0' + n % 10;
+        n /= 10;
+    }
+    int count = 6;
+    while (digits[count - 1] == '0') {
+        count--;
+    }
+
+    if (e >= -4 && e < 6) {
+        if (e < 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = 0; i < -e - 1; i++) {
+                *p++ = '0';
+            }
+            memcpy(p, digits, count);
+            p += count;
+        } else {
+            memcpy(p, digits, e + 1);
+            p += e + 1;
+            if (count > e + 1) {
+                *p++ = '.';
+                memcpy(p, digits + e + 1, count - e - 1);
+                p += count - e - 1;
+            }
+        }
+    } else {
+        *p++ = digits[0];
+        if (count > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, count - 1);
+            p += count - 1;
+        }
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        if (e < 0) {
+            e = -e;
+        }
+        memcpy(p, stl_digit_pairs() + 2*e, 2);
+        p += 2;
+    }
+    return p - out;
+}
+
+// precision < 0 selects the shortest round trip representation.
+inline int format_stl_float(float v, int precision, char *out) {
+    if (precision < 0) {
+        return format_float_shortest(v, out);
+    }
+    return format_float_fixed(v, precision, out);
+}
+
+inline char* format_stl_vector(char *p, const char *keyword, size_t keyword_length, const vec *v, int precision) {
+    memcpy(p, keyword, keyword_length);
+    p += keyword_length;
+    p += format_stl_float(v->x, precision, p);
+    *p++ = ' ';
+    p += format_stl_float(v->y, precision, p);
+    *p++ = ' ';
+    p += format_stl_float(v->z, precision, p);
+    *p++ = '\n';
+    return p;
+}
+
+// Formats one ASCII facet into out, which needs STL_ASCII_FACET_CHARS bytes.
+// Returns the length.
+inline size_t format_ascii_facet(const facet_t *facet, int precision, char *out) {
+    char *p = format_stl_vector(out, "facet normal ", 13, &facet->normal, precision);
+    memcpy(p, "  outer loop\n", 13);
+    p += 13;
+    for (int i = 0; i < 3; i++) {
+        p = format_stl_vector(p, "    vertex ", 11, &facet->vertices[i], precision);
+    }
+    memcpy(p, "  endloop\nendfacet\n", 19);
+    p += 19;
+    return p - out;
+}
+
 inline void write_header(FILE* f, const char* name, uint32_t facet_count, int is_ascii) {
     if (is_ascii) {
         if (name) {
@@ -78,21 +575,32 @@ inline void write_header(FILE* f, const char* name, uint32_t facet_count, int is
             fprintf(f, "solid \n");
         }
     } else {
-        char header[81];
-        memset(header, 0x00, 81);
+        // the header isn't NUL terminated, a name of 80 characters fills it
+        char header[80];
+        memset(header, 0x00, 80);
         if (name) {
-          strncpy(header, name, 80);
+          memcpy(header, name, std::min(strlen(name), sizeof(header)));
         }
         fwrite(header, 1, 80, f);
         fwrite(&facet_count, 1, 4, f);
     }
 }
 
+// Pipes and terminals can't be seeked, so binary output written to them must
+// have the right facet count in its header from the start.
+inline int is_seekable(FILE* f) {
+    return fseek(f, 0, SEEK_CUR) == 0;
+}
+
 inline void write_final(FILE* f, const char* name, uint32_t facet_count, int is_ascii) {
     if (is_ascii) {
         fprintf(f, "endsolid %s\n", name);
     } else {
         long offset = ftell(f);
+        if (offset < 0) {
+            // not seekable, the header already has to hold the count
+            return;
+        }
         fseek(f, 80, SEEK_SET);
         fwrite(&facet_count, 1, 4, f);
         fseek(f, offset, SEEK_SET);
@@ -101,20 +609,253 @@ inline void write_final(FILE* f, const char* name, uint32_t facet_count, int is_
 
 inline void write_facet(FILE* f, facet_t* facet, int is_ascii) {
     if (is_ascii) {
-        fprintf(f, "facet normal %f %f %f\n", facet->normal.x, facet->normal.y, facet->normal.z);
-        fprintf(f, "  outer loop\n");
-        for (int i = 0; i < 3; i++) {
-            fprintf(f, "    vertex %f %f %f\n", facet->vertices[i].x, facet->vertices[i].y, facet->vertices[i].z);
-        }
-        fprintf(f, "  endloop\n");
-        fprintf(f, "endfacet\n");
+        char text[STL_ASCII_FACET_CHARS];
+        fwrite(text, 1, format_ascii_facet(facet, -1, text), f);
     } else {
-        fwrite(&(facet->normal), 1, 12, f);
-        for (int i = 0; i < 3; i++) {
-            fwrite(&(facet->vertices[i]), 1, 12, f);
+        unsigned char record[STL_RECORD_SIZE];
+        encode_facet(facet, record);
+        fwrite(record, 1, STL_RECORD_SIZE, f);
+    }
+}
+
+// Writes n binary facets, batching them so each fwrite moves STL_BATCH_SIZE
+// records. Returns the number of facets written.
+inline size_t write_facets(FILE* f, const facet_t* facets, size_t n) {
+    unsigned char buffer[STL_RECORD_SIZE*STL_BATCH_SIZE];
+    size_t written = 0;
+    while (written < n) {
+        size_t batch = n - written;
+        if (batch > STL_BATCH_SIZE) {
+            batch = STL_BATCH_SIZE;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            encode_facet(facets + written + i, buffer + STL_RECORD_SIZE*i);
+        }
+        size_t w = fwrite(buffer, STL_RECORD_SIZE, batch, f);
+        written += w;
+        if (w < batch) {
+            break;
+        }
+    }
+    return written;
+}
+
+inline int is_stl_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline const char* skip_stl_space(const char *p, const char *end) {
+    while (p < end && is_stl_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Returns a pointer past keyword if [p, end) starts with it, NULL otherwise.
+inline const char* match_keyword(const char *p, const char *end, const char *keyword) {
+    while (*keyword) {
+        if (p >= end || *p != *keyword) {
+            return NULL;
+        }
+        p++;
+        keyword++;
+    }
+    return p;
+}
+
+// Like match_keyword, but the keyword must be a whole whitespace delimited token.
+inline const char* match_token(const char *p, const char *end, const char *token) {
+    p = match_keyword(p, end, token);
+    if (p && p < end && !is_stl_space(*p)) {
+        return NULL;
+    }
+    return p;
+}
+
+// Parses a decimal float the way strtof does in the "C" locale. Numbers with
+// up to 19 significant digits and a small exponent are converted exactly
+// (Clinger's fast path), the rare remaining cases go through strtof. Returns a
+// pointer past the number or NULL if there isn't one.
+inline const char* parse_float(const char *p, const char *end, float *out) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *start = p;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int exact = 1;
+    const char *digits_start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 19) {
+            mantissa = mantissa*10 + (*p - '0');
+            if (mantissa) {
+                digits++;
+            }
+        } else {
+            exponent++;
+            if (*p != '0') {
+                exact = 0;
+            }
+        }
+        p++;
+    }
+    int has_digits = p != digits_start;
+    if (p < end && *p == '.') {
+        p++;
+        const char *fraction_start = p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa*10 + (*p - '0');
+                exponent--;
+                if (mantissa) {
+                    digits++;
+                }
+            } else if (*p != '0') {
+                exact = 0;
+            }
+            p++;
+        }
+        has_digits = has_digits || p != fraction_start;
+    }
+    if (has_digits && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int exponent_negative = 0;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exponent_negative = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            while (q < end && *q >= '0' && *q <= '9') {
+                if (e < 100000) {
+                    e = e*10 + (*q - '0');
+                }
+                q++;
+            }
+            exponent += exponent_negative ? -e : e;
+            p = q;
+        }
+    }
+    if (has_digits && (p == end || is_stl_space(*p)) && exact &&
+            mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+        double d = (double)mantissa;
+        if (exponent < 0) {
+            d /= powers_of_ten[-exponent];
+        } else {
+            d *= powers_of_ten[exponent];
+        }
+        // Rounding to double and then to float is only wrong when the double
+        // lands exactly halfway between two floats.
+        uint64_t bits;
+        memcpy(&bits, &d, 8);
+        if (d == 0 || (d >= 1.1754943508222875e-38 && d <= 3.4028234663852886e+38 &&
+                       (bits & 0x1FFFFFFF) != 0x10000000)) {
+            *out = negative ? -(float)d : (float)d;
+            return p;
+        }
+    }
+
+    char token[64];
+    size_t length = 0;
+    for (p = start; p < end && !is_stl_space(*p) && length < sizeof(token) - 1; p++) {
+        token[length++] = *p;
+    }
+    token[length] = 0;
+    char *token_end;
+    float value = strtof(token, &token_end);
+    if (token_end == token) {
+        return NULL;
+    }
+    *out = value;
+    return start + (token_end - token);
+}
+
+// Parses one line of an ASCII facet. line_index is the position of the line
+// within the facet block:
+//   0: facet normal <x> <y> <z>
+//   1: outer loop
+//   2-4: vertex <x> <y> <z>
+//   5: endloop
+//   6: endfacet
+// Anything after the expected tokens on a line is ignored.
+inline int parse_facet_line(const char *p, const char *end, facet_t *facet, int line_index) {
+    p = skip_stl_space(p, end);
+    if (line_index == 0 || (line_index >= 2 && line_index <= 4)) {
+        vec *v;
+        if (line_index == 0) {
+            p = match_keyword(p, end, "facet");
+            if (p) {
+                p = match_keyword(skip_stl_space(p, end), end, "normal");
+            }
+            v = &(facet->normal);
+        } else {
+            p = match_keyword(p, end, "vertex");
+            v = &(facet->vertices[line_index - 2]);
+        }
+        if (!p ||
+            !(p = parse_float(skip_stl_space(p, end), end, &(v->x))) ||
+            !(p = parse_float(skip_stl_space(p, end), end, &(v->y))) ||
+            !(p = parse_float(skip_stl_space(p, end), end, &(v->z)))) {
+            return 0;
+        }
+        return 1;
+    } else if (line_index == 1) {
+        p = match_token(p, end, "outer");
+        return p && match_token(skip_stl_space(p, end), end, "loop") != NULL;
+    } else if (line_index == 5) {
+        return match_token(p, end, "endloop") != NULL;
+    } else if (line_index == 6) {
+        return match_token(p, end, "endfacet") != NULL;
+    }
+    return 0;
+}
+
+inline void copy_solid_name(const char *p, const char *end, char *name, size_t name_length) {
+    if (!name || name_length == 0) {
+        return;
+    }
+    size_t length = end - p;
+    if (length >= name_length) {
+        length = name_length - 1;
+    }
+    memcpy(name, p, length);
+    name[length] = 0;
+    for (int i = (int)length - 1; i >= 0; i--) {
+        if (isspace(name[i])) {
+            name[i] = 0;
+        } else {
+            break;
         }
-        uint16_t abc = 0;
-        fwrite(&abc, 1, 2, f);
+    }
+}
+
+// Name and facet count from the STL_HEADER_SIZE bytes of a binary header.
+inline void decode_header(const unsigned char *header, char* name, size_t name_length, uint32_t* facet_count) {
+    if (name) {
+        char text[81];
+        memcpy(text, header, 80);
+        text[80] = 0;
+        strncpy(name, text, name_length);
+        if (strlen(text) >= name_length) {
+            name[name_length - 1] = 0;
+        }
+        for (int i = strlen(name) - 1; i >= 0; i--) {
+            if (isspace(name[i])) {
+                name[i] = 0;
+            } else {
+                break;
+            }
+        }
+    }
+    if (facet_count) {
+        memcpy(facet_count, header + 80, 4);
     }
 }
 
@@ -123,46 +864,15 @@ inline int read_header(FILE* f, char* name, size_t name_length, uint32_t* facet_
         char buffer[4096];
         if (fgets(buffer, 4095, f)) {
             if (strncmp(buffer, "solid ", 6) == 0) {
-                if (name) {
-                    strncpy(name, buffer + 6, name_length);
-                    if (strlen(buffer + 6) >= name_length) {
-                        name[name_length - 1] = 0;
-                    }
-                    for (int i = strlen(name) - 1; i >= 0; i--) {
-                        if (isspace(name[i])) {
-                            name[i] = 0;
-                        } else {
-                            break;
-                        }
-                    }
-                }
+                copy_solid_name(buffer + 6, buffer + strlen(buffer), name, name_length);
                 return 1;
             }
         }
     } else {
-        char header[81];
-        memset(header, 0x00, 81);
-        if (fread(header, 1, 80, f) == 80) {
-            if (name) {
-                strncpy(name, header, name_length);
-                if (strlen(header) >= name_length) {
-                    name[name_length - 1] = 0;
-                }
-                for (int i = strlen(name) - 1; i >= 0; i--) {
-                    if (isspace(name[i])) {
-                        name[i] = 0;
-                    } else {
-                        break;
-                    }
-                }
-            }
-            uint32_t tmp = 0;
-            if (fread(&tmp, 1, 4, f) == 4) {
-                if (facet_count) {
-                    *facet_count = tmp;
-                } 
-                return 1;
-            }
+        unsigned char header[STL_HEADER_SIZE];
+        if (fread(header, 1, STL_HEADER_SIZE, f) == STL_HEADER_SIZE) {
+            decode_header(header, name, name_length, facet_count);
+            return 1;
         }
     }
     return 0;
@@ -182,300 +892,2332 @@ inline int read_final(FILE* f, int is_ascii) {
     return 0;
 }
 
-inline int read_facet(FILE* f, facet_t* facet, int is_ascii) {
-    if (!facet) {
-        return 0;
-    }
-    memset(facet, 0x00, sizeof(facet_t));
-    long offset = ftell(f);
-    if (offset < 0) {
-        return 0;
+// Reads up to n binary facets, batching them so each fread moves
+// STL_BATCH_SIZE records. Returns the number of facets read. ASCII facets
+// are read with stl_ascii_reader_t below.
+inline size_t read_facets(FILE* f, facet_t* facets, size_t n) {
+    unsigned char buffer[STL_RECORD_SIZE*STL_BATCH_SIZE];
+    size_t read = 0;
+    while (read < n) {
+        size_t batch = n - read;
+        if (batch > STL_BATCH_SIZE) {
+            batch = STL_BATCH_SIZE;
+        }
+        size_t r = fread(buffer, STL_RECORD_SIZE, batch, f);
+        for (size_t i = 0; i < r; i++) {
+            decode_facet(buffer + STL_RECORD_SIZE*i, facets + read + i);
+        }
+        read += r;
+        if (r < batch) {
+            break;
+        }
     }
-    if (is_ascii) {
-        char buffer[4096];
-        if (!fgets(buffer, 4095, f)) {
-            return 0;
+    return read;
+}
+
+// Binary output whose facet count is only known once the last facet has been
+// written. Seekable files are written in place and the count patched into
+// the header at the end. Pipes get the header and facets spooled to memory
+// and copied out by stl_spool_close, so nothing has to seek.
+typedef struct {
+    FILE *out;
+    FILE *f; // stream to write the header and facets to
+    char *buffer;
+    size_t length;
+} stl_spool_t;
+
+inline FILE* stl_spool_open(stl_spool_t *spool, FILE *out) {
+    memset(spool, 0x00, sizeof(stl_spool_t));
+    spool->out = out;
+    spool->f = out;
+    if (!is_seekable(out)) {
+        FILE *memory = open_memstream(&spool->buffer, &spool->length);
+        if (memory) {
+            spool->f = memory;
         }
-        if (strncmp(buffer, "endsolid", 8) == 0) {
-            //We have reached the end, so seek back
-            fseek(f, offset, SEEK_SET);
-            return 0;
+    }
+    return spool->f;
+}
+
+// Sets the facet count in the header and writes out anything spooled.
+// Returns 0 if writing failed.
+inline int stl_spool_close(stl_spool_t *spool, uint32_t facet_count) {
+    int ok = 1;
+    if (spool->f == spool->out) {
+        write_final(spool->out, NULL, facet_count, 0);
+    } else {
+        ok = fclose(spool->f) == 0;
+        if (ok && spool->length >= STL_HEADER_SIZE) {
+            memcpy(spool->buffer + 80, &facet_count, 4);
         }
-        if (sscanf(buffer, " facet normal %f %f %f", &(facet->normal.x), &(facet->normal.y), &(facet->normal.z)) != 3) {
-            return 0;
+        ok = ok && fwrite(spool->buffer, 1, spool->length, spool->out) == spool->length;
+        free(spool->buffer);
+    }
+    ok = fflush(spool->out) == 0 && ok;
+    memset(spool, 0x00, sizeof(stl_spool_t));
+    return ok;
+}
+
+#define STL_ASCII_BUFFER_SIZE (1 << 20)
+
+// Block buffered reader for ASCII STL files. Lines are parsed in place out of
+// a large buffer rather than copied out with fgets.
+typedef struct {
+    FILE *f;
+    char *buffer;
+    size_t capacity;
+    size_t start; // first unconsumed byte
+    size_t end;   // end of valid data
+    size_t next;  // start of the line after the one last returned
+    int eof;
+    int error;    // a facet stopped partway through
+    uint64_t bytes_read; // taken in so far, whether parsed or not
+} stl_ascii_reader_t;
+
+inline int stl_ascii_reader_open(stl_ascii_reader_t *reader, FILE *f) {
+    memset(reader, 0x00, sizeof(stl_ascii_reader_t));
+    reader->f = f;
+    reader->capacity = STL_ASCII_BUFFER_SIZE;
+    reader->buffer = (char*)malloc(reader->capacity);
+    return reader->buffer != NULL;
+}
+
+// Puts n bytes already taken off the stream, e.g. while sniffing its
+// format, in front of the rest. Call before reading anything.
+inline void stl_ascii_reader_prefill(stl_ascii_reader_t *reader, const void *data, size_t n) {
+    n = std::min(n, reader->capacity);
+    memcpy(reader->buffer, data, n);
+    reader->end = n;
+    reader->bytes_read = n;
+}
+
+inline void stl_ascii_reader_close(stl_ascii_reader_t *reader) {
+    free(reader->buffer);
+    memset(reader, 0x00, sizeof(stl_ascii_reader_t));
+}
+
+// Finds the next line without consuming it. The line excludes the '\n'.
+inline int stl_ascii_reader_line(stl_ascii_reader_t *reader, const char **line, const char **line_end) {
+    size_t scanned = reader->start;
+    for (;;) {
+        char *nl = (char*)memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+        if (nl) {
+            *line = reader->buffer + reader->start;
+            *line_end = nl;
+            reader->next = nl - reader->buffer + 1;
+            return 1;
         }
-        if (!fgets(buffer, 4095, f)) {
+        if (reader->eof) {
+            if (reader->start < reader->end) {
+                *line = reader->buffer + reader->start;
+                *line_end = reader->buffer + reader->end;
+                reader->next = reader->end;
+                return 1;
+            }
             return 0;
         }
-        char arg1[256], arg2[256];
-        if (sscanf(buffer, " %s %s", arg1, arg2) != 2 || strcmp(arg1, "outer") != 0 || strcmp(arg2, "loop") != 0) {
-            return 0;
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
         }
-        for (int i = 0; i < 3; i++) {
-            if (!fgets(buffer, 4095, f)) {
-                return 0;
-            }
-            if (sscanf(buffer, " vertex %f %f %f", &(facet->vertices[i].x), &(facet->vertices[i].y), &(facet->vertices[i].z)) != 3) {
+        if (reader->end == reader->capacity) {
+            char *buffer = (char*)realloc(reader->buffer, 2*reader->capacity);
+            if (!buffer) {
                 return 0;
             }
+            reader->buffer = buffer;
+            reader->capacity *= 2;
         }
-        if (!fgets(buffer, 4095, f)) {
-            return 0;
-        }
-        if (sscanf(buffer, " %s", arg1) != 1 || strcmp(arg1, "endloop") != 0) {
-            return 0;
-        }
-        if (!fgets(buffer, 4095, f)) {
-            return 0;
+        scanned = reader->end;
+        size_t r = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end, reader->f);
+        if (r == 0) {
+            reader->eof = 1;
         }
-        if (sscanf(buffer, " %s", arg1) != 1 || strcmp(arg1, "endfacet") != 0) {
+        reader->end += r;
+        reader->bytes_read += r;
+    }
+}
+
+inline void stl_ascii_reader_consume(stl_ascii_reader_t *reader) {
+    reader->start = reader->next;
+}
+
+inline int stl_ascii_read_header(stl_ascii_reader_t *reader, char *name, size_t name_length) {
+    const char *line, *end;
+    if (!stl_ascii_reader_line(reader, &line, &end)) {
+        return 0;
+    }
+    if (end - line < 6 || strncmp(line, "solid ", 6) != 0) {
+        return 0;
+    }
+    copy_solid_name(line + 6, end, name, name_length);
+    stl_ascii_reader_consume(reader);
+    return 1;
+}
+
+// Returns 0 without consuming anything when the endsolid line is reached.
+inline int stl_ascii_read_facet(stl_ascii_reader_t *reader, facet_t *facet) {
+    const char *line, *end;
+    memset(facet, 0x00, sizeof(facet_t));
+    for (int i = 0; i < 7; i++) {
+        if (!stl_ascii_reader_line(reader, &line, &end)) {
+            reader->error = i > 0;
             return 0;
         }
-    } else {
-        if (fread(&(facet->normal), 1, 12, f) != 12) {
+        if (i == 0 && end - line >= 8 && strncmp(line, "endsolid", 8) == 0) {
             return 0;
         }
-        facet->normal.w = 1.0;
-        for (int i = 0; i < 3; i++) {
-            if (fread(&(facet->vertices[i]), 1, 12, f) != 12) {
-                return 0;
-            }
-            facet->vertices[i].w = 1.0;
-        }
-        uint16_t abc = 0;
-        if (fread(&abc, 1, 2, f) != 2) {
+        if (!parse_facet_line(line, end, facet, i)) {
+            reader->error = i > 0;
             return 0;
         }
+        stl_ascii_reader_consume(reader);
     }
     return 1;
 }
 
-inline int is_valid_ascii_stl(FILE* f) {
-    if (!f) {
-      return 0;
-    }
-    long offset = ftell(f);
-    if (offset < 0) {
+// Returns 1 if the facets ended cleanly with an endsolid line.
+inline int stl_ascii_read_final(stl_ascii_reader_t *reader) {
+    const char *line, *end;
+    if (reader->error) {
         return 0;
     }
-    int is_valid = 0;
-    if (read_header(f, NULL, 0, NULL, 1)) {
-        facet_t facet;
-        while (read_facet(f, &facet, 1)) {
-            // Do nothing
-        }
-        if (read_final(f, 1)) {
-            is_valid = 1;
-        }
+    if (stl_ascii_reader_line(reader, &line, &end) && end - line >= 8 && strncmp(line, "endsolid", 8) == 0) {
+        stl_ascii_reader_consume(reader);
+        return 1;
     }
-    fseek(f, offset, SEEK_SET);
-    return is_valid;
+    return 0;
 }
 
-inline int is_valid_ascii_stl(char* filename) {
+// Block buffered writer for ASCII STL files. Floats are written with the
+// shortest round trip representation when precision < 0, otherwise with
+// precision digits after the decimal point like "%.*f".
+typedef struct {
     FILE *f;
-    f = fopen(filename, "r");
-    int is_valid = is_valid_ascii_stl(f);
-    if (f) {
-      fclose(f);
+    char *buffer;
+    size_t capacity;
+    size_t length;
+    int precision;
+    int error;
+} stl_ascii_writer_t;
+
+inline int stl_ascii_writer_open(stl_ascii_writer_t *writer, FILE *f, int precision) {
+    memset(writer, 0x00, sizeof(stl_ascii_writer_t));
+    writer->f = f;
+    writer->precision = precision;
+    writer->capacity = STL_ASCII_BUFFER_SIZE;
+    writer->buffer = (char*)malloc(writer->capacity);
+    return writer->buffer != NULL;
+}
+
+inline int stl_ascii_writer_flush(stl_ascii_writer_t *writer) {
+    if (writer->length > 0 && fwrite(writer->buffer, 1, writer->length, writer->f) != writer->length) {
+        writer->error = 1;
     }
-    return is_valid;
+    writer->length = 0;
+    return !writer->error;
 }
 
-inline int is_valid_binary_stl(FILE* f) {
-    if (!f) {
-      return 0;
+// Flushes and frees the buffer. Returns 0 if any write failed.
+inline int stl_ascii_writer_close(stl_ascii_writer_t *writer) {
+    int ok = stl_ascii_writer_flush(writer) && fflush(writer->f) == 0;
+    free(writer->buffer);
+    memset(writer, 0x00, sizeof(stl_ascii_writer_t));
+    return ok;
+}
+
+inline void stl_ascii_write_bytes(stl_ascii_writer_t *writer, const char *data, size_t n) {
+    if (writer->length + n > writer->capacity) {
+        stl_ascii_writer_flush(writer);
+        if (n > writer->capacity) {
+            if (fwrite(data, 1, n, writer->f) != n) {
+                writer->error = 1;
+            }
+            return;
+        }
     }
-    long offset = ftell(f);
-    if (offset < 0) {
-        return 0;
+    memcpy(writer->buffer + writer->length, data, n);
+    writer->length += n;
+}
+
+inline void stl_ascii_write_header(stl_ascii_writer_t *writer, const char *name) {
+    stl_ascii_write_bytes(writer, "solid ", 6);
+    if (name) {
+        stl_ascii_write_bytes(writer, name, strlen(name));
     }
-    int is_valid = 0;
-    struct stat st;
-    fstat(fileno(f), &st);
+    stl_ascii_write_bytes(writer, "\n", 1);
+}
 
-    off_t size = st.st_size;
-    if (size >= 84) {
-        fseek(f, 80, SEEK_SET);
+inline void stl_ascii_write_facet(stl_ascii_writer_t *writer, const facet_t *facet) {
+    if (writer->length + STL_ASCII_FACET_CHARS > writer->capacity) {
+        stl_ascii_writer_flush(writer);
+    }
+    writer->length += format_ascii_facet(facet, writer->precision, writer->buffer + writer->length);
+}
 
-        uint32_t num_tris;
-        size_t readBytes = fread(&num_tris, 4, 1, f);
-        uint64_t calced_size = 84+(4*12+2)*(uint64_t)num_tris;
-        if (size == calced_size) {
-            is_valid = 1;
+// Writes n facets, formatting them on up to threads worker threads. Each
+// thread formats a contiguous slice into its own buffer and the slices are
+// written in order, so the output matches calling stl_ascii_write_facet.
+inline void stl_ascii_write_facets(stl_ascii_writer_t *writer, const facet_t *facets, size_t n, int threads) {
+    if (threads > 1 && n / threads < STL_BATCH_SIZE / 4) {
+        threads = n / (STL_BATCH_SIZE / 4);
+    }
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            stl_ascii_write_facet(writer, facets + i);
+        }
+        return;
+    }
+    size_t slice = (n + threads - 1) / threads;
+    std::vector<char*> texts(threads);
+    std::vector<size_t> lengths(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        texts[t] = (char*)malloc(slice*STL_ASCII_FACET_CHARS);
+        if (!texts[t]) {
+            continue;
+        }
+        size_t first = slice*t;
+        size_t last = first + slice < n ? first + slice : n;
+        workers.push_back(std::thread([&, t, first, last]() {
+            char *p = texts[t];
+            for (size_t i = first; i < last; i++) {
+                p += format_ascii_facet(facets + i, writer->precision, p);
+            }
+            lengths[t] = p - texts[t];
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    for (int t = 0; t < threads; t++) {
+        if (texts[t]) {
+            stl_ascii_write_bytes(writer, texts[t], lengths[t]);
         } else {
-          //fprintf(stderr, "    actual size: %10lld\n", size);
-          //fprintf(stderr, "  num triangles: %10d\n", num_tris);
-          //fprintf(stderr, "calculated size: %10lld\n", calced_size);
+            // out of memory, format this slice serially
+            size_t first = slice*t;
+            size_t last = first + slice < n ? first + slice : n;
+            for (size_t i = first; i < last; i++) {
+                stl_ascii_write_facet(writer, facets + i);
+            }
         }
+        free(texts[t]);
     }
-    fseek(f, offset, SEEK_SET);
-    return is_valid;
 }
 
-inline int is_valid_binary_stl(char* filename) {
-    FILE *f;
-    f = fopen(filename, "rb");
-    int is_valid = is_valid_binary_stl(f);
-    if (f) {
-      fclose(f);
+inline void stl_ascii_write_final(stl_ascii_writer_t *writer, const char *name) {
+    stl_ascii_write_bytes(writer, "endsolid ", 9);
+    if (name) {
+        stl_ascii_write_bytes(writer, name, strlen(name));
     }
-    return is_valid;
+    stl_ascii_write_bytes(writer, "\n", 1);
 }
 
-inline void mat_print(mat *m) {
-    printf("%f %f %f %f\n", m->xx, m->xy, m->xz, m->xw);
-    printf("%f %f %f %f\n", m->yx, m->yy, m->yz, m->yw);
-    printf("%f %f %f %f\n", m->zx, m->zy, m->zz, m->zw);
-    printf("%f %f %f %f\n", m->tx, m->ty, m->tz, m->tw);
+// Runs fn(begin, end, thread) over about equal slices of [0, n) on up to
+// threads threads, each slice at least min_slice long, and waits for all
+// of them.
+template <typename F>
+inline void parallel_slices(size_t n, int threads, size_t min_slice, F fn) {
+    if (threads > 1 && n/threads < min_slice) {
+        threads = (int)(n/min_slice);
+    }
+    if (threads <= 1) {
+        fn((size_t)0, n, 0);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        size_t begin = n*t/threads;
+        size_t end = n*(t+1)/threads;
+        workers.push_back(std::thread(fn, begin, end, t));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
 }
 
-inline void init_identity_mat(mat *m) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
-
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+#define STL_COMPRESSION_NONE 0
+#define STL_COMPRESSION_GZIP 1
+#define STL_COMPRESSION_ZSTD 2
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+// Compressed output is cut into independent gzip members or zstd frames of
+// this much input, so they can be compressed and decompressed in parallel.
+#define STL_COMPRESSION_BLOCK_SIZE (1 << 20)
+#define STL_ZSTD_SKIPPABLE_MAGIC 0x184D2A50u
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+inline int stl_compression_from_magic(const unsigned char *p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return STL_COMPRESSION_GZIP;
+    }
+    if (n >= 4 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd && p[0] == 0x28) {
+        return STL_COMPRESSION_ZSTD;
+    }
+    if (n >= 4 && p[1] == 0x2a && p[2] == 0x4d && p[3] == 0x18 && (p[0] & 0xf0) == 0x50) {
+        // skippable frame, as written before each frame by pzstd and stl_cmd
+        return STL_COMPRESSION_ZSTD;
+    }
+    return STL_COMPRESSION_NONE;
 }
 
-inline void init_s_mat(mat *m, float s) {
-    m->xx = s;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
-
-    m->yx = 0;
-    m->yy = s;
-    m->yz = 0;
-    m->yw = 0;
+// Compression implied by a file name ending in .gz or .zst.
+inline int stl_compression_from_name(const char *name) {
+    size_t length = strlen(name);
+    if (length > 3 && strcmp(name + length - 3, ".gz") == 0) {
+        return STL_COMPRESSION_GZIP;
+    }
+    if (length > 4 && strcmp(name + length - 4, ".zst") == 0) {
+        return STL_COMPRESSION_ZSTD;
+    }
+    return STL_COMPRESSION_NONE;
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = s;
-    m->zw = 0;
+// Parses a compression name given on the command line, -1 if unknown.
+inline int stl_compression_from_string(const char *s) {
+    if (strcmp(s, "none") == 0) {
+        return STL_COMPRESSION_NONE;
+    }
+    if (strcmp(s, "gzip") == 0 || strcmp(s, "gz") == 0) {
+        return STL_COMPRESSION_GZIP;
+    }
+    if (strcmp(s, "zstd") == 0 || strcmp(s, "zst") == 0) {
+        return STL_COMPRESSION_ZSTD;
+    }
+    return -1;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+inline const char* stl_compression_name(int compression) {
+    return compression == STL_COMPRESSION_GZIP ? "gzip" : compression == STL_COMPRESSION_ZSTD ? "zstd" : "none";
 }
 
-inline void init_sx_mat(mat *m, float s) {
-    m->xx = s;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Whether this build was linked with the library for compression (see the
+// ZLIB and ZSTD variables in the Makefile).
+inline int stl_compression_supported(int compression) {
+    switch (compression) {
+        case STL_COMPRESSION_NONE:
+            return 1;
+#ifdef STL_HAVE_ZLIB
+        case STL_COMPRESSION_GZIP:
+            return 1;
+#endif
+#ifdef STL_HAVE_ZSTD
+        case STL_COMPRESSION_ZSTD:
+            return 1;
+#endif
+    }
+    return 0;
+}
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+// Compression and decompression run on a worker thread connected to the tool
+// by a socket pair, which the tool reads or writes like any other stream.
+// Unlike a pipe, writing to it after the other end is gone fails instead of
+// raising SIGPIPE.
+inline int stl_channel_open(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return 0;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    return 1;
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+inline int stl_channel_write(int fd, const void *data, size_t n) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    const char *p = (const char*)data;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, flags);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+// Reads up to n bytes, fewer only at the end of the stream.
+inline size_t stl_channel_read(int fd, void *data, size_t n) {
+    char *p = (char*)data;
+    size_t total = 0;
+    while (total < n) {
+        ssize_t r = read(fd, p + total, n - total);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        total += r;
+    }
+    return total;
 }
 
-inline void init_sy_mat(mat *m, float s) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Compressed input for a decoder: bytes already taken off the stream while
+// sniffing it, then the rest of the stream.
+typedef struct {
+    FILE *f;
+    unsigned char prefix[4];
+    size_t prefix_length;
+    std::vector<unsigned char> data;
+    size_t start; // first unconsumed byte of data
+    int eof;
+} stl_compressed_input_t;
+
+// Makes at least n unconsumed bytes available unless the input ends first.
+// Returns the number available.
+inline size_t stl_compressed_input_fill(stl_compressed_input_t *in, size_t n) {
+    size_t available = in->data.size() - in->start;
+    if (available >= n || in->eof) {
+        return available;
+    }
+    if (in->start > 0) {
+        in->data.erase(in->data.begin(), in->data.begin() + in->start);
+        in->start = 0;
+    }
+    if (in->prefix_length) {
+        in->data.insert(in->data.end(), in->prefix, in->prefix + in->prefix_length);
+        in->prefix_length = 0;
+    }
+    // grown a block at a time, so a bogus size in a header only costs memory
+    // for data that is really there
+    while (in->data.size() < n && !in->eof) {
+        size_t length = in->data.size();
+        size_t want = STL_COMPRESSION_BLOCK_SIZE;
+        in->data.resize(length + want);
+        size_t r = fread(&in->data[length], 1, want, in->f);
+        in->data.resize(length + r);
+        if (r < want) {
+            in->eof = 1;
+        }
+    }
+    return in->data.size();
+}
 
-    m->yx = 0;
-    m->yy = s;
-    m->yz = 0;
-    m->yw = 0;
+// Decompresses whole members or frames on up to threads threads and sends
+// the results in order. Returns 0 on corrupt data or if the reader is gone.
+template <typename F>
+inline int stl_decompress_blocks(std::vector<std::vector<unsigned char>> &blocks, int threads, int fd, F decompress) {
+    std::vector<std::vector<unsigned char>> outputs(blocks.size());
+    std::vector<char> ok(blocks.size());
+    parallel_slices(blocks.size(), threads, 1, [&](size_t begin, size_t end, int /*thread*/) {
+        for (size_t i = begin; i < end; i++) {
+            ok[i] = decompress(blocks[i], outputs[i]);
+        }
+    });
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!ok[i] || !stl_channel_write(fd, outputs[i].data(), outputs[i].size())) {
+            return 0;
+        }
+    }
+    blocks.clear();
+    return 1;
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+#ifdef STL_HAVE_ZLIB
+// Total size of the gzip member at p if its header records it, as the
+// members written by stl_cmd ("ST" extra field) and BGZF blocks do. 0 if it
+// doesn't.
+inline size_t gzip_member_size(const unsigned char *p, size_t n) {
+    if (n < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) {
+        return 0;
+    }
+    size_t xlen = p[10] | (p[11] << 8);
+    if (n < 12 + xlen) {
+        return 0;
+    }
+    const unsigned char *x = p + 12;
+    const unsigned char *x_end = x + xlen;
+    while (x + 4 <= x_end) {
+        size_t length = x[2] | (x[3] << 8);
+        if (x + 4 + length > x_end) {
+            break;
+        }
+        if (x[0] == 'S' && x[1] == 'T' && length == 4) {
+            return x[4] | (x[5] << 8) | (x[6] << 16) | ((size_t)x[7] << 24);
+        }
+        if (x[0] == 'B' && x[1] == 'C' && length == 2) {
+            return (x[4] | (x[5] << 8)) + 1;
+        }
+        x += 4 + length;
+    }
+    return 0;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+// Inflates one complete gzip member, which must match the length in its
+// trailer. The trailer isn't trusted for the allocation: out starts at a
+// block at most and doubles as output arrives.
+inline int gzip_inflate_member(const std::vector<unsigned char> &member, std::vector<unsigned char> &out) {
+    size_t n = member.size();
+    if (n < 18) {
+        return 0;
+    }
+    const unsigned char *trailer = &member[n - 4];
+    size_t size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+    out.resize(std::min(size + 1, (size_t)STL_COMPRESSION_BLOCK_SIZE));
+    z_stream z;
+    memset(&z, 0x00, sizeof(z));
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+        return 0;
+    }
+    z.next_in = (Bytef*)&member[0];
+    z.avail_in = n;
+    size_t produced = 0;
+    int r;
+    while (1) {
+        z.next_out = &out[produced];
+        z.avail_out = out.size() - produced;
+        r = inflate(&z, Z_NO_FLUSH);
+        produced = out.size() - z.avail_out;
+        if (r != Z_OK || z.avail_out > 0 || out.size() > size) {
+            break;
+        }
+        out.resize(std::min(2*out.size(), size + 1));
+    }
+    int ok = r == Z_STREAM_END && produced == size && z.avail_in == 0;
+    inflateEnd(&z);
+    out.resize(produced);
+    return ok;
 }
 
-inline void init_sz_mat(mat *m, float s) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Inflates the rest of the input serially, member after member.
+inline int gzip_inflate_stream(stl_compressed_input_t *in, int fd) {
+    z_stream z;
+    memset(&z, 0x00, sizeof(z));
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+        return 0;
+    }
+    std::vector<unsigned char> out(STL_COMPRESSION_BLOCK_SIZE);
+    int ok = 0;
+    while (1) {
+        size_t available = stl_compressed_input_fill(in, 1);
+        if (available == 0) {
+            break;
+        }
+        z.next_in = &in->data[in->start];
+        z.avail_in = available;
+        z.next_out = &out[0];
+        z.avail_out = out.size();
+        int r = inflate(&z, Z_NO_FLUSH);
+        in->start += available - z.avail_in;
+        if (!stl_channel_write(fd, &out[0], out.size() - z.avail_out)) {
+            break;
+        }
+        if (r == Z_STREAM_END) {
+            if (stl_compressed_input_fill(in, 1) == 0) {
+                ok = 1;
+                break;
+            }
+            inflateReset(&z);
+        } else if (r != Z_OK) {
+            break;
+        }
+    }
+    inflateEnd(&z);
+    return ok;
+}
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+inline int gzip_decompress(stl_compressed_input_t *in, int fd, int threads) {
+    std::vector<std::vector<unsigned char>> members;
+    while (1) {
+        size_t available = stl_compressed_input_fill(in, 12);
+        if (available == 0) {
+            break;
+        }
+        const unsigned char *p = &in->data[in->start];
+        if (available >= 12 && p[0] == 0x1f && p[1] == 0x8b && (p[3] & 4)) {
+            available = stl_compressed_input_fill(in, 12 + (p[10] | (p[11] << 8)));
+            p = &in->data[in->start];
+        }
+        size_t size = gzip_member_size(p, available);
+        if (size && stl_compressed_input_fill(in, size) >= size) {
+            p = &in->data[in->start];
+            members.push_back(std::vector<unsigned char>(p, p + size));
+            in->start += size;
+            if ((int)members.size() >= threads && !stl_decompress_blocks(members, threads, fd, gzip_inflate_member)) {
+                return 0;
+            }
+        } else {
+            // members of unknown size have to be inflated in sequence
+            if (!stl_decompress_blocks(members, threads, fd, gzip_inflate_member)) {
+                return 0;
+            }
+            return gzip_inflate_stream(in, fd);
+        }
+    }
+    return stl_decompress_blocks(members, threads, fd, gzip_inflate_member);
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = s;
-    m->zw = 0;
+// Deflates block as a gzip member that records its own size in an "ST"
+// extra field, so readers can find the next member without inflating.
+inline int gzip_compress_block(const std::vector<unsigned char> &block, std::vector<unsigned char> &out) {
+    z_stream z;
+    memset(&z, 0x00, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    size_t bound = deflateBound(&z, block.size());
+    out.resize(20 + bound + 8);
+    z.next_in = (Bytef*)block.data();
+    z.avail_in = block.size();
+    z.next_out = &out[20];
+    z.avail_out = bound;
+    int ok = deflate(&z, Z_FINISH) == Z_STREAM_END;
+    size_t size = 20 + z.total_out + 8;
+    deflateEnd(&z);
+    if (!ok) {
+        return 0;
+    }
+    static const unsigned char header[16] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 8, 0, 'S', 'T', 4, 0 };
+    memcpy(&out[0], header, 16);
+    uint32_t trailer[2] = { (uint32_t)size, (uint32_t)crc32(0, block.data(), block.size()) };
+    for (int i = 0; i < 4; i++) {
+        out[16 + i] = trailer[0] >> (8*i);
+        out[size - 8 + i] = trailer[1] >> (8*i);
+        out[size - 4 + i] = (uint32_t)block.size() >> (8*i);
+    }
+    out.resize(size);
+    return 1;
+}
+#endif
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+#ifdef STL_HAVE_ZSTD
+inline uint32_t stl_read_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-inline void init_rx_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
+// Decompresses one complete frame, which must match the content size in its
+// header. Like gzip_inflate_member, out grows as output arrives rather than
+// being sized from the header.
+inline int zstd_decompress_frame(const std::vector<unsigned char> &frame, std::vector<unsigned char> &out) {
+    unsigned long long size = ZSTD_getFrameContentSize(frame.data(), frame.size());
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size >= SIZE_MAX) {
+        return 0;
+    }
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    if (!context) {
+        return 0;
+    }
+    out.resize(std::min((size_t)size + 1, (size_t)STL_COMPRESSION_BLOCK_SIZE));
+    ZSTD_inBuffer input = { frame.data(), frame.size(), 0 };
+    size_t produced = 0;
+    size_t r;
+    while (1) {
+        ZSTD_outBuffer output = { &out[produced], out.size() - produced, 0 };
+        r = ZSTD_decompressStream(context, &output, &input);
+        produced += output.pos;
+        if (ZSTD_isError(r) || r == 0 || produced < out.size() || out.size() > size) {
+            break;
+        }
+        out.resize(std::min(2*out.size(), (size_t)size + 1));
+    }
+    ZSTD_freeDCtx(context);
+    out.resize(produced);
+    return !ZSTD_isError(r) && r == 0 && produced == size && input.pos == input.size;
+}
+
+// Decompresses the rest of the input serially, frame after frame.
+inline int zstd_decompress_stream(stl_compressed_input_t *in, int fd) {
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    if (!stream) {
+        return 0;
+    }
+    std::vector<unsigned char> out(ZSTD_DStreamOutSize());
+    size_t r = 0;
+    int ok = 1;
+    while (ok) {
+        size_t available = stl_compressed_input_fill(in, 1);
+        if (available == 0) {
+            break;
+        }
+        ZSTD_inBuffer input = { &in->data[in->start], available, 0 };
+        while (ok && input.pos < input.size) {
+            ZSTD_outBuffer output = { &out[0], out.size(), 0 };
+            r = ZSTD_decompressStream(stream, &output, &input);
+            ok = !ZSTD_isError(r) && stl_channel_write(fd, &out[0], output.pos);
+        }
+        in->start += input.pos;
+    }
+    ZSTD_freeDStream(stream);
+    // r is 0 at the end of a frame
+    return ok && r == 0;
+}
+
+inline int zstd_decompress(stl_compressed_input_t *in, int fd, int threads) {
+    std::vector<std::vector<unsigned char>> frames;
+    while (1) {
+        size_t available = stl_compressed_input_fill(in, 12);
+        if (available == 0) {
+            break;
+        }
+        const unsigned char *p = &in->data[in->start];
+        size_t size = 0;
+        if (available >= 12 && stl_read_le32(p) == STL_ZSTD_SKIPPABLE_MAGIC && stl_read_le32(p + 4) == 4) {
+            size = stl_read_le32(p + 8);
+        }
+        if (size && stl_compressed_input_fill(in, 12 + size) >= 12 + size) {
+            p = &in->data[in->start];
+            frames.push_back(std::vector<unsigned char>(p + 12, p + 12 + size));
+            in->start += 12 + size;
+            if ((int)frames.size() >= threads && !stl_decompress_blocks(frames, threads, fd, zstd_decompress_frame)) {
+                return 0;
+            }
+        } else {
+            if (!stl_decompress_blocks(frames, threads, fd, zstd_decompress_frame)) {
+                return 0;
+            }
+            return zstd_decompress_stream(in, fd);
+        }
+    }
+    return stl_decompress_blocks(frames, threads, fd, zstd_decompress_frame);
+}
+
+// Compresses block as one frame behind a skippable frame holding its size,
+// the layout pzstd uses, so frames can be found and decompressed in parallel.
+inline int zstd_compress_block(const std::vector<unsigned char> &block, std::vector<unsigned char> &out) {
+    out.resize(12 + ZSTD_compressBound(block.size()));
+    size_t size = ZSTD_compress(&out[12], out.size() - 12, block.data(), block.size(), ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(size)) {
+        return 0;
+    }
+    uint32_t header[3] = { STL_ZSTD_SKIPPABLE_MAGIC, 4, (uint32_t)size };
+    for (int i = 0; i < 12; i++) {
+        out[i] = header[i/4] >> (8*(i%4));
+    }
+    out.resize(12 + size);
+    return 1;
+}
+#endif
+
+// Worker for stl_decompress_input: decodes in to the socket fd, or copies it
+// unchanged if compression is STL_COMPRESSION_NONE. *result is set to 0 if
+// the input couldn't be decoded, but not if the reader went away early.
+inline void stl_decompress_worker(stl_compressed_input_t *in, int compression, int fd, int close_input, int *result) {
+    int threads = std::thread::hardware_concurrency();
+    int ok = 1;
+    if (compression == STL_COMPRESSION_GZIP) {
+#ifdef STL_HAVE_ZLIB
+        ok = gzip_decompress(in, fd, threads);
+#endif
+    } else if (compression == STL_COMPRESSION_ZSTD) {
+#ifdef STL_HAVE_ZSTD
+        ok = zstd_decompress(in, fd, threads);
+#endif
+    } else {
+        size_t available;
+        while (ok && (available = stl_compressed_input_fill(in, 1)) > 0) {
+            ok = stl_channel_write(fd, &in->data[in->start], available);
+            in->start += available;
+        }
+    }
+    if (!ok && errno != EPIPE) {
+        fprintf(stderr, "Corrupt %s compressed input.\n", stl_compression_name(compression));
+    }
+    *result = ok || errno == EPIPE;
+    close(fd);
+    if (close_input && in->f != stdin) {
+        fclose(in->f);
+    }
+    delete in;
+}
+
+// A stream handed out by stl_decompress_input and the worker feeding it,
+// until stl_input_close joins the worker.
+typedef struct {
+    FILE *f;
+    std::thread *worker;
+    int ok;
+} stl_decompressor_t;
+
+inline std::mutex& stl_decompressors_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline std::vector<stl_decompressor_t*>& stl_decompressors() {
+    static std::vector<stl_decompressor_t*> decompressors;
+    return decompressors;
+}
+
+// If f holds gzip or zstd compressed data (told apart by their magic bytes),
+// returns a stream of the decompressed data fed by a worker thread. Gzip
+// members and zstd frames that record their size are decompressed in
+// parallel. With close_input the worker closes f once it's done, otherwise
+// f must stay open until the returned stream has been read to the end.
+// The returned stream has to be closed with stl_input_close to learn
+// whether the data decoded cleanly. Anything else is returned as it is,
+// with its read position unchanged. Returns NULL for data compressed with
+// a library this build doesn't have.
+inline FILE* stl_decompress_input(FILE *f, int close_input) {
+    if (!f) {
+        return f;
+    }
+    unsigned char magic[4];
+    size_t n = 0;
+    int seekable = is_seekable(f);
+    if (seekable) {
+        long offset = ftell(f);
+        n = fread(magic, 1, 4, f);
+        fseek(f, offset, SEEK_SET);
+    } else {
+        int c = getc(f);
+        if (c == EOF) {
+            return f;
+        }
+        ungetc(c, f);
+        if (c != 0x1f && c != 0x28 && (c & 0xf0) != 0x50) {
+            return f;
+        }
+        n = fread(magic, 1, 4, f);
+    }
+    int compression = stl_compression_from_magic(magic, n);
+    if (!stl_compression_supported(compression)) {
+        fprintf(stderr, "This build can't read %s compressed input.\n", stl_compression_name(compression));
+        return NULL;
+    }
+    if (seekable && compression == STL_COMPRESSION_NONE) {
+        return f;
+    }
+    if (!seekable && compression == STL_COMPRESSION_NONE) {
+        // Uncompressed after all. Only one byte is guaranteed to go back
+        // with ungetc, but glibc and the BSDs take more, so the bytes read
+        // are pushed back last first. Whatever doesn't fit is copied through
+        // ahead of the rest of the stream by the worker.
+        while (n > 0 && ungetc(magic[n - 1], f) != EOF) {
+            n--;
+        }
+        if (n == 0) {
+            return f;
+        }
+    }
+
+    int fds[2];
+    if (!stl_channel_open(fds)) {
+        return NULL;
+    }
+    stl_compressed_input_t *in = new stl_compressed_input_t();
+    in->f = f;
+    if (!seekable) {
+        memcpy(in->prefix, magic, n);
+        in->prefix_length = n;
+    }
+    FILE *decompressed = fdopen(fds[0], "rb");
+    if (!decompressed) {
+        close(fds[0]);
+        close(fds[1]);
+        delete in;
+        return NULL;
+    }
+    stl_decompressor_t *decompressor = new stl_decompressor_t();
+    decompressor->f = decompressed;
+    decompressor->ok = 1;
+    decompressor->worker = new std::thread(stl_decompress_worker, in, compression, fds[1], close_input, &decompressor->ok);
+    std::lock_guard<std::mutex> lock(stl_decompressors_mutex());
+    stl_decompressors().push_back(decompressor);
+    return decompressed;
+}
+
+// Closes an input stream other than stdin. For a stream from
+// stl_decompress_input it waits for the worker and returns 0 if the input
+// couldn't be decoded, which the worker has reported. Returns 1 otherwise.
+inline int stl_input_close(FILE *f) {
+    if (!f) {
+        return 1;
+    }
+    stl_decompressor_t *decompressor = NULL;
+    {
+        std::lock_guard<std::mutex> lock(stl_decompressors_mutex());
+        std::vector<stl_decompressor_t*> &decompressors = stl_decompressors();
+        for (size_t i = 0; i < decompressors.size(); i++) {
+            if (decompressors[i]->f == f) {
+                decompressor = decompressors[i];
+                decompressors.erase(decompressors.begin() + i);
+                break;
+            }
+        }
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (!decompressor) {
+        return 1;
+    }
+    // a worker still writing sees the socket closed and stops
+    decompressor->worker->join();
+    int ok = decompressor->ok;
+    delete decompressor->worker;
+    delete decompressor;
+    return ok;
+}
+
+// Output compressed by a worker thread. Data written to f is cut into
+// STL_COMPRESSION_BLOCK_SIZE blocks which are compressed in parallel and
+// written to out in order.
+typedef struct {
+    FILE *out;
+    FILE *f; // stream to write to
+    int compression;
+    std::thread *worker;
+    int ok;
+} stl_compressor_t;
+
+inline int stl_compress_stream(int fd, FILE *out, int compression) {
+    int threads = std::thread::hardware_concurrency();
+    if (threads < 1) {
+        threads = 1;
+    }
+    std::vector<std::vector<unsigned char>> blocks;
+    std::vector<std::vector<unsigned char>> outputs(threads);
+    std::vector<char> ok(threads);
+    int done = 0;
+    int written = 0;
+    while (!done) {
+        blocks.clear();
+        while ((int)blocks.size() < threads) {
+            std::vector<unsigned char> block(STL_COMPRESSION_BLOCK_SIZE);
+            block.resize(stl_channel_read(fd, &block[0], block.size()));
+            if (block.size() < STL_COMPRESSION_BLOCK_SIZE) {
+                done = 1;
+            }
+            // an empty input still gets one empty member or frame
+            if (block.size() > 0 || (done && !written && blocks.empty())) {
+                blocks.push_back(block);
+            }
+            if (done) {
+                break;
+            }
+        }
+        parallel_slices(blocks.size(), threads, 1, [&](size_t begin, size_t end, int /*thread*/) {
+            for (size_t i = begin; i < end; i++) {
+#ifdef STL_HAVE_ZLIB
+                if (compression == STL_COMPRESSION_GZIP) {
+                    ok[i] = gzip_compress_block(blocks[i], outputs[i]);
+                }
+#endif
+#ifdef STL_HAVE_ZSTD
+                if (compression == STL_COMPRESSION_ZSTD) {
+                    ok[i] = zstd_compress_block(blocks[i], outputs[i]);
+                }
+#endif
+            }
+        });
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (!ok[i] || fwrite(outputs[i].data(), 1, outputs[i].size(), out) != outputs[i].size()) {
+                return 0;
+            }
+            written++;
+        }
+    }
+    return 1;
+}
+
+// Returns the stream to write to, which is out itself without compression.
+// Returns NULL if the compression isn't supported by this build.
+inline FILE* stl_compressor_open(stl_compressor_t *compressor, FILE *out, int compression) {
+    memset(compressor, 0x00, sizeof(stl_compressor_t));
+    compressor->out = out;
+    compressor->f = out;
+    compressor->compression = compression;
+    compressor->ok = 1;
+    if (compression == STL_COMPRESSION_NONE) {
+        return out;
+    }
+    int fds[2];
+    if (!stl_compression_supported(compression) || !stl_channel_open(fds)) {
+        return NULL;
+    }
+    compressor->f = fdopen(fds[1], "wb");
+    int fd = fds[0];
+    compressor->worker = new std::thread([compressor, fd]() {
+        compressor->ok = stl_compress_stream(fd, compressor->out, compressor->compression);
+        close(fd);
+    });
+    return compressor->f;
+}
+
+// Finishes the compressed stream. Returns 0 if writing failed.
+inline int stl_compressor_close(stl_compressor_t *compressor) {
+    int ok = 1;
+    if (compressor->worker) {
+        ok = fclose(compressor->f) == 0;
+        compressor->worker->join();
+        delete compressor->worker;
+        ok = ok && compressor->ok;
+    }
+    ok = fflush(compressor->out) == 0 && ok;
+    memset(compressor, 0x00, sizeof(stl_compressor_t));
+    return ok;
+}
+
+#define STL_FORMAT_INVALID 0
+#define STL_FORMAT_BINARY 1
+#define STL_FORMAT_ASCII 2
+
+// Tells binary and ASCII STL apart in constant time by reading the first
+// STL_HEADER_SIZE bytes of f, or as many as there are, into header and
+// their number into *n. A regular file whose size matches the facet count
+// in its header is binary, otherwise one starting with "solid " is ASCII.
+// Data of unknown length, such as a pipe, is ASCII if it starts with
+// "solid " and the rest of those bytes are text, which the facet count of
+// a binary file practically never is (UTF-8 names are text too), and binary if there is a whole
+// header. Nothing past the header is checked, the reading pass has to catch
+// malformed facets. The bytes read aren't put back: the reading pass starts
+// from header, with stl_ascii_reader_prefill or decode_header, and nothing
+// is seeked, so the input can be streamed.
+inline int sniff_stl_format(FILE* f, unsigned char *header, size_t *n) {
+    *n = 0;
+    if (!f) {
+      return STL_FORMAT_INVALID;
+    }
+    *n = fread(header, 1, STL_HEADER_SIZE, f);
+    int is_solid = *n >= 6 && memcmp(header, "solid ", 6) == 0;
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+        uint32_t num_tris = 0;
+        if (*n == STL_HEADER_SIZE) {
+            memcpy(&num_tris, header + 80, 4);
+        }
+        if (*n == STL_HEADER_SIZE && (uint64_t)st.st_size == STL_HEADER_SIZE + STL_RECORD_SIZE*(uint64_t)num_tris) {
+            return STL_FORMAT_BINARY;
+        }
+        return is_solid ? STL_FORMAT_ASCII : STL_FORMAT_INVALID;
+    }
+    int is_text = is_solid;
+    for (size_t i = 0; is_text && i < *n; i++) {
+        is_text = isprint(header[i]) || isspace(header[i]) || header[i] >= 0x80;
+    }
+    if (is_text) {
+        return STL_FORMAT_ASCII;
+    }
+    return *n == STL_HEADER_SIZE ? STL_FORMAT_BINARY : STL_FORMAT_INVALID;
+}
+
+inline int is_valid_ascii_stl(FILE* f) {
+    if (!f) {
+      return 0;
+    }
+    long offset = ftell(f);
+    if (offset < 0) {
+        return 0;
+    }
+    int is_valid = 0;
+    stl_ascii_reader_t reader;
+    if (stl_ascii_reader_open(&reader, f)) {
+        if (stl_ascii_read_header(&reader, NULL, 0)) {
+            facet_t facet;
+            while (stl_ascii_read_facet(&reader, &facet)) {
+                // Do nothing
+            }
+            if (stl_ascii_read_final(&reader)) {
+                is_valid = 1;
+            }
+        }
+        stl_ascii_reader_close(&reader);
+    }
+    fseek(f, offset, SEEK_SET);
+    return is_valid;
+}
+
+inline int is_valid_ascii_stl(char* filename) {
+    FILE *f;
+    f = fopen(filename, "r");
+    int is_valid = is_valid_ascii_stl(f);
+    if (f) {
+      fclose(f);
+    }
+    return is_valid;
+}
+
+inline int is_valid_binary_stl(FILE* f) {
+    if (!f) {
+      return 0;
+    }
+    long offset = ftell(f);
+    if (offset < 0) {
+        return 0;
+    }
+    int is_valid = 0;
+    struct stat st;
+    fstat(fileno(f), &st);
+
+    off_t size = st.st_size;
+    if (size >= 84) {
+        fseek(f, 80, SEEK_SET);
+
+        uint32_t num_tris = 0;
+        int has_count = fread(&num_tris, 4, 1, f) == 1;
+        uint64_t calced_size = 84+(4*12+2)*(uint64_t)num_tris;
+        if (has_count && (uint64_t)size == calced_size) {
+            is_valid = 1;
+        } else {
+          //fprintf(stderr, "    actual size: %10lld\n", size);
+          //fprintf(stderr, "  num triangles: %10d\n", num_tris);
+          //fprintf(stderr, "calculated size: %10lld\n", calced_size);
+        }
+    }
+    fseek(f, offset, SEEK_SET);
+    return is_valid;
+}
+
+inline int is_valid_binary_stl(char* filename) {
+    FILE *f;
+    f = fopen(filename, "rb");
+    int is_valid = is_valid_binary_stl(f);
+    if (f) {
+      fclose(f);
+    }
+    return is_valid;
+}
+
+// Facet count of an uncompressed binary STL file from one fstat and one
+// pread, without moving the file position. Returns 0 unless fd is a regular
+// file of exactly the size the count calls for.
+inline int read_binary_stl_count(int fd, uint32_t *num_tris) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < STL_HEADER_SIZE) {
+        return 0;
+    }
+    unsigned char count[4];
+    if (pread(fd, count, 4, 80) != 4) {
+        return 0;
+    }
+    memcpy(num_tris, count, 4);
+    return (uint64_t)st.st_size == STL_HEADER_SIZE+STL_RECORD_SIZE*(uint64_t)*num_tris;
+}
+
+// bytes moved per pread/write when the kernel can't copy files itself
+#define STL_COPY_BUFFER_SIZE (1 << 20)
+
+inline int stl_write_all(int fd, const void *data, size_t n) {
+    const char *p = (const char*)data;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return 0;
+        }
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
+
+inline int stl_pwrite_all(int fd, const void *data, size_t n, off_t offset) {
+    const char *p = (const char*)data;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, offset);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return 0;
+        }
+        p += w;
+        n -= w;
+        offset += w;
+    }
+    return 1;
+}
+
+// Copies n bytes through a buffer, to out_offset or, if it's negative, to
+// out_fd's current position.
+inline int stl_copy_buffered(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t n) {
+    std::vector<char> buffer(std::min(n, (size_t)STL_COPY_BUFFER_SIZE));
+    while (n > 0) {
+        ssize_t r = pread(in_fd, buffer.data(), std::min(n, buffer.size()), in_offset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return 0;
+        }
+        if (out_offset < 0 ? !stl_write_all(out_fd, buffer.data(), r) : !stl_pwrite_all(out_fd, buffer.data(), r, out_offset)) {
+            return 0;
+        }
+        in_offset += r;
+        if (out_offset >= 0) {
+            out_offset += r;
+        }
+        n -= r;
+    }
+    return 1;
+}
+
+// Copies n bytes from in_fd at in_offset to out_fd at out_offset without
+// moving either file position, so several copies into one file can run at
+// once. The kernel copies the data itself (sharing extents where the file
+// system can) unless the files don't allow it.
+inline int stl_copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t n) {
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+    while (n > 0) {
+        loff_t in = in_offset, out = out_offset;
+        ssize_t copied = copy_file_range(in_fd, &in, out_fd, &out, n, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+            break;
+        }
+        if (copied <= 0) {
+            return 0;
+        }
+        in_offset += copied;
+        out_offset += copied;
+        n -= copied;
+    }
+#endif
+    return stl_copy_buffered(in_fd, in_offset, out_fd, out_offset, n);
+}
+
+// Copies n bytes from in_fd at in_offset to out_fd's current position, which
+// may be a pipe or socket, without passing the data through user space where
+// the kernel allows it.
+inline int stl_copy_stream(int in_fd, off_t in_offset, int out_fd, size_t n) {
+#ifdef __linux__
+    while (n > 0) {
+        off_t offset = in_offset;
+        ssize_t copied = sendfile(out_fd, in_fd, &offset, n);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (copied <= 0) {
+            return 0;
+        }
+        in_offset += copied;
+        n -= copied;
+    }
+#endif
+    return stl_copy_buffered(in_fd, in_offset, out_fd, -1, n);
+}
+
+// Maps a regular file read-only for sequential access. Returns NULL for empty
+// files, pipes and anything else that can't be mapped.
+inline unsigned char* map_stl_file(FILE *f, size_t *length) {
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    return (unsigned char*)map;
+}
+
+// Read-only view of the 50 byte facet records of a binary STL file. Regular
+// files are memory mapped, anything else (pipes, terminals, compressed files)
+// is read into a single buffer so tools can index facets the same way
+// regardless of input.
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    uint32_t facet_count;
+    int is_mapped;
+} stl_view_t;
+
+// Opens the binary STL file f whose first STL_HEADER_SIZE bytes have
+// already been read into header, e.g. by sniff_stl_format. Regular files
+// are mapped whole, anything else has the rest of its records read.
+inline int stl_view_open_after_header(stl_view_t *view, FILE *f, const unsigned char *header) {
+    memset(view, 0x00, sizeof(stl_view_t));
+    if (!f) {
+        return 0;
+    }
+    size_t length;
+    unsigned char *map = map_stl_file(f, &length);
+    if (map) {
+        uint32_t num_tris = 0;
+        if (length >= STL_HEADER_SIZE) {
+            memcpy(&num_tris, map + 80, 4);
+        }
+        if (length < STL_HEADER_SIZE || length != STL_HEADER_SIZE+STL_RECORD_SIZE*(uint64_t)num_tris) {
+            munmap(map, length);
+            return 0;
+        }
+        view->data = map;
+        view->length = length;
+        view->facet_count = num_tris;
+        view->is_mapped = 1;
+        return 1;
+    }
+
+    // Fall back to buffered reads. The facet count comes from an untrusted
+    // header, so the buffer grows with the data that actually arrives,
+    // doubling up to the length the header declares, rather than being
+    // allocated up front.
+    uint32_t num_tris;
+    memcpy(&num_tris, header + 80, 4);
+    uint64_t expected = STL_HEADER_SIZE+STL_RECORD_SIZE*(uint64_t)num_tris;
+    if (expected > SIZE_MAX) {
+        return 0;
+    }
+    length = STL_HEADER_SIZE;
+    size_t capacity = (size_t)std::min(expected, (uint64_t)STL_HEADER_SIZE+STL_RECORD_SIZE*STL_BATCH_SIZE);
+    unsigned char *data = (unsigned char*)malloc(capacity);
+    if (!data) {
+        return 0;
+    }
+    memcpy(data, header, STL_HEADER_SIZE);
+    while (length < expected) {
+        if (length == capacity) {
+            capacity = (size_t)std::min(expected, 2*(uint64_t)capacity);
+            unsigned char *grown = (unsigned char*)realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                return 0;
+            }
+            data = grown;
+        }
+        size_t r = fread(data + length, 1, capacity - length, f);
+        if (r == 0) {
+            break;
+        }
+        length += r;
+    }
+    if (length != expected || getc(f) != EOF) {
+        free(data);
+        return 0;
+    }
+    view->data = data;
+    view->length = length;
+    view->facet_count = num_tris;
+    return 1;
+}
+
+// Opens f as it is, without looking for compression.
+inline int stl_view_open_uncompressed(stl_view_t *view, FILE *f) {
+    memset(view, 0x00, sizeof(stl_view_t));
+    unsigned char header[STL_HEADER_SIZE];
+    if (!f || fread(header, 1, STL_HEADER_SIZE, f) != STL_HEADER_SIZE) {
+        return 0;
+    }
+    return stl_view_open_after_header(view, f, header);
+}
+
+inline void stl_view_close(stl_view_t *view) {
+    if (view->data) {
+        if (view->is_mapped) {
+            munmap(view->data, view->length);
+        } else {
+            free(view->data);
+        }
+    }
+    memset(view, 0x00, sizeof(stl_view_t));
+}
+
+inline int stl_view_open(stl_view_t *view, FILE *f) {
+    // uncompressed pipes starting like compressed data come back as a copy
+    FILE *decompressed = stl_decompress_input(f, 0);
+    if (decompressed == f) {
+        return stl_view_open_uncompressed(view, f);
+    }
+    int ok = stl_view_open_uncompressed(view, decompressed);
+    // the worker is still reading f until the stream ends
+    char rest[4096];
+    while (decompressed && fread(rest, 1, sizeof(rest), decompressed) > 0) {
+    }
+    if (!stl_input_close(decompressed) && ok) {
+        stl_view_close(view);
+        ok = 0;
+    }
+    return ok;
+}
+
+// Returns a pointer to the i-th 50 byte record or NULL if i is out of range.
+inline const unsigned char* stl_view_record(const stl_view_t *view, uint32_t i) {
+    if (i >= view->facet_count) {
+        return NULL;
+    }
+    return view->data + STL_HEADER_SIZE + STL_RECORD_SIZE*(size_t)i;
+}
+
+inline int stl_view_facet(const stl_view_t *view, uint32_t i, facet_t *facet) {
+    const unsigned char *record = stl_view_record(view, i);
+    if (!record) {
+        return 0;
+    }
+    decode_facet(record, facet);
+    return 1;
+}
+
+// A triangle mesh with shared vertices. Positions are stored as separate
+// x, y and z arrays and every triangle is three consecutive entries of
+// indices.
+typedef struct {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<uint32_t> indices;
+} indexed_mesh_t;
+
+// Grid coordinate of v for welding. With a tolerance of 0 the key is the
+// exact bit pattern so only identical values weld (-0 and 0 are the same).
+inline int64_t weld_key(float v, double tolerance) {
+    if (tolerance > 0) {
+        return llround(v / tolerance);
+    }
+    if (v == 0) {
+        return 0;
+    }
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    return bits;
+}
+
+inline int64_t weld_key(double v, double tolerance) {
+    if (tolerance > 0) {
+        return llround(v / tolerance);
+    }
+    if (v == 0) {
+        return 0;
+    }
+    int64_t bits;
+    memcpy(&bits, &v, 8);
+    return bits;
+}
+
+inline uint32_t weld_hash(int64_t kx, int64_t ky, int64_t kz) {
+    uint64_t h = (uint64_t)kx;
+    h = (h ^ (h >> 33))*0xFF51AFD7ED558CCDULL + (uint64_t)ky;
+    h = (h ^ (h >> 33))*0xC4CEB9FE1A85EC53ULL + (uint64_t)kz;
+    h = (h ^ (h >> 33))*0xFF51AFD7ED558CCDULL;
+    return (uint32_t)(h >> 32);
+}
+
+// Stable LSD radix sort of (hash << 32 | corner) pairs on their upper 32
+// bits, two 16 bit digits per pass. Each thread counts and scatters its own
+// slice so the result is the same for every thread count.
+inline void weld_radix_sort(std::vector<uint64_t> &pairs, int threads) {
+    size_t n = pairs.size();
+    std::vector<uint64_t> scratch(n);
+    if (threads > 1 && n/threads < STL_BATCH_SIZE) {
+        threads = n/STL_BATCH_SIZE > 1 ? (int)(n/STL_BATCH_SIZE) : 1;
+    }
+    std::vector<size_t> counts((size_t)threads << 16);
+    uint64_t *src = pairs.data();
+    uint64_t *dst = scratch.data();
+    for (int shift = 32; shift < 64; shift += 16) {
+        std::fill(counts.begin(), counts.end(), 0);
+        parallel_slices(n, threads, 1, [&](size_t begin, size_t end, int t) {
+            size_t *count = counts.data() + ((size_t)t << 16);
+            for (size_t i = begin; i < end; i++) {
+                count[(src[i] >> shift) & 0xffff]++;
+            }
+        });
+        size_t offset = 0;
+        for (size_t d = 0; d < 0x10000; d++) {
+            for (int t = 0; t < threads; t++) {
+                size_t c = counts[((size_t)t << 16) + d];
+                counts[((size_t)t << 16) + d] = offset;
+                offset += c;
+            }
+        }
+        parallel_slices(n, threads, 1, [&](size_t begin, size_t end, int t) {
+            size_t *next = counts.data() + ((size_t)t << 16);
+            for (size_t i = begin; i < end; i++) {
+                dst[next[(src[i] >> shift) & 0xffff]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+}
+
+// Builds mesh from num_tris triangles given as nine coordinates each,
+// merging corners that fall into the same cell of a grid with spacing
+// tolerance (0 merges only identical positions). With a distance above 0 a
+// corner only merges with the earliest vertex of its cell that is less
+// than distance away, and otherwise starts a vertex of its own. Vertices
+// are numbered in order of first appearance and keep that corner's
+// position. Instead of a hash map the corners are radix sorted by the hash
+// of their cell, which is much faster on large meshes and parallel.
+// Returns 0 if the mesh has too many corners for 32 bit indices.
+template <typename T>
+inline int indexed_mesh_build_within(indexed_mesh_t *mesh, const T *corners, size_t num_tris, double tolerance, double distance, int threads) {
+    size_t n = num_tris*3;
+    if (n > UINT32_MAX) {
+        return 0;
+    }
+
+    std::vector<uint64_t> pairs(n);
+    parallel_slices(n, threads, STL_BATCH_SIZE, [&](size_t begin, size_t end, int /*thread*/) {
+        for (size_t i = begin; i < end; i++) {
+            const T *p = corners + i*3;
+            uint32_t h = weld_hash(weld_key(p[0], tolerance), weld_key(p[1], tolerance), weld_key(p[2], tolerance));
+            pairs[i] = ((uint64_t)h << 32) | i;
+        }
+    });
+    weld_radix_sort(pairs, threads);
+
+    // first[i] is the earliest corner with the same key as corner i. Corners
+    // with the same hash are adjacent and in ascending order; distinct keys
+    // sharing a hash are separated by sorting their run on the full key.
+    std::vector<uint32_t> first(n);
+    size_t run = 0;
+    while (run < n) {
+        size_t end = run + 1;
+        while (end < n && (pairs[end] >> 32) == (pairs[run] >> 32)) {
+            end++;
+        }
+        uint32_t c0 = (uint32_t)pairs[run];
+        const T *p0 = corners + (size_t)c0*3;
+        int64_t k[3] = { weld_key(p0[0], tolerance), weld_key(p0[1], tolerance), weld_key(p0[2], tolerance) };
+        size_t i = run + 1;
+        first[c0] = c0;
+        for (; i < end; i++) {
+            uint32_t c = (uint32_t)pairs[i];
+            const T *p = corners + (size_t)c*3;
+            if (weld_key(p[0], tolerance) != k[0] || weld_key(p[1], tolerance) != k[1] || weld_key(p[2], tolerance) != k[2]) {
+                break;
+            }
+            first[c] = c0;
+        }
+        if (i < end) {
+            // 1 if corner a has a smaller key than b, -1 if larger
+            auto compare = [&](uint64_t a, uint64_t b) {
+                const T *pa = corners + (size_t)(uint32_t)a*3;
+                const T *pb = corners + (size_t)(uint32_t)b*3;
+                for (int j = 0; j < 3; j++) {
+                    int64_t ka = weld_key(pa[j], tolerance);
+                    int64_t kb = weld_key(pb[j], tolerance);
+                    if (ka != kb) {
+                        return ka < kb ? 1 : -1;
+                    }
+                }
+                return 0;
+            };
+            std::sort(pairs.begin() + run, pairs.begin() + end, [&](uint64_t a, uint64_t b) {
+                int order = compare(a, b);
+                return order ? order > 0 : (uint32_t)a < (uint32_t)b;
+            });
+            for (i = run; i < end; i++) {
+                uint32_t c = (uint32_t)pairs[i];
+                first[c] = (i > run && compare(pairs[i-1], pairs[i]) == 0) ? first[(uint32_t)pairs[i-1]] : c;
+            }
+        }
+        run = end;
+    }
+    std::vector<uint64_t>().swap(pairs);
+
+    if (distance > 0) {
+        // each cell's vertices so far, a list from its earliest corner
+        std::vector<uint32_t> next(n, UINT32_MAX);
+        std::vector<uint32_t> last(n);
+        double max_squared = distance*distance;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t head = first[i];
+            if (head == i) {
+                last[i] = (uint32_t)i;
+                continue;
+            }
+            const T *p = corners + i*3;
+            uint32_t v = head;
+            for (; v != UINT32_MAX; v = next[v]) {
+                const T *q = corners + (size_t)v*3;
+                double dx = (double)p[0] - q[0];
+                double dy = (double)p[1] - q[1];
+                double dz = (double)p[2] - q[2];
+                if (dx*dx + dy*dy + dz*dz < max_squared) {
+                    break;
+                }
+            }
+            if (v != UINT32_MAX) {
+                first[i] = v;
+            } else {
+                first[i] = (uint32_t)i;
+                next[last[head]] = (uint32_t)i;
+                last[head] = (uint32_t)i;
+            }
+        }
+    }
+
+    mesh->x.clear();
+    mesh->y.clear();
+    mesh->z.clear();
+    mesh->indices.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        if (first[i] == i) {
+            first[i] = (uint32_t)mesh->x.size();
+            mesh->x.push_back((float)corners[i*3]);
+            mesh->y.push_back((float)corners[i*3+1]);
+            mesh->z.push_back((float)corners[i*3+2]);
+        } else {
+            first[i] = first[first[i]];
+        }
+        mesh->indices[i] = first[i];
+    }
+    return 1;
+}
+
+template <typename T>
+inline int indexed_mesh_build(indexed_mesh_t *mesh, const T *corners, size_t num_tris, double tolerance, int threads) {
+    return indexed_mesh_build_within(mesh, corners, num_tris, tolerance, 0, threads);
+}
+
+// Builds mesh from the facets of a binary STL view.
+inline int indexed_mesh_from_view(indexed_mesh_t *mesh, const stl_view_t *view, double tolerance, int threads) {
+    size_t num_tris = view->facet_count;
+    std::vector<float> corners(num_tris*9);
+    for (size_t i = 0; i < num_tris; i++) {
+        memcpy(&corners[i*9], view->data + STL_HEADER_SIZE + STL_RECORD_SIZE*i + 12, 36);
+    }
+    return indexed_mesh_build(mesh, corners.data(), num_tris, tolerance, threads);
+}
+
+inline size_t indexed_mesh_vertex_count(const indexed_mesh_t *mesh) {
+    return mesh->x.size();
+}
+
+inline size_t indexed_mesh_triangle_count(const indexed_mesh_t *mesh) {
+    return mesh->indices.size()/3;
+}
+
+// Key of the undirected edge between vertices a and b.
+inline uint64_t mesh_edge_key(uint32_t a, uint32_t b) {
+    return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+// A slice of an ASCII STL body parsed by one thread of parse_ascii_stl_parallel.
+struct ascii_chunk_t {
+    const char *start;
+    const char *end;
+    const char *stop; // first line that didn't parse as part of a facet, NULL if none
+    int aligned;      // 0 if a facet ran past end
+    uint32_t facet_count;
+    std::vector<unsigned char> records;
+};
+
+inline const char* next_stl_line(const char *p, const char *end) {
+    const char *nl = (const char*)memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+// Returns the start of the line following the first endfacet line at or after p.
+inline const char* next_facet_boundary(const char *p, const char *end) {
+    while (p < end) {
+        const char *next = next_stl_line(p, end);
+        if (match_token(skip_stl_space(p, next), next, "endfacet")) {
+            return next;
+        }
+        p = next;
+    }
+    return end;
+}
+
+inline void parse_ascii_chunk(ascii_chunk_t *chunk, const char *data_end) {
+    const char *p = chunk->start;
+    facet_t facet;
+    chunk->records.reserve((chunk->end - chunk->start)/200*STL_RECORD_SIZE);
+    while (p < chunk->end) {
+        memset(&facet, 0x00, sizeof(facet_t));
+        for (int i = 0; i < 7; i++) {
+            if (i > 0 && p >= chunk->end) {
+                chunk->aligned = 0;
+                return;
+            }
+            const char *next = next_stl_line(p, data_end);
+            const char *line_end = (next > p && next[-1] == '\n') ? next - 1 : next;
+            if (p >= data_end || !parse_facet_line(p, line_end, &facet, i)) {
+                // a facet cut short is an error, leave it to the serial reader
+                if (i == 0) {
+                    chunk->stop = p;
+                } else {
+                    chunk->aligned = 0;
+                }
+                return;
+            }
+            p = next;
+        }
+        size_t offset = chunk->records.size();
+        chunk->records.resize(offset + STL_RECORD_SIZE);
+        encode_facet(&facet, &chunk->records[offset]);
+        chunk->facet_count++;
+    }
+}
+
+// Parses an ASCII STL held in memory by splitting its body into chunks at
+// endfacet lines and parsing the chunks on separate threads. On success
+// records holds the binary records in file order, exactly as the serial
+// reader would have produced them. Returns 0 if the data isn't a valid ASCII
+// STL or couldn't be split cleanly, in which case callers should fall back to
+// stl_ascii_reader_t to get the serial behaviour.
+inline int parse_ascii_stl_parallel(const char *data, size_t length, int threads,
+                                    char *name, size_t name_length,
+                                    std::vector<unsigned char> &records, uint32_t *facet_count) {
+    const char *end = data + length;
+    const char *body = next_stl_line(data, end);
+    const char *header_end = (body > data && body[-1] == '\n') ? body - 1 : body;
+    if (header_end - data < 6 || strncmp(data, "solid ", 6) != 0) {
+        return 0;
+    }
+    copy_solid_name(data + 6, header_end, name, name_length);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    size_t num_chunks = 4*threads;
+    size_t chunk_size = (end - body)/num_chunks + 1;
+    if (chunk_size < (1 << 20)) {
+        chunk_size = 1 << 20;
+    }
+
+    std::vector<ascii_chunk_t> chunks;
+    const char *p = body;
+    while (p < end || chunks.empty()) {
+        ascii_chunk_t chunk;
+        chunk.start = p;
+        chunk.end = (size_t)(end - p) > chunk_size ? next_facet_boundary(next_stl_line(p + chunk_size - 1, end), end) : end;
+        chunk.stop = NULL;
+        chunk.aligned = 1;
+        chunk.facet_count = 0;
+        chunks.push_back(chunk);
+        p = chunk.end;
+    }
+
+    std::atomic<size_t> next_chunk(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&]() {
+            for (;;) {
+                size_t c = next_chunk++;
+                if (c >= chunks.size()) {
+                    break;
+                }
+                parse_ascii_chunk(&chunks[c], end);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    // prefix sum of the per chunk facet counts gives each chunk's offset
+    std::vector<uint64_t> offsets(chunks.size() + 1, 0);
+    const char *stop = NULL;
+    size_t used = 0;
+    while (used < chunks.size()) {
+        const ascii_chunk_t &chunk = chunks[used];
+        offsets[used + 1] = offsets[used] + chunk.facet_count;
+        used++;
+        if (chunk.stop) {
+            stop = chunk.stop;
+            break;
+        }
+        if (!chunk.aligned) {
+            return 0;
+        }
+    }
+    if (!stop || end - stop < 8 || strncmp(stop, "endsolid", 8) != 0 || offsets[used] > UINT32_MAX) {
+        return 0;
+    }
+
+    records.resize(offsets[used]*STL_RECORD_SIZE);
+    for (size_t c = 0; c < used; c++) {
+        if (chunks[c].facet_count) {
+            memcpy(&records[offsets[c]*STL_RECORD_SIZE], &chunks[c].records[0], chunks[c].records.size());
+        }
+        std::vector<unsigned char>().swap(chunks[c].records);
+    }
+    *facet_count = (uint32_t)offsets[used];
+    return 1;
+}
+
+inline void mat_print(mat *m) {
+    printf("%f %f %f %f\n", m->xx, m->xy, m->xz, m->xw);
+    printf("%f %f %f %f\n", m->yx, m->yy, m->yz, m->yw);
+    printf("%f %f %f %f\n", m->zx, m->zy, m->zz, m->zw);
+    printf("%f %f %f %f\n", m->tx, m->ty, m->tz, m->tw);
+}
+
+inline void init_identity_mat(mat *m) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_s_mat(mat *m, float s) {
+    m->xx = s;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = s;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = s;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_sx_mat(mat *m, float s) {
+    m->xx = s;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_sy_mat(mat *m, float s) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = s;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_sz_mat(mat *m, float s) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = s;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_rx_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
+
+    float cosa = cos(angle);
+    float sina = sin(angle);
+
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = cosa;
+    m->yz = sina;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = -sina;
+    m->zz = cosa;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_ry_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
+
+    float cosa = cos(angle);
+    float sina = sin(angle);
+
+    m->xx = cosa;
+    m->xy = 0;
+    m->xz = -sina;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = sina;
+    m->zy = 0;
+    m->zz = cosa;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_rz_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
+
+    float cosa = cos(angle);
+    float sina = sin(angle);
+
+    m->xx = cosa;
+    m->xy = sina;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = -sina;
+    m->yy = cosa;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_tx_mat(mat *m, float t) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = t;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_ty_mat(mat *m, float t) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = t;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_tz_mat(mat *m, float t) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = t;
+    m->tw = 1;
+}
+
+inline void init_inv_s_mat(mat *m, float s) {
+    m->xx = 1./s;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1./s;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1./s;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_sx_mat(mat *m, float s) {
+    m->xx = 1./s;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_sy_mat(mat *m, float s) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1./s;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_sz_mat(mat *m, float s) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
+
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
+
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1./s;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_rx_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
+
+    float cosa = cos(angle);
+    float sina = sin(angle);
+
+    m->xx = 1;
+    m->yx = 0;
+    m->zx = 0;
+    m->tx = 0;
+
+    m->xy = 0;
+    m->yy = cosa;
+    m->zy = sina;
+    m->ty = 0;
+
+    m->xz = 0;
+    m->yz = -sina;
+    m->zz = cosa;
+    m->tz = 0;
+
+    m->xw = 0;
+    m->yw = 0;
+    m->zw = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_ry_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
+
+    float cosa = cos(angle);
+    float sina = sin(angle);
+
+    m->xx = cosa;
+    m->yx = 0;
+    m->zx = -sina;
+    m->tx = 0;
+
+    m->xy = 0;
+    m->yy = 1;
+    m->zy = 0;
+    m->ty = 0;
+
+    m->xz = sina;
+    m->yz = 0;
+    m->zz = cosa;
+    m->tz = 0;
+
+    m->xw = 0;
+    m->yw = 0;
+    m->zw = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_rz_mat(mat *m, float angle) {
+    angle *= M_PI/180; // convert to radians
 
     float cosa = cos(angle);
     float sina = sin(angle);
 
+    m->xx = cosa;
+    m->yx = sina;
+    m->zx = 0;
+    m->tx = 0;
+
+    m->xy = -sina;
+    m->yy = cosa;
+    m->zy = 0;
+    m->ty = 0;
+
+    m->xz = 0;
+    m->yz = 0;
+    m->zz = 1;
+    m->tz = 0;
+
+    m->xw = 0;
+    m->yw = 0;
+    m->zw = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_tx_mat(mat *m, float t) {
     m->xx = 1;
     m->xy = 0;
     m->xz = 0;
     m->xw = 0;
 
     m->yx = 0;
-    m->yy = cosa;
-    m->yz = sina;
+    m->yy = 1;
+    m->yz = 0;
     m->yw = 0;
 
     m->zx = 0;
-    m->zy = -sina;
-    m->zz = cosa;
+    m->zy = 0;
+    m->zz = 1;
     m->zw = 0;
 
-    m->tx = 0;
+    m->tx = -t;
     m->ty = 0;
     m->tz = 0;
     m->tw = 1;
 }
 
-inline void init_ry_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
+inline void init_inv_ty_mat(mat *m, float t) {
+    m->xx = 1;
+    m->xy = 0;
+    m->xz = 0;
+    m->xw = 0;
 
-    float cosa = cos(angle);
-    float sina = sin(angle);
+    m->yx = 0;
+    m->yy = 1;
+    m->yz = 0;
+    m->yw = 0;
 
-    m->xx = cosa;
+    m->zx = 0;
+    m->zy = 0;
+    m->zz = 1;
+    m->zw = 0;
+
+    m->tx = 0;
+    m->ty = -t;
+    m->tz = 0;
+    m->tw = 1;
+}
+
+inline void init_inv_tz_mat(mat *m, float t) {
+    m->xx = 1;
     m->xy = 0;
-    m->xz = -sina;
+    m->xz = 0;
     m->xw = 0;
 
     m->yx = 0;
@@ -483,572 +3225,2113 @@ inline void init_ry_mat(mat *m, float angle) {
     m->yz = 0;
     m->yw = 0;
 
-    m->zx = sina;
+    m->zx = 0;
     m->zy = 0;
-    m->zz = cosa;
+    m->zz = 1;
     m->zw = 0;
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
-}
+    m->tx = 0;
+    m->ty = 0;
+    m->tz = -t;
+    m->tw = 1;
+}
+
+inline void mat_transpose(mat *m, mat *out) {
+    out->xx = m->xx;
+    out->xy = m->yx;
+    out->xz = m->zx;
+    out->xw = m->tx;
+
+    out->yx = m->xy;
+    out->yy = m->yy;
+    out->yz = m->zy;
+    out->yw = m->ty;
+
+    out->zx = m->xz;
+    out->zy = m->yz;
+    out->zz = m->zz;
+    out->zw = m->tz;
+
+    out->tx = m->xw;
+    out->ty = m->yw;
+    out->tz = m->zw;
+    out->tw = m->tw;
+}
+
+inline void mat_mult(mat *m1, mat *m2, mat *out) {
+    out->xx = m1->xx*m2->xx+m1->xy*m2->yx+m1->xz*m2->zx+m1->xw*m2->tx;
+    out->xy = m1->xx*m2->xy+m1->xy*m2->yy+m1->xz*m2->zy+m1->xw*m2->ty;
+    out->xz = m1->xx*m2->xz+m1->xy*m2->yz+m1->xz*m2->zz+m1->xw*m2->tz;
+    out->xw = m1->xx*m2->xw+m1->xy*m2->yw+m1->xz*m2->zw+m1->xw*m2->tw;
+
+    out->yx = m1->yx*m2->xx+m1->yy*m2->yx+m1->yz*m2->zx+m1->yw*m2->tx;
+    out->yy = m1->yx*m2->xy+m1->yy*m2->yy+m1->yz*m2->zy+m1->yw*m2->ty;
+    out->yz = m1->yx*m2->xz+m1->yy*m2->yz+m1->yz*m2->zz+m1->yw*m2->tz;
+    out->yw = m1->yx*m2->xw+m1->yy*m2->yw+m1->yz*m2->zw+m1->yw*m2->tw;
+
+    out->zx = m1->zx*m2->xx+m1->zy*m2->yx+m1->zz*m2->zx+m1->zw*m2->tx;
+    out->zy = m1->zx*m2->xy+m1->zy*m2->yy+m1->zz*m2->zy+m1->zw*m2->ty;
+    out->zz = m1->zx*m2->xz+m1->zy*m2->yz+m1->zz*m2->zz+m1->zw*m2->tz;
+    out->zw = m1->zx*m2->xw+m1->zy*m2->yw+m1->zz*m2->zw+m1->zw*m2->tw;
+
+    out->tx = m1->tx*m2->xx+m1->ty*m2->yx+m1->tz*m2->zx+m1->tw*m2->tx;
+    out->ty = m1->tx*m2->xy+m1->ty*m2->yy+m1->tz*m2->zy+m1->tw*m2->ty;
+    out->tz = m1->tx*m2->xz+m1->ty*m2->yz+m1->tz*m2->zz+m1->tw*m2->tz;
+    out->tw = m1->tx*m2->xw+m1->ty*m2->yw+m1->tz*m2->zw+m1->tw*m2->tw;
+}
+
+inline void vec_mat_mult(vec *v, mat *m, vec *out) {
+    out->x = v->x*m->xx+v->y*m->yx+v->z*m->zx+v->w*m->tx;
+    out->y = v->x*m->xy+v->y*m->yy+v->z*m->zy+v->w*m->ty;
+    out->z = v->x*m->xz+v->y*m->yz+v->z*m->zz+v->w*m->tz;
+    out->w = v->x*m->xw+v->y*m->yw+v->z*m->zw+v->w*m->tw;
+}
+
+inline float vec_magnitude(vec *v) {
+    return sqrt(v->x*v->x+v->y*v->y+v->z*v->z);
+}
+
+inline void vec_normalize(vec *v, vec *out) {
+    float invmag = 1./vec_magnitude(v);
+    out->x = v->x*invmag;
+    out->y = v->y*invmag;
+    out->z = v->z*invmag;
+}
+
+inline int vec_equals(vec *v, vec *v2) {
+    return fabs(v->x-v2->x) < EPSILON &&
+           fabs(v->y-v2->y) < EPSILON &&
+           fabs(v->z-v2->z) < EPSILON;
+}
+
+inline int vec_equals_exact(vec *v, vec *v2) {
+    return v->x-v2->x == 0 &&
+           v->y-v2->y == 0 &&
+           v->z-v2->z == 0;
+}
+
+inline void vec_copy(vec *v, vec *out) {
+    out->x = v->x;
+    out->y = v->y;
+    out->z = v->z;
+    out->w = v->w;
+}
+
+inline void mat_copy(mat *m1, mat *out) {
+    out->xx = m1->xx;
+    out->xy = m1->xy;
+    out->xz = m1->xz;
+    out->xw = m1->xw;
+
+    out->yx = m1->yx;
+    out->yy = m1->yy;
+    out->yz = m1->yz;
+    out->yw = m1->yw;
+
+    out->zx = m1->zx;
+    out->zy = m1->zy;
+    out->zz = m1->zz;
+    out->zw = m1->zw;
+
+    out->tx = m1->tx;
+    out->ty = m1->ty;
+    out->tz = m1->tz;
+    out->tw = m1->tw;
+}
+
+inline void vec_cross(vec *a, vec *b, vec *out) {
+    out->x = a->y*b->z-a->z*b->y;
+    out->y = a->z*b->x-a->x*b->z;
+    out->z = a->x*b->y-a->y*b->x;
+}
+
+inline void vec_add(vec *a, vec *b, vec *out) {
+    out->x = a->x+b->x;
+    out->y = a->y+b->y;
+    out->z = a->z+b->z;
+}
+
+inline void vec_sub(vec *a, vec *b, vec *out) {
+    out->x = a->x-b->x;
+    out->y = a->y-b->y;
+    out->z = a->z-b->z;
+}
+
+inline float vec_dot(vec *a, vec *b) {
+    return a->x*b->x+a->y*b->y+a->z*b->z;
+}
+
+inline void write_tri(FILE *f,
+                vec *p1,
+                vec *p2,
+                vec *p3, int rev) {
+    if (rev) {
+        vec *tmp = p1;
+        p1 = p3;
+        p3 = tmp;
+    }
+
+    vec n1;
+    vec v1,v2;
+
+    vec_sub(p2,p1,&v1);
+    vec_sub(p3,p1,&v2);
+
+    vec_cross(&v1,&v2,&n1);
+    vec_normalize(&n1,&n1);
+
+    unsigned char record[STL_RECORD_SIZE] = {0};
+
+    memcpy(record, &n1, 12);
+    memcpy(record + 12, p1, 12);
+    memcpy(record + 24, p2, 12);
+    memcpy(record + 36, p3, 12);
+    fwrite(record, 1, STL_RECORD_SIZE, f);
+}
+
+inline void write_quad(FILE *f,
+                vec *p1,
+                vec *p2,
+                vec *p3,
+                vec *p4,int rev) {
+    //write two triangles 1,2,3 and 1,3,4
+    if (rev) {
+        vec *tmp = p1;
+        p1 = p4;
+        p4 = tmp;
+
+        tmp = p2;
+        p2 = p3;
+        p3 = tmp;
+    }
+
+    vec n1,n2;
 
-inline void init_rz_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
+    vec v1,v2,v3;
 
-    float cosa = cos(angle);
-    float sina = sin(angle);
+    vec_sub(p2,p1,&v1);
+    vec_sub(p3,p1,&v2);
+    vec_sub(p4,p1,&v3);
 
-    m->xx = cosa;
-    m->xy = sina;
-    m->xz = 0;
-    m->xw = 0;
+    vec_cross(&v1,&v2,&n1);
+    vec_normalize(&n1,&n1);
 
-    m->yx = -sina;
-    m->yy = cosa;
-    m->yz = 0;
-    m->yw = 0;
+    vec_cross(&v2,&v3,&n2);
+    vec_normalize(&n2,&n2);
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+    unsigned char records[2*STL_RECORD_SIZE] = {0};
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+    memcpy(records, &n1, 12);
+    memcpy(records + 12, p1, 12);
+    memcpy(records + 24, p2, 12);
+    memcpy(records + 36, p3, 12);
+
+    memcpy(records + 50, &n2, 12);
+    memcpy(records + 62, p1, 12);
+    memcpy(records + 74, p3, 12);
+    memcpy(records + 86, p4, 12);
+    fwrite(records, 1, 2*STL_RECORD_SIZE, f);
 }
 
-inline void init_tx_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+inline void get_facet_bounds(facet_t *facet, bounds_t* b, int init) {
+    if (init) {
+        b->min = facet->vertices[0];
+        b->max = facet->vertices[0];
+    }
+    for (int i = init ? 1 : 0; i < 3; i++) {
+        if (b->min.x > facet->vertices[i].x) b->min.x = facet->vertices[i].x;
+        if (b->min.y > facet->vertices[i].y) b->min.y = facet->vertices[i].y;
+        if (b->min.z > facet->vertices[i].z) b->min.z = facet->vertices[i].z;
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+        if (b->max.x < facet->vertices[i].x) b->max.x = facet->vertices[i].x;
+        if (b->max.y < facet->vertices[i].y) b->max.y = facet->vertices[i].y;
+        if (b->max.z < facet->vertices[i].z) b->max.z = facet->vertices[i].z;
+    }
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+// Bounds of the STL data in f, whose first n bytes sniff_stl_format has
+// read into header. Returns 0 if the data turns out to be malformed,
+// facet_count is set to the number of facets read either way.
+inline int get_bounds(FILE *f, const unsigned char *header, size_t n, bounds_t* b, int is_ascii, uint32_t *facet_count) {
+    memset(b, 0x00, sizeof(bounds_t));
+    *facet_count = 0;
+    facet_t facet;
+    if (is_ascii) {
+        int is_valid = 0;
+        stl_ascii_reader_t reader;
+        if (stl_ascii_reader_open(&reader, f)) {
+            stl_ascii_reader_prefill(&reader, header, n);
+            if (stl_ascii_read_header(&reader, NULL, 0)) {
+                while (stl_ascii_read_facet(&reader, &facet)) {
+                    get_facet_bounds(&facet, b, *facet_count == 0);
+                    (*facet_count)++;
+                }
+                is_valid = stl_ascii_read_final(&reader);
+            }
+            stl_ascii_reader_close(&reader);
+        }
+        return is_valid;
+    }
+    if (n != STL_HEADER_SIZE) {
+        return 0;
+    }
+    uint32_t num_tris = 0;
+    decode_header(header, NULL, 0, &num_tris);
+    facet_t facets[STL_BATCH_SIZE];
+    while (*facet_count < num_tris) {
+        size_t batch = std::min(num_tris - *facet_count, (uint32_t)STL_BATCH_SIZE);
+        size_t r = read_facets(f, facets, batch);
+        for (size_t i = 0; i < r; i++) {
+            get_facet_bounds(&facets[i], b, *facet_count == 0);
+            (*facet_count)++;
+        }
+        if (r < batch) {
+            return 0;
+        }
+    }
+    return getc(f) == EOF;
+}
 
-    m->tx = t;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+// Facets are copied out of their 50 byte records in blocks this small so
+// the copy stays in L1 cache.
+#define STL_FACET_BLOCK_SIZE 256
+
+// Facets in one array per coordinate (x0 y0 z0 x1 y1 z1 x2 y2 z2), the layout
+// the reduction kernels vectorize on.
+typedef struct {
+    float v[9][STL_FACET_BLOCK_SIZE];
+} stl_facet_block_t;
+
+// Loads up to STL_FACET_BLOCK_SIZE facets starting at first, returns how many.
+inline size_t stl_load_facet_block(const stl_view_t *view, size_t first, stl_facet_block_t *block) {
+    size_t n = view->facet_count - first;
+    if (n > STL_FACET_BLOCK_SIZE) {
+        n = STL_FACET_BLOCK_SIZE;
+    }
+    const unsigned char *record = view->data + STL_HEADER_SIZE + STL_RECORD_SIZE*first + 12;
+    for (size_t i = 0; i < n; i++, record += STL_RECORD_SIZE) {
+        float p[9];
+        memcpy(p, record, 36);
+        for (int j = 0; j < 9; j++) {
+            block->v[j][i] = p[j];
+        }
+    }
+    return n;
 }
 
-inline void init_ty_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Area and six times the signed volume of the tetrahedron to the origin of
+// each facet, in double. Only IEEE operations without contraction are used,
+// so every instruction set gives the same bits. The loop vectorizes once
+// sqrt doesn't have to set errno (-fno-math-errno in the Makefile).
+__attribute__((always_inline)) inline void stl_facet_terms_kernel(const stl_facet_block_t *block, size_t n, double *__restrict area, double *__restrict volume) {
+    const float *x0 = block->v[0], *y0 = block->v[1], *z0 = block->v[2];
+    const float *x1 = block->v[3], *y1 = block->v[4], *z1 = block->v[5];
+    const float *x2 = block->v[6], *y2 = block->v[7], *z2 = block->v[8];
+    for (size_t i = 0; i < n; i++) {
+        double ax = (double)x1[i]-x0[i], ay = (double)y1[i]-y0[i], az = (double)z1[i]-z0[i];
+        double bx = (double)x2[i]-x0[i], by = (double)y2[i]-y0[i], bz = (double)z2[i]-z0[i];
+        double cx = ay*bz-az*by, cy = az*bx-ax*bz, cz = ax*by-ay*bx;
+        area[i] = .5*sqrt(cx*cx+cy*cy+cz*cz);
+        volume[i] = ((double)y0[i]*z1[i]-(double)z0[i]*y1[i])*x2[i] +
+                    ((double)z0[i]*x1[i]-(double)x0[i]*z1[i])*y2[i] +
+                    ((double)x0[i]*y1[i]-(double)y0[i]*x1[i])*z2[i];
+    }
+}
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STL_HAVE_AVX2_KERNELS
+__attribute__((target("avx2"))) inline void stl_facet_terms_avx2(const stl_facet_block_t *block, size_t n, double *area, double *volume) {
+    stl_facet_terms_kernel(block, n, area, volume);
+}
+#endif
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+inline void stl_facet_terms_generic(const stl_facet_block_t *block, size_t n, double *area, double *volume) {
+    stl_facet_terms_kernel(block, n, area, volume);
+}
 
-    m->tx = 0;
-    m->ty = t;
-    m->tz = 0;
-    m->tw = 1;
+inline void stl_facet_terms(const stl_facet_block_t *block, size_t n, double *area, double *volume) {
+#ifdef STL_HAVE_AVX2_KERNELS
+    static const int has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        stl_facet_terms_avx2(block, n, area, volume);
+        return;
+    }
+#endif
+    stl_facet_terms_generic(block, n, area, volume);
 }
 
-inline void init_tz_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Pairwise summation, the rounding error grows with log n instead of n. The
+// order of additions only depends on n. Runs of up to 128 values are summed
+// in four interleaved lanes, which vectorizes.
+inline double stl_pairwise_sum(const double *v, size_t n) {
+    if (n <= 128) {
+        double lanes[4] = { 0, 0, 0, 0 };
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            for (int j = 0; j < 4; j++) {
+                lanes[j] += v[i+j];
+            }
+        }
+        for (; i < n; i++) {
+            lanes[i%4] += v[i];
+        }
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+    size_t half = n/2;
+    return stl_pairwise_sum(v, half) + stl_pairwise_sum(v + half, n - half);
+}
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+// Surface area and signed volume of all facets in view. Facets are summed
+// pairwise within fixed blocks of STL_BATCH_SIZE and the block sums pairwise
+// again, so the blocks can be spread over threads without the result
+// depending on the thread count.
+inline void stl_view_area_volume(const stl_view_t *view, double *area, double *volume) {
+    size_t blocks = (view->facet_count + STL_BATCH_SIZE - 1)/STL_BATCH_SIZE;
+    std::vector<double> area_sums(blocks);
+    std::vector<double> volume_sums(blocks);
+    parallel_slices(blocks, std::thread::hardware_concurrency(), 4, [&](size_t begin, size_t end, int /*thread*/) {
+        stl_facet_block_t *block = new stl_facet_block_t;
+        std::vector<double> areas(STL_BATCH_SIZE);
+        std::vector<double> volumes(STL_BATCH_SIZE);
+        for (size_t b = begin; b < end; b++) {
+            size_t n = 0;
+            while (n < STL_BATCH_SIZE && b*STL_BATCH_SIZE + n < view->facet_count) {
+                size_t loaded = stl_load_facet_block(view, b*STL_BATCH_SIZE + n, block);
+                stl_facet_terms(block, loaded, &areas[n], &volumes[n]);
+                n += loaded;
+            }
+            area_sums[b] = stl_pairwise_sum(&areas[0], n);
+            volume_sums[b] = stl_pairwise_sum(&volumes[0], n);
+        }
+        delete block;
+    });
+    *area = stl_pairwise_sum(area_sums.data(), blocks);
+    *volume = stl_pairwise_sum(volume_sums.data(), blocks)/6;
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+// Surface area of all facets in view.
+inline double stl_view_area(const stl_view_t *view) {
+    double area, volume;
+    stl_view_area_volume(view, &area, &volume);
+    return area;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = t;
-    m->tw = 1;
+// Volume enclosed by the facets in view, from the signed volumes of the
+// tetrahedra between each facet and the origin.
+inline double stl_view_volume(const stl_view_t *view) {
+    double area, volume;
+    stl_view_area_volume(view, &area, &volume);
+    return fabs(volume);
 }
 
-inline void init_inv_s_mat(mat *m, float s) {
-    m->xx = 1./s;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Bounds of the n facets in block.
+inline void stl_facet_block_bounds(const stl_facet_block_t *block, size_t n, bounds_t *b) {
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++) {
+        lo[k] = hi[k] = block->v[k][0];
+        for (int j = k; j < 9; j += 3) {
+            const float *v = block->v[j];
+            for (size_t i = 0; i < n; i++) {
+                lo[k] = v[i] < lo[k] ? v[i] : lo[k];
+                hi[k] = v[i] > hi[k] ? v[i] : hi[k];
+            }
+        }
+    }
+    memset(b, 0x00, sizeof(bounds_t));
+    b->min.x = lo[0]; b->min.y = lo[1]; b->min.z = lo[2];
+    b->max.x = hi[0]; b->max.y = hi[1]; b->max.z = hi[2];
+}
 
-    m->yx = 0;
-    m->yy = 1./s;
-    m->yz = 0;
-    m->yw = 0;
+// Grows b to include o, or sets it to o with init.
+inline void stl_bounds_union(bounds_t *b, const bounds_t *o, int init) {
+    if (init) {
+        *b = *o;
+        return;
+    }
+    b->min.x = std::min(b->min.x, o->min.x); b->max.x = std::max(b->max.x, o->max.x);
+    b->min.y = std::min(b->min.y, o->min.y); b->max.y = std::max(b->max.y, o->max.y);
+    b->min.z = std::min(b->min.z, o->min.z); b->max.z = std::max(b->max.z, o->max.z);
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1./s;
-    m->zw = 0;
+// Bounds of all facets in view, all zero if there are none.
+inline void stl_view_bounds(const stl_view_t *view, bounds_t *b) {
+    memset(b, 0x00, sizeof(bounds_t));
+    size_t blocks = (view->facet_count + STL_FACET_BLOCK_SIZE - 1)/STL_FACET_BLOCK_SIZE;
+    std::vector<bounds_t> slices(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<int> found(slices.size());
+    parallel_slices(blocks, slices.size(), 64, [&](size_t begin, size_t end, int t) {
+        stl_facet_block_t *block = new stl_facet_block_t;
+        for (size_t i = begin; i < end; i++) {
+            bounds_t block_bounds;
+            size_t n = stl_load_facet_block(view, i*STL_FACET_BLOCK_SIZE, block);
+            stl_facet_block_bounds(block, n, &block_bounds);
+            stl_bounds_union(&slices[t], &block_bounds, !found[t]);
+            found[t] = 1;
+        }
+        delete block;
+    });
+    int init = 1;
+    for (size_t t = 0; t < slices.size(); t++) {
+        if (found[t]) {
+            stl_bounds_union(b, &slices[t], init);
+            init = 0;
+        }
+    }
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+typedef struct {
+    vec center;
+    vec point; // a vertex on the surface of the cylinder
+    float radius;
+    float height;
+} bcylinder_t;
+
+#define STL_AXIS_X 0
+#define STL_AXIS_Y 1
+#define STL_AXIS_Z 2
+
+inline int stl_axis_from_string(const char *s) {
+    if (strcmp(s, "x") == 0 || strcmp(s, "X") == 0) {
+        return STL_AXIS_X;
+    } else if (strcmp(s, "y") == 0 || strcmp(s, "Y") == 0) {
+        return STL_AXIS_Y;
+    } else if (strcmp(s, "z") == 0 || strcmp(s, "Z") == 0) {
+        return STL_AXIS_Z;
+    }
+    return -1;
 }
 
-inline void init_inv_sx_mat(mat *m, float s) {
-    m->xx = 1./s;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Collects the vertices that can lie on the smallest circle around all
+// vertices projected along an axis (Akl-Toussaint): everything strictly
+// inside the polygon of the extreme points in a fixed set of directions is
+// inside the convex hull and is dropped while the file is read. The polygon
+// only grows, so whatever is dropped early would be dropped at the end as
+// well. Most points fall inside the circle inscribed in the polygon, which
+// is tested first.
+#define STL_CIRCLE_DIRECTIONS 64
+#define STL_CIRCLE_COMPACT_SIZE 65536
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+typedef struct {
+    int u, v; // projected coordinates
+    int extreme_count;
+    double extreme[STL_CIRCLE_DIRECTIONS];
+    vec extreme_point[STL_CIRCLE_DIRECTIONS];
+    int edge_count;
+    double edge[STL_CIRCLE_DIRECTIONS][4]; // origin u v, direction u v
+    double inner[3]; // inscribed circle center u v, squared radius
+    size_t compacted; // points left after the last compaction
+    std::vector<vec> points;
+} stl_circle_filter_t;
+
+inline void stl_circle_filter_init(stl_circle_filter_t *filter, int axis) {
+    filter->u = (axis+1)%3;
+    filter->v = (axis+2)%3;
+    filter->extreme_count = 0;
+    filter->compacted = 0;
+    filter->points.clear();
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+// Counterclockwise from +u in equal steps.
+inline double stl_circle_direction(int k, double u, double v) {
+    static double du[STL_CIRCLE_DIRECTIONS], dv[STL_CIRCLE_DIRECTIONS];
+    static int initialized = 0;
+    if (!initialized) {
+        for (int j = 0; j < STL_CIRCLE_DIRECTIONS; j++) {
+            du[j] = cos(2*M_PI*j/STL_CIRCLE_DIRECTIONS);
+            dv[j] = sin(2*M_PI*j/STL_CIRCLE_DIRECTIONS);
+        }
+        initialized = 1;
+    }
+    return du[k]*u + dv[k]*v;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+inline int stl_circle_point_less(const vec &a, const vec &b) {
+    if (a.x != b.x) return a.x < b.x;
+    if (a.y != b.y) return a.y < b.y;
+    return a.z < b.z;
 }
 
-inline void init_inv_sy_mat(mat *m, float s) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Maps floats to integers of the same order, with -0 and 0 the same.
+inline uint32_t stl_float_order(float f) {
+    uint32_t bits;
+    f += 0.0f;
+    memcpy(&bits, &f, 4);
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
 
-    m->yx = 0;
-    m->yy = 1./s;
-    m->yz = 0;
-    m->yw = 0;
+inline void stl_circle_filter_edges(stl_circle_filter_t *filter) {
+    // the same point can be extreme in several directions
+    double cu = 0, cv = 0;
+    int n = 0;
+    for (int k = 0; k < STL_CIRCLE_DIRECTIONS; k++) {
+        const float *a = &filter->extreme_point[k].x;
+        const float *b = &filter->extreme_point[(k+1)%STL_CIRCLE_DIRECTIONS].x;
+        double *e = filter->edge[n];
+        e[0] = a[filter->u];
+        e[1] = a[filter->v];
+        e[2] = (double)b[filter->u]-a[filter->u];
+        e[3] = (double)b[filter->v]-a[filter->v];
+        if (e[2] != 0 || e[3] != 0) {
+            cu += e[0];
+            cv += e[1];
+            n++;
+        }
+    }
+    filter->edge_count = n;
+    if (n < 3) {
+        // nothing is strictly inside a point or a line
+        filter->edge_count = 1;
+        filter->edge[0][2] = filter->edge[0][3] = 0;
+        filter->inner[2] = -1;
+        return;
+    }
+    cu /= n;
+    cv /= n;
+
+    // distance from the mean of the corners to the closest edge
+    double r2 = -1;
+    for (int k = 0; k < n; k++) {
+        const double *e = filter->edge[k];
+        double length2 = e[2]*e[2]+e[3]*e[3];
+        double d = e[2]*(cv-e[1]) - e[3]*(cu-e[0]);
+        if (d <= 0) {
+            r2 = -1;
+            break;
+        }
+        if (r2 < 0 || d*d/length2 < r2) {
+            r2 = d*d/length2;
+        }
+    }
+    filter->inner[0] = cu;
+    filter->inner[1] = cv;
+    filter->inner[2] = r2*(1-1e-6);
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+inline int stl_circle_filter_inside(const stl_circle_filter_t *filter, double u, double v) {
+    if (filter->extreme_count == 0) {
+        return 0;
+    }
+    double du = u-filter->inner[0], dv = v-filter->inner[1];
+    if (du*du+dv*dv < filter->inner[2]) {
+        return 1;
+    }
+    for (int k = 0; k < filter->edge_count; k++) {
+        const double *e = filter->edge[k];
+        if (e[2]*(v-e[1]) - e[3]*(u-e[0]) <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+// Makes p an extreme point where it is one, ties go to the smaller point so
+// the polygon doesn't depend on the order points arrive in.
+inline int stl_circle_filter_extend(stl_circle_filter_t *filter, const vec *p) {
+    const float *c = &p->x;
+    double u = c[filter->u], v = c[filter->v];
+    int changed = 0;
+    for (int k = 0; k < STL_CIRCLE_DIRECTIONS; k++) {
+        double d = stl_circle_direction(k, u, v);
+        if (filter->extreme_count == 0 || d > filter->extreme[k] ||
+            (d == filter->extreme[k] && stl_circle_point_less(*p, filter->extreme_point[k]))) {
+            filter->extreme[k] = d;
+            filter->extreme_point[k] = *p;
+            changed = 1;
+        }
+    }
+    filter->extreme_count = 1;
+    return changed;
 }
 
-inline void init_inv_sz_mat(mat *m, float s) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+// Drops the points that the polygon has grown over.
+inline void stl_circle_filter_compact(stl_circle_filter_t *filter) {
+    int u = filter->u, v = filter->v;
+    std::vector<vec> &points = filter->points;
+    size_t kept = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+        const float *c = &points[i].x;
+        if (!stl_circle_filter_inside(filter, c[u], c[v])) {
+            points[kept++] = points[i];
+        }
+    }
+    points.resize(kept);
+    filter->compacted = kept;
+}
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+inline void stl_circle_filter_add(stl_circle_filter_t *filter, const vec *p) {
+    const float *c = &p->x;
+    if (stl_circle_filter_inside(filter, c[filter->u], c[filter->v])) {
+        return;
+    }
+    filter->points.push_back(*p);
+    if (stl_circle_filter_extend(filter, p)) {
+        stl_circle_filter_edges(filter);
+    }
+    if (filter->points.size() >= 2*filter->compacted + STL_CIRCLE_COMPACT_SIZE) {
+        stl_circle_filter_compact(filter);
+    }
+}
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1./s;
-    m->zw = 0;
+inline void stl_circle_filter_add_block(stl_circle_filter_t *filter, const stl_facet_block_t *block, size_t n) {
+    for (int j = 0; j < 9; j += 3) {
+        const float *x = block->v[j], *y = block->v[j+1], *z = block->v[j+2];
+        const float *pu = block->v[j+filter->u], *pv = block->v[j+filter->v];
+        for (size_t i = 0; i < n; i++) {
+            if (!stl_circle_filter_inside(filter, pu[i], pv[i])) {
+                vec p;
+                p.x = x[i]; p.y = y[i]; p.z = z[i]; p.w = 1;
+                stl_circle_filter_add(filter, &p);
+            }
+        }
+    }
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
+// Starts the polygon from facets spread evenly over the file, so files
+// ordered from the middle outwards don't keep most of their points.
+inline void stl_circle_filter_seed(stl_circle_filter_t *filter, const stl_view_t *view) {
+    uint32_t step = view->facet_count/STL_BATCH_SIZE + 1;
+    facet_t facet;
+    for (uint32_t i = 0; i < view->facet_count; i += step) {
+        stl_view_facet(view, i, &facet);
+        for (int j = 0; j < 3; j++) {
+            facet.vertices[j].w = 1;
+            stl_circle_filter_add(filter, &facet.vertices[j]);
+        }
+    }
 }
 
-inline void init_inv_rx_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
+// Folds the points kept by other into filter.
+inline void stl_circle_filter_merge(stl_circle_filter_t *filter, const stl_circle_filter_t *other) {
+    for (size_t i = 0; i < other->points.size(); i++) {
+        filter->points.push_back(other->points[i]);
+        stl_circle_filter_extend(filter, &other->points[i]);
+    }
+}
 
-    float cosa = cos(angle);
-    float sina = sin(angle);
+// Drops everything inside the final polygon and sorts the remaining points,
+// keeping one per projected position.
+inline void stl_circle_filter_finish(stl_circle_filter_t *filter) {
+    if (filter->extreme_count == 0) {
+        return;
+    }
+    stl_circle_filter_edges(filter);
+    stl_circle_filter_compact(filter);
+    int u = filter->u, v = filter->v;
+    std::vector<vec> &points = filter->points;
+    std::vector<std::pair<uint64_t, uint32_t> > keys(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        const float *c = &points[i].x;
+        keys[i].first = (uint64_t)stl_float_order(c[u]) << 32 | stl_float_order(c[v]);
+        keys[i].second = i;
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<vec> unique;
+    for (size_t i = 0; i < keys.size(); ) {
+        size_t best = keys[i].second;
+        size_t j = i + 1;
+        for (; j < keys.size() && keys[j].first == keys[i].first; j++) {
+            if (stl_circle_point_less(points[keys[j].second], points[best])) {
+                best = keys[j].second;
+            }
+        }
+        unique.push_back(points[best]);
+        i = j;
+    }
+    points.swap(unique);
+}
 
-    m->xx = 1;
-    m->yx = 0;
-    m->zx = 0;
-    m->tx = 0;
+typedef struct {
+    double u, v, r2;
+} stl_circle_t;
 
-    m->xy = 0;
-    m->yy = cosa;
-    m->zy = sina;
-    m->ty = 0;
+inline int stl_circle_contains(const stl_circle_t *c, double u, double v) {
+    double du = u-c->u, dv = v-c->v;
+    // relative slack for points that are on the circle but round outside
+    return du*du+dv*dv <= c->r2*(1+1e-10);
+}
 
-    m->xz = 0;
-    m->yz = -sina;
-    m->zz = cosa;
-    m->tz = 0;
+inline stl_circle_t stl_circle_2(double u0, double v0, double u1, double v1) {
+    stl_circle_t c;
+    c.u = .5*(u0+u1);
+    c.v = .5*(v0+v1);
+    c.r2 = .25*((u1-u0)*(u1-u0)+(v1-v0)*(v1-v0));
+    return c;
+}
 
-    m->xw = 0;
-    m->yw = 0;
-    m->zw = 0;
-    m->tw = 1;
+inline stl_circle_t stl_circle_3(double u0, double v0, double u1, double v1, double u2, double v2) {
+    double bu = u1-u0, bv = v1-v0, cu = u2-u0, cv = v2-v0;
+    double d = 2*(bu*cv-bv*cu);
+    if (d == 0) {
+        // collinear, the circle through the two points furthest apart
+        stl_circle_t c = stl_circle_2(u0, v0, u1, v1);
+        stl_circle_t c1 = stl_circle_2(u0, v0, u2, v2);
+        stl_circle_t c2 = stl_circle_2(u1, v1, u2, v2);
+        if (c1.r2 > c.r2) c = c1;
+        if (c2.r2 > c.r2) c = c2;
+        return c;
+    }
+    double b2 = bu*bu+bv*bv, c2 = cu*cu+cv*cv;
+    stl_circle_t c;
+    double ou = (cv*b2-bv*c2)/d, ov = (bu*c2-cu*b2)/d;
+    c.u = u0+ou;
+    c.v = v0+ov;
+    c.r2 = ou*ou+ov*ov;
+    return c;
 }
 
-inline void init_inv_ry_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
+// Smallest circle around the projections of points, Welzl's algorithm in
+// its iterative form. Points are visited in a fixed pseudo random order, so
+// the expected time is linear and the result is reproducible.
+inline stl_circle_t stl_min_circle(std::vector<vec> points, int u, int v) {
+    stl_circle_t c = { 0, 0, -1 };
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = points.size(); i > 1; i--) {
+        state = state*6364136223846793005ull + 1442695040888963407ull;
+        std::swap(points[i-1], points[(state >> 33) % i]);
+    }
+    size_t n = points.size();
+    #define STL_CIRCLE_UV(i) (double)(&points[i].x)[u], (double)(&points[i].x)[v]
+    for (size_t i = 0; i < n; i++) {
+        if (c.r2 >= 0 && stl_circle_contains(&c, STL_CIRCLE_UV(i))) {
+            continue;
+        }
+        c.u = (&points[i].x)[u];
+        c.v = (&points[i].x)[v];
+        c.r2 = 0;
+        for (size_t j = 0; j < i; j++) {
+            if (stl_circle_contains(&c, STL_CIRCLE_UV(j))) {
+                continue;
+            }
+            c = stl_circle_2(STL_CIRCLE_UV(i), STL_CIRCLE_UV(j));
+            for (size_t k = 0; k < j; k++) {
+                if (!stl_circle_contains(&c, STL_CIRCLE_UV(k))) {
+                    c = stl_circle_3(STL_CIRCLE_UV(i), STL_CIRCLE_UV(j), STL_CIRCLE_UV(k));
+                }
+            }
+        }
+    }
+    #undef STL_CIRCLE_UV
+    return c;
+}
 
-    float cosa = cos(angle);
-    float sina = sin(angle);
+// Smallest cylinder along axis around the points kept by filter, as high
+// as bounds along that axis. The radius is the distance to the furthest
+// point from the center, rounded up, so every vertex is inside.
+inline void stl_circle_filter_bcylinder(const stl_circle_filter_t *filter, int axis, const bounds_t *b, bcylinder_t *cylinder) {
+    memset(cylinder, 0x00, sizeof(bcylinder_t));
+    if (filter->points.empty()) {
+        return;
+    }
+    int u = filter->u, v = filter->v;
+    stl_circle_t c = stl_min_circle(filter->points, u, v);
+
+    float *center = &cylinder->center.x;
+    center[u] = c.u + 0.0;
+    center[v] = c.v + 0.0;
+    center[axis] = .5*((&b->max.x)[axis]+(&b->min.x)[axis]);
+    cylinder->height = (&b->max.x)[axis]-(&b->min.x)[axis];
+
+    double r2 = -1;
+    for (size_t i = 0; i < filter->points.size(); i++) {
+        const float *p = &filter->points[i].x;
+        double du = p[u]-(double)center[u], dv = p[v]-(double)center[v];
+        if (du*du+dv*dv > r2) {
+            r2 = du*du+dv*dv;
+            cylinder->point = filter->points[i];
+        }
+    }
+    cylinder->radius = sqrt(r2);
+    if ((double)cylinder->radius*cylinder->radius < r2) {
+        cylinder->radius = nextafterf(cylinder->radius, INFINITY);
+    }
+}
 
-    m->xx = cosa;
-    m->yx = 0;
-    m->zx = -sina;
-    m->tx = 0;
+// Smallest bounding cylinder along axis (STL_AXIS_X, _Y or _Z), from one
+// parallel pass over the facets.
+inline void stl_view_bcylinder(const stl_view_t *view, int axis, bcylinder_t *cylinder) {
+    size_t batches = (view->facet_count + STL_BATCH_SIZE - 1)/STL_BATCH_SIZE;
+    int threads = std::thread::hardware_concurrency();
+    std::vector<bounds_t> batch_bounds(batches);
+    std::vector<stl_circle_filter_t> filters(threads > 1 ? threads : 1);
+    stl_circle_filter_init(&filters[0], axis);
+    stl_circle_filter_seed(&filters[0], view);
+    for (size_t t = 1; t < filters.size(); t++) {
+        filters[t] = filters[0];
+    }
+    parallel_slices(batches, threads, 4, [&](size_t begin, size_t end, int t) {
+        stl_facet_block_t *block = new stl_facet_block_t;
+        for (size_t b = begin; b < end; b++) {
+            size_t n = 0;
+            while (n < STL_BATCH_SIZE && b*STL_BATCH_SIZE + n < view->facet_count) {
+                size_t loaded = stl_load_facet_block(view, b*STL_BATCH_SIZE + n, block);
+                bounds_t block_bounds;
+                stl_facet_block_bounds(block, loaded, &block_bounds);
+                stl_bounds_union(&batch_bounds[b], &block_bounds, n == 0);
+                stl_circle_filter_add_block(&filters[t], block, loaded);
+                n += loaded;
+            }
+        }
+        delete block;
+    });
 
-    m->xy = 0;
-    m->yy = 1;
-    m->zy = 0;
-    m->ty = 0;
+    bounds_t bounds;
+    memset(&bounds, 0x00, sizeof(bounds_t));
+    for (size_t b = 0; b < batches; b++) {
+        stl_bounds_union(&bounds, &batch_bounds[b], b == 0);
+    }
+    for (size_t t = 1; t < filters.size(); t++) {
+        stl_circle_filter_merge(&filters[0], &filters[t]);
+    }
+    stl_circle_filter_finish(&filters[0]);
+    stl_circle_filter_bcylinder(&filters[0], axis, &bounds, cylinder);
+}
 
-    m->xz = sina;
-    m->yz = 0;
-    m->zz = cosa;
-    m->tz = 0;
+// A convex hull as a triangle mesh: positions as x y z triples in double and
+// every face three consecutive entries of faces, counterclockwise seen from
+// outside.
+typedef struct {
+    std::vector<double> points;
+    std::vector<uint32_t> faces;
+} convex_hull_t;
 
-    m->xw = 0;
-    m->yw = 0;
-    m->zw = 0;
-    m->tw = 1;
+typedef struct {
+    uint32_t v[3];
+    uint32_t neighbor[3]; // across the edge from v[i] to v[(i+1)%3]
+    double normal[3];
+    double offset;
+    int dead;
+    uint32_t visited;
+    uint32_t outside; // first point above the face, linked through next
+    uint32_t furthest;
+    double furthest_distance;
+} hull_face_t;
+
+#define HULL_NONE UINT32_MAX
+
+// Links point p into the outside list of face.
+inline void hull_face_add_outside(hull_face_t *face, std::vector<uint32_t> &next, uint32_t p, double distance) {
+    next[p] = face->outside;
+    face->outside = p;
+    if (distance > face->furthest_distance) {
+        face->furthest_distance = distance;
+        face->furthest = p;
+    }
 }
 
-inline void init_inv_rz_mat(mat *m, float angle) {
-    angle *= M_PI/180; // convert to radians
-
-    float cosa = cos(angle);
-    float sina = sin(angle);
+inline double hull_face_distance(const hull_face_t *face, const double *p) {
+    return face->normal[0]*p[0]+face->normal[1]*p[1]+face->normal[2]*p[2]-face->offset;
+}
 
-    m->xx = cosa;
-    m->yx = sina;
-    m->zx = 0;
-    m->tx = 0;
+inline void hull_face_plane(hull_face_t *face, const double *points) {
+    const double *a = points + 3*face->v[0], *b = points + 3*face->v[1], *c = points + 3*face->v[2];
+    double u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+    double v[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+    double *n = face->normal;
+    n[0] = u[1]*v[2]-u[2]*v[1];
+    n[1] = u[2]*v[0]-u[0]*v[2];
+    n[2] = u[0]*v[1]-u[1]*v[0];
+    double length = sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+    if (length > 0) {
+        n[0] /= length; n[1] /= length; n[2] /= length;
+    }
+    face->offset = n[0]*a[0]+n[1]*a[1]+n[2]*a[2];
+}
 
-    m->xy = -sina;
-    m->yy = cosa;
-    m->zy = 0;
-    m->ty = 0;
+// Whether the horizon edges form one closed loop.
+inline int hull_horizon_is_loop(const std::vector<hull_face_t> &faces, const std::vector<std::pair<uint32_t, int> > &horizon, std::vector<std::pair<uint32_t, uint32_t> > &loop) {
+    loop.clear();
+    for (size_t i = 0; i < horizon.size(); i++) {
+        const hull_face_t *face = &faces[horizon[i].first];
+        int k = horizon[i].second;
+        loop.push_back(std::make_pair(face->v[k], face->v[(k+1)%3]));
+    }
+    if (loop.size() < 3) {
+        return 0;
+    }
+    std::sort(loop.begin(), loop.end());
+    for (size_t i = 1; i < loop.size(); i++) {
+        if (loop[i].first == loop[i-1].first) {
+            return 0;
+        }
+    }
+    uint32_t v = loop[0].first;
+    for (size_t steps = 0; steps < loop.size(); steps++) {
+        std::vector<std::pair<uint32_t, uint32_t> >::const_iterator edge =
+            std::lower_bound(loop.begin(), loop.end(), std::make_pair(v, (uint32_t)0));
+        if (edge == loop.end() || edge->first != v) {
+            return 0;
+        }
+        v = edge->second;
+        if (v == loop[0].first) {
+            return steps + 1 == loop.size();
+        }
+    }
+    return 0;
+}
 
-    m->xz = 0;
-    m->yz = 0;
-    m->zz = 1;
-    m->tz = 0;
+// Quickhull over n points (x y z triples). Points closer to a face than a
+// few float roundings of the largest coordinate count as inside it, so the
+// hull can miss points by that much.
+// Returns 0 if all points lie in a plane.
+inline int convex_hull_build(convex_hull_t *hull, const double *points, size_t n) {
+    hull->points.clear();
+    hull->faces.clear();
+    if (n < 4) {
+        return 0;
+    }
 
-    m->xw = 0;
-    m->yw = 0;
-    m->zw = 0;
-    m->tw = 1;
-}
+    double scale = 0;
+    size_t extreme[6] = { 0, 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < n; i++) {
+        const double *p = points + 3*i;
+        for (int k = 0; k < 3; k++) {
+            if (p[k] < points[3*extreme[2*k]+k]) extreme[2*k] = i;
+            if (p[k] > points[3*extreme[2*k+1]+k]) extreme[2*k+1] = i;
+            scale = std::max(scale, fabs(p[k]));
+        }
+    }
+    // the points come from floats, anything closer to a plane than their
+    // precision is taken to be on it
+    const double eps = 4*scale*1.1920929e-7;
+
+    // initial tetrahedron: the two extremes furthest apart, the point
+    // furthest from their line and the point furthest from their plane
+    #define HULL_P(i) (points + 3*(size_t)(i))
+    size_t simplex[4] = { 0, 0, 0, 0 };
+    double best = -1;
+    for (int a = 0; a < 6; a++) {
+        for (int b = a+1; b < 6; b++) {
+            const double *p = HULL_P(extreme[a]), *q = HULL_P(extreme[b]);
+            double d = (p[0]-q[0])*(p[0]-q[0])+(p[1]-q[1])*(p[1]-q[1])+(p[2]-q[2])*(p[2]-q[2]);
+            if (d > best) {
+                best = d;
+                simplex[0] = extreme[a];
+                simplex[1] = extreme[b];
+            }
+        }
+    }
+    const double *p0 = HULL_P(simplex[0]), *p1 = HULL_P(simplex[1]);
+    double line[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+    best = -1;
+    for (size_t i = 0; i < n; i++) {
+        const double *p = HULL_P(i);
+        double w[3] = { p[0]-p0[0], p[1]-p0[1], p[2]-p0[2] };
+        double c[3] = { line[1]*w[2]-line[2]*w[1], line[2]*w[0]-line[0]*w[2], line[0]*w[1]-line[1]*w[0] };
+        double d = c[0]*c[0]+c[1]*c[1]+c[2]*c[2];
+        if (d > best) {
+            best = d;
+            simplex[2] = i;
+        }
+    }
+    const double *p2 = HULL_P(simplex[2]);
+    double w[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+    double normal[3] = { line[1]*w[2]-line[2]*w[1], line[2]*w[0]-line[0]*w[2], line[0]*w[1]-line[1]*w[0] };
+    double normal_length = sqrt(normal[0]*normal[0]+normal[1]*normal[1]+normal[2]*normal[2]);
+    if (normal_length == 0) {
+        return 0;
+    }
+    best = 0;
+    double side = 0;
+    for (size_t i = 0; i < n; i++) {
+        const double *p = HULL_P(i);
+        double d = (normal[0]*(p[0]-p0[0])+normal[1]*(p[1]-p0[1])+normal[2]*(p[2]-p0[2]))/normal_length;
+        if (fabs(d) > best) {
+            best = fabs(d);
+            side = d;
+            simplex[3] = i;
+        }
+    }
+    if (best <= eps) {
+        return 0;
+    }
 
-inline void init_inv_tx_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+    std::vector<hull_face_t> faces(4);
+    // faces opposite each simplex vertex, wound so they face away from it
+    static const int tetrahedron[4][3] = { { 1, 2, 3 }, { 0, 3, 2 }, { 0, 1, 3 }, { 0, 2, 1 } };
+    for (int f = 0; f < 4; f++) {
+        for (int k = 0; k < 3; k++) {
+            int a = tetrahedron[f][side > 0 ? k : 2-k];
+            faces[f].v[k] = simplex[a];
+        }
+        faces[f].dead = 0;
+        faces[f].visited = 0;
+        faces[f].outside = HULL_NONE;
+        faces[f].furthest_distance = 0;
+        hull_face_plane(&faces[f], points);
+    }
+    // link neighbors by their shared edges
+    for (int f = 0; f < 4; f++) {
+        for (int k = 0; k < 3; k++) {
+            uint32_t a = faces[f].v[k], b = faces[f].v[(k+1)%3];
+            for (int g = 0; g < 4; g++) {
+                for (int j = 0; j < 3; j++) {
+                    if (g != f && faces[g].v[j] == b && faces[g].v[(j+1)%3] == a) {
+                        faces[f].neighbor[k] = g;
+                    }
+                }
+            }
+        }
+    }
+    std::vector<uint32_t> next(n);
+    for (size_t i = 0; i < n; i++) {
+        if (i == simplex[0] || i == simplex[1] || i == simplex[2] || i == simplex[3]) {
+            continue;
+        }
+        for (int f = 0; f < 4; f++) {
+            double d = hull_face_distance(&faces[f], HULL_P(i));
+            if (d > eps) {
+                hull_face_add_outside(&faces[f], next, i, d);
+                break;
+            }
+        }
+    }
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+    std::vector<uint32_t> pending;
+    for (uint32_t f = 0; f < 4; f++) {
+        if (faces[f].outside != HULL_NONE) {
+            pending.push_back(f);
+        }
+    }
+    std::vector<uint32_t> visible;
+    std::vector<uint32_t> stack;
+    std::vector<std::pair<uint32_t, int> > horizon; // face and edge seen from inside
+    std::vector<uint32_t> created;
+    std::vector<std::pair<uint32_t, uint32_t> > loop;
+    std::vector<hull_face_t> fan;
+    std::vector<uint32_t> orphans;
+    std::vector<uint32_t> unused;
+    std::vector<std::pair<uint32_t, uint32_t> > by_first, by_second;
+    uint32_t visit = 0;
+    while (!pending.empty()) {
+        uint32_t start = pending.back();
+        pending.pop_back();
+        if (faces[start].dead || faces[start].outside == HULL_NONE) {
+            continue;
+        }
+        uint32_t eye = faces[start].furthest;
+        const double *e = HULL_P(eye);
+
+        // faces seen from eye and the edges around them
+        visit++;
+        visible.clear();
+        horizon.clear();
+        stack.clear();
+        stack.push_back(start);
+        faces[start].visited = visit;
+        while (!stack.empty()) {
+            uint32_t f = stack.back();
+            stack.pop_back();
+            visible.push_back(f);
+            for (int k = 0; k < 3; k++) {
+                uint32_t g = faces[f].neighbor[k];
+                if (faces[g].visited == visit) {
+                    continue;
+                }
+                if (hull_face_distance(&faces[g], e) > eps) {
+                    faces[g].visited = visit;
+                    stack.push_back(g);
+                } else {
+                    horizon.push_back(std::make_pair(f, k));
+                }
+            }
+        }
+        // an edge can only be on the horizon once
+        for (size_t i = 0; i < horizon.size(); i++) {
+            uint32_t g = faces[horizon[i].first].neighbor[horizon[i].second];
+            if (faces[g].visited == visit) {
+                horizon.erase(horizon.begin() + i);
+                i--;
+            }
+        }
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+        // rounding can leave the visible faces without a single loop around
+        // them, eye is taken to be on the hull then
+        if (!hull_horizon_is_loop(faces, horizon, loop)) {
+            hull_face_t *face = &faces[start];
+            uint32_t list = face->outside;
+            face->outside = HULL_NONE;
+            face->furthest_distance = 0;
+            for (uint32_t p = list, following; p != HULL_NONE; p = following) {
+                following = next[p];
+                if (p != eye) {
+                    hull_face_add_outside(face, next, p, hull_face_distance(face, HULL_P(p)));
+                }
+            }
+            if (face->outside != HULL_NONE) {
+                pending.push_back(start);
+            }
+            continue;
+        }
 
-    m->tx = -t;
-    m->ty = 0;
-    m->tz = 0;
-    m->tw = 1;
-}
+        // a fan of new faces from the horizon to eye
+        fan.clear();
+        for (size_t i = 0; i < horizon.size(); i++) {
+            const hull_face_t *old = &faces[horizon[i].first];
+            int k = horizon[i].second;
+            hull_face_t face;
+            face.v[0] = old->v[k];
+            face.v[1] = old->v[(k+1)%3];
+            face.v[2] = eye;
+            face.neighbor[0] = old->neighbor[k];
+            face.dead = 0;
+            face.visited = 0;
+            face.outside = HULL_NONE;
+            face.furthest_distance = 0;
+            hull_face_plane(&face, points);
+            fan.push_back(face);
+        }
 
-inline void init_inv_ty_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
+        // the faces seen from eye are removed and their slots reused, the
+        // points above them are placed again below
+        orphans.clear();
+        for (size_t i = 0; i < visible.size(); i++) {
+            hull_face_t *face = &faces[visible[i]];
+            for (uint32_t p = face->outside; p != HULL_NONE; p = next[p]) {
+                if (p != eye) {
+                    orphans.push_back(p);
+                }
+            }
+            face->outside = HULL_NONE;
+            face->dead = 1;
+            unused.push_back(visible[i]);
+        }
 
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+        created.clear();
+        by_first.clear();
+        by_second.clear();
+        for (size_t i = 0; i < fan.size(); i++) {
+            uint32_t id;
+            if (!unused.empty()) {
+                id = unused.back();
+                unused.pop_back();
+                faces[id] = fan[i];
+            } else {
+                id = faces.size();
+                faces.push_back(fan[i]);
+            }
+            const hull_face_t *face = &faces[id];
+            hull_face_t *other = &faces[face->neighbor[0]];
+            for (int j = 0; j < 3; j++) {
+                if (other->v[j] == face->v[1] && other->v[(j+1)%3] == face->v[0]) {
+                    other->neighbor[j] = id;
+                }
+            }
+            by_first.push_back(std::make_pair(face->v[0], id));
+            by_second.push_back(std::make_pair(face->v[1], id));
+            created.push_back(id);
+        }
+        std::sort(by_first.begin(), by_first.end());
+        std::sort(by_second.begin(), by_second.end());
+        for (size_t i = 0; i < created.size(); i++) {
+            hull_face_t *face = &faces[created[i]];
+            // across v1 -> eye is the face starting at v1, across eye -> v0
+            // the face ending at v0
+            face->neighbor[1] = std::lower_bound(by_first.begin(), by_first.end(), std::make_pair(face->v[1], (uint32_t)0))->second;
+            face->neighbor[2] = std::lower_bound(by_second.begin(), by_second.end(), std::make_pair(face->v[0], (uint32_t)0))->second;
+        }
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+        // orphans go to the first new face they're above, everything else is
+        // inside now
+        for (size_t i = 0; i < orphans.size(); i++) {
+            uint32_t p = orphans[i];
+            for (size_t j = 0; j < created.size(); j++) {
+                double d = hull_face_distance(&faces[created[j]], HULL_P(p));
+                if (d > eps) {
+                    hull_face_add_outside(&faces[created[j]], next, p, d);
+                    break;
+                }
+            }
+        }
+        for (size_t j = 0; j < created.size(); j++) {
+            if (faces[created[j]].outside != HULL_NONE) {
+                pending.push_back(created[j]);
+            }
+        }
+    }
+    #undef HULL_P
 
-    m->tx = 0;
-    m->ty = -t;
-    m->tz = 0;
-    m->tw = 1;
+    // compact to the points used by live faces
+    std::vector<uint32_t> remap(n, UINT32_MAX);
+    for (size_t f = 0; f < faces.size(); f++) {
+        if (faces[f].dead) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = faces[f].v[k];
+            if (remap[v] == UINT32_MAX) {
+                remap[v] = hull->points.size()/3;
+                hull->points.insert(hull->points.end(), points + 3*(size_t)v, points + 3*(size_t)v + 3);
+            }
+            hull->faces.push_back(remap[v]);
+        }
+    }
+    return 1;
 }
 
-inline void init_inv_tz_mat(mat *m, float t) {
-    m->xx = 1;
-    m->xy = 0;
-    m->xz = 0;
-    m->xw = 0;
-
-    m->yx = 0;
-    m->yy = 1;
-    m->yz = 0;
-    m->yw = 0;
+// The unique vertices of view that can be on its convex hull. Vertices
+// strictly inside the hull of the extreme points of a sample of facets in a
+// fixed set of directions are dropped while the file is read. Whole blocks
+// of facets whose bounds are inside are skipped, and a sphere and a box
+// inscribed in that hull are tested before its faces.
+#define STL_HULL_DIRECTIONS 128
 
-    m->zx = 0;
-    m->zy = 0;
-    m->zz = 1;
-    m->zw = 0;
+inline int stl_hull_planes_contain(const std::vector<double> &planes, double x, double y, double z) {
+    for (size_t f = 0; f < planes.size(); f += 4) {
+        if (planes[f]*x+planes[f+1]*y+planes[f+2]*z >= planes[f+3]) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    m->tx = 0;
-    m->ty = 0;
-    m->tz = -t;
-    m->tw = 1;
+inline int stl_hull_planes_contain_box(const std::vector<double> &planes, const double *lo, const double *hi) {
+    for (int corner = 0; corner < 8; corner++) {
+        double x = corner & 1 ? hi[0] : lo[0];
+        double y = corner & 2 ? hi[1] : lo[1];
+        double z = corner & 4 ? hi[2] : lo[2];
+        if (!stl_hull_planes_contain(planes, x, y, z)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-inline void mat_transpose(mat *m, mat *out) {
-    out->xx = m->xx;
-    out->xy = m->yx;
-    out->xz = m->zx;
-    out->xw = m->tx;
+inline void stl_view_hull_candidates(const stl_view_t *view, std::vector<double> *candidates, int threads) {
+    candidates->clear();
 
-    out->yx = m->xy;
-    out->yy = m->yy;
-    out->yz = m->zy;
-    out->yw = m->ty;
+    // extreme points of the sample in directions spread over the sphere
+    std::vector<double> extremes;
+    {
+        std::vector<double> best(STL_HULL_DIRECTIONS, -INFINITY);
+        std::vector<vec> support(STL_HULL_DIRECTIONS);
+        double golden = M_PI*(3-sqrt(5.0));
+        uint32_t step = view->facet_count/STL_BATCH_SIZE + 1;
+        facet_t facet;
+        for (uint32_t i = 0; i < view->facet_count; i += step) {
+            stl_view_facet(view, i, &facet);
+            for (int j = 0; j < 3; j++) {
+                const vec *p = &facet.vertices[j];
+                for (int k = 0; k < STL_HULL_DIRECTIONS; k++) {
+                    double z = 1 - (2*k + 1.0)/STL_HULL_DIRECTIONS;
+                    double r = sqrt(1 - z*z);
+                    double d = r*cos(golden*k)*p->x + r*sin(golden*k)*p->y + z*p->z;
+                    if (d > best[k]) {
+                        best[k] = d;
+                        support[k] = *p;
+                    }
+                }
+            }
+        }
+        if (view->facet_count > 0) {
+            for (int k = 0; k < STL_HULL_DIRECTIONS; k++) {
+                extremes.push_back(support[k].x);
+                extremes.push_back(support[k].y);
+                extremes.push_back(support[k].z);
+            }
+        }
+    }
+    convex_hull_t seed;
+    int have_seed = convex_hull_build(&seed, extremes.data(), extremes.size()/3);
+    std::vector<double> planes; // normal x y z, offset
+    double center[3] = { 0, 0, 0 }, inner = -1;
+    if (have_seed) {
+        size_t points = seed.points.size()/3;
+        for (size_t i = 0; i < seed.points.size(); i++) {
+            center[i%3] += seed.points[i]/points;
+        }
+        for (size_t f = 0; f < seed.faces.size(); f += 3) {
+            hull_face_t face;
+            face.v[0] = seed.faces[f]; face.v[1] = seed.faces[f+1]; face.v[2] = seed.faces[f+2];
+            hull_face_plane(&face, seed.points.data());
+            // slack so points on the faces are kept
+            double offset = face.offset - 1e-9*(fabs(face.offset) + 1);
+            planes.insert(planes.end(), face.normal, face.normal + 3);
+            planes.push_back(offset);
+            double d = offset - (face.normal[0]*center[0]+face.normal[1]*center[1]+face.normal[2]*center[2]);
+            if (inner < 0 || d < inner) {
+                inner = d;
+            }
+        }
+        inner = inner > 0 ? inner*inner*(1-1e-6) : -1;
+    }
+
+    // the largest box around center, similar to the hull's bounds, that
+    // fits inside
+    double box_lo[3] = { 0, 0, 0 }, box_hi[3] = { -1, -1, -1 };
+    if (have_seed) {
+        double lo[3], hi[3];
+        for (int k = 0; k < 3; k++) {
+            lo[k] = hi[k] = seed.points[k];
+        }
+        for (size_t i = 0; i < seed.points.size(); i++) {
+            lo[i%3] = std::min(lo[i%3], seed.points[i]);
+            hi[i%3] = std::max(hi[i%3], seed.points[i]);
+        }
+        double fits = 0, fails = 1;
+        for (int iteration = 0; iteration < 20; iteration++) {
+            double scale = .5*(fits+fails);
+            double l[3], h[3];
+            for (int k = 0; k < 3; k++) {
+                l[k] = center[k] + scale*(lo[k]-center[k]);
+                h[k] = center[k] + scale*(hi[k]-center[k]);
+            }
+            if (stl_hull_planes_contain_box(planes, l, h)) {
+                fits = scale;
+            } else {
+                fails = scale;
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            box_lo[k] = center[k] + fits*(lo[k]-center[k]);
+            box_hi[k] = center[k] + fits*(hi[k]-center[k]);
+        }
+    }
 
-    out->zx = m->xz;
-    out->zy = m->yz;
-    out->zz = m->zz;
-    out->zw = m->tz;
+    size_t batches = (view->facet_count + STL_BATCH_SIZE - 1)/STL_BATCH_SIZE;
+    std::vector<std::vector<vec> > kept(threads > 1 ? threads : 1);
+    parallel_slices(batches, threads, 4, [&](size_t begin, size_t end, int t) {
+        stl_facet_block_t *block = new stl_facet_block_t;
+        // vertices are shared by neighboring facets, which are usually close
+        // in the file, so recently seen vertices are skipped
+        std::vector<vec> recent(STL_BATCH_SIZE);
+        for (size_t i = 0; i < recent.size(); i++) {
+            recent[i].x = recent[i].y = recent[i].z = NAN;
+        }
+        for (size_t b = begin; b < end; b++) {
+            size_t n = 0;
+            while (n < STL_BATCH_SIZE && b*STL_BATCH_SIZE + n < view->facet_count) {
+                size_t loaded = stl_load_facet_block(view, b*STL_BATCH_SIZE + n, block);
+                n += loaded;
+                if (have_seed) {
+                    bounds_t bounds;
+                    stl_facet_block_bounds(block, loaded, &bounds);
+                    double lo[3] = { bounds.min.x, bounds.min.y, bounds.min.z };
+                    double hi[3] = { bounds.max.x, bounds.max.y, bounds.max.z };
+                    if (stl_hull_planes_contain_box(planes, lo, hi)) {
+                        continue;
+                    }
+                }
+                for (int j = 0; j < 9; j += 3) {
+                    const float *x = block->v[j], *y = block->v[j+1], *z = block->v[j+2];
+                    for (size_t i = 0; i < loaded; i++) {
+                        if (x[i] > box_lo[0] && x[i] < box_hi[0] &&
+                            y[i] > box_lo[1] && y[i] < box_hi[1] &&
+                            z[i] > box_lo[2] && z[i] < box_hi[2]) {
+                            continue;
+                        }
+                        double dx = x[i]-center[0], dy = y[i]-center[1], dz = z[i]-center[2];
+                        if (dx*dx+dy*dy+dz*dz < inner) {
+                            continue;
+                        }
+                        uint32_t bits[3];
+                        memcpy(&bits[0], &x[i], 4);
+                        memcpy(&bits[1], &y[i], 4);
+                        memcpy(&bits[2], &z[i], 4);
+                        vec *seen = &recent[weld_hash(bits[0], bits[1], bits[2]) % STL_BATCH_SIZE];
+                        if (seen->x == x[i] && seen->y == y[i] && seen->z == z[i]) {
+                            continue;
+                        }
+                        seen->x = x[i]; seen->y = y[i]; seen->z = z[i];
+                        if (!have_seed || !stl_hull_planes_contain(planes, x[i], y[i], z[i])) {
+                            kept[t].push_back(*seen);
+                        }
+                    }
+                }
+            }
+        }
+        delete block;
+    });
 
-    out->tx = m->xw;
-    out->ty = m->yw;
-    out->tz = m->zw;
-    out->tw = m->tw;
+    std::vector<vec> points;
+    for (size_t t = 0; t < kept.size(); t++) {
+        points.insert(points.end(), kept[t].begin(), kept[t].end());
+        std::vector<vec>().swap(kept[t]);
+    }
+    std::sort(points.begin(), points.end(), [](const vec &a, const vec &b) {
+        return stl_circle_point_less(a, b) != 0;
+    });
+    for (size_t i = 0; i < points.size(); i++) {
+        if (i == 0 || stl_circle_point_less(points[i-1], points[i])) {
+            candidates->push_back(points[i].x);
+            candidates->push_back(points[i].y);
+            candidates->push_back(points[i].z);
+        }
+    }
 }
 
-inline void mat_mult(mat *m1, mat *m2, mat *out) {
-    out->xx = m1->xx*m2->xx+m1->xy*m2->yx+m1->xz*m2->zx+m1->xw*m2->tx;
-    out->xy = m1->xx*m2->xy+m1->xy*m2->yy+m1->xz*m2->zy+m1->xw*m2->ty;
-    out->xz = m1->xx*m2->xz+m1->xy*m2->yz+m1->xz*m2->zz+m1->xw*m2->tz;
-    out->xw = m1->xx*m2->xw+m1->xy*m2->yw+m1->xz*m2->zw+m1->xw*m2->tw;
-
-    out->yx = m1->yx*m2->xx+m1->yy*m2->yx+m1->yz*m2->zx+m1->yw*m2->tx;
-    out->yy = m1->yx*m2->xy+m1->yy*m2->yy+m1->yz*m2->zy+m1->yw*m2->ty;
-    out->yz = m1->yx*m2->xz+m1->yy*m2->yz+m1->yz*m2->zz+m1->yw*m2->tz;
-    out->yw = m1->yx*m2->xw+m1->yy*m2->yw+m1->yz*m2->zw+m1->yw*m2->tw;
+// Convex hull of all vertices in view. Returns 0 if they lie in a plane.
+inline int stl_view_convex_hull(const stl_view_t *view, convex_hull_t *hull, int threads) {
+    std::vector<double> candidates;
+    stl_view_hull_candidates(view, &candidates, threads);
+    return convex_hull_build(hull, candidates.data(), candidates.size()/3);
+}
 
-    out->zx = m1->zx*m2->xx+m1->zy*m2->yx+m1->zz*m2->zx+m1->zw*m2->tx;
-    out->zy = m1->zx*m2->xy+m1->zy*m2->yy+m1->zz*m2->zy+m1->zw*m2->ty;
-    out->zz = m1->zx*m2->xz+m1->zy*m2->yz+m1->zz*m2->zz+m1->zw*m2->tz;
-    out->zw = m1->zx*m2->xw+m1->zy*m2->yw+m1->zz*m2->zw+m1->zw*m2->tw;
+// Volume integrals of each facet's tetrahedron to the origin, scaled by six
+// times its signed volume d: d*(x0+x1+x2) for the first moments (x, y, z),
+// d*(x0^2+x1^2+x2^2+x0*x1+x0*x2+x1*x2) for the second moments (xx, yy, zz)
+// and d*(2*x0*y0+2*x1*y1+2*x2*y2+x0*y1+x1*y0+x0*y2+x2*y0+x1*y2+x2*y1) for the
+// products (xy, yz, zx). Dividing the sums by 24, 60 and 120 gives the
+// integrals over the solid.
+#define STL_MOMENT_TERMS 9
 
-    out->tx = m1->tx*m2->xx+m1->ty*m2->yx+m1->tz*m2->zx+m1->tw*m2->tx;
-    out->ty = m1->tx*m2->xy+m1->ty*m2->yy+m1->tz*m2->zy+m1->tw*m2->ty;
-    out->tz = m1->tx*m2->xz+m1->ty*m2->yz+m1->tz*m2->zz+m1->tw*m2->tz;
-    out->tw = m1->tx*m2->xw+m1->ty*m2->yw+m1->tz*m2->zw+m1->tw*m2->tw;
+typedef struct {
+    double v[STL_MOMENT_TERMS][STL_BATCH_SIZE];
+} stl_moment_terms_t;
+
+__attribute__((always_inline)) inline void stl_moment_terms_kernel(const stl_facet_block_t *block, size_t n, stl_moment_terms_t *__restrict terms, size_t offset) {
+    const float *x0 = block->v[0], *y0 = block->v[1], *z0 = block->v[2];
+    const float *x1 = block->v[3], *y1 = block->v[4], *z1 = block->v[5];
+    const float *x2 = block->v[6], *y2 = block->v[7], *z2 = block->v[8];
+    double *m[STL_MOMENT_TERMS];
+    for (int j = 0; j < STL_MOMENT_TERMS; j++) {
+        m[j] = terms->v[j] + offset;
+    }
+    for (size_t i = 0; i < n; i++) {
+        double ax = x0[i], ay = y0[i], az = z0[i];
+        double bx = x1[i], by = y1[i], bz = z1[i];
+        double cx = x2[i], cy = y2[i], cz = z2[i];
+        double d = (ay*bz-az*by)*cx + (az*bx-ax*bz)*cy + (ax*by-ay*bx)*cz;
+        m[0][i] = d*(ax+bx+cx);
+        m[1][i] = d*(ay+by+cy);
+        m[2][i] = d*(az+bz+cz);
+        m[3][i] = d*(ax*ax+bx*bx+cx*cx+ax*bx+ax*cx+bx*cx);
+        m[4][i] = d*(ay*ay+by*by+cy*cy+ay*by+ay*cy+by*cy);
+        m[5][i] = d*(az*az+bz*bz+cz*cz+az*bz+az*cz+bz*cz);
+        m[6][i] = d*(2*(ax*ay+bx*by+cx*cy)+ax*by+bx*ay+ax*cy+cx*ay+bx*cy+cx*by);
+        m[7][i] = d*(2*(ay*az+by*bz+cy*cz)+ay*bz+by*az+ay*cz+cy*az+by*cz+cy*bz);
+        m[8][i] = d*(2*(az*ax+bz*bx+cz*cx)+az*bx+bz*ax+az*cx+cz*ax+bz*cx+cz*bx);
+    }
 }
 
-inline void vec_mat_mult(vec *v, mat *m, vec *out) {
-    out->x = v->x*m->xx+v->y*m->yx+v->z*m->zx+v->w*m->tx;
-    out->y = v->x*m->xy+v->y*m->yy+v->z*m->zy+v->w*m->ty;
-    out->z = v->x*m->xz+v->y*m->yz+v->z*m->zz+v->w*m->tz;
-    out->w = v->x*m->xw+v->y*m->yw+v->z*m->zw+v->w*m->tw;
+#ifdef STL_HAVE_AVX2_KERNELS
+__attribute__((target("avx2"))) inline void stl_moment_terms_avx2(const stl_facet_block_t *block, size_t n, stl_moment_terms_t *terms, size_t offset) {
+    stl_moment_terms_kernel(block, n, terms, offset);
 }
+#endif
 
-inline float vec_magnitude(vec *v) {
-    return sqrt(v->x*v->x+v->y*v->y+v->z*v->z);
+inline void stl_moment_terms_generic(const stl_facet_block_t *block, size_t n, stl_moment_terms_t *terms, size_t offset) {
+    stl_moment_terms_kernel(block, n, terms, offset);
 }
 
-inline void vec_normalize(vec *v, vec *out) {
-    float invmag = 1./vec_magnitude(v);
-    out->x = v->x*invmag;
-    out->y = v->y*invmag;
-    out->z = v->z*invmag;
+inline void stl_moment_terms(const stl_facet_block_t *block, size_t n, stl_moment_terms_t *terms, size_t offset) {
+#ifdef STL_HAVE_AVX2_KERNELS
+    static const int has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        stl_moment_terms_avx2(block, n, terms, offset);
+        return;
+    }
+#endif
+    stl_moment_terms_generic(block, n, terms, offset);
 }
 
-inline int vec_equals(vec *v, vec *v2) {
-    return fabs(v->x-v2->x) < EPSILON &&
-           fabs(v->y-v2->y) < EPSILON &&
-           fabs(v->z-v2->z) < EPSILON;
-}
+// Mass properties of a binary STL file, assuming unit density.
+typedef struct {
+    uint32_t facet_count;
+    bounds_t bounds;
+    double area;
+    double volume; // signed, negative if the facets are oriented inwards
+    double centroid[3];
+    double inertia[3][3]; // about the centroid
+    bcylinder_t bcylinder;
+} stl_measure_t;
+
+// Bounds, area, signed volume, centroid, inertia tensor and bounding cylinder
+// along the y axis in one parallel pass over the facets, summed the same way
+// as stl_view_area_volume so the results don't depend on the thread count.
+inline void stl_view_measure(const stl_view_t *view, stl_measure_t *measure) {
+    memset(measure, 0x00, sizeof(stl_measure_t));
+    measure->facet_count = view->facet_count;
+
+    size_t batches = (view->facet_count + STL_BATCH_SIZE - 1)/STL_BATCH_SIZE;
+    int threads = std::thread::hardware_concurrency();
+    std::vector<double> sums[2 + STL_MOMENT_TERMS];
+    for (int j = 0; j < 2 + STL_MOMENT_TERMS; j++) {
+        sums[j].resize(batches);
+    }
+    std::vector<bounds_t> batch_bounds(batches);
+    std::vector<stl_circle_filter_t> filters(threads > 1 ? threads : 1);
+    stl_circle_filter_init(&filters[0], STL_AXIS_Y);
+    stl_circle_filter_seed(&filters[0], view);
+    for (size_t t = 1; t < filters.size(); t++) {
+        filters[t] = filters[0];
+    }
+    parallel_slices(batches, threads, 4, [&](size_t begin, size_t end, int t) {
+        stl_facet_block_t *block = new stl_facet_block_t;
+        stl_moment_terms_t *terms = new stl_moment_terms_t;
+        std::vector<double> areas(STL_BATCH_SIZE);
+        std::vector<double> volumes(STL_BATCH_SIZE);
+        for (size_t b = begin; b < end; b++) {
+            size_t n = 0;
+            while (n < STL_BATCH_SIZE && b*STL_BATCH_SIZE + n < view->facet_count) {
+                size_t loaded = stl_load_facet_block(view, b*STL_BATCH_SIZE + n, block);
+                stl_facet_terms(block, loaded, &areas[n], &volumes[n]);
+                stl_moment_terms(block, loaded, terms, n);
+                bounds_t block_bounds;
+                stl_facet_block_bounds(block, loaded, &block_bounds);
+                stl_bounds_union(&batch_bounds[b], &block_bounds, n == 0);
+                stl_circle_filter_add_block(&filters[t], block, loaded);
+                n += loaded;
+            }
+            sums[0][b] = stl_pairwise_sum(&areas[0], n);
+            sums[1][b] = stl_pairwise_sum(&volumes[0], n);
+            for (int j = 0; j < STL_MOMENT_TERMS; j++) {
+                sums[2 + j][b] = stl_pairwise_sum(terms->v[j], n);
+            }
+        }
+        delete terms;
+        delete block;
+    });
+    if (batches == 0) {
+        return;
+    }
 
-inline int vec_equals_exact(vec *v, vec *v2) {
-    return v->x-v2->x == 0 &&
-           v->y-v2->y == 0 &&
-           v->z-v2->z == 0;
-}
+    double total[2 + STL_MOMENT_TERMS];
+    for (int j = 0; j < 2 + STL_MOMENT_TERMS; j++) {
+        total[j] = stl_pairwise_sum(sums[j].data(), batches);
+    }
+    measure->area = total[0];
+    measure->volume = total[1]/6;
 
-inline void vec_copy(vec *v, vec *out) {
-    out->x = v->x;
-    out->y = v->y;
-    out->z = v->z;
-    out->w = v->w;
-}
+    bounds_t *b = &measure->bounds;
+    for (size_t k = 0; k < batches; k++) {
+        stl_bounds_union(b, &batch_bounds[k], k == 0);
+    }
 
-inline void mat_copy(mat *m1, mat *out) {
-    out->xx = m1->xx;
-    out->xy = m1->xy;
-    out->xz = m1->xz;
-    out->xw = m1->xw;
+    double V = measure->volume;
+    double *c = measure->centroid;
+    if (V != 0) {
+        for (int k = 0; k < 3; k++) {
+            c[k] = total[2 + k]/24/V;
+        }
 
-    out->yx = m1->yx;
-    out->yy = m1->yy;
-    out->yz = m1->yz;
-    out->yw = m1->yw;
+        // second moments about the origin, then moved to the centroid
+        double xx = total[5]/60, yy = total[6]/60, zz = total[7]/60;
+        double xy = total[8]/120, yz = total[9]/120, zx = total[10]/120;
+        xx -= V*c[0]*c[0]; yy -= V*c[1]*c[1]; zz -= V*c[2]*c[2];
+        xy -= V*c[0]*c[1]; yz -= V*c[1]*c[2]; zx -= V*c[2]*c[0];
+
+        // inwards facing meshes give negative integrals of a positive mass
+        double sign = V < 0 ? -1 : 1;
+        double (*I)[3] = measure->inertia;
+        I[0][0] = sign*(yy+zz); I[1][1] = sign*(zz+xx); I[2][2] = sign*(xx+yy);
+        // + 0 so symmetric parts print 0 rather than -0
+        I[0][1] = I[1][0] = -sign*xy + 0;
+        I[1][2] = I[2][1] = -sign*yz + 0;
+        I[2][0] = I[0][2] = -sign*zx + 0;
+    } else {
+        c[0] = .5*(b->max.x+b->min.x);
+        c[1] = .5*(b->max.y+b->min.y);
+        c[2] = .5*(b->max.z+b->min.z);
+    }
 
-    out->zx = m1->zx;
-    out->zy = m1->zy;
-    out->zz = m1->zz;
-    out->zw = m1->zw;
+    for (size_t t = 1; t < filters.size(); t++) {
+        stl_circle_filter_merge(&filters[0], &filters[t]);
+    }
+    stl_circle_filter_finish(&filters[0]);
+    stl_circle_filter_bcylinder(&filters[0], STL_AXIS_Y, b, &measure->bcylinder);
+}
 
-    out->tx = m1->tx;
-    out->ty = m1->ty;
-    out->tz = m1->tz;
-    out->tw = m1->tw;
+// Everything the query tools report about a binary STL file. With the
+// STL_CMD_META_CACHE environment variable set to anything but 0 the tools
+// keep it in a <file>.stlmeta sidecar and answer from there as long as the
+// file's identity still matches: size, inode, modification and change times
+// to the nanosecond and a hash of its first and last blocks. Checking it
+// takes an fstat and two small reads whatever the size of the file.
+typedef struct {
+    uint64_t file_size;
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime; // nanoseconds
+    int64_t ctime; // nanoseconds
+    uint64_t fingerprint;
+
+    uint32_t facet_count;
+    bounds_t bounds;
+    double area;
+    double volume;
+    vec centroid;
+    bcylinder_t bcylinder;
+} stl_meta_t;
+
+#define STL_META_ENV "STL_CMD_META_CACHE"
+#define STL_META_SUFFIX ".stlmeta"
+#define STL_META_VERSION 6
+#define STL_META_SAMPLE_SIZE 4096
+
+inline int stl_meta_enabled() {
+    const char *value = getenv(STL_META_ENV);
+    return value && *value && strcmp(value, "0") != 0;
 }
 
-inline void vec_cross(vec *a, vec *b, vec *out) {
-    out->x = a->y*b->z-a->z*b->y;
-    out->y = a->z*b->x-a->x*b->z;
-    out->z = a->x*b->y-a->y*b->x;
+// FNV-1a over 8 byte words of data, one multiply per word.
+inline uint64_t stl_meta_hash(const unsigned char *data, size_t length, uint64_t hash) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word)*0x100000001b3ULL;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ data[i])*0x100000001b3ULL;
+    }
+    return hash;
 }
 
-inline void vec_add(vec *a, vec *b, vec *out) {
-    out->x = a->x+b->x;
-    out->y = a->y+b->y;
-    out->z = a->z+b->z;
+// Hash of the first and last STL_META_SAMPLE_SIZE bytes of fd, which hold
+// the header and facet count. Edits anywhere else are caught by the change
+// time, which can't be set back from user space.
+inline int stl_meta_fingerprint(int fd, uint64_t size, uint64_t *fingerprint) {
+    unsigned char sample[2*STL_META_SAMPLE_SIZE];
+    size_t head = std::min(size, (uint64_t)STL_META_SAMPLE_SIZE);
+    size_t tail = std::min(size - head, (uint64_t)STL_META_SAMPLE_SIZE);
+    if (pread(fd, sample, head, 0) != (ssize_t)head ||
+        pread(fd, sample + head, tail, size - tail) != (ssize_t)tail) {
+        return 0;
+    }
+    uint64_t hash = stl_meta_hash((const unsigned char*)&size, sizeof(size), 0xcbf29ce484222325ULL);
+    *fingerprint = stl_meta_hash(sample, head + tail, hash);
+    return 1;
 }
 
-inline void vec_sub(vec *a, vec *b, vec *out) {
-    out->x = a->x-b->x;
-    out->y = a->y-b->y;
-    out->z = a->z-b->z;
+inline int64_t stl_stat_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec*1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+#endif
 }
 
-inline float vec_dot(vec *a, vec *b) {
-    return a->x*b->x+a->y*b->y+a->z*b->z;
+inline int64_t stl_stat_ctime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_ctimespec.tv_sec*1000000000 + st->st_ctimespec.tv_nsec;
+#else
+    return (int64_t)st->st_ctim.tv_sec*1000000000 + st->st_ctim.tv_nsec;
+#endif
 }
 
-inline void write_tri(FILE *f,
-                vec *p1,
-                vec *p2,
-                vec *p3, int rev) {
-    if (rev) {
-        vec *tmp = p1;
-        p1 = p3;
-        p3 = tmp;
+// Fills in the identity of the regular file open as fd.
+inline int stl_meta_stat(int fd, stl_meta_t *meta) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
     }
+    meta->file_size = st.st_size;
+    meta->device = st.st_dev;
+    meta->inode = st.st_ino;
+    meta->mtime = stl_stat_mtime_ns(&st);
+    meta->ctime = stl_stat_ctime_ns(&st);
+    return stl_meta_fingerprint(fd, meta->file_size, &meta->fingerprint);
+}
 
-    vec n1;
-    vec v1,v2;
+inline void stl_meta_compute(const stl_view_t *view, stl_meta_t *meta) {
+    stl_measure_t measure;
+    stl_view_measure(view, &measure);
+    meta->facet_count = measure.facet_count;
+    meta->bounds = measure.bounds;
+    meta->area = measure.area;
+    meta->volume = fabs(measure.volume);
+    memset(&meta->centroid, 0x00, sizeof(vec));
+    meta->centroid.x = measure.centroid[0];
+    meta->centroid.y = measure.centroid[1];
+    meta->centroid.z = measure.centroid[2];
+    meta->bcylinder = measure.bcylinder;
+}
 
-    vec_sub(p2,p1,&v1);
-    vec_sub(p3,p1,&v2);
+inline void stl_meta_write_floats(FILE *f, const char *key, const float *values, int n) {
+    char text[STL_FLOAT_CHARS];
+    fputs(key, f);
+    for (int i = 0; i < n; i++) {
+        fputc(' ', f);
+        fwrite(text, 1, format_float_shortest(values[i], text), f);
+    }
+    fputc('\n', f);
+}
 
-    vec_cross(&v1,&v2,&n1);
-    vec_normalize(&n1,&n1);
+inline void stl_meta_write_vec(FILE *f, const char *key, const vec *v) {
+    float values[3] = { v->x, v->y, v->z };
+    stl_meta_write_floats(f, key, values, 3);
+}
+
+// Writes the sidecar of file through a temporary file so readers never see
+// a partial one. Returns 0 if it can't be written, e.g. in a read only
+// directory.
+inline int stl_meta_save(const char *file, const stl_meta_t *meta) {
+    size_t length = strlen(file);
+    char *path = (char*)malloc(length + 64);
+    char *tmp_path = (char*)malloc(length + 64);
+    snprintf(path, length + 64, "%s%s", file, STL_META_SUFFIX);
+    snprintf(tmp_path, length + 64, "%s%s.%d", file, STL_META_SUFFIX, (int)getpid());
+
+    int ok = 0;
+    FILE *f = fopen(tmp_path, "w");
+    if (f) {
+        fprintf(f, "stlmeta %d\n", STL_META_VERSION);
+        fprintf(f, "size %llu\n", (unsigned long long)meta->file_size);
+        fprintf(f, "device %llu\n", (unsigned long long)meta->device);
+        fprintf(f, "inode %llu\n", (unsigned long long)meta->inode);
+        fprintf(f, "mtime %lld\n", (long long)meta->mtime);
+        fprintf(f, "ctime %lld\n", (long long)meta->ctime);
+        fprintf(f, "fingerprint %016llx\n", (unsigned long long)meta->fingerprint);
+        fprintf(f, "facets %u\n", meta->facet_count);
+        stl_meta_write_vec(f, "min", &meta->bounds.min);
+        stl_meta_write_vec(f, "max", &meta->bounds.max);
+        fprintf(f, "area %.17g\n", meta->area);
+        fprintf(f, "volume %.17g\n", meta->volume);
+        stl_meta_write_vec(f, "centroid", &meta->centroid);
+        stl_meta_write_vec(f, "bcylinder_center", &meta->bcylinder.center);
+        stl_meta_write_vec(f, "bcylinder_point", &meta->bcylinder.point);
+        stl_meta_write_floats(f, "bcylinder_radius", &meta->bcylinder.radius, 1);
+        stl_meta_write_floats(f, "bcylinder_height", &meta->bcylinder.height, 1);
+        ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok) {
+            unlink(tmp_path);
+        }
+    }
+    free(path);
+    free(tmp_path);
+    return ok;
+}
 
-    uint16_t abc = 0;
+// Reads the sidecar of file into meta. Returns 0 if there is none or it
+// doesn't match current, the identity of file from stl_meta_stat.
+inline int stl_meta_read(const char *file, const stl_meta_t *current, stl_meta_t *meta) {
+    size_t length = strlen(file);
+    char *path = (char*)malloc(length + 64);
+    snprintf(path, length + 64, "%s%s", file, STL_META_SUFFIX);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) {
+        return 0;
+    }
 
-    fwrite(&n1, 1, 12, f);
-    fwrite(p1, 1, 12, f);
-    fwrite(p2, 1, 12, f);
-    fwrite(p3, 1, 12, f);
-    fwrite(&abc,1,  2, f);
+    memset(meta, 0x00, sizeof(stl_meta_t));
+    char line[512];
+    char key[64];
+    int version = 0;
+    int fields = 0;
+    while (fgets(line, sizeof(line), f)) {
+        int offset = 0;
+        if (sscanf(line, "%63s %n", key, &offset) != 1) {
+            continue;
+        }
+        const char *p = line + offset;
+        float *values = NULL;
+        int n = 0;
+        unsigned long long u;
+        if (strcmp(key, "stlmeta") == 0) {
+            version = atoi(p);
+        } else if (strcmp(key, "size") == 0 && sscanf(p, "%llu", &u) == 1) {
+            meta->file_size = u;
+            fields++;
+        } else if (strcmp(key, "device") == 0 && sscanf(p, "%llu", &u) == 1) {
+            meta->device = u;
+            fields++;
+        } else if (strcmp(key, "inode") == 0 && sscanf(p, "%llu", &u) == 1) {
+            meta->inode = u;
+            fields++;
+        } else if (strcmp(key, "mtime") == 0) {
+            meta->mtime = strtoll(p, NULL, 10);
+            fields++;
+        } else if (strcmp(key, "ctime") == 0) {
+            meta->ctime = strtoll(p, NULL, 10);
+            fields++;
+        } else if (strcmp(key, "fingerprint") == 0 && sscanf(p, "%llx", &u) == 1) {
+            meta->fingerprint = u;
+            fields++;
+        } else if (strcmp(key, "facets") == 0 && sscanf(p, "%llu", &u) == 1) {
+            meta->facet_count = (uint32_t)u;
+            fields++;
+        } else if (strcmp(key, "min") == 0) {
+            values = &meta->bounds.min.x; n = 3;
+        } else if (strcmp(key, "max") == 0) {
+            values = &meta->bounds.max.x; n = 3;
+        } else if (strcmp(key, "area") == 0 && sscanf(p, "%lf", &meta->area) == 1) {
+            fields++;
+        } else if (strcmp(key, "volume") == 0 && sscanf(p, "%lf", &meta->volume) == 1) {
+            fields++;
+        } else if (strcmp(key, "centroid") == 0) {
+            values = &meta->centroid.x; n = 3;
+        } else if (strcmp(key, "bcylinder_center") == 0) {
+            values = &meta->bcylinder.center.x; n = 3;
+        } else if (strcmp(key, "bcylinder_point") == 0) {
+            values = &meta->bcylinder.point.x; n = 3;
+        } else if (strcmp(key, "bcylinder_radius") == 0) {
+            values = &meta->bcylinder.radius; n = 1;
+        } else if (strcmp(key, "bcylinder_height") == 0) {
+            values = &meta->bcylinder.height; n = 1;
+        }
+        if (values) {
+            char *end;
+            int i;
+            for (i = 0; i < n; i++) {
+                values[i] = strtof(p, &end);
+                if (end == p) {
+                    break;
+                }
+                p = end;
+            }
+            if (i == n) {
+                fields++;
+            }
+        }
+    }
+    fclose(f);
+
+    return version == STL_META_VERSION && fields == 16 &&
+        meta->file_size == current->file_size &&
+        meta->device == current->device &&
+        meta->inode == current->inode &&
+        meta->mtime == current->mtime &&
+        meta->ctime == current->ctime &&
+        meta->fingerprint == current->fingerprint;
 }
 
-inline void write_quad(FILE *f,
-                vec *p1,
-                vec *p2,
-                vec *p3,
-                vec *p4,int rev) {
-    //write two triangles 1,2,3 and 1,3,4
-    if (rev) {
-        vec *tmp = p1;
-        p1 = p4;
-        p4 = tmp;
+// Reads the sidecar of file into meta. Returns 0 if there is none or it is
+// out of date.
+inline int stl_meta_load(const char *file, stl_meta_t *meta) {
+    FILE *f = fopen(file, "rb");
+    if (!f) {
+        return 0;
+    }
+    stl_meta_t current;
+    int ok = stl_meta_stat(fileno(f), &current);
+    fclose(f);
+    return ok && stl_meta_read(file, &current, meta);
+}
 
-        tmp = p2;
-        p2 = p3;
-        p3 = tmp;
+// Gets the metadata of a binary STL file from its sidecar, or computes it
+// and writes the sidecar for next time. Returns 0 if file isn't a valid
+// binary STL file.
+inline int stl_meta_query(const char *file, stl_meta_t *meta) {
+    FILE *f = fopen(file, "rb");
+    if (!f) {
+        return 0;
+    }
+    stl_meta_t current;
+    memset(&current, 0x00, sizeof(stl_meta_t));
+    int can_cache = stl_meta_stat(fileno(f), &current);
+    if (can_cache && stl_meta_read(file, &current, meta)) {
+        fclose(f);
+        return 1;
     }
 
-    vec n1,n2;
+    stl_view_t view;
+    if (!stl_view_open(&view, f)) {
+        fclose(f);
+        return 0;
+    }
+    *meta = current;
+    stl_meta_compute(&view, meta);
+    stl_view_close(&view);
+    fclose(f);
 
-    vec v1,v2,v3;
+    if (can_cache) {
+        stl_meta_save(file, meta);
+    }
+    return 1;
+}
 
-    vec_sub(p2,p1,&v1);
-    vec_sub(p3,p1,&v2);
-    vec_sub(p4,p1,&v3);
+// An affine transformation of binary STL records. Vertices are multiplied
+// by m and normals by normal_m, the inverse transpose, then renormalized
+// with normalize, the same arithmetic as vec_mat_mult and vec_normalize.
+typedef struct {
+    mat m;
+    mat normal_m;
+    int normalize;
+    // only scales and translations, each coordinate depends on itself
+    int axis_aligned;
+} stl_transform_t;
+
+inline void stl_transform_init(stl_transform_t *t, const mat *m, const mat *normal_m, int normalize) {
+    t->m = *m;
+    t->normal_m = *normal_m;
+    t->normalize = normalize;
+    t->axis_aligned = 1;
+    const mat *ms[2] = { m, normal_m };
+    for (int i = 0; i < 2; i++) {
+        const mat *a = ms[i];
+        if (a->xy != 0 || a->xz != 0 || a->yx != 0 || a->yz != 0 || a->zx != 0 || a->zy != 0) {
+            t->axis_aligned = 0;
+        }
+    }
+}
 
-    vec_cross(&v1,&v2,&n1);
-    vec_normalize(&n1,&n1);
+// Records in one array per float (normal xyz, then the vertices), the layout
+// the transform kernel vectorizes on.
+typedef struct {
+    float v[12][STL_FACET_BLOCK_SIZE];
+} stl_record_block_t;
+
+// Transforms n facets in block. The general case multiplies by the full
+// 4x4 matrices. Scales and translations skip the terms with zero factors,
+// which for finite coordinates only ever added a zero, so both give the
+// bits vec_mat_mult does.
+__attribute__((always_inline)) inline void stl_transform_block_kernel(const stl_transform_t *t, stl_record_block_t *block, size_t n) {
+    const mat *m = &t->m;
+    const mat *nm = &t->normal_m;
+    // normals have w = 0, which still adds 0*tx
+    const float nw[3] = { 0.0f*nm->tx, 0.0f*nm->ty, 0.0f*nm->tz };
+    float *__restrict nx = block->v[0];
+    float *__restrict ny = block->v[1];
+    float *__restrict nz = block->v[2];
+    if (t->axis_aligned) {
+        for (size_t i = 0; i < n; i++) {
+            nx[i] = nx[i]*nm->xx+nw[0];
+            ny[i] = ny[i]*nm->yy+nw[1];
+            nz[i] = nz[i]*nm->zz+nw[2];
+        }
+        for (int j = 3; j < 12; j += 3) {
+            float *__restrict x = block->v[j];
+            float *__restrict y = block->v[j+1];
+            float *__restrict z = block->v[j+2];
+            for (size_t i = 0; i < n; i++) {
+                x[i] = x[i]*m->xx+m->tx;
+                y[i] = y[i]*m->yy+m->ty;
+                z[i] = z[i]*m->zz+m->tz;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            float x = nx[i], y = ny[i], z = nz[i];
+            nx[i] = x*nm->xx+y*nm->yx+z*nm->zx+nw[0];
+            ny[i] = x*nm->xy+y*nm->yy+z*nm->zy+nw[1];
+            nz[i] = x*nm->xz+y*nm->yz+z*nm->zz+nw[2];
+        }
+        for (int j = 3; j < 12; j += 3) {
+            float *__restrict vx = block->v[j];
+            float *__restrict vy = block->v[j+1];
+            float *__restrict vz = block->v[j+2];
+            for (size_t i = 0; i < n; i++) {
+                float x = vx[i], y = vy[i], z = vz[i];
+                vx[i] = x*m->xx+y*m->yx+z*m->zx+m->tx;
+                vy[i] = x*m->xy+y*m->yy+z*m->zy+m->ty;
+                vz[i] = x*m->xz+y*m->yz+z*m->zz+m->tz;
+            }
+        }
+    }
+    if (t->normalize) {
+        for (size_t i = 0; i < n; i++) {
+            float magnitude = sqrt(nx[i]*nx[i]+ny[i]*ny[i]+nz[i]*nz[i]);
+            float invmag = 1./magnitude;
+            nx[i] *= invmag;
+            ny[i] *= invmag;
+            nz[i] *= invmag;
+        }
+    }
+}
 
-    vec_cross(&v2,&v3,&n2);
-    vec_normalize(&n2,&n2);
+#ifdef STL_HAVE_AVX2_KERNELS
+__attribute__((target("avx2"))) inline void stl_transform_block_avx2(const stl_transform_t *t, stl_record_block_t *block, size_t n) {
+    stl_transform_block_kernel(t, block, n);
+}
+#endif
 
-    uint16_t abc = 0;
+inline void stl_transform_block_generic(const stl_transform_t *t, stl_record_block_t *block, size_t n) {
+    stl_transform_block_kernel(t, block, n);
+}
 
-    fwrite(&n1, 1, 12, f);
-    fwrite(p1, 1, 12, f);
-    fwrite(p2, 1, 12, f);
-    fwrite(p3, 1, 12, f);
-    fwrite(&abc,1,  2, f);
+// Transforms n records from in to out, which may be the same memory.
+inline void stl_transform_records(const stl_transform_t *t, const unsigned char *in, unsigned char *out, size_t n) {
+#ifdef STL_HAVE_AVX2_KERNELS
+    static const int has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    stl_record_block_t block;
+    for (size_t first = 0; first < n; first += STL_FACET_BLOCK_SIZE) {
+        size_t count = std::min((size_t)STL_FACET_BLOCK_SIZE, n - first);
+        const unsigned char *record = in + STL_RECORD_SIZE*first;
+        for (size_t i = 0; i < count; i++, record += STL_RECORD_SIZE) {
+            float p[12];
+            memcpy(p, record, 48);
+            for (int j = 0; j < 12; j++) {
+                block.v[j][i] = p[j];
+            }
+        }
+#ifdef STL_HAVE_AVX2_KERNELS
+        if (has_avx2) {
+            stl_transform_block_avx2(t, &block, count);
+        } else
+#endif
+        stl_transform_block_generic(t, &block, count);
+        record = in + STL_RECORD_SIZE*first;
+        unsigned char *written = out + STL_RECORD_SIZE*first;
+        for (size_t i = 0; i < count; i++, record += STL_RECORD_SIZE, written += STL_RECORD_SIZE) {
+            float p[12];
+            for (int j = 0; j < 12; j++) {
+                p[j] = block.v[j][i];
+            }
+            memcpy(written, p, 48);
+            if (written != record) {
+                memcpy(written + 48, record + 48, 2);
+            }
+        }
+    }
+}
 
-    fwrite(&n2, 1, 12, f);
-    fwrite(p1, 1, 12, f);
-    fwrite(p3, 1, 12, f);
-    fwrite(p4, 1, 12, f);
-    fwrite(&abc,1,  2, f);
+// stl_transform_records split over threads.
+inline void stl_transform_records_parallel(const stl_transform_t *t, const unsigned char *in, unsigned char *out, size_t n, int threads) {
+    parallel_slices(n, threads, STL_BATCH_SIZE, [&](size_t begin, size_t end, int /*thread*/) {
+        stl_transform_records(t, in + STL_RECORD_SIZE*begin, out + STL_RECORD_SIZE*begin, end - begin);
+    });
 }
 
-inline void get_facet_bounds(facet_t *facet, bounds_t* b, int init) {
-    if (init) {
-        b->min = facet->vertices[0];
-        b->max = facet->vertices[0];
+// Adds t to the vertices of n records from in to out, which may be the same
+// memory, the way vec_add does. Normals and attributes are left as they are.
+inline void stl_translate_records(const unsigned char *in, unsigned char *out, size_t n, const vec *t) {
+    for (size_t i = 0; i < n; i++, in += STL_RECORD_SIZE, out += STL_RECORD_SIZE) {
+        float v[9];
+        memcpy(v, in + 12, sizeof(v));
+        for (int j = 0; j < 9; j += 3) {
+            v[j] += t->x;
+            v[j+1] += t->y;
+            v[j+2] += t->z;
+        }
+        if (out != in) {
+            memcpy(out, in, 12);
+            memcpy(out + 48, in + 48, 2);
+        }
+        memcpy(out + 12, v, sizeof(v));
     }
-    for (int i = init ? 1 : 0; i < 3; i++) {
-        if (b->min.x > facet->vertices[i].x) b->min.x = facet->vertices[i].x;
-        if (b->min.y > facet->vertices[i].y) b->min.y = facet->vertices[i].y;
-        if (b->min.z > facet->vertices[i].z) b->min.z = facet->vertices[i].z;
+}
 
-        if (b->max.x < facet->vertices[i].x) b->max.x = facet->vertices[i].x;
-        if (b->max.y < facet->vertices[i].y) b->max.y = facet->vertices[i].y;
-        if (b->max.z < facet->vertices[i].z) b->max.z = facet->vertices[i].z;
+// stl_translate_records split over threads.
+inline void stl_translate_records_parallel(const unsigned char *in, unsigned char *out, size_t n, const vec *t, int threads) {
+    parallel_slices(n, threads, STL_BATCH_SIZE, [&](size_t begin, size_t end, int /*thread*/) {
+        stl_translate_records(in + STL_RECORD_SIZE*begin, out + STL_RECORD_SIZE*begin, end - begin, t);
+    });
+}
+
+// Maps a regular output file grown to length for writing. Returns NULL for
+// pipes and anything else that can't be mapped.
+inline unsigned char* stl_map_output(FILE *f, size_t length) {
+    int fd = fileno(f);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || ftruncate(fd, length) != 0) {
+        return NULL;
     }
+    void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return data == MAP_FAILED ? NULL : (unsigned char*)data;
 }
 
-inline void get_bounds(FILE *f, bounds_t* b, int is_ascii) {
-    uint32_t facet_count = 0;
-    memset(b, 0x00, sizeof(bounds_t));
-    read_header(f, NULL, 0, &facet_count, is_ascii);
-    for (int i = 0; is_ascii || i < facet_count; i++) {
-        facet_t facet;
-        if (read_facet(f, &facet, is_ascii)) {
-            get_facet_bounds(&facet, b, i == 0);
-        } else {
-            break;
-        }
+// Maps a binary STL file for reading and writing in place. Returns NULL if
+// it isn't one.
+inline unsigned char* stl_map_in_place(const char *file, size_t *length, uint32_t *facet_count) {
+    int fd = open(file, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *data = MAP_FAILED;
+    if (read_binary_stl_count(fd, facet_count)) {
+        *length = STL_HEADER_SIZE+STL_RECORD_SIZE*(size_t)*facet_count;
+        data = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
     }
-    read_final(f, is_ascii);
+    madvise(data, *length, MADV_SEQUENTIAL);
+    return (unsigned char*)data;
 }
 
 #endif
@@ -42,9 +42,10 @@ int main(int argc, char** argv) {
 
     char *file = argv[1];
 
-    if(!is_valid_binary_stl(file)) {
-        fprintf(stderr, "%s is not a binary stl file.\n", file);
-        exit(2);
+    stl_meta_t meta;
+    if(stl_meta_enabled() && stl_meta_query(file, &meta)) {
+        printf("%f\n", meta.volume);
+        return 0;
     }
 
     FILE *f;
@@ -55,34 +56,16 @@ int main(int argc, char** argv) {
         exit(2);
     }
 
-    fseek(f, 80, SEEK_SET);
-
-    uint32_t num_tris;
-    size_t readBytes = fread(&num_tris, 4, 1, f);
-
-    float volume = 0;
-
-    for(int i = 0; i < num_tris; i++) {
-        fseek(f, 12, SEEK_CUR); // normal
-
-        vec pt1, pt2, pt3;
-
-        readBytes = fread(&pt1, 1, 12,f);
-        readBytes = fread(&pt2, 1, 12,f);
-        readBytes = fread(&pt3, 1, 12,f);
-
-        vec cross;
-
-        vec_cross(&pt1, &pt2, &cross);
-
-        volume += vec_dot(&cross, &pt3);
-
-        fseek(f, 2, SEEK_CUR);
+    stl_view_t view;
+    if(!stl_view_open(&view, f)) {
+        fprintf(stderr, "%s is not a binary stl file.\n", file);
+        exit(2);
     }
 
-    fclose(f);
+    double volume = stl_view_volume(&view);
 
-    volume = fabs(volume/6.0f);
+    stl_view_close(&view);
+    fclose(f);
 
     printf("%f\n", volume);
 
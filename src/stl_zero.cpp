@@ -28,13 +28,174 @@ Copyright 2014 by Freakin' Sweet Apps, LLC (stl_cmd@freakinsweetapps.com)
 #include "stl_util.h"
 
 #define BUFFER_SIZE 4096
+// Facets translated by each thread before they're written in order.
+#define ZERO_CHUNK_SIZE 16384
 
 void print_usage() {
     fprintf(stderr, "stl_zero centres an STL file.\n\n");
-    fprintf(stderr, "usage: stl_zero [-base] [<input file> [<output file>] ]\n");
+    fprintf(stderr, "usage: stl_zero [-base] [-i] [<input file> [<output file>] ]\n");
     fprintf(stderr, "    Center an STL file around the origin. ");
     fprintf(stderr, "    If no input file is provided, data is read from stdin. If no output file is provided, data is sent to stdout. \n");
     fprintf(stderr, "        -base - If this is specified, set the lowest point in the design to z = 0. \n");
+    fprintf(stderr, "        -i - Move a binary input file in place instead of writing a copy. \n");
+}
+
+// Bounds of a binary STL file, from its STL_CMD_META_CACHE sidecar when
+// there's a current one, saving a pass over the facets.
+void binary_bounds(const char *file, const stl_view_t *view, bounds_t *b) {
+    stl_meta_t meta;
+    if (file && stl_meta_enabled() && stl_meta_load(file, &meta) && meta.facet_count == view->facet_count) {
+        *b = meta.bounds;
+        return;
+    }
+    stl_view_bounds(view, b);
+}
+
+void centring_translation(const bounds_t *b, int do_base, vec *translation) {
+    double x_centre = (b->min.x + b->max.x) / 2.0;
+    double y_centre = (b->min.y + b->max.y) / 2.0;
+    double z_centre = (b->min.z + b->max.z) / 2.0;
+    translation->x = -x_centre;
+    translation->y = -y_centre;
+    translation->z = do_base ? -b->min.z : -z_centre;
+    translation->w = 0;
+}
+
+// Centres a binary STL file where it is, through a shared mapping.
+void zero_in_place(const char *file, int do_base, int threads) {
+    size_t length;
+    uint32_t facet_count;
+    unsigned char *data = stl_map_in_place(file, &length, &facet_count);
+    if (!data) {
+        fprintf(stderr, "%s is not a binary stl file that can be written.\n", file);
+        exit(2);
+    }
+    stl_view_t view;
+    memset(&view, 0x00, sizeof(stl_view_t));
+    view.data = data;
+    view.length = length;
+    view.facet_count = facet_count;
+    bounds_t b;
+    binary_bounds(file, &view, &b);
+    vec translation;
+    centring_translation(&b, do_base, &translation);
+    unsigned char *records = data + STL_HEADER_SIZE;
+    stl_translate_records_parallel(records, records, facet_count, &translation, threads);
+    if (munmap(data, length) != 0) {
+        fprintf(stderr, "Error writing to %s\n", file);
+        exit(2);
+    }
+}
+
+// Centres the binary STL file in view into out_file, one reduction for
+// the bounds and one parallel pass that translates the facets straight into
+// a mapped output file, or in chunks written in order to anything else.
+int zero_binary(const char *file, const stl_view_t *view, int do_base, FILE *out_file, int threads) {
+    bounds_t b;
+    binary_bounds(file, view, &b);
+    vec translation;
+    centring_translation(&b, do_base, &translation);
+
+    // the header is copied the way read_header and write_header would
+    char name[81];
+    memset(name, 0x00, sizeof(name));
+    memcpy(name, view->data, 80);
+    for (int i = strlen(name) - 1; i >= 0 && isspace(name[i]); i--) {
+        name[i] = 0;
+    }
+    unsigned char header[STL_HEADER_SIZE];
+    memset(header, 0x00, STL_HEADER_SIZE);
+    memcpy(header, name, strlen(name));
+    memcpy(header + 80, &view->facet_count, 4);
+
+    const unsigned char *records = view->data + STL_HEADER_SIZE;
+    size_t length = STL_HEADER_SIZE+STL_RECORD_SIZE*(size_t)view->facet_count;
+    unsigned char *out = out_file != stdout ? stl_map_output(out_file, length) : NULL;
+    if (out) {
+        memcpy(out, header, STL_HEADER_SIZE);
+        stl_translate_records_parallel(records, out + STL_HEADER_SIZE, view->facet_count, &translation, threads);
+        return munmap(out, length) == 0;
+    }
+
+    fwrite(header, STL_HEADER_SIZE, 1, out_file);
+    size_t round = (size_t)threads*ZERO_CHUNK_SIZE;
+    std::vector<unsigned char> buffer(std::min(round, (size_t)view->facet_count)*STL_RECORD_SIZE);
+    for (size_t first = 0; first < view->facet_count; first += round) {
+        size_t n = std::min(round, view->facet_count - first);
+        stl_translate_records_parallel(records + STL_RECORD_SIZE*first, buffer.data(), n, &translation, threads);
+        if (fwrite(buffer.data(), STL_RECORD_SIZE, n, out_file) != n) {
+            return 0;
+        }
+    }
+    return fflush(out_file) == 0;
+}
+
+// Centres the ASCII STL data in in_file, whose first n bytes are in header,
+// into out_file. The first pass finds the bounds and the second translates
+// the facets. Seekable files are read again for the second pass, streams
+// can only be read once, so their facets are kept in memory in between.
+// Returns the number of errors, which it reports.
+int zero_ascii(FILE *in_file, const char *in_file_name, const unsigned char *header, size_t n, int do_base, FILE *out_file, const char *out_file_name) {
+    int keep = !is_seekable(in_file);
+    std::vector<facet_t> kept;
+    char name[BUFFER_SIZE];
+    memset(name, 0x00, BUFFER_SIZE);
+    bounds_t b;
+    memset(&b, 0x00, sizeof(bounds_t));
+    uint32_t facet_count = 0;
+    facet_t facet;
+    int is_valid = 0;
+    stl_ascii_reader_t reader;
+    if (stl_ascii_reader_open(&reader, in_file)) {
+        stl_ascii_reader_prefill(&reader, header, n);
+        if (stl_ascii_read_header(&reader, name, BUFFER_SIZE)) {
+            while (stl_ascii_read_facet(&reader, &facet)) {
+                get_facet_bounds(&facet, &b, facet_count == 0);
+                facet_count++;
+                if (keep) {
+                    kept.push_back(facet);
+                }
+            }
+            is_valid = stl_ascii_read_final(&reader);
+        }
+        stl_ascii_reader_close(&reader);
+    }
+    if (!is_valid) {
+        fprintf(stderr, "%s is not an STL file (error at facet %u).\n", in_file_name, facet_count);
+        return 1;
+    }
+
+    vec translation;
+    centring_translation(&b, do_base, &translation);
+    stl_ascii_writer_t writer;
+    if (!stl_ascii_writer_open(&writer, out_file, -1)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    stl_ascii_write_header(&writer, name);
+    if (keep) {
+        for (size_t i = 0; i < kept.size(); i++) {
+            for (int j = 0; j < 3; j++) {
+                vec_add(&kept[i].vertices[j], &translation, &kept[i].vertices[j]);
+            }
+            stl_ascii_write_facet(&writer, &kept[i]);
+        }
+    } else if (fseek(in_file, 0, SEEK_SET) == 0 && stl_ascii_reader_open(&reader, in_file)) {
+        stl_ascii_read_header(&reader, NULL, 0);
+        while (stl_ascii_read_facet(&reader, &facet)) {
+            for (int j = 0; j < 3; j++) {
+                vec_add(&facet.vertices[j], &translation, &facet.vertices[j]);
+            }
+            stl_ascii_write_facet(&writer, &facet);
+        }
+        stl_ascii_reader_close(&reader);
+    }
+    stl_ascii_write_final(&writer, name);
+    if (!stl_ascii_writer_close(&writer)) {
+        fprintf(stderr, "Error writing to %s\n", out_file_name);
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv) {
@@ -43,6 +204,7 @@ int main(int argc, char** argv) {
     FILE *out_file = stdout;
     const char* out_file_name = "stdout";
     int do_base = 0;
+    int in_place = 0;
     int done_flags = 0;
 
     for (int arg = 1; arg < argc; arg++) {
@@ -57,6 +219,9 @@ int main(int argc, char** argv) {
                 } else if (strcmp(argv[arg], "-base") == 0) {
                     do_base = 1;
                     continue;
+                } else if (strcmp(argv[arg], "-i") == 0) {
+                    in_place = 1;
+                    continue;
                 } else {
                     fprintf(stderr, "Unrecognized argument: %s\n", argv[arg]);
                     print_usage();
@@ -95,51 +260,45 @@ int main(int argc, char** argv) {
         }
     }
 
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    if (in_place) {
+        if (in_file == stdin || out_file != stdout) {
+            fprintf(stderr, "-i needs exactly one input file.\n");
+            print_usage();
+            exit(2);
+        }
+        fclose(in_file);
+        zero_in_place(in_file_name, do_base, threads);
+        return 0;
+    }
+
     int failed = 0;
-    int is_ascii = is_valid_ascii_stl(in_file);
-    if (!is_ascii && !is_valid_binary_stl(in_file)) {
+    in_file = stl_decompress_input(in_file, 1);
+    unsigned char header[STL_HEADER_SIZE];
+    size_t header_length;
+    int format = sniff_stl_format(in_file, header, &header_length);
+    stl_view_t view;
+    if (format == STL_FORMAT_BINARY) {
+        // bounds are found in a first pass, so pipes are read into memory
+        if (!stl_view_open_after_header(&view, in_file, header)) {
+            fprintf(stderr, "%s is not an STL file.\n", in_file_name);
+            failed++;
+        } else {
+            const char *cache_name = strcmp(in_file_name, "stdin") == 0 || !view.is_mapped ? NULL : in_file_name;
+            if (!zero_binary(cache_name, &view, do_base, out_file, threads)) {
+                fprintf(stderr, "Error writing to %s\n", out_file_name);
+                failed++;
+            }
+            stl_view_close(&view);
+        }
+    } else if (format == STL_FORMAT_INVALID) {
         fprintf(stderr, "%s is not an STL file.\n", in_file_name);
         failed++;
     } else {
-        bounds_t b;
-        get_bounds(in_file, &b, is_ascii);
-        double x_centre = (b.min.x + b.max.x) / 2.0;
-        double y_centre = (b.min.y + b.max.y) / 2.0;
-        double z_centre = (b.min.z + b.max.z) / 2.0;
-        vec translation;
-        translation.x = -x_centre;
-        translation.y = -y_centre;
-        translation.z = do_base ? -b.min.z : -z_centre;
-        translation.w = 0;
-
-        fseek(in_file, 0, SEEK_SET);
-        char name[BUFFER_SIZE];
-        memset(name, 0x00, BUFFER_SIZE);
-        facet_t facet;
-        facet_t translated_facet;
-        uint32_t facet_count = 0;
-
-        read_header(in_file, name, BUFFER_SIZE, &facet_count, is_ascii);
-        write_header(out_file, name, facet_count, is_ascii);
-        for (int i = 0; is_ascii || i < facet_count; i++) {
-            if (read_facet(in_file, &facet, is_ascii)) {
-                translated_facet.normal = facet.normal;
-                for (int j = 0; j < 3; j++) {
-                    vec_add(&facet.vertices[j], &translation, &translated_facet.vertices[j]); 
-                }
-                write_facet(out_file, &translated_facet, is_ascii);
-                if (is_ascii) {
-                    facet_count++;
-                }
-            } else {
-                break;
-            }
-        }
-        read_final(in_file, is_ascii);
-        write_final(out_file, name, facet_count, is_ascii);
+        failed += zero_ascii(in_file, in_file_name, header, header_length, do_base, out_file, out_file_name);
     }
-    if (in_file != stdin) {
-        fclose(in_file);
+    if (!stl_input_close(in_file)) {
+        failed++;
     }
     if (out_file != stdout) {
         fclose(out_file);